@@ -0,0 +1,262 @@
+#include "admin.h"
+#include "config.h"
+#include "dns.h"
+#include "registry.h"
+#include "servers.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define COMMAND_SIZE 1024
+#define COMMAND_TIMEOUT_S 2 // A client that stalls can't hold the thread for longer
+#define MAX_ARGUMENTS 8
+
+// Owner only, the socket lets anyone who can open it close sessions
+#define SOCKET_MODE 0600
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int listen_fd;
+    int event_fd;           // Signalled on shutdown
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+} admin = { .listen_fd = -1, .event_fd = -1 };
+
+static const char* const usage =
+    "list [client=ADDRESS] [user=NAME] [route=NAME] [backend=ADDRESS]  connected sessions, all filters must match\n"
+    "kill ID                                                          close a session\n"
+    "drain ROUTE                                                      turn new logins to a route away\n"
+    "undrain ROUTE                                                    let them in again\n"
+    "drained                                                          routes being drained\n"
+    "routes                                                           the routes in use and their backends\n"
+    "dns                                                              the DNS cache\n";
+
+static int matches(const SessionView* view, char** filters, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const char* value = strchr(filters[i], '=') + 1;
+        if ((strncmp(filters[i], "client=", 7) == 0 && strcmp(view->address, value) != 0) ||
+            (strncmp(filters[i], "user=", 5) == 0 && strcasecmp(view->username, value) != 0) ||
+            (strncmp(filters[i], "route=", 6) == 0 && strcasecmp(view->route, value) != 0) ||
+            (strncmp(filters[i], "backend=", 8) == 0 && strcmp(view->backend, value) != 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void list_sessions(FILE* out, char** filters, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (strchr(filters[i], '=') == NULL) {
+            fprintf(out, "Unknown filter: %s\n", filters[i]);
+            return;
+        }
+    }
+
+    time_t now = time(NULL);
+    size_t listed = 0;
+    RegistryCursor cursor;
+    SessionView view;
+    registry_cursor(&cursor);
+    while (registry_next(&cursor, &view)) {
+        if (!matches(&view, filters, count)) {
+            continue;
+        }
+        fprintf(out, "id=%llu client=%s user=%s route=%s backend=%s age_s=%lld from_client=%llu to_client=%llu%s\n",
+                (unsigned long long)view.id, view.address, view.username, view.route, view.backend, (long long)(now - view.started),
+                (unsigned long long)view.from_client, (unsigned long long)view.to_client, view.offloaded ? " offloaded" : "");
+        ++listed;
+    }
+    fprintf(out, "%zu sessions\n", listed);
+}
+
+void admin_command(char* line, FILE* out) {
+    char* arguments[MAX_ARGUMENTS];
+    size_t count = 0;
+    char* save = NULL;
+    for (char* token = strtok_r(line, " \t\r\n", &save); token != NULL && count < MAX_ARGUMENTS; token = strtok_r(NULL, " \t\r\n", &save)) {
+        arguments[count++] = token;
+    }
+
+    if (count == 0 || strcmp(arguments[0], "help") == 0) {
+        fputs(usage, out);
+    } else if (strcmp(arguments[0], "list") == 0) {
+        list_sessions(out, arguments + 1, count - 1);
+    } else if (strcmp(arguments[0], "kill") == 0 && count == 2) {
+        char* end;
+        unsigned long long id = strtoull(arguments[1], &end, 10);
+        if (*end != '\0' || registry_kill(id) < 0) {
+            fprintf(out, "No session %s\n", arguments[1]);
+        } else {
+            fprintf(out, "Closing session %llu\n", id);
+        }
+    } else if ((strcmp(arguments[0], "drain") == 0 || strcmp(arguments[0], "undrain") == 0) && count == 2) {
+        int drain = arguments[0][0] == 'd';
+        if (registry_drain(arguments[1], drain) < 0) {
+            fprintf(out, "Too many routes drained already\n");
+        } else {
+            printf("Route %s %s from the admin socket\n", arguments[1], drain ? "drained" : "undrained");
+            fprintf(out, "%s %s\n", arguments[1], drain ? "drained, new logins are turned away" : "takes new logins again");
+        }
+    } else if (strcmp(arguments[0], "drained") == 0) {
+        char drained[REGISTRY_MAX_DRAINED * (MAX_HOSTNAME_LENGTH + 2)];
+        registry_drained(drained, sizeof(drained));
+        fputs(drained, out);
+    } else if (strcmp(arguments[0], "routes") == 0) {
+        routes_dump(out);
+    } else if (strcmp(arguments[0], "dns") == 0) {
+        dns_cache_dump(out);
+    } else {
+        fprintf(out, "Unknown command, try help\n");
+    }
+}
+
+// Runs one command and closes, the connection is blocking with timeouts. The answer is written
+// as it is produced, a long session list never sits in memory whole
+static void serve(int fd) {
+    struct timeval timeout = { .tv_sec = COMMAND_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char line[COMMAND_SIZE];
+    size_t length = 0;
+    while (length < sizeof(line) - 1) {
+        ssize_t received = recv(fd, line + length, sizeof(line) - 1 - length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        length += received;
+        if (memchr(line + length - received, '\n', received) != NULL) {
+            break;
+        }
+    }
+    line[length] = '\0';
+
+    FILE* out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        return;
+    }
+    admin_command(line, out);
+    fclose(out);
+}
+
+static void* admin_run(void* arg) {
+    (void)arg;
+
+    while (!atomic_load(&admin.stopping)) {
+        struct pollfd fds[2] = {
+            { .fd = admin.listen_fd, .events = POLLIN },
+            { .fd = admin.event_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(admin.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd != -1) {
+                serve(fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// The socket is bound inside a private directory next to the path, restricted there and only then moved
+// to the path, so it is never reachable by others. One left behind by a process that is gone is replaced
+static int open_listener(const char* path) {
+    char directory[sizeof(((struct sockaddr_un*)0)->sun_path) - 2]; // Leaves room for "/s"
+    const char* slash = strrchr(path, '/');
+    int length = slash != NULL ? snprintf(directory, sizeof(directory), "%.*s/.admin-XXXXXX", (int)(slash - path), path)
+                               : snprintf(directory, sizeof(directory), ".admin-XXXXXX");
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path) || length < 0 || (size_t)length >= sizeof(directory)) {
+        printf("Invalid admin_socket, the path is too long: %s\n", path);
+        return -1;
+    }
+    if (mkdtemp(directory) == NULL) {
+        perror("Error opening the admin socket");
+        return -1;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s/s", directory);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 || chmod(address.sun_path, SOCKET_MODE) == -1 ||
+        listen(fd, 16) == -1 || rename(address.sun_path, path) == -1) {
+        perror("Error opening the admin socket");
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(address.sun_path);
+        rmdir(directory);
+        return -1;
+    }
+    rmdir(directory);
+    return fd;
+}
+
+ssize_t admin_init() {
+    if (admin.running || strcmp(config.admin_socket, "none") == 0) {
+        return 0;
+    }
+
+    atomic_store(&admin.stopping, 0);
+    strcpy(admin.path, "");
+    admin.listen_fd = open_listener(config.admin_socket);
+    if (admin.listen_fd != -1) {
+        snprintf(admin.path, sizeof(admin.path), "%.*s", (int)sizeof(admin.path) - 1, config.admin_socket);
+    }
+    admin.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (admin.listen_fd == -1 || admin.event_fd == -1 || pthread_create(&admin.thread, NULL, admin_run, NULL) != 0) {
+        perror("Error starting the admin socket");
+        admin_shutdown();
+        return -1;
+    }
+
+    printf("Taking admin commands on %s\n", admin.path);
+    admin.running = 1;
+    return 0;
+}
+
+void admin_shutdown() {
+    if (admin.running) {
+        atomic_store(&admin.stopping, 1);
+        uint64_t one = 1;
+        if (write(admin.event_fd, &one, sizeof(one)) < 0) {
+            perror("Error signalling eventfd");
+        }
+        pthread_join(admin.thread, NULL);
+        admin.running = 0;
+    }
+
+    if (admin.listen_fd != -1) {
+        close(admin.listen_fd);
+        admin.listen_fd = -1;
+        unlink(admin.path);
+    }
+    if (admin.event_fd != -1) {
+        close(admin.event_fd);
+        admin.event_fd = -1;
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Starts the thread taking commands on the admin_socket path, does nothing with "none"
+ssize_t admin_init();
+void admin_shutdown();
+
+// Runs one command line and writes its answer
+void admin_command(char* line, FILE* out);
+
+#endif // ADMIN_H
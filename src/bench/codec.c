@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../packet-tools.h"
+
+#define VARINT_COUNT (1 << 20)
+#define ROUNDS 50
+#define HANDSHAKES 2000000
+
+static double now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static size_t put_varint(char* buffer, uint32_t value) {
+    size_t length = 0;
+    do {
+        buffer[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buffer[length] |= 0x80;
+        }
+        ++length;
+    } while (value != 0);
+    return length;
+}
+
+// The byte at a time loop the decoder replaced, with a bounds check added to be fair
+static ssize_t varint_reference(const char* buffer, size_t length, int32_t* value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < VARINT_MAX_BYTES && i < length; ++i) {
+        result |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0) {
+            *value = (int32_t)result;
+            return i + 1;
+        }
+    }
+    return length < VARINT_MAX_BYTES ? 0 : -1;
+}
+
+typedef ssize_t (*VarintDecoder)(const char*, size_t, int32_t*);
+
+static double bench_varints(VarintDecoder decode, const char* buffer, size_t length, int64_t* checksum) {
+    double start = now_ns();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (size_t cursor = 0; cursor < length;) {
+            int32_t value;
+            ssize_t size = decode(buffer + cursor, length - cursor, &value);
+            if (size <= 0) {
+                fprintf(stderr, "Decoding failed at %zu\n", cursor);
+                exit(EXIT_FAILURE);
+            }
+            *checksum += value;
+            cursor += size;
+        }
+    }
+    return (now_ns() - start) / ((double)ROUNDS * VARINT_COUNT);
+}
+
+static size_t put_stream(char* buffer) {
+    const char* address = "play.example.com";
+    char fields[256];
+    size_t length = put_varint(fields, 767);
+    length += put_varint(fields + length, strlen(address));
+    memcpy(fields + length, address, strlen(address));
+    length += strlen(address);
+    fields[length++] = 0x63;
+    fields[length++] = 0xDD;
+    length += put_varint(fields + length, PACKET_STATE_LOGIN);
+
+    size_t total = put_varint(buffer, length + 1);
+    buffer[total++] = 0x00;
+    memcpy(buffer + total, fields, length);
+    total += length;
+
+    char login[] = "\x00\x05Notch0123456789abcdef";
+    total += put_varint(buffer + total, sizeof(login) - 1);
+    memcpy(buffer + total, login, sizeof(login) - 1);
+    return total + sizeof(login) - 1;
+}
+
+// Whole stream in one piece, then split in three like a slow client's segments
+static double bench_handshakes(size_t pieces, int64_t* checksum) {
+    char stream[256];
+    size_t length = put_stream(stream);
+
+    double start = now_ns();
+    for (int i = 0; i < HANDSHAKES; ++i) {
+        PacketDecoder decoder;
+        packet_decoder_init(&decoder);
+
+        enum PacketStatus status = PACKET_NEED_MORE;
+        for (size_t piece = 1; piece <= pieces; ++piece) {
+            status = packet_decoder_feed(&decoder, stream, length * piece / pieces);
+        }
+        if (status != PACKET_READY) {
+            fprintf(stderr, "Handshake not decoded\n");
+            exit(EXIT_FAILURE);
+        }
+        *checksum += decoder.username.offset;
+    }
+    return (now_ns() - start) / HANDSHAKES;
+}
+
+int main(void) {
+    // Values of every width, from one byte ids to five byte VarInts
+    char* buffer = malloc(VARINT_COUNT * VARINT_MAX_BYTES);
+    size_t length = 0;
+    srand(42);
+    for (size_t i = 0; i < VARINT_COUNT; ++i) {
+        uint32_t bits = (uint32_t)rand() % 33;
+        uint32_t value = bits == 32 ? (uint32_t)rand() << 1 : (uint32_t)rand() & ((1u << bits) - 1);
+        length += put_varint(buffer + length, value);
+    }
+
+    int64_t reference_sum = 0;
+    int64_t decoder_sum = 0;
+    double reference = bench_varints(varint_reference, buffer, length, &reference_sum);
+    double decoder = bench_varints(varint_decode, buffer, length, &decoder_sum);
+
+    if (reference_sum != decoder_sum) {
+        fprintf(stderr, "Decoders disagree\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("VarInt, byte loop:     %6.2f ns\n", reference);
+    printf("VarInt, varint_decode: %6.2f ns (%.2fx)\n", decoder, reference / decoder);
+
+    int64_t checksum = 0;
+    printf("Handshake + Login Start, 1 read:  %6.1f ns\n", bench_handshakes(1, &checksum));
+    printf("Handshake + Login Start, 3 reads: %6.1f ns\n", bench_handshakes(3, &checksum));
+
+    free(buffer);
+    return checksum == 0;
+}
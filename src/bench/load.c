@@ -0,0 +1,814 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define PROXY_PORT 25565        // The proxy's listener isn't configurable
+#define MAX_EVENTS 256
+#define CHUNK_SIZE 65536
+#define HEADER_SIZE 512         // Handshake + Login Start or Status Request, with room to spare
+#define FIRST_PACKET "\x08\x02welcome" // What the backend answers Login Start with, framed
+#define STATUS_JSON "{\"version\":{\"name\":\"bench\",\"protocol\":767},\"players\":{\"max\":100,\"online\":0},\"description\":{\"text\":\"bench\"}}"
+
+// Command line, see usage()
+static struct {
+    size_t clients;
+    size_t threads;
+    double duration_s;
+    size_t download;            // Bytes the backend sends per join
+    size_t upload;              // Bytes the client sends per join
+    size_t ping_every;          // Every Nth connection is a server list ping, 0 for none
+    const char* proxy;
+    const char* directory;
+    const char* io_backend;
+    const char* forward_mode;
+    size_t workers;
+} options = {
+    .clients = 2000,
+    .threads = 4,
+    .duration_s = 10,
+    .download = 262144,
+    .upload = 16384,
+    .ping_every = 10,
+    .proxy = "bin/proxy",
+    .directory = "bin/bench-run",
+    .io_backend = "epoll",
+    .forward_mode = "splice",
+    .workers = 0,
+};
+
+static atomic_int stopping;
+static char chunk[CHUNK_SIZE];                 // What gets sent as download and upload
+static _Thread_local char scratch[CHUNK_SIZE]; // Where they're read into and dropped
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static size_t put_varint(char* buffer, uint32_t value) {
+    size_t length = 0;
+    do {
+        buffer[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buffer[length] |= 0x80;
+        }
+        ++length;
+    } while (value != 0);
+    return length;
+}
+
+// Returns the bytes the VarInt took, 0 if it isn't complete yet
+static size_t get_varint(const char* buffer, size_t length, uint32_t* value) {
+    *value = 0;
+    for (size_t i = 0; i < 5 && i < length; ++i) {
+        *value |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Length of the complete packet at the start of the buffer, header included, 0 if it isn't complete
+static size_t frame_length(const char* buffer, size_t length) {
+    uint32_t payload;
+    size_t header = get_varint(buffer, length, &payload);
+    return header != 0 && header + payload <= length ? header + payload : 0;
+}
+
+static size_t put_packet(char* buffer, const char* payload, size_t length) {
+    size_t header = put_varint(buffer, length);
+    memcpy(buffer + header, payload, length);
+    return header + length;
+}
+
+static size_t put_handshake(char* buffer, int next_state) {
+    const char* address = "bench.local";
+    char payload[64];
+    size_t length = 0;
+    payload[length++] = 0x00;
+    length += put_varint(payload + length, 767);
+    length += put_varint(payload + length, strlen(address));
+    memcpy(payload + length, address, strlen(address));
+    length += strlen(address);
+    payload[length++] = (char)(PROXY_PORT >> 8);
+    payload[length++] = (char)(PROXY_PORT & 0xFF);
+    length += put_varint(payload + length, next_state);
+    return put_packet(buffer, payload, length);
+}
+
+static size_t put_login_start(char* buffer, size_t client) {
+    char payload[64];
+    char name[17];
+    size_t name_length = snprintf(name, sizeof(name), "bench%zu", client);
+    size_t length = 0;
+    payload[length++] = 0x00;
+    length += put_varint(payload + length, name_length);
+    memcpy(payload + length, name, name_length);
+    length += name_length;
+    memset(payload + length, 0x42, 16); // UUID
+    length += 16;
+    return put_packet(buffer, payload, length);
+}
+
+static int set_option(int fd, int level, int option, int value) {
+    return setsockopt(fd, level, option, &value, sizeof(value));
+}
+
+// Mock backend: answers status requests and pings like a server, and for a login sends a first
+// packet, then the download while it reads and drops the upload
+
+typedef struct {
+    int fd;
+    char header[HEADER_SIZE];
+    size_t header_length;
+    int handshaken;
+    int login;
+    int joined;                 // Past Login Start, everything else read is upload
+    char reply[HEADER_SIZE];    // Status response, pong or the first packet of a login
+    size_t reply_length;
+    size_t reply_offset;
+    size_t download_left;
+    int close_after_reply;      // The pong is out, the ping is done
+} Peer;
+
+typedef struct {
+    pthread_t thread;
+    int listener;
+    int epoll_fd;
+    atomic_uint_least64_t received; // Upload bytes that made it through the proxy
+} Backend;
+
+static void peer_close(Backend* backend, Peer* peer) {
+    epoll_ctl(backend->epoll_fd, EPOLL_CTL_DEL, peer->fd, NULL);
+    close(peer->fd);
+    free(peer);
+}
+
+// Handles every complete packet read so far. Returns -1 if the peer broke the protocol
+static ssize_t peer_packets(Peer* peer) {
+    size_t offset = 0;
+    size_t length;
+
+    while (!peer->login && (length = frame_length(peer->header + offset, peer->header_length - offset)) != 0) {
+        const char* packet = peer->header + offset;
+        uint32_t payload_length;
+        size_t header = get_varint(packet, length, &payload_length);
+        const char* payload = packet + header;
+        if (payload_length == 0 || peer->reply_length + HEADER_SIZE / 2 > HEADER_SIZE) {
+            return -1;
+        }
+
+        if (!peer->handshaken) {
+            // Its last field is the next state
+            peer->handshaken = 1;
+            peer->login = payload[payload_length - 1] != 1;
+            offset += length;
+            continue;
+        }
+
+        if (payload[0] == 0x00) {
+            char response[HEADER_SIZE];
+            size_t json_length = strlen(STATUS_JSON);
+            size_t response_length = 0;
+            response[response_length++] = 0x00;
+            response_length += put_varint(response + response_length, json_length);
+            memcpy(response + response_length, STATUS_JSON, json_length);
+            response_length += json_length;
+            peer->reply_length += put_packet(peer->reply + peer->reply_length, response, response_length);
+        } else if (payload[0] == 0x01) {
+            memcpy(peer->reply + peer->reply_length, packet, length);
+            peer->reply_length += length;
+            peer->close_after_reply = 1;
+        } else {
+            return -1;
+        }
+        offset += length;
+    }
+
+    memmove(peer->header, peer->header + offset, peer->header_length - offset);
+    peer->header_length -= offset;
+    return 0;
+}
+
+// The handshake sets login, Login Start is the next packet, which is followed by the upload
+static ssize_t peer_read(Backend* backend, Peer* peer) {
+    while (1) {
+        if (peer->login && !peer->joined && peer->header_length > 0) {
+            size_t length = frame_length(peer->header, peer->header_length);
+            if (length == 0) {
+                if (peer->header_length == HEADER_SIZE) {
+                    return -1;
+                }
+            } else {
+                // Login Start: the first packet goes out right away, the rest of the buffer is upload
+                atomic_fetch_add_explicit(&backend->received, peer->header_length - length, memory_order_relaxed);
+                peer->header_length = 0;
+                peer->joined = 1;
+                memcpy(peer->reply, FIRST_PACKET, sizeof(FIRST_PACKET) - 1);
+                peer->reply_length = sizeof(FIRST_PACKET) - 1;
+                peer->download_left = options.download;
+            }
+        }
+
+        char* buffer = peer->joined ? scratch : peer->header + peer->header_length;
+        size_t capacity = buffer == scratch ? CHUNK_SIZE : HEADER_SIZE - peer->header_length;
+        ssize_t bytes = recv(peer->fd, buffer, capacity, 0);
+        if (bytes == 0) {
+            return -1;
+        }
+        if (bytes < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        if (buffer == scratch) {
+            atomic_fetch_add_explicit(&backend->received, bytes, memory_order_relaxed);
+            continue;
+        }
+        peer->header_length += bytes;
+        if (peer_packets(peer) < 0) {
+            return -1;
+        }
+    }
+}
+
+static ssize_t peer_write(Peer* peer) {
+    while (peer->reply_offset < peer->reply_length || peer->download_left > 0) {
+        int from_reply = peer->reply_offset < peer->reply_length;
+        const char* data = from_reply ? peer->reply + peer->reply_offset : chunk;
+        size_t length = from_reply ? peer->reply_length - peer->reply_offset : (peer->download_left < CHUNK_SIZE ? peer->download_left : CHUNK_SIZE);
+
+        ssize_t bytes = send(peer->fd, data, length, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (from_reply) {
+            peer->reply_offset += bytes;
+            if (peer->reply_offset == peer->reply_length) {
+                if (peer->close_after_reply) {
+                    return -1;
+                }
+                peer->reply_offset = peer->reply_length = 0;
+            }
+        } else {
+            peer->download_left -= bytes;
+        }
+    }
+    return 0;
+}
+
+static void* backend_run(void* arg) {
+    Backend* backend = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&stopping)) {
+        int count = epoll_wait(backend->epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                int fd;
+                while ((fd = accept4(backend->listener, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+                    Peer* peer = calloc(1, sizeof(Peer));
+                    peer->fd = fd;
+                    set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+                    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = peer };
+                    epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+                }
+                continue;
+            }
+
+            Peer* peer = events[i].data.ptr;
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) || peer_read(backend, peer) < 0 || peer_write(peer) < 0) {
+                peer_close(backend, peer);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Synthetic clients: each joins, waits for the first packet, exchanges the download and upload,
+// resets the connection and joins again. Every ping_every-th connection pings instead
+
+enum ClientState {
+    CLIENT_CONNECTING,
+    CLIENT_FIRST_BYTE,          // Handshake sent, waiting for the backend's first packet
+    CLIENT_TRANSFER,
+    CLIENT_STATUS,              // Waiting for the status response
+    CLIENT_PONG
+};
+
+typedef struct {
+    int fd;
+    enum ClientState state;
+    size_t index;
+    uint64_t sent_us;
+    size_t downloaded;
+    size_t uploaded;
+    char buffer[HEADER_SIZE];
+    size_t buffer_length;
+    struct ClientThread* thread;
+} Client;
+
+typedef struct ClientThread {
+    pthread_t thread;
+    int epoll_fd;
+    Client* clients;
+    size_t count;
+    size_t connections;         // Started so far, picks which ones ping
+    uint32_t* latencies;        // Handshake to first byte of every join, in microseconds
+    size_t latency_count;
+    size_t latency_capacity;
+    uint64_t joins;
+    uint64_t pings;
+    uint64_t errors;
+    uint64_t downloaded;
+} ClientThread;
+
+static struct sockaddr_in proxy_address;
+
+static void client_record(ClientThread* thread, uint32_t latency) {
+    if (thread->latency_count == thread->latency_capacity) {
+        thread->latency_capacity = thread->latency_capacity ? thread->latency_capacity * 2 : 65536;
+        thread->latencies = realloc(thread->latencies, thread->latency_capacity * sizeof(uint32_t));
+        if (thread->latencies == NULL) {
+            perror("Error allocating latencies");
+            exit(EXIT_FAILURE);
+        }
+    }
+    thread->latencies[thread->latency_count++] = latency;
+}
+
+static void client_connect(Client* client) {
+    ClientThread* thread = client->thread;
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    set_option(client->fd, IPPROTO_TCP, TCP_NODELAY, 1);
+
+    // Reset instead of FIN, thousands of joins a second would run out of ports in TIME_WAIT
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+    client->state = CLIENT_CONNECTING;
+    client->downloaded = client->uploaded = client->buffer_length = 0;
+    client->index = thread->connections++;
+
+    if (connect(client->fd, (struct sockaddr*)&proxy_address, sizeof(proxy_address)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = client };
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+}
+
+static void client_restart(Client* client, int failed) {
+    client->thread->errors += failed;
+    close(client->fd);
+    client_connect(client);
+}
+
+// Returns 1 once the connection is done, -1 on errors
+static ssize_t client_send_header(Client* client) {
+    char header[HEADER_SIZE];
+    int ping = options.ping_every > 0 && client->index % options.ping_every == options.ping_every - 1;
+    size_t length = put_handshake(header, ping ? 1 : 2);
+    if (ping) {
+        header[length++] = 0x01;
+        header[length++] = 0x00;
+    } else {
+        length += put_login_start(header + length, client->index);
+    }
+
+    if (send(client->fd, header, length, MSG_NOSIGNAL) != (ssize_t)length) {
+        return -1;
+    }
+    client->sent_us = now_us();
+    client->state = ping ? CLIENT_STATUS : CLIENT_FIRST_BYTE;
+    return 0;
+}
+
+static ssize_t client_upload(Client* client) {
+    while (client->uploaded < options.upload) {
+        size_t length = options.upload - client->uploaded < CHUNK_SIZE ? options.upload - client->uploaded : CHUNK_SIZE;
+        ssize_t bytes = send(client->fd, chunk, length, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        client->uploaded += bytes;
+    }
+    return 0;
+}
+
+static ssize_t client_status(Client* client) {
+    while (1) {
+        ssize_t bytes = recv(client->fd, client->buffer + client->buffer_length, HEADER_SIZE - client->buffer_length, 0);
+        if (bytes <= 0) {
+            return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        client->buffer_length += bytes;
+
+        size_t length = frame_length(client->buffer, client->buffer_length);
+        if (length == 0) {
+            if (client->buffer_length == HEADER_SIZE) {
+                return -1;
+            }
+            continue;
+        }
+        if (client->state == CLIENT_PONG) {
+            ++client->thread->pings;
+            return 1;
+        }
+
+        char ping[] = "\x09\x01\x00\x00\x00\x00\x00\x00\x00\x2A";
+        if (send(client->fd, ping, sizeof(ping) - 1, MSG_NOSIGNAL) != sizeof(ping) - 1) {
+            return -1;
+        }
+        memmove(client->buffer, client->buffer + length, client->buffer_length - length);
+        client->buffer_length -= length;
+        client->state = CLIENT_PONG;
+    }
+}
+
+static ssize_t client_download(Client* client) {
+    while (1) {
+        ssize_t bytes = recv(client->fd, scratch, CHUNK_SIZE, 0);
+        if (bytes <= 0) {
+            return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        ClientThread* thread = client->thread;
+        if (client->state == CLIENT_FIRST_BYTE) {
+            client_record(thread, now_us() - client->sent_us);
+            client->state = CLIENT_TRANSFER;
+        }
+        client->downloaded += bytes;
+        thread->downloaded += bytes;
+    }
+}
+
+static ssize_t client_event(Client* client, uint32_t events) {
+    if (events & EPOLLERR) {
+        return -1;
+    }
+
+    if (client->state == CLIENT_CONNECTING) {
+        if (!(events & EPOLLOUT)) {
+            return 0;
+        }
+        if (client_send_header(client) < 0) {
+            return -1;
+        }
+    }
+
+    if (client->state == CLIENT_STATUS || client->state == CLIENT_PONG) {
+        return client_status(client);
+    }
+
+    if (client_download(client) < 0 || (client->state == CLIENT_TRANSFER && client_upload(client) < 0)) {
+        return -1;
+    }
+
+    // The first packet is framed, the download behind it is counted as it arrives
+    if (client->downloaded >= options.download + sizeof(FIRST_PACKET) - 1 && client->uploaded == options.upload) {
+        ++client->thread->joins;
+        return 1;
+    }
+    return 0;
+}
+
+static void* clients_run(void* arg) {
+    ClientThread* thread = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (size_t i = 0; i < thread->count; ++i) {
+        thread->clients[i].thread = thread;
+        client_connect(&thread->clients[i]);
+    }
+
+    while (!atomic_load(&stopping)) {
+        int count = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < count; ++i) {
+            Client* client = events[i].data.ptr;
+            ssize_t result = client_event(client, events[i].events);
+            if (result != 0) {
+                client_restart(client, result < 0);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < thread->count; ++i) {
+        close(thread->clients[i].fd);
+    }
+    return NULL;
+}
+
+// The proxy under test, started from its own directory with a generated servers.conf
+
+static pid_t start_proxy(unsigned short backend_port) {
+    char proxy[PATH_MAX], path[PATH_MAX];
+    if (realpath(options.proxy, proxy) == NULL) {
+        perror(options.proxy);
+        exit(EXIT_FAILURE);
+    }
+    mkdir(options.directory, 0755);
+
+    snprintf(path, sizeof(path), "%s/servers.conf", options.directory);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "bench.local 127.0.0.1:%u\n", backend_port);
+    fprintf(file, "set workers %zu\nset io_backend %s\nset forward_mode %s\n", options.workers, options.io_backend, options.forward_mode);
+    // Every client comes from 127.0.0.1
+    fprintf(file, "set connection_rate 0\nset max_handshakes 0\n");
+    fclose(file);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        snprintf(path, sizeof(path), "%s/proxy.out", options.directory);
+        int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (chdir(options.directory) == -1 || out == -1) {
+            perror(options.directory);
+            _exit(EXIT_FAILURE);
+        }
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        execl(proxy, proxy, (char*)NULL);
+        perror(proxy);
+        _exit(EXIT_FAILURE);
+    }
+
+    // Up once a connection gets through
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        usleep(50000);
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "The proxy exited, see %s/proxy.out\n", options.directory);
+            exit(EXIT_FAILURE);
+        }
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int connected = connect(fd, (struct sockaddr*)&proxy_address, sizeof(proxy_address)) == 0;
+        close(fd);
+        if (connected) {
+            return pid;
+        }
+    }
+    fprintf(stderr, "The proxy didn't start listening\n");
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+// User plus system time of the process in seconds, and its resident memory now and at its peak in KB
+static void proxy_usage(pid_t pid, double* cpu_s, size_t* rss_kb, size_t* peak_kb) {
+    char path[64], line[256];
+    *cpu_s = 0;
+    *rss_kb = *peak_kb = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* file = fopen(path, "r");
+    if (file != NULL) {
+        unsigned long user = 0, system = 0;
+        // The command name is in parentheses and may contain spaces, the fields after it are fixed
+        if (fgets(line, sizeof(line), file) != NULL && strrchr(line, ')') != NULL &&
+            sscanf(strrchr(line, ')') + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &user, &system) == 2) {
+            *cpu_s = (double)(user + system) / sysconf(_SC_CLK_TCK);
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            sscanf(line, "VmRSS: %zu", rss_kb);
+            sscanf(line, "VmHWM: %zu", peak_kb);
+        }
+        fclose(file);
+    }
+}
+
+// Busy time of the whole machine in seconds. Forwarding the kernel does on the proxy's behalf, like
+// sockmap redirects finished by kernel threads, isn't charged to the proxy's process
+static double system_busy_s() {
+    unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+    FILE* file = fopen("/proc/stat", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) < 4) {
+        user = nice = system = irq = softirq = steal = 0;
+    }
+    fclose(file);
+    return (double)(user + nice + system + irq + softirq + steal) / sysconf(_SC_CLK_TCK);
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t* sorted, size_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --clients N       concurrent clients (%zu)\n"
+            "  --threads N       client and backend threads each (%zu)\n"
+            "  --duration S      seconds to measure (%.0f)\n"
+            "  --download BYTES  sent by the backend per join (%zu)\n"
+            "  --upload BYTES    sent by the client per join (%zu)\n"
+            "  --ping-every N    every Nth connection is a server list ping, 0 for none (%zu)\n"
+            "  --proxy PATH      proxy binary (%s)\n"
+            "  --dir PATH        where servers.conf, logs and the proxy's output go (%s)\n"
+            "  --io-backend, --forward-mode, --workers  passed on to the proxy's config\n"
+            "Prints one JSON object with the results on stdout\n",
+            program, options.clients, options.threads, options.duration_s, options.download, options.upload,
+            options.ping_every, options.proxy, options.directory);
+}
+
+static void parse_options(int argc, char** argv) {
+    static const struct option long_options[] = {
+        { "clients", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "download", required_argument, NULL, 'D' },
+        { "upload", required_argument, NULL, 'U' },
+        { "ping-every", required_argument, NULL, 'p' },
+        { "proxy", required_argument, NULL, 'P' },
+        { "dir", required_argument, NULL, 'r' },
+        { "io-backend", required_argument, NULL, 'i' },
+        { "forward-mode", required_argument, NULL, 'f' },
+        { "workers", required_argument, NULL, 'w' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'c': options.clients = strtoul(optarg, NULL, 10); break;
+            case 't': options.threads = strtoul(optarg, NULL, 10); break;
+            case 'd': options.duration_s = strtod(optarg, NULL); break;
+            case 'D': options.download = strtoul(optarg, NULL, 10); break;
+            case 'U': options.upload = strtoul(optarg, NULL, 10); break;
+            case 'p': options.ping_every = strtoul(optarg, NULL, 10); break;
+            case 'P': options.proxy = optarg; break;
+            case 'r': options.directory = optarg; break;
+            case 'i': options.io_backend = optarg; break;
+            case 'f': options.forward_mode = optarg; break;
+            case 'w': options.workers = strtoul(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (options.clients == 0 || options.threads == 0 || options.duration_s <= 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char** argv) {
+    parse_options(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Both ends of every connection are in this process or the proxy, which inherits the limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur < options.clients * 2 + 64) {
+        fprintf(stderr, "Open file limit %lu is too low for %zu clients\n", (unsigned long)limit.rlim_cur, options.clients);
+        return EXIT_FAILURE;
+    }
+
+    proxy_address.sin_family = AF_INET;
+    proxy_address.sin_port = htons(PROXY_PORT);
+    proxy_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Backend threads share a port through SO_REUSEPORT
+    Backend* backends = calloc(options.threads, sizeof(Backend));
+    struct sockaddr_in backend_address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for (size_t i = 0; i < options.threads; ++i) {
+        Backend* backend = &backends[i];
+        backend->listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        socklen_t length = sizeof(backend_address);
+        if (set_option(backend->listener, SOL_SOCKET, SO_REUSEPORT, 1) == -1 ||
+            bind(backend->listener, (struct sockaddr*)&backend_address, sizeof(backend_address)) == -1 ||
+            listen(backend->listener, 4096) == -1 ||
+            getsockname(backend->listener, (struct sockaddr*)&backend_address, &length) == -1) {
+            perror("Error starting the mock backend");
+            return EXIT_FAILURE;
+        }
+
+        backend->epoll_fd = epoll_create1(0);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, backend->listener, &event);
+        pthread_create(&backend->thread, NULL, backend_run, backend);
+    }
+
+    pid_t proxy = start_proxy(ntohs(backend_address.sin_port));
+    fprintf(stderr, "Proxy %d up, %zu clients for %.0f s\n", proxy, options.clients, options.duration_s);
+
+    double cpu_start, cpu_end;
+    size_t rss_kb, peak_kb;
+    proxy_usage(proxy, &cpu_start, &rss_kb, &peak_kb);
+    double busy_start = system_busy_s();
+    uint64_t start = now_us();
+
+    ClientThread* threads = calloc(options.threads, sizeof(ClientThread));
+    Client* clients = calloc(options.clients, sizeof(Client));
+    for (size_t i = 0, first = 0; i < options.threads; ++i) {
+        ClientThread* thread = &threads[i];
+        thread->count = options.clients / options.threads + (i < options.clients % options.threads);
+        thread->clients = clients + first;
+        first += thread->count;
+        thread->epoll_fd = epoll_create1(0);
+        pthread_create(&thread->thread, NULL, clients_run, thread);
+    }
+
+    usleep(options.duration_s * 1e6);
+    proxy_usage(proxy, &cpu_end, &rss_kb, &peak_kb);
+    double busy_end = system_busy_s();
+    double elapsed_s = (now_us() - start) / 1e6;
+    atomic_store(&stopping, 1);
+
+    uint64_t joins = 0, pings = 0, errors = 0, downloaded = 0, uploaded = 0;
+    size_t latency_count = 0;
+    for (size_t i = 0; i < options.threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        pthread_join(backends[i].thread, NULL);
+        joins += threads[i].joins;
+        pings += threads[i].pings;
+        errors += threads[i].errors;
+        downloaded += threads[i].downloaded;
+        uploaded += atomic_load(&backends[i].received);
+        latency_count += threads[i].latency_count;
+    }
+
+    uint32_t* latencies = malloc((latency_count + 1) * sizeof(uint32_t));
+    for (size_t i = 0, offset = 0; i < options.threads; ++i) {
+        memcpy(latencies + offset, threads[i].latencies, threads[i].latency_count * sizeof(uint32_t));
+        offset += threads[i].latency_count;
+    }
+    qsort(latencies, latency_count, sizeof(uint32_t), compare_latencies);
+
+    kill(proxy, SIGINT);
+    waitpid(proxy, NULL, 0);
+
+    double gbps = (downloaded + uploaded) * 8 / elapsed_s / 1e9;
+    double proxy_cores = (cpu_end - cpu_start) / elapsed_s;
+    double system_cores = (busy_end - busy_start) / elapsed_s;
+    // CPUs kept busy per Gbps forwarded. The system figure includes the load generator, which costs
+    // the same whatever the proxy does, so only differences between runs say something
+    double proxy_per_gbps = gbps > 0 ? proxy_cores / gbps : 0;
+    double system_per_gbps = gbps > 0 ? system_cores / gbps : 0;
+    fprintf(stderr, "%.0f joins/s, %.0f pings/s, first byte p50 %u us p99 %u us p999 %u us, %.2f Gbps, proxy %.2f CPUs %zu KB RSS, "
+            "%.3f proxy CPUs and %.3f system CPUs per Gbps\n",
+            joins / elapsed_s, pings / elapsed_s, percentile(latencies, latency_count, 0.5), percentile(latencies, latency_count, 0.99),
+            percentile(latencies, latency_count, 0.999), gbps, proxy_cores, rss_kb, proxy_per_gbps, system_per_gbps);
+
+    printf("{\"clients\":%zu,\"threads\":%zu,\"duration_s\":%.3f,\"download_bytes\":%zu,\"upload_bytes\":%zu,"
+           "\"io_backend\":\"%s\",\"forward_mode\":\"%s\",\"workers\":%zu,"
+           "\"joins\":%llu,\"joins_per_s\":%.1f,\"pings\":%llu,\"pings_per_s\":%.1f,\"errors\":%llu,"
+           "\"first_byte_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u},"
+           "\"forwarded_bytes\":%llu,\"forwarded_gbps\":%.3f,"
+           "\"proxy_cpu_cores\":%.3f,\"proxy_rss_kb\":%zu,\"proxy_peak_rss_kb\":%zu,"
+           "\"system_cpu_cores\":%.3f,\"proxy_cpu_per_gbps\":%.4f,\"system_cpu_per_gbps\":%.4f}\n",
+           options.clients, options.threads, elapsed_s, options.download, options.upload,
+           options.io_backend, options.forward_mode, options.workers,
+           (unsigned long long)joins, joins / elapsed_s, (unsigned long long)pings, pings / elapsed_s, (unsigned long long)errors,
+           percentile(latencies, latency_count, 0.5), percentile(latencies, latency_count, 0.99),
+           percentile(latencies, latency_count, 0.999), latency_count > 0 ? latencies[latency_count - 1] : 0,
+           (unsigned long long)(downloaded + uploaded), gbps, proxy_cores, rss_kb, peak_kb,
+           system_cores, proxy_per_gbps, system_per_gbps);
+
+    return errors > joins / 100 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
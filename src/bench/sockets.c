@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../profiles.h"
+
+#define JOINS 200
+#define ROUND_TRIPS 200
+#define HANDSHAKE_SIZE 24       // Handshake, sent on its own like the client does
+#define LOGIN_SIZE 24           // Login Start, right behind it
+#define REPLY_SIZE 64
+
+typedef struct {
+    int listener;
+    const SocketProfile* profile;
+    int echo;                   // One connection echoing round trips instead of a series of joins
+} Server;
+
+static double now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static void read_exactly(int fd, char* buffer, size_t length) {
+    for (size_t done = 0; done < length;) {
+        ssize_t bytes = read(fd, buffer + done, length - done);
+        if (bytes <= 0) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        done += bytes;
+    }
+}
+
+static void write_all(int fd, const char* buffer, size_t length) {
+    if (write(fd, buffer, length) != (ssize_t)length) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Plays the backend: answers a handshake and Login Start with one packet, or echoes every round
+// trip back in two writes
+static void* serve(void* arg) {
+    Server* server = arg;
+    char buffer[HANDSHAKE_SIZE + LOGIN_SIZE + REPLY_SIZE] = {0};
+
+    for (int i = 0; i < (server->echo ? 1 : JOINS); ++i) {
+        int fd = accept(server->listener, NULL, NULL);
+        if (fd == -1) {
+            perror("accept");
+            exit(EXIT_FAILURE);
+        }
+        socket_profile_client(fd, server->profile);
+
+        for (int round = 0; round < (server->echo ? ROUND_TRIPS : 1); ++round) {
+            read_exactly(fd, buffer, HANDSHAKE_SIZE + LOGIN_SIZE);
+            if (server->echo) {
+                write_all(fd, buffer, HANDSHAKE_SIZE);
+                write_all(fd, buffer + HANDSHAKE_SIZE, LOGIN_SIZE);
+            } else {
+                write_all(fd, buffer, REPLY_SIZE);
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* what, double* samples, size_t count) {
+    double sum = 0, squares = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += samples[i];
+    }
+    double mean = sum / count;
+    for (size_t i = 0; i < count; ++i) {
+        squares += (samples[i] - mean) * (samples[i] - mean);
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("  %-12s p50 %8.1f us  p99 %8.1f us  stddev %8.1f us\n", what, samples[count / 2], samples[count * 99 / 100], sqrt(squares / count));
+}
+
+static int start_server(Server* server, pthread_t* thread, struct sockaddr_in* address) {
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t length = sizeof(*address);
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (server->listener == -1 || socket_profile_listener(server->listener, server->profile) < 0 ||
+        bind(server->listener, (struct sockaddr*)address, sizeof(*address)) == -1 || listen(server->listener, 16) == -1 ||
+        getsockname(server->listener, (struct sockaddr*)address, &length) == -1) {
+        perror("Error starting the server");
+        return -1;
+    }
+    return pthread_create(thread, NULL, serve, server) == 0 ? 0 : -1;
+}
+
+static int connect_to(const struct sockaddr_in* address, const SocketProfile* profile) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    socket_profile_backend(fd, profile, 0);
+    if (connect(fd, (const struct sockaddr*)address, sizeof(*address)) == -1) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Connect, handshake and Login Start in two writes, first packet of the answer
+static void bench_joins(const SocketProfile* profile) {
+    Server server = { .profile = profile };
+    pthread_t thread;
+    struct sockaddr_in address;
+    if (start_server(&server, &thread, &address) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    double samples[JOINS];
+    char buffer[REPLY_SIZE] = {0};
+    for (int i = 0; i < JOINS; ++i) {
+        double start = now_us();
+        int fd = connect_to(&address, profile);
+        write_all(fd, buffer, HANDSHAKE_SIZE);
+        write_all(fd, buffer, LOGIN_SIZE);
+        read_exactly(fd, buffer, REPLY_SIZE);
+        samples[i] = now_us() - start;
+        close(fd);
+    }
+
+    pthread_join(thread, NULL);
+    close(server.listener);
+    report("join", samples, JOINS);
+}
+
+// Two small writes each way per round trip, the pattern Nagle and delayed ACKs stall on
+static void bench_round_trips(const SocketProfile* profile) {
+    Server server = { .profile = profile, .echo = 1 };
+    pthread_t thread;
+    struct sockaddr_in address;
+    if (start_server(&server, &thread, &address) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    double samples[ROUND_TRIPS];
+    char buffer[HANDSHAKE_SIZE + LOGIN_SIZE] = {0};
+    int fd = connect_to(&address, profile);
+    for (int i = 0; i < ROUND_TRIPS; ++i) {
+        double start = now_us();
+        write_all(fd, buffer, HANDSHAKE_SIZE);
+        write_all(fd, buffer + HANDSHAKE_SIZE, LOGIN_SIZE);
+        read_exactly(fd, buffer, HANDSHAKE_SIZE + LOGIN_SIZE);
+        samples[i] = now_us() - start;
+    }
+    close(fd);
+
+    pthread_join(thread, NULL);
+    close(server.listener);
+    report("round trip", samples, ROUND_TRIPS);
+}
+
+int main(void) {
+    char kernel_options[] = "";
+    char low_latency_options[] = "nodelay=on quickack=on notsent_lowat=16384 defer_accept_s=5";
+    SocketProfile kernel = { .name = "kernel defaults" };
+    SocketProfile low_latency = { .name = "nodelay+quickack+lowat" };
+    if (socket_profile_parse(&kernel, kernel_options) < 0 || socket_profile_parse(&low_latency, low_latency_options) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    const SocketProfile* profiles[] = { &kernel, &default_socket_profile, &low_latency };
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+        printf("%s\n", profiles[i]->name);
+        bench_joins(profiles[i]);
+        bench_round_trips(profiles[i]);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#include "buffers.h"
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CACHE_BYTES 262144  // Freed buffers each thread keeps per class, the rest goes back to malloc
+#define LARGE_CLASS BUFFER_CLASSES
+
+static const size_t class_sizes[BUFFER_CLASSES] = { 1024, 4096, 16384, 32768 };
+
+// In front of every buffer, keeps the payload 16 byte aligned like malloc's
+typedef union BufferHeader {
+    struct {
+        uint32_t class_index;
+        size_t size;                // Payload bytes, the class size or the requested size if larger
+        union BufferHeader* next;   // While cached
+    };
+    max_align_t align;
+} BufferHeader;
+
+typedef struct {
+    atomic_size_t in_use;
+    atomic_size_t high_water;
+    atomic_size_t cached;
+} ClassCounters;
+
+static struct {
+    atomic_size_t in_use;
+    atomic_size_t high_water;
+    atomic_size_t cached;
+    atomic_size_t throttled;
+    ClassCounters classes[BUFFER_CLASSES];
+} buffers;
+
+// Per thread, so reuse needs no lock. Workers free what they allocate, a buffer freed elsewhere just
+// lands in that thread's cache
+static __thread BufferHeader* cache[BUFFER_CLASSES];
+static __thread size_t cache_count[BUFFER_CLASSES];
+
+static void raise_high_water(atomic_size_t* high_water, size_t value) {
+    size_t current = atomic_load_explicit(high_water, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(high_water, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static uint32_t class_of(size_t size) {
+    for (uint32_t i = 0; i < BUFFER_CLASSES; ++i) {
+        if (size <= class_sizes[i]) {
+            return i;
+        }
+    }
+    return LARGE_CLASS;
+}
+
+void* buffer_alloc(size_t size) {
+    uint32_t class_index = class_of(size);
+    BufferHeader* header = NULL;
+
+    if (class_index != LARGE_CLASS && cache[class_index] != NULL) {
+        header = cache[class_index];
+        cache[class_index] = header->next;
+        --cache_count[class_index];
+        atomic_fetch_sub_explicit(&buffers.classes[class_index].cached, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&buffers.cached, header->size, memory_order_relaxed);
+    } else {
+        size_t payload = class_index != LARGE_CLASS ? class_sizes[class_index] : size;
+        header = malloc(sizeof(BufferHeader) + payload);
+        if (header == NULL) {
+            return NULL;
+        }
+        header->class_index = class_index;
+        header->size = payload;
+    }
+
+    size_t in_use = atomic_fetch_add_explicit(&buffers.in_use, header->size, memory_order_relaxed) + header->size;
+    raise_high_water(&buffers.high_water, in_use);
+    if (class_index != LARGE_CLASS) {
+        ClassCounters* counters = &buffers.classes[class_index];
+        raise_high_water(&counters->high_water, atomic_fetch_add_explicit(&counters->in_use, 1, memory_order_relaxed) + 1);
+    }
+
+    return header + 1;
+}
+
+void buffer_free(void* buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    BufferHeader* header = (BufferHeader*)buffer - 1;
+    uint32_t class_index = header->class_index;
+    atomic_fetch_sub_explicit(&buffers.in_use, header->size, memory_order_relaxed);
+
+    if (class_index == LARGE_CLASS) {
+        free(header);
+        return;
+    }
+
+    atomic_fetch_sub_explicit(&buffers.classes[class_index].in_use, 1, memory_order_relaxed);
+    if (cache_count[class_index] >= CACHE_BYTES / class_sizes[class_index]) {
+        free(header);
+        return;
+    }
+
+    header->next = cache[class_index];
+    cache[class_index] = header;
+    ++cache_count[class_index];
+    atomic_fetch_add_explicit(&buffers.classes[class_index].cached, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&buffers.cached, header->size, memory_order_relaxed);
+}
+
+int buffers_under_pressure() {
+    size_t budget = config.memory_budget_mb * 1024 * 1024;
+    return budget != 0 && atomic_load_explicit(&buffers.in_use, memory_order_relaxed) >= budget;
+}
+
+void buffers_throttled() {
+    atomic_fetch_add_explicit(&buffers.throttled, 1, memory_order_relaxed);
+}
+
+void buffers_stats(BufferStats* stats) {
+    stats->budget = config.memory_budget_mb * 1024 * 1024;
+    stats->in_use = atomic_load_explicit(&buffers.in_use, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&buffers.high_water, memory_order_relaxed);
+    stats->cached = atomic_load_explicit(&buffers.cached, memory_order_relaxed);
+    stats->throttled = atomic_load_explicit(&buffers.throttled, memory_order_relaxed);
+
+    for (size_t i = 0; i < BUFFER_CLASSES; ++i) {
+        stats->classes[i].size = class_sizes[i];
+        stats->classes[i].in_use = atomic_load_explicit(&buffers.classes[i].in_use, memory_order_relaxed);
+        stats->classes[i].high_water = atomic_load_explicit(&buffers.classes[i].high_water, memory_order_relaxed);
+        stats->classes[i].cached = atomic_load_explicit(&buffers.classes[i].cached, memory_order_relaxed);
+    }
+}
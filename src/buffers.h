@@ -0,0 +1,38 @@
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BUFFER_CLASSES 4    // 1 KB, 4 KB, 16 KB and 32 KB, anything larger comes straight from malloc
+
+typedef struct {
+    size_t size;
+    size_t in_use;          // Buffers handed out right now
+    size_t high_water;      // Most ever handed out at once
+    size_t cached;          // Freed buffers kept by the threads for reuse
+} BufferClassStats;
+
+typedef struct {
+    size_t budget;          // Bytes, 0 if unlimited
+    size_t in_use;          // Bytes of the buffers handed out, by their class size
+    size_t high_water;
+    size_t cached;
+    size_t throttled;       // Reads held back or shrunk because the budget was reached
+    BufferClassStats classes[BUFFER_CLASSES];
+} BufferStats;
+
+// Never blocks. Rounds the size up to its class and reuses a buffer freed by the same thread if
+// there is one. Returns NULL when out of memory, the budget only slows reads down
+void* buffer_alloc(size_t size);
+// Accepts any buffer from buffer_alloc, whichever thread allocated it
+void buffer_free(void* buffer);
+
+// Usage reached memory_budget_mb, connections should stop pulling bytes they may have to queue
+int buffers_under_pressure();
+void buffers_throttled();
+void buffers_stats(BufferStats* stats);
+
+#endif // BUFFERS_H
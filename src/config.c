@@ -0,0 +1,196 @@
+#include "config.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum OptionType {
+    OPTION_SIZE,
+    OPTION_TIMEOUT_MS,  // A size routes keep in 32 bits of milliseconds, bounded like their own timeouts
+    OPTION_TIMEOUT_S,   // The same in seconds
+    OPTION_BOOL,    // on/off
+    OPTION_CHOICE,  // One of a NULL terminated list of names, stored as its index in an enum field
+    OPTION_STRING   // The rest of the line, stored in a CONFIG_STRING_SIZE array
+};
+
+typedef struct {
+    const char* name;
+    enum OptionType type;
+    size_t offset;
+    const char* const* choices;
+} Option;
+
+Config config = {
+    .workers = 0,
+    .forward_mode = FORWARD_SPLICE,
+    .io_backend = IO_BACKEND_EPOLL,
+    .reuseport = 1,
+    .pin_workers = 1,
+    .watch_config = 0,
+    .dns_timeout_ms = 1000,
+    .dns_attempts = 3,
+    .dns_cache_size = 4096,
+    .dns_stale_s = 300,
+    .dns_negative_ttl_s = 5,
+    .log_full_policy = LOG_FULL_DROP,
+    .status_cache_ttl_ms = 5000,
+    .status_timeout_ms = 2000,
+    .status_fallback_motd = "Server is offline",
+    .pool_size = 8,
+    .pool_max_age_ms = 10000,
+    .health_check = HEALTH_CHECK_TCP,
+    .health_interval_ms = 5000,
+    .health_timeout_ms = 2000,
+    .metrics_listen = "none",
+    .admin_socket = "none",
+    .memory_budget_mb = 256,
+    .connection_rate = 10,
+    .connection_burst = 100,
+    .max_handshakes = 4096,
+    .handshake_timeout_ms = 5000,
+    .connect_timeout_ms = 5000,
+    .idle_timeout_s = 300,
+    .listen_profile = "default",
+    .shaping_global_mbps = 0,
+    .shaping_session_kbps = 0,
+    .shaping_burst_ms = 50,
+    .shaping_interactive_bytes = 512,
+    .upgrade_drain_s = 3600,
+    .trace_sample = 0,
+    .trace_slow_ms = 1000,
+};
+
+static const char* const forward_modes[] = { "splice", "copy", "sockmap", NULL };
+static const char* const io_backends[] = { "epoll", "io_uring", NULL };
+static const char* const log_full_policies[] = { "drop", "block", NULL };
+static const char* const health_checks[] = { "off", "tcp", "ping", NULL };
+
+static const Option options[] = {
+    { "workers", OPTION_SIZE, offsetof(Config, workers), NULL },
+    { "forward_mode", OPTION_CHOICE, offsetof(Config, forward_mode), forward_modes },
+    { "io_backend", OPTION_CHOICE, offsetof(Config, io_backend), io_backends },
+    { "reuseport", OPTION_BOOL, offsetof(Config, reuseport), NULL },
+    { "pin_workers", OPTION_BOOL, offsetof(Config, pin_workers), NULL },
+    { "watch_config", OPTION_BOOL, offsetof(Config, watch_config), NULL },
+    { "dns_timeout_ms", OPTION_SIZE, offsetof(Config, dns_timeout_ms), NULL },
+    { "dns_attempts", OPTION_SIZE, offsetof(Config, dns_attempts), NULL },
+    { "dns_cache_size", OPTION_SIZE, offsetof(Config, dns_cache_size), NULL },
+    { "dns_stale_s", OPTION_SIZE, offsetof(Config, dns_stale_s), NULL },
+    { "dns_negative_ttl_s", OPTION_SIZE, offsetof(Config, dns_negative_ttl_s), NULL },
+    { "log_full_policy", OPTION_CHOICE, offsetof(Config, log_full_policy), log_full_policies },
+    { "status_cache_ttl_ms", OPTION_SIZE, offsetof(Config, status_cache_ttl_ms), NULL },
+    { "status_timeout_ms", OPTION_SIZE, offsetof(Config, status_timeout_ms), NULL },
+    { "status_fallback_motd", OPTION_STRING, offsetof(Config, status_fallback_motd), NULL },
+    { "pool_size", OPTION_SIZE, offsetof(Config, pool_size), NULL },
+    { "pool_max_age_ms", OPTION_SIZE, offsetof(Config, pool_max_age_ms), NULL },
+    { "health_check", OPTION_CHOICE, offsetof(Config, health_check), health_checks },
+    { "health_interval_ms", OPTION_SIZE, offsetof(Config, health_interval_ms), NULL },
+    { "health_timeout_ms", OPTION_SIZE, offsetof(Config, health_timeout_ms), NULL },
+    { "metrics_listen", OPTION_STRING, offsetof(Config, metrics_listen), NULL },
+    { "admin_socket", OPTION_STRING, offsetof(Config, admin_socket), NULL },
+    { "memory_budget_mb", OPTION_SIZE, offsetof(Config, memory_budget_mb), NULL },
+    { "connection_rate", OPTION_SIZE, offsetof(Config, connection_rate), NULL },
+    { "connection_burst", OPTION_SIZE, offsetof(Config, connection_burst), NULL },
+    { "max_handshakes", OPTION_SIZE, offsetof(Config, max_handshakes), NULL },
+    { "handshake_timeout_ms", OPTION_SIZE, offsetof(Config, handshake_timeout_ms), NULL },
+    { "connect_timeout_ms", OPTION_TIMEOUT_MS, offsetof(Config, connect_timeout_ms), NULL },
+    { "idle_timeout_s", OPTION_TIMEOUT_S, offsetof(Config, idle_timeout_s), NULL },
+    { "listen_profile", OPTION_STRING, offsetof(Config, listen_profile), NULL },
+    { "shaping_global_mbps", OPTION_SIZE, offsetof(Config, shaping_global_mbps), NULL },
+    { "shaping_session_kbps", OPTION_SIZE, offsetof(Config, shaping_session_kbps), NULL },
+    { "shaping_burst_ms", OPTION_SIZE, offsetof(Config, shaping_burst_ms), NULL },
+    { "shaping_interactive_bytes", OPTION_SIZE, offsetof(Config, shaping_interactive_bytes), NULL },
+    { "upgrade_drain_s", OPTION_SIZE, offsetof(Config, upgrade_drain_s), NULL },
+    { "trace_sample", OPTION_SIZE, offsetof(Config, trace_sample), NULL },
+    { "trace_slow_ms", OPTION_SIZE, offsetof(Config, trace_slow_ms), NULL },
+};
+
+ssize_t config_set(const char* const key, const char* const value) {
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i) {
+        if (strcmp(options[i].name, key) != 0) {
+            continue;
+        }
+
+        void* field = (char*)&config + options[i].offset;
+        char* end;
+
+        // Only strings take the whole rest of the line, everything else is the first word of it
+        char word[64];
+        size_t word_length = strcspn(value, " \t");
+        if (options[i].type != OPTION_STRING) {
+            if (word_length >= sizeof(word)) {
+                printf("Invalid value for %s: %s\n", key, value);
+                return -1;
+            }
+            memcpy(word, value, word_length);
+            word[word_length] = '\0';
+        }
+
+        switch (options[i].type) {
+            case OPTION_SIZE:
+            case OPTION_TIMEOUT_MS:
+            case OPTION_TIMEOUT_S: {
+                unsigned long long parsed = strtoull(word, &end, 10);
+                unsigned long long max = options[i].type == OPTION_TIMEOUT_MS ? UINT32_MAX :
+                                         options[i].type == OPTION_TIMEOUT_S ? UINT32_MAX / 1000 : SIZE_MAX;
+                if (end == word || *end != '\0' || parsed > max) {
+                    printf("Invalid value for %s: %s\n", key, value);
+                    return -1;
+                }
+                *(size_t*)field = parsed;
+                return 0;
+            }
+
+            case OPTION_BOOL:
+                if (strcmp(word, "on") == 0 || strcmp(word, "yes") == 0 || strcmp(word, "true") == 0) {
+                    *(int*)field = 1;
+                    return 0;
+                }
+                if (strcmp(word, "off") == 0 || strcmp(word, "no") == 0 || strcmp(word, "false") == 0) {
+                    *(int*)field = 0;
+                    return 0;
+                }
+                printf("Invalid value for %s: %s\n", key, value);
+                return -1;
+
+            case OPTION_CHOICE:
+                for (int choice = 0; options[i].choices[choice] != NULL; ++choice) {
+                    if (strcmp(options[i].choices[choice], word) == 0) {
+                        *(int*)field = choice;
+                        return 0;
+                    }
+                }
+                printf("Invalid value for %s: %s\n", key, value);
+                return -1;
+
+            case OPTION_STRING:
+                if (strlen(value) >= CONFIG_STRING_SIZE) {
+                    printf("Value for %s is too long\n", key);
+                    return -1;
+                }
+                strcpy(field, value);
+                return 0;
+        }
+    }
+
+    printf("Unknown option: %s\n", key);
+    return -1;
+}
+
+size_t config_worker_count() {
+    if (config.workers > 0) {
+        return config.workers;
+    }
+
+    // Respect cpusets and taskset, the process may not be allowed on every online CPU
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+        return CPU_COUNT(&set);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
@@ -0,0 +1,79 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum ForwardMode {
+    FORWARD_SPLICE, // socket -> pipe -> socket inside the kernel
+    FORWARD_COPY,   // read()/write() through a userspace buffer
+    FORWARD_SOCKMAP // Sockets handed to a BPF program after the handshake, splice until then
+};
+
+enum IoBackend {
+    IO_BACKEND_EPOLL,   // Readiness based, works everywhere
+    IO_BACKEND_URING    // Completion based, falls back to epoll on kernels without the needed opcodes
+};
+
+enum LogFullPolicy {
+    LOG_FULL_DROP,  // Count the record as dropped and carry on, logging never slows a connection down
+    LOG_FULL_BLOCK  // Wait for the writer to make room, no record is lost
+};
+
+enum HealthCheck {
+    HEALTH_CHECK_OFF,
+    HEALTH_CHECK_TCP,   // The backend accepts a connection
+    HEALTH_CHECK_PING   // The backend answers a status request
+};
+
+#define CONFIG_STRING_SIZE 256
+
+// Global tunables, set with "set <key> <value>" lines in servers.conf
+typedef struct {
+    size_t workers;                 // Event loop threads, 0 means one per online CPU
+    enum ForwardMode forward_mode;
+    enum IoBackend io_backend;
+    int reuseport;                  // One SO_REUSEPORT listener per worker instead of a shared one
+    int pin_workers;                // Pin each worker, and with reuseport its listener, to one CPU
+    int watch_config;               // Reload servers.conf when it changes on disk, SIGHUP always works
+    size_t dns_timeout_ms;          // How long to wait for a nameserver before asking the next one
+    size_t dns_attempts;            // Tries per DNS query across all nameservers
+    size_t dns_cache_size;          // Names kept in the DNS cache
+    size_t dns_stale_s;             // How long an expired answer is still used while it is refreshed
+    size_t dns_negative_ttl_s;      // How long a failed lookup is remembered
+    enum LogFullPolicy log_full_policy; // What logging does while the log ring is full
+    size_t status_cache_ttl_ms;     // How long a backend's status response answers pings, 0 sends every ping to the backend
+    size_t status_timeout_ms;       // How long a status refresh waits for the backend
+    char status_fallback_motd[CONFIG_STRING_SIZE]; // Answered while the backend is down, "none" to not answer
+    size_t pool_size;               // Most pre-connected sockets kept per backend, 0 disables the pool
+    size_t pool_max_age_ms;         // Pooled sockets are closed before backends time out idle connections
+    enum HealthCheck health_check;  // How backends are probed in the background
+    size_t health_interval_ms;      // Time between probes of a healthy backend
+    size_t health_timeout_ms;       // How long a probe may take, half of it marks the backend degraded
+    char metrics_listen[CONFIG_STRING_SIZE]; // host:port serving Prometheus metrics, "none" to not listen
+    char admin_socket[CONFIG_STRING_SIZE]; // Path of the Unix socket taking admin commands, "none" to not listen
+    size_t memory_budget_mb;        // Connection buffers past which reads are throttled, 0 for no limit
+    size_t connection_rate;         // New connections per second allowed from one address, 0 for no limit
+    size_t connection_burst;        // Connections an address may open at once before its rate applies
+    size_t max_handshakes;          // Connections still handshaking past which new ones are turned away, 0 for no limit
+    size_t handshake_timeout_ms;    // How long a client has to finish its handshake or ping, 0 to wait forever
+    size_t connect_timeout_ms;      // How long a backend has to accept, for routes without connect_timeout_ms=
+    size_t idle_timeout_s;          // How long a session may go without traffic, for routes without idle_timeout_s=
+    char listen_profile[CONFIG_STRING_SIZE]; // Socket profile of the listener, which accepted connections inherit
+    size_t shaping_global_mbps;     // Bandwidth to players across all sessions, 0 for no limit
+    size_t shaping_session_kbps;    // Bandwidth to each player, 0 for no limit
+    size_t shaping_burst_ms;        // How much of its rate a bucket lets out at once
+    size_t shaping_interactive_bytes; // Reads up to this size skip the queue while only the shared buckets are empty
+    size_t upgrade_drain_s;         // After handing its listeners to a new binary, how long the old one serves its players before closing them
+    size_t trace_sample;            // One session in this many is written to logs/trace.jsonl, 0 for none
+    size_t trace_slow_ms;           // Sessions taking longer to reach the backend's first answer are always written, 0 for none
+} Config;
+
+extern Config config;
+
+ssize_t config_set(const char* const key, const char* const value);
+size_t config_worker_count();
+
+#endif // CONFIG_H
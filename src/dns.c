@@ -1,229 +1,392 @@
 #include "dns.h"
+#include "config.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <strings.h>
+
+#define CACHE_SHARDS 16         // Must be a power of two
+#define MIN_TTL 1
+#define MAX_TTL 86400
+
+typedef struct CacheEntry {
+    char hostname[256];
+    uint64_t hash;
+    ssize_t status;             // -1 for a cached failure
+    DnsAnswer answer;
+    uint64_t expires;           // Fresh until, in seconds of the monotonic clock
+    uint64_t refresh_at;        // Hits from here on refresh the entry in the background
+    uint8_t refreshing;
+    uint32_t cursor;            // Rotates through the addresses on every hit
+    struct CacheEntry* chain;   // Next entry of the same bucket
+    struct CacheEntry* newer;
+    struct CacheEntry* older;
+} CacheEntry;
+
+// Each shard has its own lock, so lookups of different names rarely contend
+typedef struct {
+    pthread_mutex_t mutex;
+    CacheEntry** buckets;
+    size_t mask;
+    CacheEntry* entries;
+    size_t used;
+    size_t capacity;
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    DnsCacheStats stats;
+} CacheShard;
+
+static CacheShard* dns_cache = NULL;
+
+static uint64_t now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
 
-#define MC_SRV_PREFIX "_minecraft._tcp."
-
-pthread_mutex_t dns_cache_mutex;
-
-CacheEntry* dns_cache;
-size_t CACHE_SIZE = 0;
+static uint64_t hash_hostname(const char* hostname) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *hostname != '\0'; ++hostname) {
+        hash ^= (unsigned char)tolower((unsigned char)*hostname);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
 ssize_t dns_cache_init(size_t cache_size) {
-    dns_cache = malloc(cache_size * sizeof(CacheEntry));
+    dns_cache_destroy();
+
+    dns_cache = calloc(CACHE_SHARDS, sizeof(CacheShard));
     if (dns_cache == NULL) {
         return -1;
     }
 
-    if (pthread_mutex_init(&dns_cache_mutex, NULL) != 0) {
-        free(dns_cache);
-        dns_cache = NULL;
-        return -1;
+    size_t capacity = cache_size / CACHE_SHARDS > 0 ? cache_size / CACHE_SHARDS : 1;
+    size_t buckets = 1;
+    while (buckets < capacity) {
+        buckets <<= 1;
     }
 
-    for (size_t i = 0; i < cache_size; ++i) {
-        dns_cache[i].hostname[0] = '\0';
-        dns_cache[i].ip_address[0] = '\0';
-        dns_cache[i].last_used = 0;
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        CacheShard* shard = &dns_cache[i];
+        shard->capacity = capacity;
+        shard->mask = buckets - 1;
+        shard->buckets = calloc(buckets, sizeof(CacheEntry*));
+        shard->entries = calloc(capacity, sizeof(CacheEntry));
+
+        if (shard->buckets == NULL || shard->entries == NULL || pthread_mutex_init(&shard->mutex, NULL) != 0) {
+            free(shard->buckets);
+            free(shard->entries);
+            shard->buckets = NULL;
+            shard->entries = NULL;
+            dns_cache_destroy();
+            return -1;
+        }
     }
 
-    CACHE_SIZE = cache_size;
     return 0;
 }
 
 void dns_cache_destroy() {
-    CACHE_SIZE = 0;
+    if (dns_cache == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        if (dns_cache[i].entries != NULL) {
+            pthread_mutex_destroy(&dns_cache[i].mutex);
+        }
+        free(dns_cache[i].buckets);
+        free(dns_cache[i].entries);
+    }
     free(dns_cache);
     dns_cache = NULL;
 }
 
-ssize_t resolve_hostname(const char* const hostname, char* const address) {
-    struct sockaddr_in sa;
+static CacheShard* shard_of(uint64_t hash) {
+    // The low bits pick the bucket inside the shard
+    return &dns_cache[(hash >> 56) & (CACHE_SHARDS - 1)];
+}
 
-    if (dns_cache == NULL) {
-        printf("DNS cache not initialized\n");
-        return -1;
+static CacheEntry* shard_find(CacheShard* shard, const char* hostname, uint64_t hash) {
+    for (CacheEntry* entry = shard->buckets[hash & shard->mask]; entry != NULL; entry = entry->chain) {
+        if (entry->hash == hash && strcasecmp(entry->hostname, hostname) == 0) {
+            return entry;
+        }
     }
+    return NULL;
+}
 
-    int result = inet_pton(AF_INET, hostname, &(sa.sin_addr));
-    // if the hostname is already an IP address, no need to query the DNS
-    if (result != 0)
-    {
-        strncpy(address, hostname, 15);
-        return 0;
+static void lru_unlink(CacheShard* shard, CacheEntry* entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
     }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
 
-    time_t now = time(NULL);
-
-    pthread_mutex_lock(&dns_cache_mutex);
+static void lru_push(CacheShard* shard, CacheEntry* entry) {
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if (shard->newest != NULL) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
 
-    for (size_t i = 0; i < CACHE_SIZE; ++i) {
-        if (dns_cache[i].hostname != NULL && strcmp(dns_cache[i].hostname, hostname) == 0) {
-            if (now - dns_cache[i].last_used > 300) {
-                break; // if the entry is older than 5 minutes, re-query the DNS
-            }
+// Takes a free entry, or the least recently used one once the shard is full
+static CacheEntry* shard_take(CacheShard* shard) {
+    if (shard->used < shard->capacity) {
+        return &shard->entries[shard->used++];
+    }
 
-            dns_cache[i].last_used = now;
-            strncpy(address, dns_cache[i].ip_address, 15);
-            pthread_mutex_unlock(&dns_cache_mutex);
-            return 0;
+    CacheEntry* entry = shard->oldest;
+    lru_unlink(shard, entry);
+    for (CacheEntry** link = &shard->buckets[entry->hash & shard->mask]; *link != NULL; link = &(*link)->chain) {
+        if (*link == entry) {
+            *link = entry->chain;
+            break;
         }
     }
-    pthread_mutex_unlock(&dns_cache_mutex);
+    ++shard->stats.evictions;
+    return entry;
+}
 
-    char ip_address[16];
+// IP addresses are answered without touching the cache
+static ssize_t parse_literal(const char* hostname, DnsAnswer* answer) {
+    memset(answer, 0, sizeof(*answer));
 
-    if (dns_query_mc(hostname, ip_address) < 0) {
+    if (inet_pton(AF_INET, hostname, &answer->addresses[0].v4) == 1) {
+        answer->addresses[0].family = AF_INET;
+    } else if (inet_pton(AF_INET6, hostname, &answer->addresses[0].v6) == 1) {
+        answer->addresses[0].family = AF_INET6;
+    } else {
         return -1;
     }
 
-    pthread_mutex_lock(&dns_cache_mutex);
+    answer->count = 1;
+    return 0;
+}
 
-    ssize_t lru_index = -1;
-    for (size_t i = 0; i < CACHE_SIZE; ++i) {
-        if (dns_cache[i].hostname[0] == '\0') {
-            lru_index = i;
-            break;
-        }
+// Never blocks on the network. Entries past their TTL are still served for dns_stale_s seconds
+// while the first hit refreshes them in the background, so a cached name never delays a join
+enum DnsCacheResult dns_cache_lookup(const char* const hostname, DnsAnswer* const answer) {
+    if (parse_literal(hostname, answer) == 0) {
+        return DNS_CACHE_HIT;
     }
 
-    if (lru_index == -1) {
-        time_t lru_time = now;
-        for (size_t i = 0; i < CACHE_SIZE; ++i) {
-            if (dns_cache[i].last_used <= lru_time) {
-                lru_time = dns_cache[i].last_used;
-                lru_index = i;
+    if (dns_cache == NULL) {
+        return DNS_CACHE_MISS;
+    }
+
+    uint64_t hash = hash_hostname(hostname);
+    CacheShard* shard = shard_of(hash);
+    uint64_t now = now_seconds();
+    enum DnsCacheResult result = DNS_CACHE_MISS;
+    int refresh = 0;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    CacheEntry* entry = shard_find(shard, hostname, hash);
+
+    if (entry == NULL || (entry->status != 0 && now >= entry->expires) || now >= entry->expires + config.dns_stale_s) {
+        ++shard->stats.misses;
+    } else if (entry->status != 0) {
+        ++shard->stats.negative_hits;
+        result = DNS_CACHE_NEGATIVE;
+    } else {
+        // Hand out the addresses starting at a different one every time to spread the load. Each family
+        // rotates on its own behind the IPv4 ones, so a host without IPv6 is never sent to one first
+        const DnsAnswer* cached = &entry->answer;
+        *answer = *cached;
+        size_t v4_count = 0;
+        for (size_t i = 0; i < cached->count; ++i) {
+            v4_count += cached->addresses[i].family == AF_INET;
+        }
+        size_t v6_count = cached->count - v4_count;
+        size_t v4_seen = 0;
+        size_t v6_seen = 0;
+        for (size_t i = 0; i < cached->count; ++i) {
+            if (cached->addresses[i].family == AF_INET) {
+                answer->addresses[(v4_seen++ + v4_count - entry->cursor % v4_count) % v4_count] = cached->addresses[i];
+            } else {
+                answer->addresses[v4_count + (v6_seen++ + v6_count - entry->cursor % v6_count) % v6_count] = cached->addresses[i];
             }
         }
+        ++entry->cursor;
+
+        if (now >= entry->expires) {
+            ++shard->stats.stale_hits;
+        } else {
+            ++shard->stats.hits;
+        }
+
+        if (now >= entry->refresh_at && !entry->refreshing) {
+            entry->refreshing = 1;
+            refresh = 1;
+        }
+
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+        result = DNS_CACHE_HIT;
     }
-    
-    strncpy(dns_cache[lru_index].hostname, hostname, 255);
-    strncpy(dns_cache[lru_index].ip_address, ip_address, 15);
-    dns_cache[lru_index].last_used = now;
 
-    pthread_mutex_unlock(&dns_cache_mutex);
+    pthread_mutex_unlock(&shard->mutex);
 
-    strncpy(address, ip_address, 15);
-    return 0;
+    if (refresh) {
+        resolver_refresh(hostname);
+    }
+    return result;
 }
 
-void parse_dns_response(const char* response, char* domain, const size_t max_len) {
-    const char* response_ptr = response;
-    char* domain_ptr = domain;
-    size_t total_len = 0;
+void dns_cache_store(const char* const hostname, ssize_t status, const DnsAnswer* const answer) {
+    if (dns_cache == NULL || strlen(hostname) >= sizeof(((CacheEntry*)0)->hostname)) {
+        return;
+    }
 
-    while (*response_ptr != '\0' && total_len < max_len - 1) {
-        size_t len = *response_ptr++;
-        if (len <= 0) {
-            break;
-        }
+    uint64_t hash = hash_hostname(hostname);
+    CacheShard* shard = shard_of(hash);
+    uint64_t now = now_seconds();
 
-        if (total_len + len >= max_len - 1) {
-            // If the length of the label exceeds the remaining space in the domain buffer, truncate
-            len = max_len - 1 - total_len;
-        }
+    pthread_mutex_lock(&shard->mutex);
+
+    CacheEntry* entry = shard_find(shard, hostname, hash);
 
-        strncpy(domain_ptr, response_ptr, len);
-        domain_ptr += len;
-        response_ptr += len;
-        total_len += len;
+    // A failed refresh keeps the last good answer for as long as it may be served stale,
+    // the next refresh is attempted once a negative entry would have expired
+    if (status != 0 && entry != NULL && entry->status == 0 && now < entry->expires + config.dns_stale_s) {
+        entry->refreshing = 0;
+        entry->refresh_at = now + config.dns_negative_ttl_s;
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
 
-        if (total_len < max_len - 1) {
-            *domain_ptr++ = '.';
-            total_len++;
+    uint32_t ttl;
+    if (status == 0) {
+        ttl = answer->ttl < MIN_TTL ? MIN_TTL : answer->ttl > MAX_TTL ? MAX_TTL : answer->ttl;
+    } else {
+        ttl = config.dns_negative_ttl_s;
+        if (answer->ttl > 0 && answer->ttl < ttl) {
+            ttl = answer->ttl;
         }
     }
 
-    // Ensure the domain is null-terminated
-    if (total_len > 0 && *(domain_ptr - 1) == '.') {
-        *(domain_ptr - 1) = '\0';
+    if (entry == NULL) {
+        entry = shard_take(shard);
+        strcpy(entry->hostname, hostname);
+        entry->hash = hash;
+        entry->cursor = 0;
+        entry->chain = shard->buckets[hash & shard->mask];
+        shard->buckets[hash & shard->mask] = entry;
     } else {
-        *domain_ptr = '\0';
+        lru_unlink(shard, entry);
     }
-}
 
-ns_type get_dns_record(const char* const fqdn, char* address, const ns_type query_type) {
-    char response[NS_PACKETSZ];
-    char domain_name[256];
-    strncpy(domain_name, fqdn, 255);
+    entry->status = status;
+    entry->answer = *answer;
+    entry->expires = now + ttl;
+    entry->refresh_at = now + ttl - ttl / 10;
+    entry->refreshing = 0;
+    lru_push(shard, entry);
 
-    ssize_t len = res_query((const char *)domain_name, ns_c_in, query_type, response, sizeof(response));
+    pthread_mutex_unlock(&shard->mutex);
+}
 
-    if (len < 0) {
-        address = NULL;
-        return ns_t_invalid;
+void dns_cache_stats(DnsCacheStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (dns_cache == NULL) {
+        return;
     }
 
-    ns_msg msg;
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        CacheShard* shard = &dns_cache[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->entries += shard->used;
+        stats->hits += shard->stats.hits;
+        stats->stale_hits += shard->stats.stale_hits;
+        stats->negative_hits += shard->stats.negative_hits;
+        stats->misses += shard->stats.misses;
+        stats->evictions += shard->stats.evictions;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
 
-    if (ns_initparse(response, len, &msg) < 0)
-    {
-        printf("Parsing failed\n");
-        address = NULL;
-        return ns_t_invalid;
+void dns_cache_dump(FILE* out) {
+    if (dns_cache == NULL) {
+        return;
     }
 
-    for (ssize_t i = ns_msg_count(msg, ns_s_an) - 1; i >= 0; i--)
-    {
-        ns_rr rr;
-        char target[256];
-        
-        if (ns_parserr(&msg, ns_s_an, i, &rr))
-        {
-            printf("Error parsing record\n");
-            continue;
+    uint64_t now = now_seconds();
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        CacheShard* shard = &dns_cache[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (const CacheEntry* entry = shard->newest; entry != NULL; entry = entry->older) {
+            fprintf(out, "%s", entry->hostname);
+            if (entry->status != 0) {
+                fprintf(out, " unresolved");
+            }
+            for (size_t j = 0; j < entry->answer.count && entry->status == 0; ++j) {
+                const DnsAddress* address = &entry->answer.addresses[j];
+                char text[INET6_ADDRSTRLEN];
+                inet_ntop(address->family, &address->v4, text, sizeof(text));
+                fprintf(out, "%s%s", j == 0 ? " " : ",", text);
+            }
+            if (entry->answer.port != 0 && entry->status == 0) {
+                fprintf(out, " srv_port=%u", entry->answer.port);
+            }
+            // Negative when the answer is served stale
+            fprintf(out, " expires_in_s=%lld\n", (long long)entry->expires - (long long)now);
         }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
 
-        switch(ns_rr_type(rr))
-        {
-            case ns_t_srv:
-                //TODO: consider using the port given in the SRV record (ns_get16(ns_rr_rdata(rr) + 4))
-                parse_dns_response(ns_rr_rdata(rr) + 6, target, sizeof(target));
-                strncpy(address, target, 255);
-                return ns_rr_type(rr);
-            case ns_t_a:
-                snprintf(target, 16, "%d.%d.%d.%d", 
-                    ns_rr_rdata(rr)[0], 
-                    ns_rr_rdata(rr)[1], 
-                    ns_rr_rdata(rr)[2], 
-                    ns_rr_rdata(rr)[3]
-                );
-                strncpy(address, target, 15);
-                return ns_rr_type(rr);
-            case ns_t_cname:
-                parse_dns_response(ns_rr_rdata(rr), target, sizeof(target));
-                strncpy(address, target, 255);
-                return ns_rr_type(rr);
+// Writes the first IPv4 address of the answer, the callers below only deal with IPv4
+static ssize_t first_ipv4(const DnsAnswer* answer, char* const address) {
+    for (size_t i = 0; i < answer->count; ++i) {
+        if (answer->addresses[i].family == AF_INET) {
+            inet_ntop(AF_INET, &answer->addresses[i].v4, address, 16);
+            return 0;
         }
     }
+    return -1;
 }
 
-ssize_t dns_query_mc(const char* const fqdn, char* const address)
-{
-    char domain_name[256];
-    char query_fqdn[256];
-
-    // Check if the fqdn is a SRV record
-    // Append _minecraft._tcp. to the fqdn
-    snprintf(query_fqdn, 255, "%s%s", MC_SRV_PREFIX, fqdn);
-    ns_type record_type = get_dns_record(query_fqdn, domain_name, ns_t_srv);
-    if (record_type == ns_t_srv)
-    {
-        strncpy(query_fqdn, domain_name, 255);
-    } else {
-        strncpy(query_fqdn, fqdn, 255);
+// Blocks the calling thread until the name is resolved, the event loops use resolver_lookup instead
+ssize_t resolve_hostname(const char* const hostname, char* const address) {
+    if (dns_cache == NULL) {
+        printf("DNS cache not initialized\n");
+        return -1;
     }
 
-    // If the fqdn is not a SRV record, check if it is an A record
-    record_type = get_dns_record(query_fqdn, domain_name, ns_t_a);
-    if (record_type == ns_t_a)
-    {
-        strncpy(address, domain_name, 15);
-        return 0;
-    } else if (record_type == ns_t_cname) {
-        printf("TODO: add support for CNAME records\n");
-    } else {
-        printf("DNS query error\n");
+    DnsAnswer answer;
+    switch (dns_cache_lookup(hostname, &answer)) {
+        case DNS_CACHE_HIT:
+            return first_ipv4(&answer, address);
+        case DNS_CACHE_NEGATIVE:
+            return -1;
+        case DNS_CACHE_MISS:
+            break;
+    }
+
+    // The resolver caches the answer
+    return dns_query_mc(hostname, address);
+}
+
+// Resolves the Minecraft server address, following the _minecraft._tcp SRV record if there is one
+ssize_t dns_query_mc(const char* const fqdn, char* const address)
+{
+    DnsAnswer answer;
+    if (parse_literal(fqdn, &answer) != 0 && resolver_lookup_sync(fqdn, &answer) != 0) {
         return -1;
     }
-    
-    return -1;
+    return first_ipv4(&answer, address);
 }
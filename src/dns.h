@@ -12,15 +12,31 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#include "resolver.h"
+
+enum DnsCacheResult {
+    DNS_CACHE_HIT,          // The answer is filled in, a stale one is being refreshed in the background
+    DNS_CACHE_MISS,
+    DNS_CACHE_NEGATIVE      // The name failed to resolve moments ago
+};
+
 typedef struct {
-    char hostname[256];
-    char ip_address[16];
-    time_t last_used;
-} CacheEntry;
+    size_t entries;
+    size_t hits;
+    size_t stale_hits;
+    size_t negative_hits;
+    size_t misses;
+    size_t evictions;
+} DnsCacheStats;
 
 ssize_t dns_cache_init(size_t cache_size);
 void dns_cache_destroy();
+enum DnsCacheResult dns_cache_lookup(const char* const hostname, DnsAnswer* const answer);
+void dns_cache_store(const char* const hostname, ssize_t status, const DnsAnswer* const answer);
+void dns_cache_stats(DnsCacheStats* stats);
+// Writes every cached name with its addresses and how long they stay fresh, newest first per shard
+void dns_cache_dump(FILE* out);
 ssize_t resolve_hostname(const char* const hostname, char* const address);
 ssize_t dns_query_mc(const char* const fqdn, char* const address);
 
-#endif // DNS_H
\ No newline at end of file
+#endif // DNS_H
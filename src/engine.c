@@ -0,0 +1,1096 @@
+#include "engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "buffers.h"
+#include "config.h"
+#include "pool.h"
+#include "profiles.h"
+#include "uring.h"
+
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64 // Accepts per wakeup, so one worker can't starve its own connections
+#define SPLICE_SIZE 65536 // Default pipe capacity
+#define PRESSURE_READ_SIZE 4096 // Reads over the memory budget, at most this much may end up queued
+
+// Cleared the first time the kernel refuses to splice sockets, new connections then copy
+static volatile int splice_supported = 1;
+
+static Worker* workers = NULL;
+static size_t workers_count = 0;
+
+// Cleared once the listeners have been handed to another process
+static atomic_int accepting = 1;
+
+// Connections closed during the current event batch, freed once the batch is done
+static __thread Connection* closed_connections = NULL;
+
+int create_and_connect_socket(const struct sockaddr* const address, socklen_t address_length, const SocketProfile* profile) {
+    // Create the socket for the destination server
+    int server_socket = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket == -1) {
+        perror("Error creating to socket");
+        return -1;
+    }
+
+    // With fastopen connect() returns at once, the SYN goes out with the handshake on the first send
+    socket_profile_backend(server_socket, profile, 0);
+
+    // Start connecting, completion is reported by EPOLLOUT
+    if (connect(server_socket, address, address_length) < 0 && errno != EINPROGRESS) {
+        perror("Error connecting to socket");
+        close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+static ssize_t pipe_acquire(Worker* worker, Side* side) {
+    if (worker->pipes_count > 0) {
+        --worker->pipes_count;
+        side->pipe[0] = worker->pipes[worker->pipes_count][0];
+        side->pipe[1] = worker->pipes[worker->pipes_count][1];
+        return 0;
+    }
+
+    if (pipe2(side->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("Error creating pipe");
+        side->pipe[0] = side->pipe[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Gives the pipe back to the worker, a pipe still holding bytes can't be reused and is closed
+static void pipe_release(Worker* worker, Side* side) {
+    if (side->pipe[0] == -1) {
+        return;
+    }
+
+    if (side->piped == 0 && worker->pipes_count < PIPE_POOL_SIZE) {
+        worker->pipes[worker->pipes_count][0] = side->pipe[0];
+        worker->pipes[worker->pipes_count][1] = side->pipe[1];
+        ++worker->pipes_count;
+    } else {
+        close(side->pipe[0]);
+        close(side->pipe[1]);
+    }
+
+    side->pipe[0] = side->pipe[1] = -1;
+    side->piped = 0;
+}
+
+static void connection_close(Worker* worker, Connection* connection) {
+    if (connection->session.state == SESSION_CLOSED) {
+        return;
+    }
+
+    // Log the disconnection if the player was connected to the server
+    if (connection->session.state == SESSION_PIPE) {
+        session_log(&connection->session, connection->client.fd, LOG_DISCONNECTED);
+    }
+
+    // The kernel counted what it forwarded
+    if (connection->offloaded) {
+        uint64_t from_client, to_client;
+        if (sockmap_forwarded(connection->client.fd, connection->server.fd, &connection->sockmap, &from_client, &to_client) == 0) {
+            metrics_route_add(connection->session.metrics, ROUTE_BYTES_FROM_CLIENT, from_client);
+            metrics_route_add(connection->session.metrics, ROUTE_BYTES_TO_CLIENT, to_client);
+        }
+        sockmap_detach(&connection->sockmap);
+    }
+
+    registry_remove(worker->sessions, connection->listed);
+    connection->listed = NULL;
+    timer_cancel(&worker->timers, &connection->timer);
+    if (connection->shaped) {
+        shaped_queue_finish(&worker->backlog, &connection->downstream);
+    }
+    pipe_release(worker, &connection->client);
+    pipe_release(worker, &connection->server);
+
+    // Closing the fds also removes them from the epoll set
+    close(connection->client.fd);
+    if (connection->server.fd != -1) {
+        close(connection->server.fd);
+    }
+
+    connection->session.state = SESSION_CLOSED;
+
+    // A connection waiting on the resolver is freed once the lookup comes back
+    if (!connection->resolving) {
+        connection->next_closed = closed_connections;
+        closed_connections = connection;
+    }
+}
+
+static void connection_free(Connection* connection) {
+    buffer_free(connection->client.pending);
+    buffer_free(connection->server.pending);
+    session_destroy(&connection->session);
+    free(connection);
+}
+
+// Arms the connection's timer for the phase it is in, a timeout of 0 leaves it unarmed
+static void connection_deadline(Worker* worker, Connection* connection, enum TimerKind kind, uint64_t timeout_ms) {
+    connection->timer.kind = kind;
+    if (timeout_ms == 0) {
+        timer_cancel(&worker->timers, &connection->timer);
+    } else {
+        timer_arm(&worker->timers, &connection->timer, worker->now_ms + timeout_ms);
+    }
+}
+
+static void accept_connections(Worker* worker) {
+    for (size_t i = 0; i < ACCEPT_BATCH; ++i) {
+        // Accept the client's connection
+        struct sockaddr_storage address;
+        socklen_t address_length = sizeof(address);
+        int client_socket = accept4(worker->server_socket, (struct sockaddr*)&address, &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+
+        // Floods are turned away before they cost any memory
+        enum Admission admission = limiter_admit((struct sockaddr*)&address, address_length);
+        if (admission != ADMIT) {
+            limiter_reject(client_socket, admission);
+            continue;
+        }
+
+        Connection* connection = calloc(1, sizeof(Connection));
+        if (connection == NULL || session_init(&connection->session) < 0) {
+            perror("Error allocating connection");
+            limiter_handshake_done();
+            free(connection);
+            close(client_socket);
+            continue;
+        }
+
+        connection->client.fd = client_socket;
+        connection->client.writable = 1;
+        connection->client.pipe[0] = connection->client.pipe[1] = -1;
+        connection->client.connection = connection;
+        connection->server.fd = -1;
+        connection->server.pipe[0] = connection->server.pipe[1] = -1;
+        connection->server.connection = connection;
+        connection->splice = config.forward_mode != FORWARD_COPY && splice_supported;
+
+        // EPOLLOUT too, edge-triggered it only fires when a full socket drains
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = &connection->client
+        };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            perror("Error registering connection");
+            close(client_socket);
+            session_destroy(&connection->session);
+            free(connection);
+            continue;
+        }
+
+        connection_deadline(worker, connection, TIMER_HANDSHAKE, config.handshake_timeout_ms);
+    }
+}
+
+// Buffers what the client sent until the socket is drained or the buffer is full. Returns -1 to close
+static ssize_t read_client(Connection* connection) {
+    Session* session = &connection->session;
+
+    while (session->handshake_length < HANDSHAKE_BUFFER_SIZE) {
+        ssize_t bytes = recv(connection->client.fd, session->handshake + session->handshake_length,
+                             HANDSHAKE_BUFFER_SIZE - session->handshake_length, 0);
+        if (bytes > 0) {
+            session->handshake_length += bytes;
+            continue;
+        }
+
+        // Connection closed by the client
+        if (bytes == 0) {
+            return -1;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            connection->client.readable = 0;
+            break;
+        }
+
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Reads the client's handshake until it is complete or the socket is drained.
+// Returns 1 when the handshake is complete, 0 if more bytes are needed, -1 to close
+static ssize_t read_handshake(Connection* connection) {
+    if (read_client(connection) < 0) {
+        return -1;
+    }
+
+    ssize_t ready = session_handshake_ready(&connection->session);
+    if (ready < 0) {
+        printf("Malformed packet received\n");
+    }
+    return ready;
+}
+
+// Answers a server list ping from the status cache, one reply at a time.
+// Returns 0 while the exchange goes on, 1 once the Pong is out, -1 on errors
+static ssize_t answer_status(Connection* connection) {
+    Side* client = &connection->client;
+
+    while (1) {
+        while (connection->reply_offset < connection->reply_length) {
+            if (!client->writable) {
+                return 0;
+            }
+
+            ssize_t bytes = send(client->fd, connection->reply + connection->reply_offset,
+                                 connection->reply_length - connection->reply_offset, MSG_NOSIGNAL);
+            if (bytes < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    client->writable = 0;
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            connection->reply_offset += bytes;
+        }
+
+        if (connection->reply_last) {
+            return 1;
+        }
+
+        if (client->readable && read_client(connection) < 0) {
+            return -1;
+        }
+
+        ssize_t advanced = session_status_advance(&connection->session, &connection->reply, &connection->reply_length);
+        if (advanced < 0) {
+            printf("Malformed packet received\n");
+            return -1;
+        }
+        if (connection->reply == NULL) {
+            return 0;
+        }
+        connection->reply_offset = 0;
+        connection->reply_last = advanced == 1;
+    }
+}
+
+static ssize_t connect_backend(Worker* worker, Connection* connection);
+
+// Carries on with the backend the session picked: connects to it, or waits for the resolver
+static ssize_t connect_or_resolve(Worker* worker, Connection* connection, ssize_t picked) {
+    if (picked < 0) {
+        return -1;
+    }
+
+    // Client readiness is latched meanwhile, like while connecting. The resolver has its own timeouts
+    if (picked == 1) {
+        timer_cancel(&worker->timers, &connection->timer);
+        connection->resolving = 1;
+        connection->session.state = SESSION_RESOLVE;
+        return 0;
+    }
+
+    return connect_backend(worker, connection);
+}
+
+static ssize_t connect_backend(Worker* worker, Connection* connection) {
+    // A pooled socket is already connected, EPOLLOUT fires as soon as it is registered
+    const SocketProfile* profile = connection->session.entry->profile;
+    trace_mark(&connection->session.trace, TRACE_CONNECTING);
+    int server_socket = pool_take((struct sockaddr*)&connection->session.backend, connection->session.backend_length);
+    if (server_socket != -1) {
+        socket_profile_backend(server_socket, profile, 1);
+    } else {
+        server_socket = create_and_connect_socket((struct sockaddr*)&connection->session.backend, connection->session.backend_length, profile);
+    }
+
+    // Move on to the route's next backend if the connection was refused
+    if (server_socket == -1) {
+        printf("Connection refused\n");
+        return connect_or_resolve(worker, connection, session_backend_failed(&connection->session, &worker->resolved));
+    }
+
+    connection->server.fd = server_socket;
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = &connection->server
+    };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+        perror("Error registering backend");
+        return -1;
+    }
+
+    connection->session.state = SESSION_CONNECT;
+    connection_deadline(worker, connection, TIMER_CONNECT, connection->session.entry->connect_timeout_ms);
+    return 0;
+}
+
+static ssize_t route_backend(Worker* worker, Connection* connection) {
+    ssize_t routed = session_route(&connection->session, &worker->resolved);
+    if (routed < 0) {
+        return -1;
+    }
+
+    // Nothing to connect to, the status cache answers
+    if (routed == 2) {
+        return answer_status(connection) == 0 ? 0 : -1;
+    }
+
+    socket_profile_client(connection->client.fd, connection->session.entry->profile);
+    connection->shaped = shaped_flow_init(&connection->downstream, connection->session.entry->bandwidth);
+    connection->offload = config.forward_mode == FORWARD_SOCKMAP && sockmap_enabled() && !connection->shaped;
+    connection->idle_timeout_s = connection->session.entry->idle_timeout_s;
+    return connect_or_resolve(worker, connection, routed);
+}
+
+// Carries on with the connections whose backend hostname has been resolved
+static void finish_resolve(Worker* worker) {
+    ResolveRequest* request = resolve_queue_take(&worker->resolved);
+
+    while (request != NULL) {
+        ResolveRequest* next = request->next;
+        Connection* connection = (Connection*)((char*)request - offsetof(Connection, session.resolve));
+        connection->resolving = 0;
+
+        if (connection->session.state == SESSION_CLOSED) {
+            connection->next_closed = closed_connections;
+            closed_connections = connection;
+        } else if (connect_or_resolve(worker, connection, session_resolved(&connection->session, &worker->resolved)) < 0) {
+            connection_close(worker, connection);
+        }
+        request = next;
+    }
+}
+
+// Closes the sessions the admin socket asked for, it wakes the worker through the resolver queue
+static void finish_kills(Worker* worker) {
+    Connection* connection;
+    while ((connection = registry_next_kill(worker->sessions)) != NULL) {
+        printf("Closing the session of %s on request\n", connection->session.username);
+        connection_close(worker, connection);
+    }
+}
+
+// Gives up on the backend being connected to. The client doesn't notice, its bytes are still buffered
+// for the route's next backend. Returns like connect_or_resolve
+static ssize_t connect_next_backend(Worker* worker, Connection* connection) {
+    close(connection->server.fd);
+    connection->server.fd = -1;
+    connection->server.readable = 0;
+    connection->server.writable = 0;
+    return connect_or_resolve(worker, connection, session_backend_failed(&connection->session, &worker->resolved));
+}
+
+// Returns 1 once connected, 0 while connecting to the route's next backend instead, -1 to close
+static ssize_t finish_connect(Worker* worker, Connection* connection) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+
+    if (getsockopt(connection->server.fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+        errno = error;
+        perror("Error connecting to socket");
+        printf("Connection refused\n");
+        return connect_next_backend(worker, connection) < 0 ? -1 : 0;
+    }
+
+    // Forward the buffered packets to the server before anything else
+    connection->server.pending = session_take_handshake(&connection->session, &connection->server.pending_length);
+    connection->server.pending_offset = 0;
+
+    connection->session.state = SESSION_PIPE;
+    connection->listed = registry_add(worker->sessions, connection, connection->client.fd, &connection->session);
+    registry_count(connection->listed, 1, connection->server.pending_length);
+    session_connected(&connection->session, connection->server.fd);
+    connection->active_ms = worker->now_ms;
+    connection_deadline(worker, connection, TIMER_IDLE, connection->idle_timeout_s * 1000ULL);
+
+    // Log the connection if the player is trying to join the server
+    session_log(&connection->session, connection->client.fd, LOG_CONNECTED);
+    return 1;
+}
+
+// Closes an offloaded session that hung up once the kernel has sent on what the side that hung up
+// sent before, or once that took too long. Returns 1 if it was closed
+static int drain_offloaded(Worker* worker, Connection* connection) {
+    if (worker->now_ms < connection->drain_until_ms &&
+        !sockmap_flushed(connection->client.fd, connection->server.fd, &connection->sockmap, connection->hungup_client)) {
+        return 0;
+    }
+    connection_close(worker, connection);
+    return 1;
+}
+
+// Closes the connections whose client is still handshaking or pinging past its deadline, and the
+// idle sessions. A backend that didn't accept in time is given up on like one that refused
+static void expire_timers(Worker* worker) {
+    Timer* timer;
+
+    while ((timer = timer_expired(&worker->timers, worker->now_ms)) != NULL) {
+        Connection* connection = (Connection*)((char*)timer - offsetof(Connection, timer));
+        Session* session = &connection->session;
+
+        if (timer->kind == TIMER_HANDSHAKE && (session->state == SESSION_HANDSHAKE || session->state == SESSION_STATUS)) {
+            metrics_add(GLOBAL_HANDSHAKE_TIMEOUTS, 1);
+            connection_close(worker, connection);
+        } else if (timer->kind == TIMER_CONNECT && session->state == SESSION_CONNECT) {
+            printf("Connecting to the backend timed out\n");
+            metrics_add(GLOBAL_CONNECT_TIMEOUTS, 1);
+            metrics_route_add(session->metrics, ROUTE_TIMEOUT_CONNECT, 1);
+            if (connect_next_backend(worker, connection) < 0) {
+                connection_close(worker, connection);
+            }
+        } else if (timer->kind == TIMER_IDLE && session->state == SESSION_PIPE) {
+            // Activity doesn't move the timer, it is only looked at once the timer fires. The worker
+            // doesn't see the traffic of an offloaded session, its sockets know when they last had some
+            if (connection->offloaded) {
+                uint64_t idle_ms = sockmap_idle_ms(connection->client.fd, connection->server.fd);
+                if (worker->now_ms - idle_ms > connection->active_ms) {
+                    connection->active_ms = worker->now_ms - idle_ms;
+                }
+            }
+            uint64_t idle_until = connection->active_ms + connection->idle_timeout_s * 1000ULL;
+            if (idle_until > worker->now_ms) {
+                timer_arm(&worker->timers, timer, idle_until);
+                continue;
+            }
+            metrics_add(GLOBAL_IDLE_TIMEOUTS, 1);
+            metrics_route_add(session->metrics, ROUTE_TIMEOUT_IDLE, 1);
+            connection_close(worker, connection);
+        } else if (timer->kind == TIMER_DRAIN && session->state == SESSION_PIPE) {
+            if (!drain_offloaded(worker, connection)) {
+                timer_arm(&worker->timers, timer, worker->now_ms + 1);
+            }
+        }
+    }
+}
+
+// Writes out the bytes queued for a side. Returns -1 if the connection should be closed
+static ssize_t flush_pending(Side* side) {
+    while (side->pending != NULL) {
+        ssize_t bytes = send(side->fd, side->pending + side->pending_offset,
+                             side->pending_length - side->pending_offset, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            // A fastopen socket without a cookie for the backend sent a plain SYN, EPOLLOUT follows the handshake
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+                side->writable = 0;
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        side->pending_offset += bytes;
+        if (side->pending_offset == side->pending_length) {
+            buffer_free(side->pending);
+            side->pending = NULL;
+            side->pending_offset = 0;
+            side->pending_length = 0;
+        }
+    }
+
+    return 0;
+}
+
+static void count_forwarded(Side* source, size_t bytes) {
+    Connection* connection = source->connection;
+    if (source == &connection->server) {
+        trace_mark(&connection->session.trace, TRACE_FIRST_BYTE);
+    }
+    registry_count(connection->listed, source == &connection->client, bytes);
+    metrics_route_add(connection->session.metrics, source == &connection->client ? ROUTE_BYTES_FROM_CLIENT : ROUTE_BYTES_TO_CLIENT, bytes);
+}
+
+// Copies through the worker's buffer, whatever the destination can't take right away is queued.
+// Over the memory budget reads pause until the destination is writable again, and are kept small
+// so little has to be queued; the latched readiness picks them up on the destination's next event.
+// Stops once budget bytes were read, what was read is taken off it
+static ssize_t relay_copy(Worker* worker, Side* source, Side* destination, size_t* budget) {
+    while (source->readable && *budget > 0) {
+        size_t length = sizeof(worker->buffer);
+        if (buffers_under_pressure()) {
+            buffers_throttled();
+            if (!destination->writable) {
+                break;
+            }
+            length = PRESSURE_READ_SIZE;
+        }
+        if (length > *budget) {
+            length = *budget;
+        }
+
+        ssize_t bytes = recv(source->fd, worker->buffer, length, 0);
+        if (bytes == 0) {
+            return -1;
+        }
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                source->readable = 0;
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        count_forwarded(source, bytes);
+        *budget -= bytes;
+
+        ssize_t sent = send(destination->fd, worker->buffer, bytes, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return -1;
+            }
+            sent = 0;
+        }
+
+        if (sent < bytes) {
+            // The destination is full, keep the rest until it becomes writable again
+            destination->pending = buffer_alloc(bytes - sent);
+            if (destination->pending == NULL) {
+                return -1;
+            }
+            memcpy(destination->pending, worker->buffer + sent, bytes - sent);
+            destination->pending_length = bytes - sent;
+            destination->pending_offset = 0;
+            destination->writable = 0;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// Moves bytes socket -> pipe -> socket without them ever reaching userspace.
+// The pipe is borrowed from the worker while data is in flight and returned once drained
+static ssize_t relay_splice(Worker* worker, Connection* connection, Side* source, Side* destination, size_t* budget) {
+    while (1) {
+        // Drain the pipe into the destination before pulling more from the source
+        while (destination->piped > 0) {
+            if (!destination->writable) {
+                return 0;
+            }
+
+            ssize_t bytes = splice(destination->pipe[0], NULL, destination->fd, NULL, destination->piped,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes < 0) {
+                if (errno == EAGAIN) {
+                    destination->writable = 0;
+                    return 0;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            destination->piped -= bytes;
+        }
+
+        if (!source->readable || *budget == 0) {
+            pipe_release(worker, destination);
+            return 0;
+        }
+
+        if (destination->pipe[0] == -1 && pipe_acquire(worker, destination) < 0) {
+            connection->splice = 0;
+            return relay_copy(worker, source, destination, budget);
+        }
+
+        size_t length = *budget < SPLICE_SIZE ? *budget : SPLICE_SIZE;
+        ssize_t bytes = splice(source->fd, NULL, destination->pipe[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes == 0) {
+            return -1;
+        }
+        if (bytes < 0) {
+            // The pipe is empty here, so EAGAIN can only mean the source is drained
+            if (errno == EAGAIN) {
+                source->readable = 0;
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // Nothing was moved yet, carry on with plain copies
+                splice_supported = 0;
+                connection->splice = 0;
+                pipe_release(worker, destination);
+                return relay_copy(worker, source, destination, budget);
+            }
+            return -1;
+        }
+        destination->piped += bytes;
+        count_forwarded(source, bytes);
+        *budget -= bytes;
+    }
+}
+
+// Forwards what is readable from source to destination, up to budget bytes.
+// Reading stops while the destination still has queued bytes, which pushes back on the sender
+static ssize_t relay(Worker* worker, Connection* connection, Side* source, Side* destination, size_t* budget) {
+    // Bytes queued by the copy path, like the replayed handshake, always go out first
+    if (destination->pending != NULL) {
+        if (!destination->writable) {
+            return 0;
+        }
+        if (flush_pending(destination) < 0) {
+            return -1;
+        }
+        if (destination->pending != NULL) {
+            return 0;
+        }
+    }
+
+    if (connection->splice) {
+        return relay_splice(worker, connection, source, destination, budget);
+    }
+    return relay_copy(worker, source, destination, budget);
+}
+
+static ssize_t relay_to_server(Worker* worker, Connection* connection) {
+    size_t unlimited = SIZE_MAX;
+    return relay(worker, connection, &connection->client, &connection->server, &unlimited);
+}
+
+// Bytes to the client are what floods an uplink, a shaped connection reads them as its buckets allow.
+// One that used up its grant with more to read joins the backlog, from then on only the scheduler
+// reads for it and events just flush what was read already
+static ssize_t relay_to_client(Worker* worker, Connection* connection) {
+    size_t budget = SIZE_MAX;
+    if (!connection->shaped) {
+        return relay(worker, connection, &connection->server, &connection->client, &budget);
+    }
+
+    ShapedFlow* flow = &connection->downstream;
+    if (flow->backlogged) {
+        budget = 0;
+        return relay(worker, connection, &connection->server, &connection->client, &budget);
+    }
+
+    uint64_t now = shaper_now_ns();
+    enum ShapingScope limited;
+    size_t granted = budget = shaped_flow_grant(flow, now, &limited);
+    ssize_t result = relay(worker, connection, &connection->server, &connection->client, &budget);
+    shaped_flow_charge(flow, granted - budget, now);
+
+    if (result == 0 && budget == 0 && connection->server.readable) {
+        shaped_queue_push(&worker->backlog, flow, limited, connection->session.metrics);
+    }
+    return result;
+}
+
+// Deficit round robin over the backlog: every flow gets a quantum more per round and reads what its
+// deficit and the buckets allow, so bulk transfers split what is left evenly whatever their speed
+static void serve_backlog(Worker* worker) {
+    uint64_t now = shaper_now_ns();
+
+    for (size_t round = worker->backlog.count; round > 0; --round) {
+        ShapedFlow* flow = worker->backlog.head;
+        Connection* connection = (Connection*)((char*)flow - offsetof(Connection, downstream));
+
+        // Waiting on the shared buckets doesn't save up into a burst
+        if (flow->deficit < 2 * SHAPING_QUANTUM) {
+            flow->deficit += SHAPING_QUANTUM;
+        }
+
+        // Once a shared bucket runs dry the flow keeps its turn for the next tick, or the same flows
+        // would get the refill first every time
+        enum ShapingScope limited;
+        size_t granted = shaped_flow_grant(flow, now, &limited);
+        if (granted == 0 && limited != SHAPING_SESSION) {
+            break;
+        }
+        shaped_queue_pop(&worker->backlog);
+
+        size_t budget = granted;
+        if (granted > 0 && relay(worker, connection, &connection->server, &connection->client, &budget) < 0) {
+            connection_close(worker, connection);
+            continue;
+        }
+        shaped_flow_charge(flow, granted - budget, now);
+
+        if (connection->server.readable) {
+            shaped_queue_push(&worker->backlog, flow, limited, connection->session.metrics);
+        } else {
+            shaped_queue_finish(&worker->backlog, flow);
+        }
+    }
+}
+
+// Hands the session to the kernel once the handshake and everything read since went out, the
+// sockmap then forwards between the sockets. A session it refuses carries on in userspace
+static void offload(Worker* worker, Connection* connection) {
+    if (connection->client.pending != NULL || connection->server.pending != NULL ||
+        connection->client.piped > 0 || connection->server.piped > 0) {
+        return;
+    }
+
+    connection->offload = 0;
+    if (sockmap_attach(connection->client.fd, connection->server.fd, &connection->sockmap) < 0) {
+        perror("Error adding a session to the sockmap");
+        metrics_add(GLOBAL_SOCKMAP_REFUSED, 1);
+        return;
+    }
+    metrics_add(GLOBAL_SOCKMAP_OFFLOADED, 1);
+    registry_offloaded(connection->listed);
+    connection->offloaded = 1;
+    pipe_release(worker, &connection->client);
+    pipe_release(worker, &connection->server);
+}
+
+// Events of an offloaded session only matter once a side hangs up. Its last bytes may still be on
+// their way out of the other side, the session is closed once they are out
+static void offloaded_event(Worker* worker, Connection* connection, Side* side, uint32_t events) {
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        connection_close(worker, connection);
+        return;
+    }
+
+    if (connection->timer.kind != TIMER_DRAIN) {
+        if (!(events & EPOLLRDHUP)) {
+            return;
+        }
+        connection->hungup_client = side == &connection->client;
+        connection->drain_until_ms = worker->now_ms + SOCKMAP_DRAIN_MS;
+        connection_deadline(worker, connection, TIMER_DRAIN, 1);
+    }
+    drain_offloaded(worker, connection);
+}
+
+static void handle_event(Worker* worker, Side* side, uint32_t events) {
+    Connection* connection = side->connection;
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        side->readable = 1;
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        side->writable = 1;
+    }
+
+    switch (connection->session.state) {
+        case SESSION_HANDSHAKE: {
+            if (side != &connection->client) {
+                return;
+            }
+
+            ssize_t ready = read_handshake(connection);
+            if (ready < 0 || (ready == 1 && route_backend(worker, connection) < 0)) {
+                connection_close(worker, connection);
+            }
+            return;
+        }
+
+        case SESSION_STATUS:
+            if (answer_status(connection) != 0) {
+                connection_close(worker, connection);
+            }
+            return;
+
+        case SESSION_RESOLVE:
+            return;
+
+        case SESSION_CONNECT: {
+            // Client readiness is latched and picked up once the backend is connected
+            if (!connection->server.writable) {
+                return;
+            }
+            ssize_t connected = finish_connect(worker, connection);
+            if (connected < 0) {
+                connection_close(worker, connection);
+            }
+            if (connected != 1) {
+                return;
+            }
+        }
+            // fallthrough
+
+        case SESSION_PIPE:
+            if (connection->offloaded) {
+                offloaded_event(worker, connection, side, events);
+                return;
+            }
+            connection->active_ms = worker->now_ms;
+            if (relay_to_server(worker, connection) < 0 || relay_to_client(worker, connection) < 0) {
+                connection_close(worker, connection);
+            } else if (connection->offload) {
+                offload(worker, connection);
+            }
+            return;
+
+        case SESSION_CLOSED:
+            return;
+    }
+}
+
+static ssize_t worker_epoll_init(Worker* worker) {
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epoll_fd == -1) {
+        perror("Error creating epoll instance");
+        return -1;
+    }
+
+    // Workers sharing a listener all wait on it, EPOLLEXCLUSIVE wakes only one of them per connection
+    struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->server_socket, &event) == -1) {
+        perror("Error registering the server socket");
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &worker->resolved;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->resolved.event_fd, &event) == -1) {
+        perror("Error registering the resolver queue");
+        return -1;
+    }
+    return 0;
+}
+
+static void* worker_run(void* arg) {
+    Worker* worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Backlogged connections get more bandwidth every tick
+        int timeout = timer_wait_ms(&worker->timers, limiter_now_ms());
+        if (worker->backlog.count > 0 && (timeout < 0 || timeout > SHAPING_TICK_MS)) {
+            timeout = SHAPING_TICK_MS;
+        }
+
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        worker->now_ms = limiter_now_ms();
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(worker);
+            } else if (events[i].data.ptr == &worker->resolved) {
+                finish_resolve(worker);
+                finish_kills(worker);
+            } else {
+                handle_event(worker, events[i].data.ptr, events[i].events);
+            }
+        }
+
+        if (worker->backlog.count > 0) {
+            serve_backlog(worker);
+        }
+
+        expire_timers(worker);
+
+        while (closed_connections != NULL) {
+            Connection* next = closed_connections->next_closed;
+            connection_free(closed_connections);
+            closed_connections = next;
+        }
+    }
+
+    return NULL;
+}
+
+// Lists the CPUs this process may run on, in ascending order
+static size_t allowed_cpus(int* cpus, size_t max) {
+    cpu_set_t set;
+    size_t count = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return 0;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+// Steers each new connection to the listener whose index matches the CPU that received the SYN,
+// so a connection is accepted and served on the core that already has its packets in cache.
+// Listener i must belong to the worker pinned to CPU i, which only holds when CPUs are numbered 0..n-1
+static void steer_reuseport_group(int server_socket) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog program = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    if (setsockopt(server_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+    }
+}
+
+void* engine_fallback_run(void* arg) {
+    Worker* worker = arg;
+
+    printf("Worker falling back to epoll\n");
+    if (worker_epoll_init(worker) < 0) {
+        return NULL;
+    }
+    atomic_store(&worker->uring, 0);
+
+    // The listeners may have been handed over while the ring was being set up
+    if (!engine_accepting()) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->server_socket, NULL);
+    }
+    return worker_run(worker);
+}
+
+ssize_t engine_start(const int* server_sockets, size_t socket_count, size_t worker_count) {
+    // Accepting never blocks, idle workers just go back to epoll_wait
+    for (size_t i = 0; i < socket_count; ++i) {
+        int flags = fcntl(server_sockets[i], F_GETFL, 0);
+        if (flags == -1 || fcntl(server_sockets[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("Error making the server socket non-blocking");
+            return -1;
+        }
+    }
+
+    workers = calloc(worker_count, sizeof(Worker));
+    int* cpus = calloc(worker_count, sizeof(int));
+    if (workers == NULL || cpus == NULL) {
+        perror("Error allocating workers");
+        free(cpus);
+        return -1;
+    }
+
+    size_t cpu_count = config.pin_workers ? allowed_cpus(cpus, worker_count) : 0;
+
+    if (socket_count > 1 && cpu_count == socket_count && cpus[cpu_count - 1] == (int)cpu_count - 1) {
+        steer_reuseport_group(server_sockets[0]);
+    }
+
+    void* (*run)(void*) = worker_run;
+    if (config.io_backend == IO_BACKEND_URING) {
+        if (uring_supported()) {
+            printf("Using the io_uring backend\n");
+            run = uring_worker_run;
+            if (config.shaping_global_mbps > 0 || config.shaping_session_kbps > 0) {
+                printf("Bandwidth shaping only applies to the epoll backend\n");
+            }
+        } else {
+            printf("io_uring is not available, falling back to epoll\n");
+        }
+    }
+
+    // Reloads can switch to sockmap forwarding only if it was loaded at startup
+    if (run == worker_run && config.forward_mode == FORWARD_SOCKMAP) {
+        if (sockmap_init() == 0) {
+            printf("Forwarding through the BPF sockmap after the handshake\n");
+        } else {
+            printf("BPF sockmap forwarding is not available, falling back to splice\n");
+        }
+    }
+
+    for (size_t i = 0; i < worker_count; ++i) {
+        Worker* worker = &workers[i];
+        worker->server_socket = server_sockets[i % socket_count];
+        worker->cpu = cpu_count > 0 ? cpus[i % cpu_count] : -1;
+
+        if (resolve_queue_init(&worker->resolved) < 0) {
+            return -1;
+        }
+        worker->sessions = registry_slab(worker->resolved.event_fd);
+        if (worker->sessions == NULL) {
+            perror("Error allocating the session registry");
+            return -1;
+        }
+        worker->now_ms = limiter_now_ms();
+        timer_wheel_init(&worker->timers, worker->now_ms);
+
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+
+        if (worker->cpu != -1) {
+            // Threads start on their CPU, so everything they allocate is local to it
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(worker->cpu, &set);
+            pthread_attr_setaffinity_np(&attributes, sizeof(set), &set);
+
+            // A sharded listener prefers connections whose packets arrive on its worker's CPU
+            if (socket_count > 1 && setsockopt(worker->server_socket, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof(worker->cpu)) == -1) {
+                perror("setsockopt(SO_INCOMING_CPU) failed");
+            }
+        }
+
+        if (run == worker_run) {
+            if (worker_epoll_init(worker) < 0) {
+                return -1;
+            }
+        } else {
+            atomic_store(&worker->uring, 1);
+        }
+
+        int result = pthread_create(&worker->thread, &attributes, run, worker);
+        pthread_attr_destroy(&attributes);
+        if (result != 0) {
+            perror("Error creating worker thread");
+            return -1;
+        }
+
+        ++workers_count;
+    }
+
+    free(cpus);
+    return 0;
+}
+
+void engine_wait() {
+    for (size_t i = 0; i < workers_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
+
+void engine_stop_accepting() {
+    atomic_store(&accepting, 0);
+
+    for (size_t i = 0; i < workers_count; ++i) {
+        Worker* worker = &workers[i];
+        if (atomic_load(&worker->uring)) {
+            // io_uring workers cancel their accept themselves, the resolver queue wakes them up
+            uint64_t one = 1;
+            if (write(worker->resolved.event_fd, &one, sizeof(one)) < 0) {
+                perror("Error waking a worker");
+            }
+        } else if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, worker->server_socket, NULL) == -1) {
+            perror("Error unregistering the server socket");
+        }
+    }
+}
+
+int engine_accepting() {
+    return atomic_load(&accepting);
+}
@@ -0,0 +1,86 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "limiter.h"
+#include "registry.h"
+#include "session.h"
+#include "shaper.h"
+#include "sockmap.h"
+#include "timers.h"
+
+#define BUFFER_SIZE 32768 // MC packets don't exceed 32768 (2^15) bytes.
+#define PIPE_POOL_SIZE 64
+
+struct Connection;
+
+// One end of a proxied connection
+typedef struct {
+    int fd;
+    uint8_t readable;           // Edge-triggered readiness, cleared on EAGAIN
+    uint8_t writable;
+    char* pending;              // Bytes waiting to be written to this fd
+    uint32_t pending_offset;
+    uint32_t pending_length;
+    int pipe[2];                // Spliced bytes waiting to be written to this fd, only held while data is in flight
+    uint32_t piped;
+    struct Connection* connection;
+} Side;
+
+typedef struct Connection {
+    Side client;
+    Side server;
+    Session session;
+    uint8_t splice;             // Forwarding with splice(), cleared when the kernel refuses it
+    uint8_t resolving;          // The resolver holds the session, freeing waits until it comes back
+    uint8_t shaped;             // Bytes to the client go through the worker's bandwidth scheduler
+    uint8_t offload;            // Handed to the kernel's sockmap once nothing is left to write in userspace
+    uint8_t offloaded;          // The kernel forwards between the sockets, events only tell of hangups
+    uint8_t hungup_client;      // Which side of an offloaded session hung up, while its last bytes go out
+    ShapedFlow downstream;
+    SockmapPair sockmap;
+    RegistryEntry* listed;      // In the worker's registry slab while the backend is connected
+    const char* reply;          // Status cache answer being sent, points into the session
+    uint32_t reply_offset;
+    uint32_t reply_length;
+    uint8_t reply_last;         // The reply is the Pong, close once it is out
+    Timer timer;                // The deadline of the phase the connection is in
+    uint64_t active_ms;         // Last event of the session, the idle timer is checked against it
+    uint32_t idle_timeout_s;    // The route's, its entry may be gone by the time the session is idle
+    uint64_t drain_until_ms;    // When an offloaded session that hung up is closed even with bytes left
+    struct Connection* next_closed;
+} Connection;
+
+typedef struct {
+    pthread_t thread;
+    int cpu;                    // CPU the worker is pinned to, -1 if it floats
+    int epoll_fd;
+    atomic_int uring;           // Set while the worker runs on io_uring rather than epoll
+    int server_socket;
+    ResolveQueue resolved;      // Connections whose backend hostname has been resolved
+    TimerWheel timers;          // Deadlines of the worker's connections
+    RegistrySlab* sessions;     // Connected sessions, for the admin socket
+    uint64_t now_ms;            // Taken once per loop, deadlines and activity don't need more
+    ShapedQueue backlog;        // Shaped connections with bytes for the client waiting on bandwidth
+    char buffer[BUFFER_SIZE];   // Scratch space shared by every connection of the worker
+    int pipes[PIPE_POOL_SIZE][2]; // Empty pipes ready to be lent to a splicing connection
+    size_t pipes_count;
+} Worker;
+
+ssize_t engine_start(const int* server_sockets, size_t socket_count, size_t worker_count);
+void engine_wait();
+// Runs an io_uring worker on epoll instead, when its own ring could not be set up
+void* engine_fallback_run(void* arg);
+
+// Workers stop taking connections from the listeners and keep serving the ones they have. Connections
+// still queued on the listeners are left for whichever process shares them
+void engine_stop_accepting();
+int engine_accepting();
+
+#endif // ENGINE_H
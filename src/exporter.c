@@ -0,0 +1,310 @@
+#include "exporter.h"
+#include "buffers.h"
+#include "config.h"
+#include "dns.h"
+#include "health.h"
+#include "limiter.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool.h"
+#include "servers.h"
+#include "status.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define REQUEST_SIZE 2048
+#define SCRAPE_TIMEOUT_S 2  // A scraper that stalls can't hold the thread for longer
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int listen_fd;
+    int event_fd;           // Signalled on shutdown
+} exporter = { .listen_fd = -1, .event_fd = -1 };
+
+static void write_value(FILE* out, const char* name, const char* type, const char* help, size_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %zu\n", name, help, name, type, name, value);
+}
+
+void exporter_render(FILE* out) {
+    metrics_render(out);
+
+    DnsCacheStats dns;
+    dns_cache_stats(&dns);
+    write_value(out, "mcproxy_dns_cache_entries", "gauge", "Names held by the DNS cache.", dns.entries);
+    fprintf(out, "# HELP mcproxy_dns_cache_lookups_total DNS cache lookups by outcome.\n");
+    fprintf(out, "# TYPE mcproxy_dns_cache_lookups_total counter\n");
+    fprintf(out, "mcproxy_dns_cache_lookups_total{result=\"hit\"} %zu\n", dns.hits);
+    fprintf(out, "mcproxy_dns_cache_lookups_total{result=\"stale_hit\"} %zu\n", dns.stale_hits);
+    fprintf(out, "mcproxy_dns_cache_lookups_total{result=\"negative_hit\"} %zu\n", dns.negative_hits);
+    fprintf(out, "mcproxy_dns_cache_lookups_total{result=\"miss\"} %zu\n", dns.misses);
+    write_value(out, "mcproxy_dns_cache_evictions_total", "counter", "Names evicted to make room.", dns.evictions);
+
+    StatusCacheStats status;
+    status_cache_stats(&status);
+    fprintf(out, "# HELP mcproxy_status_cache_lookups_total Status cache lookups by outcome.\n");
+    fprintf(out, "# TYPE mcproxy_status_cache_lookups_total counter\n");
+    fprintf(out, "mcproxy_status_cache_lookups_total{result=\"hit\"} %zu\n", status.hits);
+    fprintf(out, "mcproxy_status_cache_lookups_total{result=\"miss\"} %zu\n", status.misses);
+    write_value(out, "mcproxy_status_cache_refreshes_total", "counter", "Status responses fetched from backends.", status.refreshes);
+    write_value(out, "mcproxy_status_cache_refresh_failures_total", "counter", "Status fetches that failed.", status.failures);
+
+    PoolStats pool;
+    pool_stats(&pool);
+    write_value(out, "mcproxy_pool_idle_sockets", "gauge", "Connected backend sockets waiting for a join.", pool.idle);
+    fprintf(out, "# HELP mcproxy_pool_takes_total Joins by whether they got a pooled socket.\n");
+    fprintf(out, "# TYPE mcproxy_pool_takes_total counter\n");
+    fprintf(out, "mcproxy_pool_takes_total{result=\"hit\"} %zu\n", pool.hits);
+    fprintf(out, "mcproxy_pool_takes_total{result=\"miss\"} %zu\n", pool.misses);
+    write_value(out, "mcproxy_pool_dropped_total", "counter", "Pooled sockets closed unused.", pool.dropped);
+
+    HealthStats health;
+    health_stats(&health);
+    fprintf(out, "# HELP mcproxy_backends Backends of servers.conf by health.\n");
+    fprintf(out, "# TYPE mcproxy_backends gauge\n");
+    fprintf(out, "mcproxy_backends{health=\"up\"} %zu\n", health.up);
+    fprintf(out, "mcproxy_backends{health=\"degraded\"} %zu\n", health.degraded);
+    fprintf(out, "mcproxy_backends{health=\"down\"} %zu\n", health.down);
+    fprintf(out, "mcproxy_backends{health=\"unknown\"} %zu\n", health.backends - health.up - health.degraded - health.down);
+    write_value(out, "mcproxy_health_probes_total", "counter", "Health probes started.", health.probes);
+    write_value(out, "mcproxy_health_probe_failures_total", "counter", "Health probes that failed.", health.failures);
+
+    BufferStats buffers;
+    buffers_stats(&buffers);
+    write_value(out, "mcproxy_buffer_budget_bytes", "gauge", "Connection buffer memory past which reads are throttled, 0 if unlimited.", buffers.budget);
+    write_value(out, "mcproxy_buffer_bytes", "gauge", "Connection buffer memory handed out.", buffers.in_use);
+    write_value(out, "mcproxy_buffer_high_water_bytes", "gauge", "Most connection buffer memory ever handed out at once.", buffers.high_water);
+    write_value(out, "mcproxy_buffer_cached_bytes", "gauge", "Freed connection buffers kept for reuse.", buffers.cached);
+    write_value(out, "mcproxy_buffer_throttled_reads_total", "counter", "Reads paused or shrunk because the budget was reached.", buffers.throttled);
+    fprintf(out, "# HELP mcproxy_buffers Connection buffers handed out, by size class.\n");
+    fprintf(out, "# TYPE mcproxy_buffers gauge\n");
+    for (size_t i = 0; i < BUFFER_CLASSES; ++i) {
+        fprintf(out, "mcproxy_buffers{size=\"%zu\"} %zu\n", buffers.classes[i].size, buffers.classes[i].in_use);
+    }
+    fprintf(out, "# HELP mcproxy_buffers_high_water Most connection buffers handed out at once, by size class.\n");
+    fprintf(out, "# TYPE mcproxy_buffers_high_water gauge\n");
+    for (size_t i = 0; i < BUFFER_CLASSES; ++i) {
+        fprintf(out, "mcproxy_buffers_high_water{size=\"%zu\"} %zu\n", buffers.classes[i].size, buffers.classes[i].high_water);
+    }
+
+    LimiterStats limiter;
+    limiter_stats(&limiter);
+    write_value(out, "mcproxy_handshakes_active", "gauge", "Connections admitted that haven't finished their handshake.", limiter.handshakes);
+    write_value(out, "mcproxy_rate_limit_addresses", "gauge", "Source addresses the rate limit is keeping track of.", limiter.tracked);
+    write_value(out, "mcproxy_rate_limit_untracked_total", "counter", "Connections let through unchecked because the rate limit table had no room for their address.", limiter.table_full);
+
+    LogStats log;
+    log_stats(&log);
+    fprintf(out, "# HELP mcproxy_log_records_total Log records by whether they reached the file.\n");
+    fprintf(out, "# TYPE mcproxy_log_records_total counter\n");
+    fprintf(out, "mcproxy_log_records_total{result=\"written\"} %zu\n", log.written);
+    fprintf(out, "mcproxy_log_records_total{result=\"dropped\"} %zu\n", log.dropped);
+
+    RoutesLoadStats routes;
+    routes_load_stats(&routes);
+    write_value(out, "mcproxy_routes", "gauge", "Entries of the servers.conf in use.", routes.entries);
+    write_value(out, "mcproxy_config_loads_total", "counter", "Times servers.conf was loaded.", routes.generation);
+    write_value(out, "mcproxy_config_load_failures_total", "counter", "Reloads rejected because servers.conf didn't parse.", routes.failures);
+
+#ifndef NO_TRACING
+    TraceStats trace;
+    trace_stats(&trace);
+    fprintf(out, "# HELP mcproxy_session_phase_seconds Time sessions spent in each phase of joining, across all routes.\n");
+    fprintf(out, "# TYPE mcproxy_session_phase_seconds histogram\n");
+    for (size_t span = 0; span < TRACE_SPANS; ++span) {
+        const char* name = trace_span_names[span];
+        for (size_t bucket = 0; bucket < TRACE_BUCKETS - 1; ++bucket) {
+            fprintf(out, "mcproxy_session_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %llu\n", name, (double)(1ULL << bucket) / 1000000, (unsigned long long)trace.buckets[span][bucket]);
+        }
+        fprintf(out, "mcproxy_session_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", name, (unsigned long long)trace.buckets[span][TRACE_BUCKETS - 1]);
+        fprintf(out, "mcproxy_session_phase_seconds_sum{phase=\"%s\"} %.6f\n", name, trace.sum_us[span] / 1000000.0);
+        fprintf(out, "mcproxy_session_phase_seconds_count{phase=\"%s\"} %llu\n", name, (unsigned long long)trace.buckets[span][TRACE_BUCKETS - 1]);
+    }
+    fprintf(out, "# HELP mcproxy_trace_records_total Slow and sampled sessions by whether they reached the trace file.\n");
+    fprintf(out, "# TYPE mcproxy_trace_records_total counter\n");
+    fprintf(out, "mcproxy_trace_records_total{result=\"written\"} %zu\n", trace.written);
+    fprintf(out, "mcproxy_trace_records_total{result=\"dropped\"} %zu\n", trace.dropped);
+#endif
+}
+
+static void send_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += sent;
+        length -= sent;
+    }
+}
+
+// Answers one request and closes, the connection is blocking with timeouts
+static void serve(int fd) {
+    struct timeval timeout = { .tv_sec = SCRAPE_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, the headers are read so the client doesn't see a reset
+    char request[REQUEST_SIZE];
+    size_t length = 0;
+    while (length < sizeof(request) - 1) {
+        ssize_t received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        length += received;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0) {
+        const char* missing = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n\r\nNot found\n";
+        send_all(fd, missing, strlen(missing));
+        return;
+    }
+
+    char* body = NULL;
+    size_t body_length = 0;
+    FILE* out = open_memstream(&body, &body_length);
+    if (out == NULL) {
+        perror("Error rendering metrics");
+        return;
+    }
+    exporter_render(out);
+    fclose(out);
+
+    char header[128];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_length);
+    send_all(fd, header, header_length);
+    send_all(fd, body, body_length);
+    free(body);
+}
+
+static void* exporter_run(void* arg) {
+    (void)arg;
+
+    while (!atomic_load(&exporter.stopping)) {
+        struct pollfd fds[2] = {
+            { .fd = exporter.listen_fd, .events = POLLIN },
+            { .fd = exporter.event_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(exporter.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd != -1) {
+                serve(fd);
+                close(fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// metrics_listen is host:port, [v6 address]:port for IPv6
+static int open_listener(const char* listen_address) {
+    char host[CONFIG_STRING_SIZE];
+    const char* colon = strrchr(listen_address, ':');
+    if (colon == NULL || colon == listen_address) {
+        printf("Invalid metrics_listen: %s\n", listen_address);
+        return -1;
+    }
+
+    const char* start = listen_address;
+    size_t host_length = colon - listen_address;
+    if (*start == '[' && colon[-1] == ']') {
+        ++start;
+        host_length -= 2;
+    }
+    memcpy(host, start, host_length);
+    host[host_length] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE };
+    struct addrinfo* address;
+    if (getaddrinfo(host, colon + 1, &hints, &address) != 0) {
+        printf("Invalid metrics_listen: %s\n", listen_address);
+        return -1;
+    }
+
+    int fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int enable = 1;
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        bind(fd, address->ai_addr, address->ai_addrlen) == -1 || listen(fd, 16) == -1) {
+        perror("Error opening the metrics listener");
+        if (fd != -1) {
+            close(fd);
+        }
+        fd = -1;
+    }
+    freeaddrinfo(address);
+    return fd;
+}
+
+ssize_t exporter_init() {
+    if (exporter.running || strcmp(config.metrics_listen, "none") == 0) {
+        return 0;
+    }
+
+    atomic_store(&exporter.stopping, 0);
+    exporter.listen_fd = open_listener(config.metrics_listen);
+    exporter.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (exporter.listen_fd == -1 || exporter.event_fd == -1 || pthread_create(&exporter.thread, NULL, exporter_run, NULL) != 0) {
+        perror("Error starting the metrics listener");
+        exporter_shutdown();
+        return -1;
+    }
+
+    printf("Serving metrics on http://%s/metrics\n", config.metrics_listen);
+    exporter.running = 1;
+    return 0;
+}
+
+void exporter_shutdown() {
+    if (exporter.running) {
+        atomic_store(&exporter.stopping, 1);
+        uint64_t one = 1;
+        if (write(exporter.event_fd, &one, sizeof(one)) < 0) {
+            perror("Error signalling eventfd");
+        }
+        pthread_join(exporter.thread, NULL);
+        exporter.running = 0;
+    }
+
+    if (exporter.listen_fd != -1) {
+        close(exporter.listen_fd);
+        exporter.listen_fd = -1;
+    }
+    if (exporter.event_fd != -1) {
+        close(exporter.event_fd);
+        exporter.event_fd = -1;
+    }
+}
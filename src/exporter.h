@@ -0,0 +1,16 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Starts the thread serving GET /metrics on metrics_listen, does nothing with "none"
+ssize_t exporter_init();
+void exporter_shutdown();
+
+// Writes the metrics of every module in the Prometheus text format
+void exporter_render(FILE* out);
+
+#endif // EXPORTER_H
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../packet-tools.h"
+
+// Checks the decoder against its own promises on any input:
+//  - it never reads outside the buffer (run under AddressSanitizer)
+//  - fields point inside the bytes it was given
+//  - feeding the stream in pieces gives the same result as feeding it at once
+//  - the VarInt fast path agrees with decoding one byte at a time
+
+static ssize_t varint_reference(const uint8_t* buffer, size_t length, int32_t* value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < VARINT_MAX_BYTES; ++i) {
+        if (i >= length) {
+            return 0;
+        }
+        result |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0) {
+            *value = (int32_t)result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+static void check_slice(PacketSlice slice, size_t length) {
+    assert(slice.offset <= length && slice.length <= length - slice.offset);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    // A copy of exactly the input size, so ASan catches any read past it
+    char* buffer = malloc(size > 0 ? size : 1);
+    memcpy(buffer, data, size);
+
+    for (size_t offset = 0; offset < size && offset < 16; ++offset) {
+        int32_t expected = 0, value = 0;
+        ssize_t expected_size = varint_reference(data + offset, size - offset, &expected);
+        ssize_t decoded_size = varint_decode(buffer + offset, size - offset, &value);
+        assert(decoded_size == expected_size);
+        assert(decoded_size <= 0 || value == expected);
+    }
+
+    PacketDecoder whole;
+    packet_decoder_init(&whole);
+    enum PacketStatus status = packet_decoder_feed(&whole, buffer, size);
+    assert(whole.position <= size);
+
+    if (status == PACKET_READY) {
+        check_slice(whole.server_address, size);
+        check_slice(whole.username, size);
+        assert(whole.server_address.length > 0);
+    }
+
+    // Split points taken from the input itself, so the fuzzer explores them too
+    PacketDecoder pieces;
+    packet_decoder_init(&pieces);
+    enum PacketStatus piece_status = PACKET_NEED_MORE;
+    size_t fed = 0;
+    for (size_t i = 0; fed < size && piece_status == PACKET_NEED_MORE; ++i) {
+        fed += 1 + (size > 0 ? data[i % size] % 7 : 0);
+        fed = fed > size ? size : fed;
+        piece_status = packet_decoder_feed(&pieces, buffer, fed);
+    }
+    if (size == 0) {
+        piece_status = packet_decoder_feed(&pieces, buffer, 0);
+    }
+
+    // A stream that is complete early stops being read, the rest would go to the backend
+    if (piece_status == PACKET_READY) {
+        assert(status == PACKET_READY);
+        assert(memcmp(&pieces, &whole, sizeof(whole)) == 0);
+    } else {
+        assert(piece_status == status);
+    }
+
+    free(buffer);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+// Without libFuzzer, mutates valid handshakes for the given number of iterations
+static size_t put_varint(uint8_t* buffer, uint32_t value) {
+    size_t length = 0;
+    do {
+        buffer[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buffer[length] |= 0x80;
+        }
+        ++length;
+    } while (value != 0);
+    return length;
+}
+
+static size_t put_seed(uint8_t* buffer) {
+    uint8_t fields[300];
+    size_t address_length = rand() % 260;
+    size_t length = put_varint(fields, rand() % 1000);
+    length += put_varint(fields + length, address_length);
+    for (size_t i = 0; i < address_length; ++i) {
+        fields[length++] = 'a' + rand() % 26;
+    }
+    fields[length++] = 0x63;
+    fields[length++] = 0xDD;
+    fields[length++] = 1 + rand() % 3;
+
+    size_t total = put_varint(buffer, length + 1);
+    buffer[total++] = 0x00;
+    memcpy(buffer + total, fields, length);
+    total += length;
+
+    uint8_t login[] = "\x06\x00\x04Test";
+    memcpy(buffer + total, login, sizeof(login) - 1);
+    return total + sizeof(login) - 1;
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    uint8_t input[512];
+    for (long i = 0; i < iterations; ++i) {
+        size_t size = put_seed(input);
+
+        // Flip a few bytes and cut the stream somewhere
+        for (int flips = rand() % 4; flips > 0; --flips) {
+            input[rand() % size] = rand();
+        }
+        size = rand() % 4 == 0 ? (size_t)rand() % (size + 1) : size;
+
+        LLVMFuzzerTestOneInput(input, size);
+    }
+
+    printf("%ld inputs decoded\n", iterations);
+    return 0;
+}
+#endif
@@ -0,0 +1,525 @@
+#include "health.h"
+#include "config.h"
+#include "dns.h"
+#include "logger.h"
+#include "packet-tools.h"
+#include "servers.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 64
+#define HEALTH_FALL 3               // Failed probes in a row before a backend is down
+#define HEALTH_BACKOFF_MAX_MS 30000 // Longest time between probes of a failing backend
+#define HEALTH_POLL_MS 1000         // Reloads of servers.conf are noticed within this long
+#define PROBE_PROTOCOL_VERSION -1   // Server list tools ping with -1, no real client version is claimed
+
+enum ProbePhase {
+    PROBE_IDLE,
+    PROBE_RESOLVE,
+    PROBE_CONNECT,
+    PROBE_RECEIVE
+};
+
+typedef struct Probe {
+    BackendState* state;
+    char* destination;
+    unsigned short port;
+    unsigned char default_port;
+    enum ProbePhase phase;
+    int fd;
+    uint64_t started_us;
+    uint64_t due;                   // When the next probe starts, or the running one times out, in monotonic ms
+    uint64_t seen_failure;          // Failed join that last triggered a probe
+    uint32_t failures;              // Probes that failed in a row
+    uint8_t configured;             // Still in servers.conf, cleared probes are freed once idle
+    ResolveRequest resolve;
+    char* buffer;                   // The ping going out, then the response coming in
+    size_t length;
+    size_t offset;
+    size_t capacity;
+    struct Probe* next;
+} Probe;
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int epoll_fd;
+    int event_fd;                   // Signalled on shutdown
+    ResolveQueue resolved;
+    size_t generation;              // Route table the probes were set up from
+    Probe* probes;
+    uint64_t random;
+    pthread_mutex_t stats_mutex;
+    HealthStats stats;
+} health = { .epoll_fd = -1, .event_fd = -1, .resolved = { .event_fd = -1 }, .stats_mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static const char* const health_names[] = { "unknown", "up", "degraded", "down" };
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t now_ms() {
+    return now_us() / 1000;
+}
+
+// Spreads probes over +-20% of the delay, so backends restarted together aren't probed in lockstep
+static uint64_t jitter(uint64_t delay) {
+    health.random ^= health.random << 13;
+    health.random ^= health.random >> 7;
+    health.random ^= health.random << 17;
+    return delay * 4 / 5 + health.random % (delay * 2 / 5 + 1);
+}
+
+static void probe_close(Probe* probe) {
+    if (probe->fd != -1) {
+        close(probe->fd);
+        probe->fd = -1;
+    }
+    free(probe->buffer);
+    probe->buffer = NULL;
+    probe->phase = PROBE_IDLE;
+}
+
+static void probe_free(Probe* probe) {
+    probe_close(probe);
+    free(probe->destination);
+    free(probe);
+}
+
+// Only changes between up and down are printed, degraded comes and goes with single lost probes
+static void probe_set_health(Probe* probe, enum BackendHealth state, const char* reason) {
+    unsigned previous = atomic_exchange_explicit(&probe->state->health, state, memory_order_relaxed);
+    if (previous == (unsigned)state || (state != BACKEND_DOWN && previous != BACKEND_DOWN)) {
+        return;
+    }
+
+    char message[512];
+    if (reason != NULL) {
+        snprintf(message, sizeof(message), "Backend %s:%u is %s: %s", probe->destination, probe->port, health_names[state], reason);
+    } else {
+        snprintf(message, sizeof(message), "Backend %s:%u is %s", probe->destination, probe->port, health_names[state]);
+    }
+    printf("%s\n", message);
+    log_info(message);
+}
+
+static void probe_succeed(Probe* probe) {
+    uint32_t elapsed_us = now_us() - probe->started_us;
+    probe_close(probe);
+
+    atomic_store_explicit(&probe->state->probe_us, elapsed_us, memory_order_relaxed);
+    probe->failures = 0;
+    probe_set_health(probe, elapsed_us / 1000 > config.health_timeout_ms / 2 ? BACKEND_DEGRADED : BACKEND_UP, NULL);
+    probe->due = now_ms() + jitter(config.health_interval_ms);
+}
+
+// Failing backends are probed less and less often, up to HEALTH_BACKOFF_MAX_MS apart
+static void probe_fail(Probe* probe, const char* reason) {
+    probe_close(probe);
+
+    ++probe->failures;
+    probe_set_health(probe, probe->failures >= HEALTH_FALL ? BACKEND_DOWN : BACKEND_DEGRADED, reason);
+
+    uint64_t delay = config.health_interval_ms << (probe->failures < 4 ? probe->failures - 1 : 3);
+    if (delay > HEALTH_BACKOFF_MAX_MS && config.health_interval_ms < HEALTH_BACKOFF_MAX_MS) {
+        delay = HEALTH_BACKOFF_MAX_MS;
+    }
+    probe->due = now_ms() + jitter(delay);
+
+    pthread_mutex_lock(&health.stats_mutex);
+    ++health.stats.failures;
+    pthread_mutex_unlock(&health.stats_mutex);
+}
+
+static void probe_connect(Probe* probe, const DnsAnswer* answer) {
+    if (probe->default_port && answer->port != 0) {
+        probe->port = answer->port;
+    }
+
+    struct sockaddr_storage address;
+    socklen_t address_length = dns_answer_address(answer, probe->port, 0, &address);
+    if (address_length == 0) {
+        probe_fail(probe, "no address");
+        return;
+    }
+
+    probe->fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (probe->fd == -1 || (connect(probe->fd, (struct sockaddr*)&address, address_length) < 0 && errno != EINPROGRESS)) {
+        probe_fail(probe, strerror(errno));
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = probe };
+    if (epoll_ctl(health.epoll_fd, EPOLL_CTL_ADD, probe->fd, &event) == -1) {
+        probe_fail(probe, strerror(errno));
+        return;
+    }
+
+    probe->phase = PROBE_CONNECT;
+    probe->due = now_ms() + config.health_timeout_ms;
+}
+
+static void probe_start(Probe* probe) {
+    probe->started_us = now_us();
+
+    pthread_mutex_lock(&health.stats_mutex);
+    ++health.stats.probes;
+    pthread_mutex_unlock(&health.stats_mutex);
+
+    DnsAnswer answer;
+    switch (dns_cache_lookup(probe->destination, &answer)) {
+        case DNS_CACHE_HIT:
+            probe_connect(probe, &answer);
+            return;
+        case DNS_CACHE_NEGATIVE:
+            probe_fail(probe, "could not resolve the hostname");
+            return;
+        case DNS_CACHE_MISS:
+            // The resolver has its own timeouts
+            probe->phase = PROBE_RESOLVE;
+            resolver_lookup(&probe->resolve, probe->destination, &health.resolved);
+            return;
+    }
+}
+
+// A Status Request the way a client sends it, the backend has to answer it to count as up
+static void probe_send_ping(Probe* probe) {
+    probe->capacity = STATUS_REQUEST_MAX_LENGTH;
+    probe->buffer = malloc(probe->capacity);
+    if (probe->buffer == NULL) {
+        probe_fail(probe, "out of memory");
+        return;
+    }
+
+    probe->length = status_request_encode(probe->buffer, PROBE_PROTOCOL_VERSION, probe->destination, probe->port);
+
+    // A fresh socket always has room for a few hundred bytes
+    ssize_t sent = send(probe->fd, probe->buffer, probe->length, MSG_NOSIGNAL);
+    if (sent != (ssize_t)probe->length) {
+        probe_fail(probe, sent < 0 ? strerror(errno) : "short write");
+        return;
+    }
+
+    probe->length = 0;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = probe };
+    if (epoll_ctl(health.epoll_fd, EPOLL_CTL_MOD, probe->fd, &event) == -1) {
+        probe_fail(probe, strerror(errno));
+        return;
+    }
+    probe->phase = PROBE_RECEIVE;
+}
+
+static void probe_receive(Probe* probe) {
+    while (1) {
+        if (probe->length == probe->capacity) {
+            size_t capacity = probe->capacity * 2 < STATUS_RESPONSE_MAX_LENGTH ? probe->capacity * 2 : STATUS_RESPONSE_MAX_LENGTH;
+            char* buffer = capacity > probe->capacity ? realloc(probe->buffer, capacity) : NULL;
+            if (buffer == NULL) {
+                probe_fail(probe, "response too large");
+                return;
+            }
+            probe->buffer = buffer;
+            probe->capacity = capacity;
+        }
+
+        ssize_t received = recv(probe->fd, probe->buffer + probe->length, probe->capacity - probe->length, 0);
+        if (received == 0) {
+            probe_fail(probe, "connection closed");
+            return;
+        }
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                probe_fail(probe, strerror(errno));
+            }
+            return;
+        }
+        probe->length += received;
+
+        size_t length;
+        enum PacketStatus status = status_response_decode(probe->buffer, probe->length, &length);
+        if (status == PACKET_MALFORMED) {
+            probe_fail(probe, "invalid status response");
+            return;
+        }
+        if (status == PACKET_READY) {
+            probe_succeed(probe);
+            return;
+        }
+    }
+}
+
+static void probe_ready(Probe* probe) {
+    if (probe->phase == PROBE_CONNECT) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+            probe_fail(probe, strerror(error != 0 ? error : errno));
+        } else if (config.health_check == HEALTH_CHECK_PING) {
+            probe_send_ping(probe);
+        } else {
+            probe_succeed(probe);
+        }
+    } else if (probe->phase == PROBE_RECEIVE) {
+        probe_receive(probe);
+    }
+}
+
+static void take_resolved() {
+    ResolveRequest* request = resolve_queue_take(&health.resolved);
+
+    while (request != NULL) {
+        ResolveRequest* next = request->next;
+        Probe* probe = (Probe*)((char*)request - offsetof(Probe, resolve));
+        probe->phase = PROBE_IDLE;
+
+        if (!probe->configured) {
+            // Unlinked when servers.conf dropped it, the resolver was the last one holding it
+            probe_free(probe);
+        } else if (atomic_load(&health.stopping)) {
+            // Freed by health_shutdown
+        } else if (request->status != 0) {
+            probe_fail(probe, "could not resolve the hostname");
+        } else {
+            probe_connect(probe, &request->answer);
+        }
+        request = next;
+    }
+}
+
+// Follows servers.conf: backends new to it are probed soon, spread over one interval, dropped ones are forgotten
+static void sync_probes(uint64_t now) {
+    RoutesLoadStats load;
+    routes_load_stats(&load);
+    if (load.generation == health.generation) {
+        return;
+    }
+    health.generation = load.generation;
+
+    for (Probe* probe = health.probes; probe != NULL; probe = probe->next) {
+        probe->configured = 0;
+    }
+
+    RouteTable* routes = routes_acquire();
+    size_t count = routes_backend_count(routes);
+    for (size_t i = 0; i < count; ++i) {
+        const Backend* backend = routes_backend(routes, i);
+
+        Probe* probe = backend->state->probe;
+        if (probe != NULL) {
+            probe->configured = 1;
+            continue;
+        }
+
+        probe = calloc(1, sizeof(Probe));
+        if (probe != NULL) {
+            probe->destination = strdup(backend->destination);
+        }
+        if (probe == NULL || probe->destination == NULL) {
+            perror("Error allocating health probe");
+            free(probe);
+            continue;
+        }
+
+        probe->state = backend->state;
+        probe->port = backend->port;
+        probe->default_port = backend->default_port;
+        probe->fd = -1;
+        probe->configured = 1;
+        probe->seen_failure = atomic_load_explicit(&backend->state->failed_ms, memory_order_relaxed);
+        probe->due = now + jitter(config.health_interval_ms / 2);
+        probe->next = health.probes;
+        health.probes = probe;
+        backend->state->probe = probe;
+    }
+    routes_release(routes);
+
+    Probe** link = &health.probes;
+    while (*link != NULL) {
+        Probe* probe = *link;
+        if (probe->configured) {
+            link = &probe->next;
+            continue;
+        }
+
+        // A backend that comes back later starts over
+        atomic_store_explicit(&probe->state->health, BACKEND_UNKNOWN, memory_order_relaxed);
+        probe->state->probe = NULL;
+        *link = probe->next;
+        if (probe->phase != PROBE_RESOLVE) {
+            probe_free(probe);
+        }
+    }
+}
+
+// Starts the probes that are due, times out the running ones and returns how long to wait for the next
+static int run_probes(uint64_t now) {
+    uint64_t next = now + HEALTH_POLL_MS;
+    HealthStats counts = {0};
+
+    for (Probe* probe = health.probes; probe != NULL; probe = probe->next) {
+        // A join that just failed to connect gets its backend probed right away
+        uint64_t failed = atomic_load_explicit(&probe->state->failed_ms, memory_order_relaxed);
+        if (probe->phase == PROBE_IDLE && failed != probe->seen_failure) {
+            probe->seen_failure = failed;
+            probe->due = now;
+        }
+
+        if (probe->phase == PROBE_IDLE && probe->due <= now) {
+            probe_start(probe);
+        } else if ((probe->phase == PROBE_CONNECT || probe->phase == PROBE_RECEIVE) && probe->due <= now) {
+            probe_fail(probe, "timed out");
+        }
+
+        if (probe->phase != PROBE_RESOLVE && probe->due < next) {
+            next = probe->due;
+        }
+
+        ++counts.backends;
+        switch (atomic_load_explicit(&probe->state->health, memory_order_relaxed)) {
+            case BACKEND_UP:
+                ++counts.up;
+                break;
+            case BACKEND_DEGRADED:
+                ++counts.degraded;
+                break;
+            case BACKEND_DOWN:
+                ++counts.down;
+                break;
+        }
+    }
+
+    pthread_mutex_lock(&health.stats_mutex);
+    health.stats.backends = counts.backends;
+    health.stats.up = counts.up;
+    health.stats.degraded = counts.degraded;
+    health.stats.down = counts.down;
+    pthread_mutex_unlock(&health.stats_mutex);
+
+    return next > now ? (int)(next - now) : 0;
+}
+
+static void* health_run(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = 0;
+
+    while (!atomic_load(&health.stopping)) {
+        int count = epoll_wait(health.epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                continue;
+            } else if (events[i].data.ptr == &health.resolved) {
+                take_resolved();
+            } else {
+                probe_ready(events[i].data.ptr);
+            }
+        }
+
+        uint64_t now = now_ms();
+        sync_probes(now);
+        timeout = run_probes(now);
+    }
+
+    return NULL;
+}
+
+ssize_t health_init() {
+    if (health.running || config.health_check == HEALTH_CHECK_OFF) {
+        return 0;
+    }
+
+    atomic_store(&health.stopping, 0);
+    health.random = now_us() | 1;
+
+    health.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    health.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (health.epoll_fd == -1 || health.event_fd == -1 || resolve_queue_init(&health.resolved) < 0) {
+        perror("Error setting up the health checker");
+        health_shutdown();
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event resolved = { .events = EPOLLIN, .data.ptr = &health.resolved };
+    if (epoll_ctl(health.epoll_fd, EPOLL_CTL_ADD, health.event_fd, &event) == -1 ||
+        epoll_ctl(health.epoll_fd, EPOLL_CTL_ADD, health.resolved.event_fd, &resolved) == -1 ||
+        pthread_create(&health.thread, NULL, health_run, NULL) != 0) {
+        perror("Error starting the health checker");
+        health_shutdown();
+        return -1;
+    }
+
+    health.running = 1;
+    return 0;
+}
+
+void health_shutdown() {
+    if (health.running) {
+        atomic_store(&health.stopping, 1);
+        uint64_t one = 1;
+        if (write(health.event_fd, &one, sizeof(one)) < 0) {
+            perror("Error signalling eventfd");
+        }
+        pthread_join(health.thread, NULL);
+        health.running = 0;
+    }
+
+    // Probes handed to the resolver can only be freed once it gives them back
+    while (health.probes != NULL) {
+        Probe** link = &health.probes;
+        while (*link != NULL) {
+            Probe* probe = *link;
+            if (probe->phase == PROBE_RESOLVE) {
+                link = &probe->next;
+                continue;
+            }
+            *link = probe->next;
+            probe->state->probe = NULL;
+            probe_free(probe);
+        }
+
+        if (health.probes != NULL) {
+            struct pollfd pollfd = { .fd = health.resolved.event_fd, .events = POLLIN };
+            poll(&pollfd, 1, -1);
+            take_resolved();
+        }
+    }
+
+    resolve_queue_destroy(&health.resolved);
+    if (health.event_fd != -1) {
+        close(health.event_fd);
+        health.event_fd = -1;
+    }
+    if (health.epoll_fd != -1) {
+        close(health.epoll_fd);
+        health.epoll_fd = -1;
+    }
+    health.generation = 0;
+}
+
+void health_stats(HealthStats* stats) {
+    pthread_mutex_lock(&health.stats_mutex);
+    *stats = health.stats;
+    pthread_mutex_unlock(&health.stats_mutex);
+}
@@ -0,0 +1,24 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+    size_t backends;    // Backends of the current servers.conf being probed
+    size_t up;
+    size_t degraded;
+    size_t down;
+    size_t probes;
+    size_t failures;    // Probes that failed
+} HealthStats;
+
+// Starts the thread probing every backend of servers.conf, does nothing with health_check off.
+// Results go to each backend's BackendState, where the backend selection reads them
+ssize_t health_init();
+void health_shutdown();
+void health_stats(HealthStats* stats);
+
+#endif // HEALTH_H
@@ -0,0 +1,165 @@
+#include "limiter.h"
+#include "config.h"
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+
+#define PROBES 8    // Slots an address may land in, past them it goes untracked
+
+// A token bucket kept as the time it will be full again (GCRA): each connection pushes it one
+// interval further, and the source is over its rate once that is more than a burst ahead of now.
+// A slot whose bucket is full again holds nothing worth keeping, so any address may take it over
+typedef struct {
+    atomic_uint_least64_t key;  // Hash of the source address, 0 if the slot was never used
+    atomic_uint_least64_t full_us;
+} Slot;
+
+static Slot table[LIMITER_SLOTS];
+static uint64_t seed;
+static atomic_size_t handshakes;
+static atomic_size_t table_full;
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t limiter_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// IPv4 addresses count one by one, IPv6 ones by their /64, which is what a single host gets handed
+static uint64_t address_hash(const struct sockaddr* address, socklen_t length) {
+    uint64_t high = 0, low = 0;
+
+    if (address->sa_family == AF_INET && length >= sizeof(struct sockaddr_in)) {
+        low = ((const struct sockaddr_in*)address)->sin_addr.s_addr;
+    } else if (address->sa_family == AF_INET6 && length >= sizeof(struct sockaddr_in6)) {
+        const struct in6_addr* ip = &((const struct sockaddr_in6*)address)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(ip)) {
+            memcpy(&low, ip->s6_addr + 12, 4);
+        } else {
+            memcpy(&high, ip->s6_addr, 8);
+            high |= 1ULL << 63; // Keeps IPv6 prefixes apart from IPv4 addresses
+        }
+    } else {
+        return 0;
+    }
+
+    return mix(mix(high ^ seed) ^ low) | 1;
+}
+
+void limiter_init() {
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        seed = now_us();
+    }
+}
+
+// Returns 0 if the source is within its rate, and counts the connection against it
+static ssize_t slot_take(Slot* slot, uint64_t now) {
+    uint64_t interval = 1000000 / config.connection_rate;
+    uint64_t burst = config.connection_burst > 0 ? config.connection_burst : 1;
+    uint64_t full = atomic_load_explicit(&slot->full_us, memory_order_relaxed);
+
+    while (1) {
+        uint64_t next = (full > now ? full : now) + interval;
+        if (next - now > burst * interval) {
+            return -1;
+        }
+        if (atomic_compare_exchange_weak_explicit(&slot->full_us, &full, next, memory_order_relaxed, memory_order_relaxed)) {
+            return 0;
+        }
+    }
+}
+
+static enum Admission admit_rate(const struct sockaddr* address, socklen_t length) {
+    uint64_t key = address_hash(address, length);
+    if (key == 0) {
+        return ADMIT;
+    }
+
+    uint64_t now = now_us();
+    size_t start = (key >> 16) & (LIMITER_SLOTS - 1);
+
+    // Two tries, a slot being claimed by another thread at the same time sends us round again
+    for (size_t attempt = 0; attempt < 2; ++attempt) {
+        Slot* free_slot = NULL;
+        uint64_t free_key = 0;
+
+        for (size_t i = 0; i < PROBES; ++i) {
+            Slot* slot = &table[(start + i) & (LIMITER_SLOTS - 1)];
+            uint64_t current = atomic_load_explicit(&slot->key, memory_order_relaxed);
+            if (current == key) {
+                return slot_take(slot, now) == 0 ? ADMIT : REJECT_RATE;
+            }
+            if (free_slot == NULL && (current == 0 || atomic_load_explicit(&slot->full_us, memory_order_relaxed) <= now)) {
+                free_slot = slot;
+                free_key = current;
+            }
+        }
+
+        // A full bucket is the same for every address, the new owner carries on from it as is
+        if (free_slot != NULL && atomic_compare_exchange_strong_explicit(&free_slot->key, &free_key, key, memory_order_relaxed, memory_order_relaxed)) {
+            return slot_take(free_slot, now) == 0 ? ADMIT : REJECT_RATE;
+        }
+        if (free_slot == NULL) {
+            break;
+        }
+    }
+
+    // Losing track of a source is better than turning players away for what others did
+    atomic_fetch_add_explicit(&table_full, 1, memory_order_relaxed);
+    return ADMIT;
+}
+
+enum Admission limiter_admit(const struct sockaddr* address, socklen_t length) {
+    if (config.connection_rate > 0 && admit_rate(address, length) != ADMIT) {
+        return REJECT_RATE;
+    }
+
+    size_t active = atomic_fetch_add_explicit(&handshakes, 1, memory_order_relaxed) + 1;
+    if (config.max_handshakes > 0 && active > config.max_handshakes) {
+        atomic_fetch_sub_explicit(&handshakes, 1, memory_order_relaxed);
+        return REJECT_HANDSHAKES;
+    }
+    return ADMIT;
+}
+
+void limiter_handshake_done() {
+    atomic_fetch_sub_explicit(&handshakes, 1, memory_order_relaxed);
+}
+
+void limiter_reject(int socket, enum Admission admission) {
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(socket);
+
+    metrics_add(admission == REJECT_RATE ? GLOBAL_REJECTED_RATE : GLOBAL_REJECTED_HANDSHAKES, 1);
+}
+
+void limiter_stats(LimiterStats* stats) {
+    uint64_t now = now_us();
+
+    stats->handshakes = atomic_load_explicit(&handshakes, memory_order_relaxed);
+    stats->table_full = atomic_load_explicit(&table_full, memory_order_relaxed);
+    stats->tracked = 0;
+    for (size_t i = 0; i < LIMITER_SLOTS; ++i) {
+        stats->tracked += atomic_load_explicit(&table[i].full_us, memory_order_relaxed) > now;
+    }
+}
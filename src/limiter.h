@@ -0,0 +1,38 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define LIMITER_SLOTS 65536 // Source addresses tracked at once, must be a power of two
+
+enum Admission {
+    ADMIT,
+    REJECT_RATE,        // The source address opened connections faster than connection_rate
+    REJECT_HANDSHAKES   // max_handshakes connections are still handshaking
+};
+
+typedef struct {
+    size_t handshakes;      // Connections admitted that haven't finished their handshake
+    size_t tracked;         // Source addresses in the table whose bucket isn't full again yet
+    size_t table_full;      // Connections let through untracked because their slots were all taken
+} LimiterStats;
+
+// Seeds the address hash, so nobody can pick addresses that collide in the table
+void limiter_init();
+
+// Runs on every accepted socket before anything is allocated for it. Never blocks or locks.
+// Admitted connections hold a handshake slot until limiter_handshake_done
+enum Admission limiter_admit(const struct sockaddr* address, socklen_t length);
+void limiter_handshake_done();
+// Closes a rejected socket with a reset, so it leaves nothing behind in TIME_WAIT, and counts it
+void limiter_reject(int socket, enum Admission admission);
+void limiter_stats(LimiterStats* stats);
+
+uint64_t limiter_now_ms();
+
+#endif // LIMITER_H
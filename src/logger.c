@@ -1,97 +1,429 @@
+#define _GNU_SOURCE
+
 #include "logger.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
 #define DATE_FORMAT "%Y-%m-%d"
-#define TIME_FORMAT "%Y-%m-%dT%H:%M:%S%z"
+#define TIME_FORMAT "%Y-%m-%dT%H:%M:%S%z" // RFC 5424 :3
 #define FILENAME_FORMAT "logs/%s.txt"
 
 // Read/Write
-#define MKDIR_MODE 0600 
+#define MKDIR_MODE 0600
+#define FILE_MODE 0644
 
-pthread_mutex_t logger_mutex;
+#define LOG_RING_SIZE 4096      // Must be a power of two
+#define LOG_RECORD_SIZE 512
+#define LOG_BATCH 64            // Records per writev
+#define LOG_IDLE_MS 1000        // The writer wakes up at least this often to notice a new day
 
-char log_file[256];
-int log_file_day = 0;
+// One slot of the ring. sequence tells who owns it: equal to the position when free for the
+// producer claiming that position, position + 1 once the record is ready for the writer
+typedef struct {
+    atomic_size_t sequence;
+    time_t time;
+    unsigned short length;
+    char text[LOG_RECORD_SIZE];  // Ends with a newline
+} LogSlot;
 
-ssize_t log_refresh_file() {
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+// Connection threads only claim a slot and copy the record, the writer thread formats the
+// timestamps, writes whole batches with one writev and keeps the day's file open
+typedef struct {
+    LogSlot slots[LOG_RING_SIZE];
+    atomic_size_t enqueue_position;
+    size_t dequeue_position;        // Only touched by the writer
+
+    atomic_int idle;                // The writer is about to sleep on wake_fd
+    atomic_int stopping;
+    atomic_int running;
+    int wake_fd;
+    pthread_t thread;
+
+    // Producers waiting for room with log_full_policy block
+    pthread_mutex_t room_mutex;
+    pthread_cond_t room;
+    atomic_int waiting;
+
+    atomic_size_t written;
+    atomic_size_t dropped;
+    atomic_size_t unreported;       // Dropped records not yet mentioned in the log
+
+    // Writer state
+    int fd;
+    int file_day;
+    time_t cached_second;
+    int cached_day;
+    char cached_time[32];
+} Logger;
 
-    log_file_day = tm->tm_mday;
+static Logger logger = { .fd = -1, .wake_fd = -1, .cached_second = -1 };
+
+static ssize_t log_open_file(const struct tm* tm) {
+    struct stat st = {0};
+    if (stat("logs", &st) == -1 && mkdir("logs", MKDIR_MODE) == -1 && errno != EEXIST) {
+        return -1;
+    }
 
     char date_str[11];
+    char log_file[256];
     strftime(date_str, sizeof(date_str), DATE_FORMAT, tm);
     snprintf(log_file, sizeof(log_file), FILENAME_FORMAT, date_str);
 
-    struct stat st = {0};
-    if (stat("logs", &st) == -1) {
-        return mkdir("logs", MKDIR_MODE);
+    int fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE);
+    if (fd < 0) {
+        return -1;
     }
+
+    if (logger.fd >= 0) {
+        close(logger.fd);
+    }
+    logger.fd = fd;
+    logger.file_day = tm->tm_yday;
     return 0;
 }
 
-void log_message(const char *message) {
-    pthread_mutex_lock(&logger_mutex);
+// localtime and strftime only run when the second changes, a burst of records shares one timestamp
+static void log_format_time(time_t time) {
+    if (time == logger.cached_second) {
+        return;
+    }
 
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+    struct tm tm;
+    localtime_r(&time, &tm);
+    size_t length = strftime(logger.cached_time, sizeof(logger.cached_time) - 2, TIME_FORMAT, &tm);
+    strcpy(logger.cached_time + length, ": ");
+
+    logger.cached_second = time;
+    logger.cached_day = tm.tm_yday;
+
+    if (logger.fd < 0 || tm.tm_yday != logger.file_day) {
+        if (log_open_file(&tm) < 0) {
+            perror("Error opening log file");
+        }
+    }
+}
+
+static int slot_ready(size_t position) {
+    return atomic_load(&logger.slots[position & (LOG_RING_SIZE - 1)].sequence) == position + 1;
+}
+
+static ssize_t write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Writes up to LOG_BATCH ready records, returns how many were taken off the ring
+static size_t log_drain_batch() {
+    struct iovec iov[LOG_BATCH * 2 + 2];
+    char times[LOG_BATCH][32];
+    char notice_time[32];
+    char notice[128];
+    int count = 0;
+    size_t taken = 0;
+    size_t position = logger.dequeue_position;
+
+    size_t unreported = atomic_exchange(&logger.unreported, 0);
+    if (unreported > 0) {
+        time_t now = time(NULL);
+        log_format_time(now);
+        strcpy(notice_time, logger.cached_time);
+        iov[count++] = (struct iovec){ notice_time, strlen(notice_time) };
+        int length = snprintf(notice, sizeof(notice), "[ERROR]: %zu log records dropped, the log ring was full\n", unreported);
+        iov[count++] = (struct iovec){ notice, length };
+    }
+
+    while (taken < LOG_BATCH && slot_ready(position + taken)) {
+        LogSlot* slot = &logger.slots[(position + taken) & (LOG_RING_SIZE - 1)];
+
+        // A new day goes into a new file, end the batch before the first record of it
+        int previous_day = logger.cached_day;
+        if (taken > 0 && slot->time != logger.cached_second) {
+            struct tm tm;
+            localtime_r(&slot->time, &tm);
+            if (tm.tm_yday != previous_day) {
+                break;
+            }
+        }
+
+        log_format_time(slot->time);
+        // Records of the same second point at one copy of the timestamp
+        if (taken == 0 || slot->time != logger.slots[(position + taken - 1) & (LOG_RING_SIZE - 1)].time) {
+            strcpy(times[taken], logger.cached_time);
+            iov[count++] = (struct iovec){ times[taken], strlen(times[taken]) };
+        } else {
+            iov[count] = iov[count - 2];
+            ++count;
+        }
+        iov[count++] = (struct iovec){ slot->text, slot->length };
+        ++taken;
+    }
+
+    if (count > 0) {
+        if (logger.fd >= 0 && write_all(logger.fd, iov, count) == 0) {
+            atomic_fetch_add(&logger.written, taken);
+        } else {
+            if (logger.fd >= 0) {
+                perror("Error writing log file");
+            }
+            atomic_fetch_add(&logger.dropped, taken);
+        }
+    }
+
+    // Hand the slots back to the producers, one lap further on
+    for (size_t i = 0; i < taken; ++i) {
+        atomic_store(&logger.slots[(position + i) & (LOG_RING_SIZE - 1)].sequence, position + i + LOG_RING_SIZE);
+    }
+    logger.dequeue_position = position + taken;
+
+    if (taken > 0 && atomic_load(&logger.waiting) > 0) {
+        pthread_mutex_lock(&logger.room_mutex);
+        pthread_cond_broadcast(&logger.room);
+        pthread_mutex_unlock(&logger.room_mutex);
+    }
+
+    return taken;
+}
+
+static void* log_writer_thread(void* arg) {
+    (void)arg;
+
+    struct pollfd wake = { .fd = logger.wake_fd, .events = POLLIN };
+
+    for (;;) {
+        if (log_drain_batch() > 0) {
+            continue;
+        }
+
+        // A producer stopped between claiming and filling its slot can't be waited for on shutdown
+        if (atomic_load(&logger.stopping)) {
+            break;
+        }
+
+        // Producers only signal wake_fd when they see idle set, check the ring once more after setting it
+        atomic_store(&logger.idle, 1);
+        if (slot_ready(logger.dequeue_position) || atomic_load(&logger.unreported) > 0) {
+            atomic_store(&logger.idle, 0);
+            continue;
+        }
+
+        if (poll(&wake, 1, LOG_IDLE_MS) > 0) {
+            uint64_t value;
+            if (read(logger.wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                perror("Error reading the log wakeup");
+            }
+        } else {
+            // Rotate even when nothing is logged for a while
+            log_format_time(time(NULL));
+        }
+        atomic_store(&logger.idle, 0);
+    }
+
+    return NULL;
+}
 
-    if (tm->tm_mday != log_file_day) {
-        if (log_refresh_file() < 0) {
-            perror("Error creating log file");
-            pthread_mutex_unlock(&logger_mutex);
-            return;
+static void log_wake_writer() {
+    if (atomic_exchange(&logger.idle, 0)) {
+        uint64_t one = 1;
+        if (write(logger.wake_fd, &one, sizeof(one)) < 0) {
+            perror("Error waking the log writer");
         }
     }
+}
+
+// Claims a free slot, NULL if the ring is full
+static LogSlot* log_claim() {
+    size_t position = atomic_load_explicit(&logger.enqueue_position, memory_order_relaxed);
+
+    for (;;) {
+        LogSlot* slot = &logger.slots[position & (LOG_RING_SIZE - 1)];
+        // Sequentially consistent so a producer about to wait for room can't miss the writer freeing it
+        size_t sequence = atomic_load(&slot->sequence);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logger.enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                return slot;
+            }
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = atomic_load_explicit(&logger.enqueue_position, memory_order_relaxed);
+        }
+    }
+}
+
+static LogSlot* log_claim_waiting() {
+    LogSlot* slot = log_claim();
+    if (slot != NULL || config.log_full_policy == LOG_FULL_DROP || !atomic_load(&logger.running)) {
+        return slot;
+    }
+
+    pthread_mutex_lock(&logger.room_mutex);
+    atomic_fetch_add(&logger.waiting, 1);
+    while ((slot = log_claim()) == NULL && atomic_load(&logger.running)) {
+        log_wake_writer();
+        pthread_cond_wait(&logger.room, &logger.room_mutex);
+    }
+    atomic_fetch_sub(&logger.waiting, 1);
+    pthread_mutex_unlock(&logger.room_mutex);
+    return slot;
+}
+
+__attribute__((format(printf, 1, 2)))
+static void log_record(const char* format, ...) {
+    if (!atomic_load(&logger.running)) {
+        return;
+    }
+
+    LogSlot* slot = log_claim_waiting();
+    if (slot == NULL) {
+        atomic_fetch_add(&logger.dropped, 1);
+        atomic_fetch_add(&logger.unreported, 1);
+        return;
+    }
+
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(slot->text, sizeof(slot->text) - 1, format, arguments);
+    va_end(arguments);
+
+    if (length < 0) {
+        length = 0;
+    } else if (length > (int)sizeof(slot->text) - 2) {
+        length = sizeof(slot->text) - 2;
+    }
+    slot->text[length++] = '\n';
+    slot->length = length;
+    slot->time = time(NULL);
 
-    FILE* file = fopen(log_file, "a");
+    // Publishing and reading idle are both sequentially consistent, so the writer either sees
+    // the record before it sleeps or this sees it idle and wakes it up
+    size_t position = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store(&slot->sequence, position + 1);
+    log_wake_writer();
+}
+
+static void log_message(const char *message) {
+    log_record("%s", message);
+}
 
-    if (file == NULL) {
-        perror("Error opening log file");
-        pthread_mutex_unlock(&logger_mutex);
+// Also runs from exit(), so handle_error and sigint_handler never lose queued records
+static void log_stop() {
+    if (!atomic_exchange(&logger.running, 0)) {
         return;
     }
 
-    char time_str[30];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S%z", tm); // RFC 5424 :3
+    atomic_store(&logger.stopping, 1);
+    atomic_store(&logger.idle, 1);
+    log_wake_writer();
+    pthread_join(logger.thread, NULL);
 
-    fprintf(file, "%s: %s\n", time_str, message);
-    fclose(file);
+    // Release producers still waiting for room, they drop their record
+    pthread_mutex_lock(&logger.room_mutex);
+    pthread_cond_broadcast(&logger.room);
+    pthread_mutex_unlock(&logger.room_mutex);
 
-    pthread_mutex_unlock(&logger_mutex);
+    if (logger.fd >= 0) {
+        close(logger.fd);
+        logger.fd = -1;
+    }
 }
 
 ssize_t log_init() {
-    if (log_refresh_file() < 0) {
-        perror("Error creating log file");
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i) {
+        atomic_init(&logger.slots[i].sequence, i);
+    }
+
+    time_t now = time(NULL);
+    log_format_time(now);
+    if (logger.fd < 0) {
+        return -1;
+    }
+
+    logger.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (logger.wake_fd < 0) {
+        perror("Error creating the log wakeup");
         return -1;
     }
-    if (pthread_mutex_init(&logger_mutex, NULL) != 0) {
+
+    if (pthread_mutex_init(&logger.room_mutex, NULL) != 0 || pthread_cond_init(&logger.room, NULL) != 0) {
         perror("Error creating logger mutex");
         return -1;
     }
+
+    // Signals are for the other threads, the writer must never run sigint_handler and join itself
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int error = pthread_create(&logger.thread, NULL, log_writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (error != 0) {
+        errno = error;
+        perror("Error creating the log writer thread");
+        return -1;
+    }
+
+    atomic_store(&logger.running, 1);
+    atexit(log_stop);
+
     log_message("Server initialized");
     return 0;
 }
 
 void log_shutdown() {
     log_message("Shutting down the server");
+    log_stop();
+}
+
+void log_stats(LogStats* stats) {
+    stats->written = atomic_load(&logger.written);
+    stats->dropped = atomic_load(&logger.dropped);
 }
 
 
 void log_error(const char* const message) {
-    char error_message[512];
-    sprintf(error_message, "[ERROR]: %s", message);
-    log_message(error_message);
+    log_record("[ERROR]: %s", message);
+}
+
+void log_info(const char* const message) {
+    log_record("[INFO]: %s", message);
 }
 
 
 void log_connection(const char *username, const char *client_ip, const char *server_ip_address, const char *resolved_address, enum LogConnectionType connection_type) {
-    char message[512];
     if (connection_type == LOG_CONNECTED) {
-        sprintf(message, "Client %s (%s) connected to %s (%s)", username, client_ip, server_ip_address, resolved_address);
+        log_record("Client %s (%s) connected to %s (%s)", username, client_ip, server_ip_address, resolved_address);
     } else {
-        sprintf(message, "Client %s (%s) disconnected from %s (%s)", username, client_ip, server_ip_address, resolved_address);
+        log_record("Client %s (%s) disconnected from %s (%s)", username, client_ip, server_ip_address, resolved_address);
     }
-
-    log_message(message);
-}
\ No newline at end of file
+}
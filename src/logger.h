@@ -14,9 +14,18 @@ enum LogConnectionType
     LOG_DISCONNECTED
 };
 
+typedef struct {
+    size_t written;     // Records that reached the log file
+    size_t dropped;     // Records lost because the ring was full or the file couldn't be written
+} LogStats;
+
+// Starts the writer thread, log calls from here on only copy the record into a ring
 ssize_t log_init();
+// Logs the shutdown and waits until everything queued is on disk, safe to call more than once
 void log_shutdown();
 void log_connection(const char *username, const char *client_ip, const char *server_ip_address, const char *resolved_address, enum LogConnectionType connection_type);
 void log_error(const char* const message);
+void log_info(const char* const message);
+void log_stats(LogStats* stats);
 
-#endif // LOGGER_H
\ No newline at end of file
+#endif // LOGGER_H
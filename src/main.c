@@ -2,14 +2,23 @@
 #include "packet-tools.h"
 #include "logger.h"
 #include "dns.h"
+#include "config.h"
+#include "engine.h"
+#include "reload.h"
+#include "resolver.h"
+#include "status.h"
+#include "pool.h"
+#include "health.h"
+#include "exporter.h"
+#include "limiter.h"
+#include "upgrade.h"
+#include "shaper.h"
+#include "trace.h"
+#include "admin.h"
 
 #define SERVER_PORT 25565
 #define MAX_PENDING_CONNECTIONS 256
 
-#define BUFFER_SIZE 32768 // MC packets don't exceed 32768 (2^15) bytes.
-
-void *handle_client(void *arg);
-
 // In case of an error, log the error and exit the program
 void handle_error(const char* error_message) {
     perror(error_message);
@@ -17,27 +26,9 @@ void handle_error(const char* error_message) {
     exit(EXIT_FAILURE);
 }
 
-void log_connect(char *username, int client_socket, char* server_ip_address, char* resolved_address, enum LogConnectionType connection_type) {
-    struct sockaddr_in client_address;
-    socklen_t client_address_length = sizeof(client_address);
-
-    // Get the client's IP address
-    if (getpeername(client_socket, (struct sockaddr *)&client_address, &client_address_length) == -1) {
-        perror("getpeername failed");
-        return;
-    }
-
-    // Convert the client's IP address to a string
-    char *client_ip = inet_ntoa(client_address.sin_addr);
-
-    // Log the connection
-    log_connection(username, client_ip, server_ip_address, resolved_address, connection_type);
-}
-
-
 int create_and_bind_socket() {
     // Create the server socket
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_socket == -1) {
         handle_error("Error creating socket");
     }
@@ -48,6 +39,23 @@ int create_and_bind_socket() {
         handle_error("setsockopt(SO_REUSEADDR) failed");
     }
 
+    // Let every worker bind its own listener to the same port, the kernel spreads connections across them
+    if (config.reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        handle_error("setsockopt(SO_REUSEPORT) failed");
+    }
+
+    // Accepted connections inherit the listener's options until their route's profile is applied
+    RouteTable* routes = routes_acquire();
+    const SocketProfile* profile = routes_profile(routes, config.listen_profile);
+    if (profile == NULL) {
+        printf("Unknown listen_profile %s\n", config.listen_profile);
+        exit(EXIT_FAILURE);
+    }
+    if (socket_profile_listener(server_socket, profile) < 0) {
+        handle_error("Error applying the listen profile");
+    }
+    routes_release(routes);
+
     // Set up the address struct for the server socket
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
@@ -62,215 +70,150 @@ int create_and_bind_socket() {
     return server_socket;
 }
 
-int create_and_connect_socket(char* address, short port) {
-    // Create the socket for the destination server
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("Error creating to socket");
-        return -1;
-    }
+int* server_sockets = NULL;
+size_t server_socket_count = 0;
 
-    // Set up the address struct for the destination server
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
+void listen_and_accept_connections() {
+    size_t worker_count = config_worker_count();
+    size_t shards = config.reuseport ? worker_count : 1;
 
-    // Convert the address to a binary form
-    if (inet_pton(AF_INET, address, &(server_address.sin_addr)) <= 0) {
-        perror("inet_pton error");
-        return -1;
+    server_sockets = calloc(shards > UPGRADE_MAX_SOCKETS ? shards : UPGRADE_MAX_SOCKETS, sizeof(int));
+    if (server_sockets == NULL) {
+        handle_error("Error allocating the server sockets");
     }
 
-    // Attempt to connect to the destination server
-    if (connect(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Error connecting to socket");
-        return -1;
+    // Started by an upgrade, the previous process's listeners are used as they are
+    ssize_t inherited = upgrade_inherit(server_sockets, UPGRADE_MAX_SOCKETS);
+    if (inherited < 0) {
+        handle_error("Error taking over the listeners");
+    }
+    if (inherited > 0) {
+        server_socket_count = shards = inherited;
+        printf("Took over %zu listeners from the previous process\n", shards);
     }
 
-    return server_socket;
-}
+    for (size_t i = server_socket_count; i < shards; ++i) {
+        server_sockets[i] = create_and_bind_socket();
+        ++server_socket_count;
 
-void listen_and_accept_connections(int server_socket) {
-    // Start listening to the server socket
-    if (listen(server_socket, MAX_PENDING_CONNECTIONS) == -1) {
-        handle_error("Error listening to the socket");
+        // Start listening to the server socket
+        if (listen(server_sockets[i], MAX_PENDING_CONNECTIONS) == -1) {
+            handle_error("Error listening to the socket");
+        }
     }
 
     printf("Server listening on port %d...\n", SERVER_PORT);
 
-    // Accept all incoming connections
-    while (1) {
-        struct sockaddr_in client_address;
-        socklen_t client_address_length = sizeof(client_address);
-        // Accept the client's connection
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_length);
-        if (client_socket == -1) {
-            perror("Error accepting connection");
-            continue;
-        }
+    // Hand the sockets over to the event loop workers, they accept and serve all connections
+    if (engine_start(server_sockets, shards, worker_count) != 0) {
+        handle_error("Error starting the workers");
+    }
 
-        // Create a new thread for each client
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, handle_client, &client_socket) != 0) {
-            perror("Error creating thread");
-            continue;
-        }
+    // From here on SIGUSR2 can hand the listeners to a new binary
+    upgrade_ready(server_sockets, shards);
 
-        // Detach the thread so it can be cleaned up automatically
-        pthread_detach(client_thread);
-    }
+    engine_wait();
 }
 
-void *handle_client(void *arg) {
-    int client_socket = *((int *)arg);
-    char buffer[BUFFER_SIZE];
-    char server_ip_address[256] = {0};
-
-    // Receive the packet from the client
-    ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+void sigint_handler(int) {
+    printf("\nShutting down the server proxy\n");
+    // Log the server shutdown
+    log_shutdown();
 
-    // Connection closed by the client
-    if (bytes_received <= 0) {
-        return NULL;
-    }
-    
-    // Assume the packet is a handshake packet
-    parseHandshakePacket(buffer, server_ip_address);
-
-    // Not a valid packet
-    if (strlen(server_ip_address) == 0) {
-        printf("Malformed packet received\n");
-        return NULL;
+    // Close the server sockets
+    for (size_t i = 0; i < server_socket_count; ++i) {
+        close(server_sockets[i]);
     }
 
-    // Find the server in the dictionary
-    Entry* entry = find_entry(server_ip_address);
+    // Exit the program
+    exit(EXIT_SUCCESS);
+}
 
-    // Exit if the target server is not found
-    if (entry == NULL) {
-        printf("Server not found (%s)\n", server_ip_address);
-        return NULL;
-    }
+int main(int argc, char** argv) {
+    (void)argc;
+    setbuf(stdout, NULL);
 
-    // Resolve the hostname to an IP address
-    char resolved_address[16];
-    if (resolve_hostname(entry->destination, resolved_address) != 0) {
-        printf("Could not resolve the hostname\n");
-        return NULL;
-    }
+    printf("The server proxy is starting\n");
 
-    // Attempt to connect to the destination server
-    int server_socket = create_and_connect_socket(resolved_address, entry->port);
+    // Initialize the logging mechanisms
+    if (log_init() != 0) {
+        handle_error("Error initializing the logger");
+    }
 
-    // Exit if the connection was refused
-    if (server_socket == -1) {
-        printf("Connection refused\n");
-        return NULL;
+    // Loads the servers from the config file
+    if (load_dictionary("servers.conf") != 0) {
+        handle_error("Error loading the servers");
     }
 
-    char username[32];
+    // Initialize the DNS cache, sized by the config
+    if (dns_cache_init(config.dns_cache_size) != 0) {
+        handle_error("Error initializing the DNS cache");
+    }
 
-    // Check if the packet is a login packet, meaning the player is attempting to join the server
-    int is_login_packet = parseLoginPacket(buffer, username);
+    RoutesLoadStats stats;
+    routes_load_stats(&stats);
+    printf("Loaded %zu servers in %.2f ms\n", stats.entries, stats.milliseconds);
 
-    if (is_login_packet == -1) {
-        printf("Malformed packet received\n");
-        return NULL;
+    // SIGUSR2 starts a new binary and hands it the listeners. Blocks it for the threads started from here on,
+    // the ones started before block every signal
+    if (upgrade_start(argv) != 0) {
+        handle_error("Error starting the upgrade handler");
     }
 
-    // Log the connection if the player is trying to join the server
-    if (is_login_packet) {
-        log_connect(username, client_socket, server_ip_address, resolved_address, LOG_CONNECTED);
+    // Reload the servers on SIGHUP. Same as above, the upgrade thread was started with every signal blocked
+    if (reload_start("servers.conf") != 0) {
+        handle_error("Error starting the config reloader");
     }
 
-    // Forward the packet to the server
-    if (write(server_socket, buffer, bytes_received) <= 0) {
-        perror("Error responding to the server");
-        close(server_socket);
-        return NULL;
+    // Backend hostnames are looked up on a thread of their own, the workers never block on DNS
+    if (resolver_init(NULL, 0) != 0) {
+        handle_error("Error starting the DNS resolver");
     }
 
-    // Establish a connection between the client and the server
-    fd_set set;
-    while (1) {
-        FD_ZERO(&set);
-        FD_SET(client_socket, &set);
-        FD_SET(server_socket, &set);
-
-        // Wait for either the client or the server to send a packet
-        if (select(FD_SETSIZE, &set, NULL, NULL, NULL) < 0) {
-            perror("select");
-            break;
-        }
-
-        // Forward the packet from the client to the server
-        if (FD_ISSET(client_socket, &set)) {
-            ssize_t bytes = read(client_socket, buffer, sizeof(buffer));
-            if (bytes <= 0) break;
-            if (write(server_socket, buffer, bytes) <= 0) break;
-        }
-
-        // Forward the packet from the server to the client
-        if (FD_ISSET(server_socket, &set)) {
-            ssize_t bytes = read(server_socket, buffer, sizeof(buffer));
-            if (bytes <= 0) break;
-            if (write(client_socket, buffer, bytes) <= 0) break;
-        }
+    // Server list pings are answered from responses refreshed in the background
+    if (status_cache_init() != 0) {
+        handle_error("Error starting the status cache");
     }
 
-    // Log the disconnection if the player was connected to the server
-    if (is_login_packet) {
-        log_connect(username, client_socket, server_ip_address, resolved_address, LOG_DISCONNECTED);
+    // Backends are connected to ahead of the joins that will need them
+    if (pool_init() != 0) {
+        handle_error("Error starting the backend pool");
     }
 
-    close(server_socket);
-
-    return NULL;
-}
-
-int server_socket = 0;
-
-void sigint_handler(int) {
-    printf("\nShutting down the server proxy\n");
-    // Log the server shutdown
-    log_shutdown();
-
-    // Close the server socket
-    if (server_socket) close(server_socket);
+    // Dead backends are found by probing them, not by the joins sent their way
+    if (health_init() != 0) {
+        handle_error("Error starting the health checker");
+    }
 
-    // Exit the program
-    exit(EXIT_SUCCESS);
-}
+    // Connection floods are turned away right after accept
+    limiter_init();
 
-int main() {
-    setbuf(stdout, NULL);
+    // Bandwidth to the players is shared out by the workers, under the global limit if one is set
+    shaper_init();
 
-    printf("The server proxy is starting\n");
-
-    // Initialize the logging mechanisms
-    if (log_init() != 0) {
-        handle_error("Error initializing the logger");
+    // Slow and sampled sessions are written out by a thread of their own
+    if (trace_init() != 0) {
+        handle_error("Error starting the session tracer");
     }
 
-    // Initialize the DNS cache
-    if (dns_cache_init(8) != 0) {
-        handle_error("Error initializing the DNS cache");
+    // Counters are only summed up when a scraper asks for them
+    if (exporter_init() != 0) {
+        handle_error("Error starting the metrics listener");
     }
 
-    // Loads the servers from the config file
-    if (load_dictionary("servers.conf") != 0) {
-        handle_error("Error loading the servers");
+    // Sessions are listed and closed from a local socket
+    if (admin_init() != 0) {
+        handle_error("Error starting the admin socket");
     }
 
-    server_socket = create_and_bind_socket();
-
     // Handle SIGINT and shutdown gracefully
     signal(SIGINT, sigint_handler);
 
-    // Start listening to the server socket
-    listen_and_accept_connections(server_socket);
+    // Writes to peers that went away are reported as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
-    close(server_socket);
+    // Start listening to the server sockets
+    listen_and_accept_connections();
 
     return EXIT_FAILURE;
 }
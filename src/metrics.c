@@ -0,0 +1,329 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUTE_BUCKETS 1024
+#define LATENCY_FIRST_EXPONENT 7    // The first exported bucket is 128 us
+
+typedef struct {
+    _Alignas(64) atomic_uint_least64_t counters[GLOBAL_COUNTERS];
+} GlobalSlot;
+
+struct RouteMetrics {
+    char* route;
+    _Atomic(RouteSlot*) slots[METRICS_MAX_THREADS];
+    struct RouteMetrics* next;      // In its bucket
+    struct RouteMetrics* next_all;  // In creation order
+};
+
+static struct {
+    pthread_mutex_t mutex;          // Only guards creating routes, never taken while recording
+    RouteMetrics* buckets[ROUTE_BUCKETS];
+    _Atomic(RouteMetrics*) all;
+    _Atomic(GlobalSlot*) global[METRICS_MAX_THREADS];
+    atomic_uint threads;
+} metrics = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread int thread_index = -1;
+static __thread GlobalSlot* global_slot = NULL;
+
+static const char* const error_kinds[] = { "resolve", "connect", "no_backend" };
+
+static size_t hash_route(const char* route) {
+    size_t hash = 2166136261u;
+    for (; *route != '\0'; ++route) {
+        hash = (hash ^ (unsigned char)*route) * 16777619u;
+    }
+    return hash % ROUTE_BUCKETS;
+}
+
+static size_t current_thread() {
+    if (thread_index == -1) {
+        thread_index = atomic_fetch_add_explicit(&metrics.threads, 1, memory_order_relaxed) % METRICS_MAX_THREADS;
+    }
+    return thread_index;
+}
+
+// Threads racing for a shared slot all end up with the same one, the losers free theirs
+static void* claim_slot(_Atomic(void*)* slot, size_t size) {
+    void* current = atomic_load_explicit(slot, memory_order_acquire);
+    if (current != NULL) {
+        return current;
+    }
+
+    void* fresh = aligned_alloc(64, size);
+    if (fresh == NULL) {
+        return NULL;
+    }
+    memset(fresh, 0, size);
+
+    if (!atomic_compare_exchange_strong_explicit(slot, &current, fresh, memory_order_acq_rel, memory_order_acquire)) {
+        free(fresh);
+        return current;
+    }
+    return fresh;
+}
+
+RouteMetrics* metrics_route(const char* route) {
+    size_t bucket = hash_route(route);
+
+    pthread_mutex_lock(&metrics.mutex);
+    RouteMetrics* found = metrics.buckets[bucket];
+    while (found != NULL && strcmp(found->route, route) != 0) {
+        found = found->next;
+    }
+
+    if (found == NULL) {
+        found = calloc(1, sizeof(RouteMetrics));
+        if (found != NULL && (found->route = strdup(route)) == NULL) {
+            free(found);
+            found = NULL;
+        }
+        if (found != NULL) {
+            found->next = metrics.buckets[bucket];
+            metrics.buckets[bucket] = found;
+            found->next_all = atomic_load_explicit(&metrics.all, memory_order_relaxed);
+            atomic_store_explicit(&metrics.all, found, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&metrics.mutex);
+
+    return found;
+}
+
+RouteSlot* metrics_route_slot(RouteMetrics* metrics) {
+    if (metrics == NULL) {
+        return NULL;
+    }
+    return claim_slot((_Atomic(void*)*)&metrics->slots[current_thread()], sizeof(RouteSlot));
+}
+
+size_t metrics_latency_bucket(uint64_t microseconds) {
+    if (microseconds < 16) {
+        return microseconds;
+    }
+    if (microseconds >= 1ULL << METRICS_LATENCY_MAX_EXPONENT) {
+        return METRICS_LATENCY_BUCKETS - 1;
+    }
+
+    size_t exponent = 63 - __builtin_clzll(microseconds);
+    size_t sub = (microseconds >> (exponent - 3)) & (METRICS_LATENCY_SUB_BUCKETS - 1);
+    return 16 + (exponent - 4) * METRICS_LATENCY_SUB_BUCKETS + sub;
+}
+
+void metrics_add(enum GlobalCounter counter, uint64_t value) {
+    if (global_slot == NULL) {
+        global_slot = claim_slot((_Atomic(void*)*)&metrics.global[current_thread()], sizeof(GlobalSlot));
+        if (global_slot == NULL) {
+            return;
+        }
+    }
+    atomic_fetch_add_explicit(&global_slot->counters[counter], value, memory_order_relaxed);
+}
+
+// Route names come from servers.conf, label values must not break out of their quotes
+static void write_label(FILE* out, const char* value) {
+    for (; *value != '\0'; ++value) {
+        if (*value == '\\' || *value == '"') {
+            fputc('\\', out);
+            fputc(*value, out);
+        } else if (*value == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*value, out);
+        }
+    }
+}
+
+#define EXPORTED_BUCKETS (METRICS_LATENCY_MAX_EXPONENT - LATENCY_FIRST_EXPONENT + 2)
+
+// One route summed over every thread, with the latencies folded into one bucket per power of two
+typedef struct {
+    const char* route;
+    uint64_t counters[ROUTE_COUNTERS];
+    uint64_t latency[EXPORTED_BUCKETS]; // Cumulative, the last one is +Inf
+    uint64_t latency_sum_us;
+} RouteTotals;
+
+static void sum_route(const RouteMetrics* route, RouteTotals* totals) {
+    uint64_t latency[METRICS_LATENCY_BUCKETS] = {0};
+    memset(totals, 0, sizeof(*totals));
+    totals->route = route->route;
+
+    for (size_t thread = 0; thread < METRICS_MAX_THREADS; ++thread) {
+        RouteSlot* slot = atomic_load_explicit(&route->slots[thread], memory_order_acquire);
+        if (slot == NULL) {
+            continue;
+        }
+        for (size_t i = 0; i < ROUTE_COUNTERS; ++i) {
+            totals->counters[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+        }
+        for (size_t i = 0; i < METRICS_LATENCY_BUCKETS; ++i) {
+            latency[i] += atomic_load_explicit(&slot->latency[i], memory_order_relaxed);
+        }
+        totals->latency_sum_us += atomic_load_explicit(&slot->latency_sum_us, memory_order_relaxed);
+    }
+
+    // Powers of two are bucket bounds, values below 2^n sit in the buckets before the one 2^n lands in
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (size_t i = 0; i < EXPORTED_BUCKETS; ++i) {
+        size_t exponent = LATENCY_FIRST_EXPONENT + i;
+        size_t end = exponent < METRICS_LATENCY_MAX_EXPONENT ? metrics_latency_bucket(1ULL << exponent) : METRICS_LATENCY_BUCKETS;
+        for (; bucket < end; ++bucket) {
+            cumulative += latency[bucket];
+        }
+        totals->latency[i] = cumulative;
+    }
+}
+
+static void write_route_line(FILE* out, const char* name, const RouteTotals* totals, const char* labels, uint64_t value) {
+    fprintf(out, "%s{route=\"", name);
+    write_label(out, totals->route);
+    fprintf(out, "\"%s} %llu\n", labels, (unsigned long long)value);
+}
+
+static void write_family(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void sum_global(uint64_t* global) {
+    for (size_t thread = 0; thread < METRICS_MAX_THREADS; ++thread) {
+        GlobalSlot* slot = atomic_load_explicit(&metrics.global[thread], memory_order_acquire);
+        for (size_t i = 0; slot != NULL && i < GLOBAL_COUNTERS; ++i) {
+            global[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t metrics_connections_active() {
+    uint64_t global[GLOBAL_COUNTERS] = {0};
+    sum_global(global);
+    return global[GLOBAL_ACCEPTED] > global[GLOBAL_CLOSED] ? global[GLOBAL_ACCEPTED] - global[GLOBAL_CLOSED] : 0;
+}
+
+void metrics_render(FILE* out) {
+    uint64_t global[GLOBAL_COUNTERS] = {0};
+    sum_global(global);
+
+    // Closes are counted after the accepts they follow, but another thread's may be seen first
+    uint64_t accepted = global[GLOBAL_ACCEPTED];
+    uint64_t closed = global[GLOBAL_CLOSED];
+
+    write_family(out, "mcproxy_connections_accepted_total", "counter", "Client connections accepted.");
+    fprintf(out, "mcproxy_connections_accepted_total %llu\n", (unsigned long long)accepted);
+    write_family(out, "mcproxy_connections_active", "gauge", "Client connections open right now.");
+    fprintf(out, "mcproxy_connections_active %llu\n", (unsigned long long)(accepted > closed ? accepted - closed : 0));
+    write_family(out, "mcproxy_client_errors_total", "counter", "Connections closed before they could be routed.");
+    fprintf(out, "mcproxy_client_errors_total{kind=\"malformed\"} %llu\n", (unsigned long long)global[GLOBAL_ERROR_MALFORMED]);
+    fprintf(out, "mcproxy_client_errors_total{kind=\"unknown_route\"} %llu\n", (unsigned long long)global[GLOBAL_ERROR_UNKNOWN_ROUTE]);
+    fprintf(out, "mcproxy_client_errors_total{kind=\"handshake_timeout\"} %llu\n", (unsigned long long)global[GLOBAL_HANDSHAKE_TIMEOUTS]);
+    write_family(out, "mcproxy_connections_rejected_total", "counter", "Connections closed right after accept, by reason.");
+    fprintf(out, "mcproxy_connections_rejected_total{reason=\"rate\"} %llu\n", (unsigned long long)global[GLOBAL_REJECTED_RATE]);
+    fprintf(out, "mcproxy_connections_rejected_total{reason=\"handshakes\"} %llu\n", (unsigned long long)global[GLOBAL_REJECTED_HANDSHAKES]);
+    write_family(out, "mcproxy_timeouts_total", "counter", "Connections whose deadline passed, by the deadline.");
+    fprintf(out, "mcproxy_timeouts_total{reason=\"handshake\"} %llu\n", (unsigned long long)global[GLOBAL_HANDSHAKE_TIMEOUTS]);
+    fprintf(out, "mcproxy_timeouts_total{reason=\"connect\"} %llu\n", (unsigned long long)global[GLOBAL_CONNECT_TIMEOUTS]);
+    fprintf(out, "mcproxy_timeouts_total{reason=\"idle\"} %llu\n", (unsigned long long)global[GLOBAL_IDLE_TIMEOUTS]);
+    write_family(out, "mcproxy_shaping_queued_total", "counter", "Sessions queued for bandwidth, by the bucket that ran dry.");
+    fprintf(out, "mcproxy_shaping_queued_total{scope=\"session\"} %llu\n", (unsigned long long)global[GLOBAL_SHAPING_QUEUED_SESSION]);
+    fprintf(out, "mcproxy_shaping_queued_total{scope=\"route\"} %llu\n", (unsigned long long)global[GLOBAL_SHAPING_QUEUED_ROUTE]);
+    fprintf(out, "mcproxy_shaping_queued_total{scope=\"global\"} %llu\n", (unsigned long long)global[GLOBAL_SHAPING_QUEUED_GLOBAL]);
+    write_family(out, "mcproxy_shaping_interactive_total", "counter", "Small reads let past an empty route or global bucket.");
+    fprintf(out, "mcproxy_shaping_interactive_total %llu\n", (unsigned long long)global[GLOBAL_SHAPING_INTERACTIVE]);
+    write_family(out, "mcproxy_sockmap_sessions_total", "counter", "Sessions handed to the kernel after the handshake, and the ones it refused.");
+    fprintf(out, "mcproxy_sockmap_sessions_total{result=\"offloaded\"} %llu\n", (unsigned long long)global[GLOBAL_SOCKMAP_OFFLOADED]);
+    fprintf(out, "mcproxy_sockmap_sessions_total{result=\"refused\"} %llu\n", (unsigned long long)global[GLOBAL_SOCKMAP_REFUSED]);
+
+    // Routes are summed once, a family's lines have to stay together
+    size_t count = 0;
+    RouteMetrics* first = atomic_load_explicit(&metrics.all, memory_order_acquire);
+    for (RouteMetrics* route = first; route != NULL; route = route->next_all) {
+        ++count;
+    }
+
+    RouteTotals* totals = calloc(count > 0 ? count : 1, sizeof(RouteTotals));
+    if (totals == NULL) {
+        perror("Error allocating metrics");
+        return;
+    }
+    size_t index = 0;
+    for (RouteMetrics* route = first; index < count; route = route->next_all) {
+        sum_route(route, &totals[index++]);
+    }
+
+    write_family(out, "mcproxy_route_sessions_total", "counter", "Connections routed by the entry.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_sessions_total", &totals[i], "", totals[i].counters[ROUTE_SESSIONS]);
+    }
+
+    write_family(out, "mcproxy_route_sessions_active", "gauge", "Routed connections open right now.");
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t sessions = totals[i].counters[ROUTE_SESSIONS];
+        uint64_t ended = totals[i].counters[ROUTE_SESSIONS_CLOSED];
+        write_route_line(out, "mcproxy_route_sessions_active", &totals[i], "", sessions > ended ? sessions - ended : 0);
+    }
+
+    write_family(out, "mcproxy_route_bytes_total", "counter", "Bytes forwarded, handshakes included.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_bytes_total", &totals[i], ",direction=\"from_client\"", totals[i].counters[ROUTE_BYTES_FROM_CLIENT]);
+        write_route_line(out, "mcproxy_route_bytes_total", &totals[i], ",direction=\"to_client\"", totals[i].counters[ROUTE_BYTES_TO_CLIENT]);
+    }
+
+    write_family(out, "mcproxy_route_dns_lookups_total", "counter", "Backend addresses looked up in the DNS cache.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_dns_lookups_total", &totals[i], ",result=\"hit\"", totals[i].counters[ROUTE_DNS_HITS]);
+        write_route_line(out, "mcproxy_route_dns_lookups_total", &totals[i], ",result=\"miss\"", totals[i].counters[ROUTE_DNS_MISSES]);
+    }
+
+    write_family(out, "mcproxy_route_status_cached_total", "counter", "Pings answered by the status cache.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_status_cached_total", &totals[i], "", totals[i].counters[ROUTE_STATUS_CACHED]);
+    }
+
+    write_family(out, "mcproxy_route_errors_total", "counter", "Failed attempts to reach a backend.");
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t kind = 0; kind < sizeof(error_kinds) / sizeof(error_kinds[0]); ++kind) {
+            char labels[32];
+            snprintf(labels, sizeof(labels), ",kind=\"%s\"", error_kinds[kind]);
+            write_route_line(out, "mcproxy_route_errors_total", &totals[i], labels, totals[i].counters[ROUTE_ERROR_RESOLVE + kind]);
+        }
+    }
+
+    write_family(out, "mcproxy_route_shaping_queued_total", "counter", "Sessions of the route queued for bandwidth.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_shaping_queued_total", &totals[i], "", totals[i].counters[ROUTE_SHAPING_QUEUED]);
+    }
+
+    write_family(out, "mcproxy_route_timeouts_total", "counter", "Backend connects and sessions of the route that timed out.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_timeouts_total", &totals[i], ",reason=\"connect\"", totals[i].counters[ROUTE_TIMEOUT_CONNECT]);
+        write_route_line(out, "mcproxy_route_timeouts_total", &totals[i], ",reason=\"idle\"", totals[i].counters[ROUTE_TIMEOUT_IDLE]);
+    }
+
+    write_family(out, "mcproxy_route_drained_total", "counter", "Logins turned away while the route was drained.");
+    for (size_t i = 0; i < count; ++i) {
+        write_route_line(out, "mcproxy_route_drained_total", &totals[i], "", totals[i].counters[ROUTE_DRAINED]);
+    }
+
+    write_family(out, "mcproxy_route_connect_seconds", "histogram", "Time from the complete handshake to the connected backend.");
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t bucket = 0; bucket < EXPORTED_BUCKETS; ++bucket) {
+            char labels[32];
+            if (bucket == EXPORTED_BUCKETS - 1) {
+                snprintf(labels, sizeof(labels), ",le=\"+Inf\"");
+            } else {
+                snprintf(labels, sizeof(labels), ",le=\"%.9g\"", (double)(1ULL << (LATENCY_FIRST_EXPONENT + bucket)) / 1000000);
+            }
+            write_route_line(out, "mcproxy_route_connect_seconds_bucket", &totals[i], labels, totals[i].latency[bucket]);
+        }
+        fprintf(out, "mcproxy_route_connect_seconds_sum{route=\"");
+        write_label(out, totals[i].route);
+        fprintf(out, "\"} %.6f\n", totals[i].latency_sum_us / 1000000.0);
+        write_route_line(out, "mcproxy_route_connect_seconds_count", &totals[i], "", totals[i].latency[EXPORTED_BUCKETS - 1]);
+    }
+
+    free(totals);
+}
@@ -0,0 +1,96 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Connect latencies are kept in log-linear buckets: exact below 16 us, then 8 buckets per power of two
+// up to 2^26 us (67 s), so any recorded value is off by at most 12.5%
+#define METRICS_LATENCY_SUB_BUCKETS 8
+#define METRICS_LATENCY_MAX_EXPONENT 26
+#define METRICS_LATENCY_BUCKETS (16 + (METRICS_LATENCY_MAX_EXPONENT - 4) * METRICS_LATENCY_SUB_BUCKETS)
+
+// Threads get their own slots up to this many, any further ones share them
+#define METRICS_MAX_THREADS 256
+
+enum RouteCounter {
+    ROUTE_SESSIONS,             // Connections routed by this entry
+    ROUTE_SESSIONS_CLOSED,
+    ROUTE_BYTES_FROM_CLIENT,
+    ROUTE_BYTES_TO_CLIENT,
+    ROUTE_DNS_HITS,             // Backend addresses found in the DNS cache, IP addresses included
+    ROUTE_DNS_MISSES,           // Backend hostnames that went to the resolver
+    ROUTE_STATUS_CACHED,        // Pings answered by the status cache
+    ROUTE_ERROR_RESOLVE,
+    ROUTE_ERROR_CONNECT,
+    ROUTE_ERROR_NO_BACKEND,     // Every backend of the route failed or is down
+    ROUTE_SHAPING_QUEUED,       // Sessions queued for bandwidth, by any of their buckets
+    ROUTE_TIMEOUT_CONNECT,      // Backends that didn't accept within connect_timeout_ms
+    ROUTE_TIMEOUT_IDLE,         // Sessions closed after idle_timeout_s without traffic
+    ROUTE_DRAINED,              // Logins turned away while the route was drained from the admin socket
+    ROUTE_COUNTERS
+};
+
+enum GlobalCounter {
+    GLOBAL_ACCEPTED,
+    GLOBAL_CLOSED,
+    GLOBAL_ERROR_MALFORMED,     // Handshakes and pings that broke the protocol
+    GLOBAL_ERROR_UNKNOWN_ROUTE,
+    GLOBAL_REJECTED_RATE,       // Closed right after accept, before anything was allocated for them
+    GLOBAL_REJECTED_HANDSHAKES,
+    GLOBAL_HANDSHAKE_TIMEOUTS,
+    GLOBAL_CONNECT_TIMEOUTS,
+    GLOBAL_IDLE_TIMEOUTS,
+    GLOBAL_SHAPING_QUEUED_SESSION, // Sessions queued for bandwidth, by the bucket that ran dry
+    GLOBAL_SHAPING_QUEUED_ROUTE,
+    GLOBAL_SHAPING_QUEUED_GLOBAL,
+    GLOBAL_SHAPING_INTERACTIVE, // Small reads let past an empty route or global bucket
+    GLOBAL_SOCKMAP_OFFLOADED,   // Sessions the kernel forwarded after the handshake
+    GLOBAL_SOCKMAP_REFUSED,     // Sessions that stayed in userspace because the sockmap refused them
+    GLOBAL_COUNTERS
+};
+
+// One thread's numbers for one route. Only summed up when the metrics are read,
+// a line of its own keeps threads from bouncing each other's cache lines
+typedef struct {
+    _Alignas(64) atomic_uint_least64_t counters[ROUTE_COUNTERS];
+    atomic_uint_least64_t latency[METRICS_LATENCY_BUCKETS];
+    atomic_uint_least64_t latency_sum_us;
+} RouteSlot;
+
+typedef struct RouteMetrics RouteMetrics;
+
+// The route's metrics, created on first use and kept for the life of the process, so counters
+// carry on across reloads. Takes a lock, callers keep the result instead of asking per sample
+RouteMetrics* metrics_route(const char* route);
+// The calling thread's slot of the route, NULL if it couldn't be allocated. Recording into it never locks
+RouteSlot* metrics_route_slot(RouteMetrics* metrics);
+
+size_t metrics_latency_bucket(uint64_t microseconds);
+
+static inline void metrics_route_add(RouteSlot* slot, enum RouteCounter counter, uint64_t value) {
+    if (slot != NULL) {
+        atomic_fetch_add_explicit(&slot->counters[counter], value, memory_order_relaxed);
+    }
+}
+
+static inline void metrics_route_latency(RouteSlot* slot, uint64_t microseconds) {
+    if (slot != NULL) {
+        atomic_fetch_add_explicit(&slot->latency[metrics_latency_bucket(microseconds)], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&slot->latency_sum_us, microseconds, memory_order_relaxed);
+    }
+}
+
+void metrics_add(enum GlobalCounter counter, uint64_t value);
+
+// Client connections accepted and not closed yet, summed over every thread
+uint64_t metrics_connections_active();
+
+// Writes every route's and the global numbers in the Prometheus text format
+void metrics_render(FILE* out);
+
+#endif // METRICS_H
@@ -1,71 +1,239 @@
 #include "packet-tools.h"
 
-#define STATE_LOGIN 0x02
+#include <endian.h>
 
-ssize_t parseVarInt(char* buffer, ssize_t* cursor) {
-    size_t position = 0;
-    int value = 0;
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
-    while (1) {
-        char byte = buffer[(*cursor)++];
+#define PACKET_MAX_LENGTH 2097151   // Serverbound packet lengths are at most 3 byte VarInts
+#define ADDRESS_MAX_LENGTH 1024     // 255 characters, plus what Forge and BungeeCord forwarding append
 
-        value |= (byte & 0x7F) << (position);
+// One byte at a time, for the last few bytes of a buffer
+static ssize_t varint_decode_short(const uint8_t* bytes, size_t length, int32_t* value) {
+    uint32_t result = 0;
 
-        if ((byte & 0x80) != 0x80) {
-            break;
+    for (size_t i = 0; i < VARINT_MAX_BYTES; ++i) {
+        if (i >= length) {
+            return 0;
         }
 
-        position += 7;
+        result |= (uint32_t)(bytes[i] & 0x7F) << (7 * i);
 
-        if (position > 32) {
-            return -1;
-        } 
+        if ((bytes[i] & 0x80) == 0) {
+            *value = (int32_t)result;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+ssize_t varint_decode(const char* buffer, size_t length, int32_t* value) {
+    const uint8_t* bytes = (const uint8_t*)buffer;
+
+    // Packet ids and most lengths fit in one byte
+    if (length > 0 && bytes[0] < 0x80) {
+        *value = bytes[0];
+        return 1;
+    }
+
+    if (length < VARINT_MAX_BYTES) {
+        return varint_decode_short(bytes, length, value);
+    }
+
+    // All five bytes a VarInt may span are there: find the terminating byte from the cleared
+    // continuation bits and gather the 7 bit groups without a branch per byte
+    uint32_t low;
+    memcpy(&low, bytes, sizeof(low));
+    uint64_t word = le32toh(low) | (uint64_t)bytes[4] << 32;
+
+    uint64_t stops = ~word & 0x8080808080ULL;
+    if (stops == 0) {
+        return -1;
+    }
+
+    unsigned size = (__builtin_ctzll(stops) >> 3) + 1;
+    word &= ~0ULL >> (64 - 8 * size);
+
+#ifdef __BMI2__
+    *value = (int32_t)(uint32_t)_pext_u64(word, 0x7F7F7F7F7FULL);
+#else
+    *value = (int32_t)(uint32_t)((word & 0x7F) | ((word >> 1) & 0x3F80) | ((word >> 2) & 0x1FC000) |
+                                 ((word >> 3) & 0xFE00000) | ((word >> 4) & 0xF0000000));
+#endif
+    return size;
+}
+
+void packet_decoder_init(PacketDecoder* decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->phase = PACKET_PHASE_HANDSHAKE;
+}
+
+// Finds the packet starting at position, [body, end) is its id and fields
+static enum PacketStatus frame_packet(const char* buffer, size_t length, size_t position, size_t* body, size_t* end) {
+    int32_t packet_length;
+    ssize_t header = varint_decode(buffer + position, length - position, &packet_length);
+
+    if (header < 0) {
+        return PACKET_MALFORMED;
+    }
+    if (header == 0) {
+        return PACKET_NEED_MORE;
+    }
+    if (packet_length <= 0 || packet_length > PACKET_MAX_LENGTH) {
+        return PACKET_MALFORMED;
+    }
+    if (length - position - header < (size_t)packet_length) {
+        return PACKET_NEED_MORE;
+    }
+
+    *body = position + header;
+    *end = *body + packet_length;
+    return PACKET_READY;
+}
+
+// Fields never continue past their packet, running out of bytes inside one is an error
+static int read_varint(const char* buffer, size_t* cursor, size_t end, int32_t* value) {
+    ssize_t size = varint_decode(buffer + *cursor, end - *cursor, value);
+    if (size <= 0) {
+        return -1;
     }
-    
-    return value;
+    *cursor += size;
+    return 0;
 }
 
-void parseHandshakePacket(char* buffer, char* server_address) {
-    size_t cursor = 0;
-    ssize_t packet_length = parseVarInt(buffer, &cursor);
-    
-    if (cursor < 1) {
-        return;
+static int read_string(const char* buffer, size_t* cursor, size_t end, size_t max_length, PacketSlice* slice) {
+    int32_t length;
+    if (read_varint(buffer, cursor, end, &length) < 0 || length <= 0 || (size_t)length > max_length || (size_t)length > end - *cursor) {
+        return -1;
     }
 
-    char packet_id = buffer[cursor++];
+    slice->offset = *cursor;
+    slice->length = length;
+    *cursor += length;
+    return 0;
+}
 
-    if (packet_id != 0x0) {
-        return;
+static enum PacketStatus decode_handshake(PacketDecoder* decoder, const char* buffer, size_t cursor, size_t end) {
+    int32_t packet_id;
+    if (read_varint(buffer, &cursor, end, &packet_id) < 0 || packet_id != 0x00) {
+        return PACKET_MALFORMED;
     }
 
-    int version = parseVarInt(buffer, &cursor);
+    if (read_varint(buffer, &cursor, end, &decoder->protocol_version) < 0 ||
+        read_string(buffer, &cursor, end, ADDRESS_MAX_LENGTH, &decoder->server_address) < 0 ||
+        end - cursor < 2) {
+        return PACKET_MALFORMED;
+    }
 
-    ssize_t address_length = parseVarInt(buffer, &cursor);
+    decoder->server_port = (uint16_t)((uint8_t)buffer[cursor] << 8 | (uint8_t)buffer[cursor + 1]);
+    cursor += 2;
 
-    if (address_length >= 256 || address_length < 1) {
-        return;
+    if (read_varint(buffer, &cursor, end, &decoder->next_state) < 0) {
+        return PACKET_MALFORMED;
     }
 
-    memcpy(server_address, buffer + cursor, address_length);
-    server_address[address_length] = '\0';
+    switch (decoder->next_state) {
+        case PACKET_STATE_STATUS:
+            decoder->phase = PACKET_PHASE_DONE;
+            return PACKET_READY;
+        case PACKET_STATE_LOGIN:
+        case PACKET_STATE_TRANSFER:
+            decoder->phase = PACKET_PHASE_LOGIN_START;
+            return PACKET_READY;
+        default:
+            return PACKET_MALFORMED;
+    }
 }
 
-int parseLoginPacket(char* buffer, char* username) {
-    size_t payload_len = buffer[0];
-    int state = buffer[payload_len];
+// Only the name is needed, the UUID after it changed shape between versions
+static enum PacketStatus decode_login_start(PacketDecoder* decoder, const char* buffer, size_t cursor, size_t end) {
+    int32_t packet_id;
+    if (read_varint(buffer, &cursor, end, &packet_id) < 0 || packet_id != 0x00 ||
+        read_string(buffer, &cursor, end, end - cursor, &decoder->username) < 0) {
+        return PACKET_MALFORMED;
+    }
 
-    if (state == STATE_LOGIN) {
-        size_t username_len = buffer[payload_len + 3];
+    decoder->phase = PACKET_PHASE_DONE;
+    return PACKET_READY;
+}
 
-        if (username_len >= 32) {
-            return -1;
+enum PacketStatus packet_decoder_feed(PacketDecoder* decoder, const char* buffer, size_t length) {
+    while (decoder->phase != PACKET_PHASE_DONE) {
+        size_t body, end;
+        enum PacketStatus status = frame_packet(buffer, length, decoder->position, &body, &end);
+        if (status != PACKET_READY) {
+            return status;
         }
 
-        memcpy(username, &buffer[payload_len + 4], username_len);
-        username[username_len] = '\0';
-        return 1;
+        status = decoder->phase == PACKET_PHASE_HANDSHAKE
+            ? decode_handshake(decoder, buffer, body, end)
+            : decode_login_start(decoder, buffer, body, end);
+        if (status != PACKET_READY) {
+            return status;
+        }
+
+        decoder->position = end;
     }
 
-    return 0;
+    return PACKET_READY;
+}
+
+size_t varint_encode(char* buffer, uint32_t value) {
+    size_t length = 0;
+    do {
+        buffer[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buffer[length] |= 0x80;
+        }
+        ++length;
+    } while (value != 0);
+    return length;
+}
+
+size_t status_request_encode(char* buffer, int32_t protocol_version, const char* hostname, unsigned short port) {
+    size_t hostname_length = strlen(hostname);
+    char fields[STATUS_REQUEST_MAX_LENGTH];
+
+    size_t length = varint_encode(fields, protocol_version);
+    length += varint_encode(fields + length, hostname_length);
+    memcpy(fields + length, hostname, hostname_length);
+    length += hostname_length;
+    fields[length++] = port >> 8;
+    fields[length++] = port & 0xFF;
+    length += varint_encode(fields + length, PACKET_STATE_STATUS);
+
+    size_t written = varint_encode(buffer, length + 1);
+    buffer[written++] = 0x00;
+    memcpy(buffer + written, fields, length);
+    written += length;
+
+    // Status Request, an empty packet 0
+    buffer[written++] = 0x01;
+    buffer[written++] = 0x00;
+    return written;
+}
+
+enum PacketStatus status_response_decode(const char* buffer, size_t available, size_t* length) {
+    int32_t packet_length;
+    ssize_t header = varint_decode(buffer, available, &packet_length);
+    if (header < 0 || (header > 0 && (packet_length <= 0 || header + (size_t)packet_length > STATUS_RESPONSE_MAX_LENGTH))) {
+        return PACKET_MALFORMED;
+    }
+    if (header == 0 || available < header + (size_t)packet_length) {
+        return PACKET_NEED_MORE;
+    }
+
+    size_t cursor = header;
+    size_t end = header + packet_length;
+    int32_t packet_id, json_length;
+    if (read_varint(buffer, &cursor, end, &packet_id) < 0 || packet_id != 0x00 ||
+        read_varint(buffer, &cursor, end, &json_length) < 0 || json_length <= 0 || cursor + json_length != end) {
+        return PACKET_MALFORMED;
+    }
+
+    *length = end;
+    return PACKET_READY;
 }
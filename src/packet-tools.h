@@ -1,11 +1,67 @@
 #ifndef PACKET_TOOLS_H
 #define PACKET_TOOLS_H
 
+#define _GNU_SOURCE
+
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 
-ssize_t parseVarInt(char* buffer, ssize_t* cursor);
-void parseHandshakePacket(char* buffer, char* server_address);
-int parseLoginPacket(char* buffer, char* username);
+#define VARINT_MAX_BYTES 5
+#define STATUS_REQUEST_MAX_LENGTH 300   // Handshake with a 255 byte hostname, then the Status Request
+#define STATUS_RESPONSE_MAX_LENGTH 262144 // Favicons make responses large, anything bigger is refused
+
+#define PACKET_STATE_STATUS 1
+#define PACKET_STATE_LOGIN 2
+#define PACKET_STATE_TRANSFER 3     // 1.20.5+, continues with Login Start like a login
+
+enum PacketStatus {
+    PACKET_MALFORMED = -1,
+    PACKET_NEED_MORE = 0,
+    PACKET_READY = 1
+};
+
+// Bytes of a field inside the stream the decoder was fed, nothing is copied out
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} PacketSlice;
+
+enum PacketDecoderPhase {
+    PACKET_PHASE_HANDSHAKE,
+    PACKET_PHASE_LOGIN_START,
+    PACKET_PHASE_DONE
+};
+
+// Frames the Handshake and, for logins, the Login Start packet of a client stream that may arrive
+// in any number of pieces. Feeding it the grown buffer again continues where the last call stopped
+typedef struct {
+    enum PacketDecoderPhase phase;
+    uint32_t position;              // Start of the next packet in the stream
+    int32_t protocol_version;
+    PacketSlice server_address;
+    uint16_t server_port;
+    int32_t next_state;
+    PacketSlice username;           // Only set for logins
+} PacketDecoder;
+
+// Decodes a VarInt without reading past length.
+// Returns the number of bytes it spans, 0 if more bytes are needed, -1 if it is longer than 5 bytes
+ssize_t varint_decode(const char* buffer, size_t length, int32_t* value);
+
+// Encodes the VarInt, buffer must have room for VARINT_MAX_BYTES. Returns the number of bytes written
+size_t varint_encode(char* buffer, uint32_t value);
+
+// Writes what a client sends to ask for the server list entry: a Handshake with next state status and
+// a Status Request. The hostname must be shorter than 256 bytes. Returns the number of bytes written
+size_t status_request_encode(char* buffer, int32_t protocol_version, const char* hostname, unsigned short port);
+
+// Checks the Status Response at the start of the buffer, a packet id 0 and a string filling the packet.
+// On PACKET_READY length is set to the size of the whole packet
+enum PacketStatus status_response_decode(const char* buffer, size_t available, size_t* length);
+
+void packet_decoder_init(PacketDecoder* decoder);
+// buffer holds the stream from its first byte, the bytes seen by earlier calls must be unchanged
+enum PacketStatus packet_decoder_feed(PacketDecoder* decoder, const char* buffer, size_t length);
 
-#endif // PACKET_TOOLS_H
\ No newline at end of file
+#endif // PACKET_TOOLS_H
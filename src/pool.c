@@ -0,0 +1,516 @@
+#include "pool.h"
+#include "config.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define POOL_SHARDS 16              // Must be a power of two
+#define POOL_MAX_SOCKETS 64         // Upper bound for pool_size
+#define MAX_EVENTS 64
+#define TICK_MS 1000                // How often join rates are sampled and sockets retired
+#define CONNECT_TIMEOUT_MS 5000
+#define BACKOFF_MAX_MS 30000        // Longest pause after connects to a backend kept failing
+#define WARM_MS 60000               // A backend keeps one socket for this long after its last join
+#define FORGET_MS 600000            // Pools without a join for this long are freed
+#define REPORT_MS 60000
+
+enum PooledState {
+    POOLED_EMPTY,
+    POOLED_CONNECTING,
+    POOLED_IDLE
+};
+
+struct BackendPool;
+
+typedef struct {
+    struct BackendPool* backend;
+    int fd;
+    enum PooledState state;
+    uint64_t started;               // When connect() was called, in monotonic ms
+} PooledSocket;
+
+typedef struct BackendPool {
+    struct sockaddr_storage address;
+    socklen_t length;
+    uint64_t hash;
+    PooledSocket sockets[POOL_MAX_SOCKETS];
+    size_t idle;
+    size_t connecting;
+    size_t target;                  // Sockets the pool tries to hold
+    size_t joins;                   // Takes since the last tick
+    double rate;                    // Joins per second, smoothed over the last few ticks
+    uint64_t last_join;
+    size_t failures;                // Connects that failed in a row, refilling pauses for a while
+    uint64_t retry_at;
+    struct BackendPool* next;
+} BackendPool;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    BackendPool* backends;
+    PoolStats stats;
+} PoolShard;
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int epoll_fd;
+    int event_fd;                   // Signalled when a take left a pool short, and on shutdown
+    uint64_t next_tick;
+    uint64_t next_report;
+    size_t reported_joins;
+    PoolShard shards[POOL_SHARDS];
+} pools = { .epoll_fd = -1, .event_fd = -1 };
+
+static uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t hash_address(const struct sockaddr* address, socklen_t length) {
+    const unsigned char* bytes = (const unsigned char*)address;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (socklen_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static PoolShard* shard_of(uint64_t hash) {
+    return &pools.shards[hash & (POOL_SHARDS - 1)];
+}
+
+static size_t pool_limit() {
+    return config.pool_size < POOL_MAX_SOCKETS ? config.pool_size : POOL_MAX_SOCKETS;
+}
+
+static void format_address(const BackendPool* backend, char* buffer, size_t length) {
+    const void* address = backend->address.ss_family == AF_INET6
+        ? (const void*)&((const struct sockaddr_in6*)&backend->address)->sin6_addr
+        : (const void*)&((const struct sockaddr_in*)&backend->address)->sin_addr;
+    unsigned short port = ntohs(backend->address.ss_family == AF_INET6
+        ? ((const struct sockaddr_in6*)&backend->address)->sin6_port
+        : ((const struct sockaddr_in*)&backend->address)->sin_port);
+
+    char host[INET6_ADDRSTRLEN] = "?";
+    inet_ntop(backend->address.ss_family, address, host, sizeof(host));
+    snprintf(buffer, length, "%s:%u", host, port);
+}
+
+// Closing the fd also takes it out of the epoll set
+static void socket_discard(BackendPool* backend, PooledSocket* slot) {
+    if (slot->state == POOLED_IDLE) {
+        --backend->idle;
+    } else if (slot->state == POOLED_CONNECTING) {
+        --backend->connecting;
+    }
+    close(slot->fd);
+    slot->fd = -1;
+    slot->state = POOLED_EMPTY;
+}
+
+// Backs off exponentially, a backend that is down shouldn't see a connect every tick
+static void backend_failed(BackendPool* backend, int error, uint64_t now) {
+    ++backend->failures;
+    size_t shift = backend->failures < 6 ? backend->failures - 1 : 5;
+    uint64_t delay = (uint64_t)1000 << shift;
+    backend->retry_at = now + (delay < BACKOFF_MAX_MS ? delay : BACKOFF_MAX_MS);
+
+    if (backend->failures == 1) {
+        char address[INET6_ADDRSTRLEN + 8];
+        format_address(backend, address, sizeof(address));
+        printf("Pooling connections to %s failed: %s\n", address, strerror(error));
+    }
+}
+
+// A pooled socket never receives anything, if it is readable the backend closed it or sent an error
+static int socket_alive(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static BackendPool* backend_create(const struct sockaddr* address, socklen_t length, uint64_t hash) {
+    BackendPool* backend = calloc(1, sizeof(BackendPool));
+    if (backend == NULL) {
+        perror("Error allocating backend pool");
+        return NULL;
+    }
+
+    memcpy(&backend->address, address, length);
+    backend->length = length;
+    backend->hash = hash;
+    for (size_t i = 0; i < POOL_MAX_SOCKETS; ++i) {
+        backend->sockets[i].backend = backend;
+        backend->sockets[i].fd = -1;
+    }
+    return backend;
+}
+
+int pool_take(const struct sockaddr* address, socklen_t length) {
+    if (!pools.running || length > sizeof(struct sockaddr_storage)) {
+        return -1;
+    }
+
+    uint64_t hash = hash_address(address, length);
+    PoolShard* shard = shard_of(hash);
+    int fd = -1;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    BackendPool* backend = shard->backends;
+    while (backend != NULL && (backend->hash != hash || backend->length != length || memcmp(&backend->address, address, length) != 0)) {
+        backend = backend->next;
+    }
+
+    if (backend == NULL) {
+        backend = backend_create(address, length, hash);
+        if (backend == NULL) {
+            pthread_mutex_unlock(&shard->mutex);
+            return -1;
+        }
+        backend->next = shard->backends;
+        shard->backends = backend;
+        ++shard->stats.backends;
+    }
+
+    ++backend->joins;
+    backend->last_join = now_ms();
+
+    // The oldest socket goes first, it is the closest to being retired
+    while (fd == -1 && backend->idle > 0) {
+        PooledSocket* oldest = NULL;
+        for (size_t i = 0; i < POOL_MAX_SOCKETS; ++i) {
+            PooledSocket* slot = &backend->sockets[i];
+            if (slot->state == POOLED_IDLE && (oldest == NULL || slot->started < oldest->started)) {
+                oldest = slot;
+            }
+        }
+
+        if (!socket_alive(oldest->fd)) {
+            socket_discard(backend, oldest);
+            ++shard->stats.dropped;
+            continue;
+        }
+
+        epoll_ctl(pools.epoll_fd, EPOLL_CTL_DEL, oldest->fd, NULL);
+        fd = oldest->fd;
+        oldest->fd = -1;
+        oldest->state = POOLED_EMPTY;
+        --backend->idle;
+    }
+
+    if (fd != -1) {
+        ++shard->stats.hits;
+    } else {
+        ++shard->stats.misses;
+    }
+
+    // A burst raises the target right away instead of at the next tick
+    if (backend->joins > backend->target) {
+        backend->target = backend->joins < pool_limit() ? backend->joins : pool_limit();
+    }
+    int refill = backend->idle + backend->connecting < backend->target;
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (refill) {
+        uint64_t one = 1;
+        if (write(pools.event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Error signalling eventfd");
+        }
+    }
+    return fd;
+}
+
+static ssize_t socket_connect(BackendPool* backend, PooledSocket* slot, uint64_t now) {
+    int fd = socket(backend->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Error creating pooled socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&backend->address, backend->length) < 0 && errno != EINPROGRESS) {
+        backend_failed(backend, errno, now);
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = slot };
+    if (epoll_ctl(pools.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("Error registering pooled socket");
+        close(fd);
+        return -1;
+    }
+
+    slot->fd = fd;
+    slot->state = POOLED_CONNECTING;
+    slot->started = now;
+    ++backend->connecting;
+    return 0;
+}
+
+static void socket_ready(PooledSocket* slot, uint32_t events) {
+    BackendPool* backend = slot->backend;
+    PoolShard* shard = shard_of(backend->hash);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // An empty slot was taken by a worker after the event was reported
+    if (slot->state == POOLED_CONNECTING) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1) {
+            error = errno;
+        }
+
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = slot };
+        if (error == 0 && (events & EPOLLERR) == 0 && epoll_ctl(pools.epoll_fd, EPOLL_CTL_MOD, slot->fd, &event) == 0) {
+            slot->state = POOLED_IDLE;
+            --backend->connecting;
+            ++backend->idle;
+            backend->failures = 0;
+        } else {
+            backend_failed(backend, error != 0 ? error : ECONNREFUSED, now_ms());
+            socket_discard(backend, slot);
+        }
+    } else if (slot->state == POOLED_IDLE) {
+        socket_discard(backend, slot);
+        ++shard->stats.dropped;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// Samples the join rate, retires sockets before the backend would time them out and tops the pool up
+static void backend_maintain(PoolShard* shard, BackendPool* backend, uint64_t now, int tick) {
+    if (tick) {
+        backend->rate = (backend->rate * 3 + backend->joins) / 4;
+        backend->joins = 0;
+
+        // One second worth of joins, and one socket while the backend was joined recently
+        size_t target = (size_t)(backend->rate + 0.999);
+        if (target == 0 && now - backend->last_join < WARM_MS) {
+            target = 1;
+        }
+        backend->target = target < pool_limit() ? target : pool_limit();
+    }
+
+    for (size_t i = 0; i < POOL_MAX_SOCKETS; ++i) {
+        PooledSocket* slot = &backend->sockets[i];
+        if (slot->state == POOLED_IDLE && (now - slot->started >= config.pool_max_age_ms || (tick && backend->idle > backend->target))) {
+            socket_discard(backend, slot);
+            ++shard->stats.dropped;
+        } else if (slot->state == POOLED_CONNECTING && now - slot->started >= CONNECT_TIMEOUT_MS) {
+            backend_failed(backend, ETIMEDOUT, now);
+            socket_discard(backend, slot);
+        }
+    }
+
+    if (now < backend->retry_at) {
+        return;
+    }
+
+    for (size_t i = 0; i < POOL_MAX_SOCKETS && backend->idle + backend->connecting < backend->target; ++i) {
+        if (backend->sockets[i].state == POOLED_EMPTY && socket_connect(backend, &backend->sockets[i], now) < 0) {
+            break;
+        }
+    }
+}
+
+static void maintain(uint64_t now) {
+    int tick = now >= pools.next_tick;
+    if (tick) {
+        pools.next_tick = now + TICK_MS;
+    }
+
+    for (size_t i = 0; i < POOL_SHARDS; ++i) {
+        PoolShard* shard = &pools.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+
+        BackendPool** link = &shard->backends;
+        while (*link != NULL) {
+            BackendPool* backend = *link;
+            backend_maintain(shard, backend, now, tick);
+
+            // Backends that left servers.conf or the DNS answer would otherwise be kept forever
+            if (tick && backend->target == 0 && backend->idle == 0 && backend->connecting == 0 && now - backend->last_join >= FORGET_MS) {
+                *link = backend->next;
+                free(backend);
+                --shard->stats.backends;
+                continue;
+            }
+            link = &backend->next;
+        }
+
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// The hit rate is what pool_size and pool_max_age_ms are tuned by
+static void report(uint64_t now) {
+    if (now < pools.next_report) {
+        return;
+    }
+    pools.next_report = now + REPORT_MS;
+
+    PoolStats stats;
+    pool_stats(&stats);
+    size_t joins = stats.hits + stats.misses;
+    if (joins == pools.reported_joins) {
+        return;
+    }
+    pools.reported_joins = joins;
+
+    char message[256];
+    snprintf(message, sizeof(message), "Backend pool: %zu of %zu joins got a connected socket (%.1f%%), %zu idle sockets to %zu backends",
+             stats.hits, joins, 100.0 * stats.hits / joins, stats.idle, stats.backends);
+    printf("%s\n", message);
+    log_info(message);
+}
+
+static void* pool_run(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&pools.stopping)) {
+        uint64_t now = now_ms();
+        int timeout = pools.next_tick > now ? (int)(pools.next_tick - now) : 0;
+
+        int count = epoll_wait(pools.epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t value;
+                if (read(pools.event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    perror("Error reading eventfd");
+                }
+            } else {
+                socket_ready(events[i].data.ptr, events[i].events);
+            }
+        }
+
+        // Pools are only freed here, after every event of the batch that could point into them
+        now = now_ms();
+        maintain(now);
+        report(now);
+    }
+
+    return NULL;
+}
+
+ssize_t pool_init() {
+    if (pools.running) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < POOL_SHARDS; ++i) {
+        pthread_mutex_init(&pools.shards[i].mutex, NULL);
+    }
+
+    if (config.pool_size == 0) {
+        return 0;
+    }
+
+    atomic_store(&pools.stopping, 0);
+    pools.next_tick = now_ms() + TICK_MS;
+    pools.next_report = now_ms() + REPORT_MS;
+
+    pools.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pools.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pools.epoll_fd == -1 || pools.event_fd == -1) {
+        perror("Error setting up the backend pool");
+        pool_shutdown();
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(pools.epoll_fd, EPOLL_CTL_ADD, pools.event_fd, &event) == -1) {
+        perror("Error setting up the backend pool");
+        pool_shutdown();
+        return -1;
+    }
+
+    // Running before the thread starts, so the first takes already count
+    pools.running = 1;
+    if (pthread_create(&pools.thread, NULL, pool_run, NULL) != 0) {
+        perror("Error starting the backend pool");
+        pools.running = 0;
+        pool_shutdown();
+        return -1;
+    }
+    return 0;
+}
+
+void pool_shutdown() {
+    if (pools.running) {
+        pools.running = 0;
+        atomic_store(&pools.stopping, 1);
+        uint64_t one = 1;
+        if (write(pools.event_fd, &one, sizeof(one)) < 0) {
+            perror("Error signalling eventfd");
+        }
+        pthread_join(pools.thread, NULL);
+    }
+
+    for (size_t i = 0; i < POOL_SHARDS; ++i) {
+        PoolShard* shard = &pools.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        while (shard->backends != NULL) {
+            BackendPool* next = shard->backends->next;
+            for (size_t slot = 0; slot < POOL_MAX_SOCKETS; ++slot) {
+                if (shard->backends->sockets[slot].state != POOLED_EMPTY) {
+                    socket_discard(shard->backends, &shard->backends->sockets[slot]);
+                }
+            }
+            free(shard->backends);
+            shard->backends = next;
+        }
+        memset(&shard->stats, 0, sizeof(shard->stats));
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    if (pools.event_fd != -1) {
+        close(pools.event_fd);
+        pools.event_fd = -1;
+    }
+    if (pools.epoll_fd != -1) {
+        close(pools.epoll_fd);
+        pools.epoll_fd = -1;
+    }
+}
+
+void pool_stats(PoolStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i < POOL_SHARDS; ++i) {
+        PoolShard* shard = &pools.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->backends += shard->stats.backends;
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->dropped += shard->stats.dropped;
+        for (BackendPool* backend = shard->backends; backend != NULL; backend = backend->next) {
+            stats->idle += backend->idle;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+typedef struct {
+    size_t backends;    // Addresses joins have gone to, each with its own pool
+    size_t idle;        // Connected sockets waiting for a join
+    size_t hits;        // Joins that got a connected socket
+    size_t misses;      // Joins that had to connect themselves
+    size_t dropped;     // Pooled sockets closed by the backend or retired before it would time them out
+} PoolStats;
+
+// Starts the thread keeping the pools connected, does nothing with pool_size 0
+ssize_t pool_init();
+void pool_shutdown();
+
+// Never blocks. Returns a socket already connected to the address, non-blocking, or -1 if there is
+// none ready and the caller connects itself. Every call counts towards the join rate pools are sized by
+int pool_take(const struct sockaddr* address, socklen_t length);
+void pool_stats(PoolStats* stats);
+
+#endif // POOL_H
@@ -0,0 +1,175 @@
+#include "profiles.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+const SocketProfile default_socket_profile = {
+    .name = "default",
+    .nodelay = 1,
+    .quickack = PROFILE_UNSET,
+    .fastopen = PROFILE_UNSET,
+    .defer_accept_s = 5,
+    .rcvbuf = PROFILE_UNSET,
+    .sndbuf = PROFILE_UNSET,
+    .notsent_lowat = PROFILE_UNSET,
+    .keepalive_idle_s = PROFILE_UNSET,
+    .keepalive_interval_s = PROFILE_UNSET,
+    .keepalive_count = PROFILE_UNSET,
+};
+
+static const SocketProfile unset_profile = {
+    .nodelay = PROFILE_UNSET,
+    .quickack = PROFILE_UNSET,
+    .fastopen = PROFILE_UNSET,
+    .defer_accept_s = PROFILE_UNSET,
+    .rcvbuf = PROFILE_UNSET,
+    .sndbuf = PROFILE_UNSET,
+    .notsent_lowat = PROFILE_UNSET,
+    .keepalive_idle_s = PROFILE_UNSET,
+    .keepalive_interval_s = PROFILE_UNSET,
+    .keepalive_count = PROFILE_UNSET,
+};
+
+static ssize_t parse_number(const char* value, int32_t* number) {
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || parsed < 0 || parsed > INT32_MAX) {
+        return -1;
+    }
+    *number = parsed;
+    return 0;
+}
+
+static ssize_t parse_switch(const char* value, int8_t* flag) {
+    if (strcmp(value, "on") == 0) {
+        *flag = 1;
+    } else if (strcmp(value, "off") == 0) {
+        *flag = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// "idle,interval,count" in seconds and probes
+static ssize_t parse_keepalive(char* value, SocketProfile* profile) {
+    char* interval = strchr(value, ',');
+    char* count = interval != NULL ? strchr(interval + 1, ',') : NULL;
+    if (count == NULL) {
+        return -1;
+    }
+    *interval++ = '\0';
+    *count++ = '\0';
+    if (parse_number(value, &profile->keepalive_idle_s) < 0 || parse_number(interval, &profile->keepalive_interval_s) < 0 ||
+        parse_number(count, &profile->keepalive_count) < 0 ||
+        profile->keepalive_idle_s == 0 || profile->keepalive_interval_s == 0 || profile->keepalive_count == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t socket_profile_parse(SocketProfile* profile, char* options) {
+    const char* name = profile->name;
+    *profile = unset_profile;
+    profile->name = name;
+
+    for (char* token = strtok(options, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        char* value = strchr(token, '=');
+        if (value == NULL) {
+            printf("Invalid profile option: %s\n", token);
+            return -1;
+        }
+        *value++ = '\0';
+
+        ssize_t result;
+        if (strcmp(token, "nodelay") == 0) {
+            result = parse_switch(value, &profile->nodelay);
+        } else if (strcmp(token, "quickack") == 0) {
+            result = parse_switch(value, &profile->quickack);
+        } else if (strcmp(token, "fastopen") == 0) {
+            result = parse_switch(value, &profile->fastopen);
+        } else if (strcmp(token, "defer_accept_s") == 0) {
+            result = parse_number(value, &profile->defer_accept_s);
+        } else if (strcmp(token, "rcvbuf") == 0) {
+            result = parse_number(value, &profile->rcvbuf);
+        } else if (strcmp(token, "sndbuf") == 0) {
+            result = parse_number(value, &profile->sndbuf);
+        } else if (strcmp(token, "notsent_lowat") == 0) {
+            result = parse_number(value, &profile->notsent_lowat);
+        } else if (strcmp(token, "keepalive") == 0) {
+            result = parse_keepalive(value, profile);
+        } else {
+            printf("Unknown profile option: %s\n", token);
+            return -1;
+        }
+
+        if (result < 0) {
+            printf("Invalid value for profile option %s: %s\n", token, value);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int set_option(int socket, int level, int option, int value) {
+    return setsockopt(socket, level, option, &value, sizeof(value));
+}
+
+// Returns the number of options the kernel refused, and the name of the last one
+static int apply_common(int socket, const SocketProfile* profile, const char** failed) {
+    int failures = 0;
+
+#define APPLY(condition, level, option, value) \
+    if ((condition) && set_option(socket, level, option, value) == -1) { \
+        *failed = #option; \
+        ++failures; \
+    }
+
+    APPLY(profile->nodelay != PROFILE_UNSET, IPPROTO_TCP, TCP_NODELAY, profile->nodelay);
+    APPLY(profile->rcvbuf != PROFILE_UNSET, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf);
+    APPLY(profile->sndbuf != PROFILE_UNSET, SOL_SOCKET, SO_SNDBUF, profile->sndbuf);
+    APPLY(profile->notsent_lowat != PROFILE_UNSET, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notsent_lowat);
+    APPLY(profile->keepalive_idle_s != PROFILE_UNSET, SOL_SOCKET, SO_KEEPALIVE, 1);
+    APPLY(profile->keepalive_idle_s != PROFILE_UNSET, IPPROTO_TCP, TCP_KEEPIDLE, profile->keepalive_idle_s);
+    APPLY(profile->keepalive_idle_s != PROFILE_UNSET, IPPROTO_TCP, TCP_KEEPINTVL, profile->keepalive_interval_s);
+    APPLY(profile->keepalive_idle_s != PROFILE_UNSET, IPPROTO_TCP, TCP_KEEPCNT, profile->keepalive_count);
+
+#undef APPLY
+    return failures;
+}
+
+ssize_t socket_profile_listener(int socket, const SocketProfile* profile) {
+    const char* failed = NULL;
+    int failures = apply_common(socket, profile, &failed);
+
+    if (profile->defer_accept_s != PROFILE_UNSET && set_option(socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept_s) == -1) {
+        failed = "TCP_DEFER_ACCEPT";
+        ++failures;
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "Socket profile %s: ", profile->name);
+        perror(failed);
+        return -1;
+    }
+    return 0;
+}
+
+void socket_profile_client(int socket, const SocketProfile* profile) {
+    const char* failed;
+    apply_common(socket, profile, &failed);
+    if (profile->quickack != PROFILE_UNSET) {
+        set_option(socket, IPPROTO_TCP, TCP_QUICKACK, profile->quickack);
+    }
+}
+
+void socket_profile_backend(int socket, const SocketProfile* profile, int connected) {
+    socket_profile_client(socket, profile);
+    if (!connected && profile->fastopen == 1) {
+        set_option(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+    }
+}
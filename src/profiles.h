@@ -0,0 +1,43 @@
+#ifndef PROFILES_H
+#define PROFILES_H
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROFILE_UNSET -1    // Leaves the kernel's default, or what the socket inherited from the listener
+
+// TCP options for one kind of traffic, from a "profile <name> key=value ..." line of servers.conf
+typedef struct {
+    const char* name;
+    int8_t nodelay;             // TCP_NODELAY, off lets Nagle hold back small writes
+    int8_t quickack;            // TCP_QUICKACK once the socket is set up, the kernel may go back to delaying ACKs later
+    int8_t fastopen;            // TCP_FASTOPEN_CONNECT on fresh backend sockets, the handshake rides in the SYN
+    int32_t defer_accept_s;     // TCP_DEFER_ACCEPT on the listener, accept only returns once the client sent something
+    int32_t rcvbuf;             // SO_RCVBUF in bytes, which also turns off the kernel's autotuning
+    int32_t sndbuf;
+    int32_t notsent_lowat;      // TCP_NOTSENT_LOWAT, unsent bytes the kernel queues before the socket stops being writable
+    int32_t keepalive_idle_s;   // SO_KEEPALIVE with TCP_KEEPIDLE, TCP_KEEPINTVL and TCP_KEEPCNT
+    int32_t keepalive_interval_s;
+    int32_t keepalive_count;
+} SocketProfile;
+
+// Used by routes without profile= and the listener without listen_profile, unless servers.conf
+// defines its own "default": Nagle off, accept waits up to 5 s for the client's first bytes, everything
+// else left to the kernel
+extern const SocketProfile default_socket_profile;
+
+// Parses the key=value tokens of a profile line, the options it doesn't name are left unset.
+// The name is kept
+ssize_t socket_profile_parse(SocketProfile* profile, char* options);
+
+// Accepted sockets inherit everything but quickack from the listener. Failures are printed
+ssize_t socket_profile_listener(int socket, const SocketProfile* profile);
+// Once the client is routed, applied on top of what it inherited. Failures are ignored, they would
+// only be printed once per connection
+void socket_profile_client(int socket, const SocketProfile* profile);
+// Before connect() for a fresh socket, or once connected for a pooled one, fastopen then doesn't apply
+void socket_profile_backend(int socket, const SocketProfile* profile, int connected);
+
+#endif // PROFILES_H
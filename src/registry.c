@@ -0,0 +1,274 @@
+#include "registry.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static struct {
+    _Atomic(RegistrySlab*) slabs;
+    atomic_uint_least64_t next_id;
+
+    pthread_mutex_t mutex;          // Guards the drained routes, only taken while one is
+    char drained[REGISTRY_MAX_DRAINED][MAX_HOSTNAME_LENGTH + 1];
+    atomic_size_t drained_count;
+} registry = { .next_id = 1, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static RegistryEntry* entry_at(RegistrySlab* slab, size_t index) {
+    RegistryChunk* chunk = atomic_load_explicit(&slab->chunks[index / REGISTRY_CHUNK], memory_order_acquire);
+    return &chunk->entries[index % REGISTRY_CHUNK];
+}
+
+RegistrySlab* registry_slab(int wake_fd) {
+    RegistrySlab* slab = calloc(1, sizeof(RegistrySlab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->wake_fd = wake_fd;
+
+    slab->next = atomic_load_explicit(&registry.slabs, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&registry.slabs, &slab->next, slab, memory_order_release, memory_order_relaxed)) {
+    }
+    return slab;
+}
+
+// Makes the entry's view odd while it is rewritten, readers that overlap it start over
+static void entry_write_begin(RegistryEntry* entry) {
+    uint64_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+    atomic_store_explicit(&entry->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void entry_write_end(RegistryEntry* entry) {
+    uint64_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+    atomic_store_explicit(&entry->sequence, sequence + 1, memory_order_release);
+}
+
+static void copy_string(char* destination, const char* source, size_t size) {
+    if (source == NULL) {
+        destination[0] = '\0';
+        return;
+    }
+    size_t length = strnlen(source, size - 1);
+    memcpy(destination, source, length);
+    destination[length] = '\0';
+}
+
+RegistryEntry* registry_add(RegistrySlab* slab, void* owner, int client_socket, const Session* session) {
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    RegistryEntry* entry;
+    if (slab->free != 0) {
+        entry = entry_at(slab, slab->free - 1);
+        slab->free = entry->next_free;
+    } else {
+        size_t used = atomic_load_explicit(&slab->used, memory_order_relaxed);
+        if (used == (size_t)REGISTRY_MAX_CHUNKS * REGISTRY_CHUNK) {
+            return NULL;
+        }
+        if (used % REGISTRY_CHUNK == 0) {
+            RegistryChunk* chunk = aligned_alloc(64, sizeof(RegistryChunk));
+            if (chunk == NULL) {
+                return NULL;
+            }
+            memset(chunk, 0, sizeof(*chunk));
+            atomic_store_explicit(&slab->chunks[used / REGISTRY_CHUNK], chunk, memory_order_release);
+        }
+        entry = entry_at(slab, used);
+        entry->index = used;
+        atomic_store_explicit(&slab->used, used + 1, memory_order_release);
+    }
+    entry->owner = owner;
+
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    char client[INET6_ADDRSTRLEN] = "";
+    if (getpeername(client_socket, (struct sockaddr*)&address, &address_length) == 0) {
+        if (address.ss_family == AF_INET6) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6*)&address)->sin6_addr, client, sizeof(client));
+        } else {
+            inet_ntop(AF_INET, &((struct sockaddr_in*)&address)->sin_addr, client, sizeof(client));
+        }
+    }
+
+    entry_write_begin(entry);
+    SessionView* view = &entry->view;
+    view->id = atomic_fetch_add_explicit(&registry.next_id, 1, memory_order_relaxed);
+    view->started = time(NULL);
+    copy_string(view->address, client, sizeof(view->address));
+    copy_string(view->username, session->username, sizeof(view->username));
+    copy_string(view->route, session->entry != NULL ? session->entry->source : session->server_ip_address, sizeof(view->route));
+    copy_string(view->backend, session->resolved_address, sizeof(view->backend));
+    atomic_store_explicit(&entry->from_client, 0, memory_order_relaxed);
+    atomic_store_explicit(&entry->to_client, 0, memory_order_relaxed);
+    atomic_store_explicit(&entry->offloaded, 0, memory_order_relaxed);
+    atomic_store_explicit(&entry->kill, 0, memory_order_relaxed);
+    entry_write_end(entry);
+    return entry;
+}
+
+void registry_remove(RegistrySlab* slab, RegistryEntry* entry) {
+    if (entry == NULL) {
+        return;
+    }
+
+    entry_write_begin(entry);
+    entry->view.id = 0;
+    entry_write_end(entry);
+
+    entry->owner = NULL;
+    entry->next_free = slab->free;
+    slab->free = entry->index + 1;
+}
+
+void* registry_next_kill(RegistrySlab* slab) {
+    // Requests made after the count was reset wake the worker up again
+    if (slab->kill_scan == 0) {
+        if (atomic_exchange_explicit(&slab->kills, 0, memory_order_acquire) == 0) {
+            return NULL;
+        }
+        slab->kill_scan = 1;
+    }
+
+    size_t used = atomic_load_explicit(&slab->used, memory_order_relaxed);
+    for (size_t index = slab->kill_scan - 1; index < used; ++index) {
+        RegistryEntry* entry = entry_at(slab, index);
+        uint64_t kill = atomic_load_explicit(&entry->kill, memory_order_relaxed);
+        if (kill != 0 && kill == entry->view.id) {
+            slab->kill_scan = index + 2;
+            return entry->owner;
+        }
+    }
+
+    slab->kill_scan = 0;
+    return NULL;
+}
+
+void registry_cursor(RegistryCursor* cursor) {
+    cursor->slab = atomic_load_explicit(&registry.slabs, memory_order_acquire);
+    cursor->index = 0;
+}
+
+// Copies the entry out once no rewrite overlapped the copy
+static void entry_read(RegistryEntry* entry, SessionView* view) {
+    for (;;) {
+        uint64_t before = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(view, &entry->view, sizeof(*view));
+        view->from_client = atomic_load_explicit(&entry->from_client, memory_order_relaxed);
+        view->to_client = atomic_load_explicit(&entry->to_client, memory_order_relaxed);
+        view->offloaded = atomic_load_explicit(&entry->offloaded, memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->sequence, memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+int registry_next(RegistryCursor* cursor, SessionView* view) {
+    while (cursor->slab != NULL) {
+        size_t used = atomic_load_explicit(&cursor->slab->used, memory_order_acquire);
+        while (cursor->index < used) {
+            entry_read(entry_at(cursor->slab, cursor->index++), view);
+            if (view->id != 0) {
+                return 1;
+            }
+        }
+        cursor->slab = cursor->slab->next;
+        cursor->index = 0;
+    }
+    return 0;
+}
+
+ssize_t registry_kill(uint64_t id) {
+    for (RegistrySlab* slab = atomic_load_explicit(&registry.slabs, memory_order_acquire); slab != NULL; slab = slab->next) {
+        size_t used = atomic_load_explicit(&slab->used, memory_order_acquire);
+        for (size_t index = 0; index < used; ++index) {
+            RegistryEntry* entry = entry_at(slab, index);
+            SessionView view;
+            entry_read(entry, &view);
+            if (id == 0 || view.id != id) {
+                continue;
+            }
+
+            atomic_store_explicit(&entry->kill, id, memory_order_relaxed);
+            atomic_fetch_add_explicit(&slab->kills, 1, memory_order_release);
+            uint64_t one = 1;
+            if (write(slab->wake_fd, &one, sizeof(one)) < 0) {
+                perror("Error waking a worker");
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+ssize_t registry_drain(const char* route, int drain) {
+    ssize_t result = 0;
+    pthread_mutex_lock(&registry.mutex);
+
+    size_t count = atomic_load_explicit(&registry.drained_count, memory_order_relaxed);
+    size_t found = 0;
+    while (found < count && strcasecmp(registry.drained[found], route) != 0) {
+        ++found;
+    }
+
+    if (drain && found == count) {
+        if (count == REGISTRY_MAX_DRAINED) {
+            result = -1;
+        } else {
+            copy_string(registry.drained[count], route, sizeof(registry.drained[count]));
+            atomic_store_explicit(&registry.drained_count, count + 1, memory_order_relaxed);
+        }
+    } else if (!drain && found < count) {
+        memcpy(registry.drained[found], registry.drained[count - 1], sizeof(registry.drained[found]));
+        atomic_store_explicit(&registry.drained_count, count - 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&registry.mutex);
+    return result;
+}
+
+int registry_draining(const char* route) {
+    // Joins only take the lock while some route is drained
+    if (atomic_load_explicit(&registry.drained_count, memory_order_relaxed) == 0) {
+        return 0;
+    }
+
+    int draining = 0;
+    pthread_mutex_lock(&registry.mutex);
+    size_t count = atomic_load_explicit(&registry.drained_count, memory_order_relaxed);
+    for (size_t i = 0; i < count && !draining; ++i) {
+        draining = strcasecmp(registry.drained[i], route) == 0;
+    }
+    pthread_mutex_unlock(&registry.mutex);
+    return draining;
+}
+
+void registry_drained(char* buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+
+    pthread_mutex_lock(&registry.mutex);
+    size_t count = atomic_load_explicit(&registry.drained_count, memory_order_relaxed);
+    for (size_t i = 0; i < count && length < size; ++i) {
+        int written = snprintf(buffer + length, size - length, "%s\n", registry.drained[i]);
+        if (written < 0) {
+            break;
+        }
+        length += written;
+    }
+    pthread_mutex_unlock(&registry.mutex);
+}
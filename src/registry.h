@@ -0,0 +1,107 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "servers.h"
+#include "session.h"
+
+#define REGISTRY_CHUNK 1024         // Entries allocated at once when a slab runs out
+#define REGISTRY_MAX_CHUNKS 1024    // Sessions past this many on one worker are forwarded but not listed
+#define REGISTRY_MAX_DRAINED 64     // Routes that can be drained at once
+
+// What the admin socket shows of a session, copied out of the registry
+typedef struct {
+    uint64_t id;
+    time_t started;                 // When the backend was connected
+    char address[INET6_ADDRSTRLEN]; // The player's
+    char username[32];
+    char route[MAX_HOSTNAME_LENGTH + 1];
+    char backend[INET6_ADDRSTRLEN];
+    uint64_t from_client;
+    uint64_t to_client;
+    uint8_t offloaded;              // The kernel forwards it, the byte counts stop at the handover
+} SessionView;
+
+// One connected session. The owning worker rewrites the view between bumps of sequence, readers copy
+// it and retry if sequence was odd or changed meanwhile, so neither side ever waits for the other
+typedef struct {
+    atomic_uint_least64_t sequence;
+    SessionView view;               // id 0 while the entry is free
+    atomic_uint_least64_t from_client; // Only written by the owner, any thread may read them
+    atomic_uint_least64_t to_client;
+    atomic_uint offloaded;
+    atomic_uint_least64_t kill;     // id of the session the admin socket wants closed, ignored if it was replaced
+    void* owner;                    // The worker's connection, only touched by the worker
+    uint32_t index;                 // In the slab
+    uint32_t next_free;             // Index of the next free entry plus one, 0 at the end
+} RegistryEntry;
+
+typedef struct {
+    RegistryEntry entries[REGISTRY_CHUNK];
+} RegistryChunk;
+
+// A worker's sessions. Chunks are never freed, readers walk them while the worker reuses entries
+typedef struct RegistrySlab {
+    int wake_fd;                    // Written to when the admin socket asks the worker to close a session
+    _Atomic(RegistryChunk*) chunks[REGISTRY_MAX_CHUNKS];
+    atomic_size_t used;             // Entries handed out at least once, readers stop there
+    uint32_t free;                  // Index of the first free entry plus one, only touched by the worker
+    atomic_uint kills;              // Kill requests since the worker last looked
+    size_t kill_scan;               // Where the worker's look for them resumes plus one, 0 when not looking
+    struct RegistrySlab* next;
+} RegistrySlab;
+
+// Creates the slab of a worker, wake_fd wakes it up to pick up kill requests
+RegistrySlab* registry_slab(int wake_fd);
+
+// Lists a session whose backend just accepted, while it still holds its route. The client socket gives
+// its address, the session the rest. Returns NULL if the slab is full, the session is then forwarded
+// without being listed
+RegistryEntry* registry_add(RegistrySlab* slab, void* owner, int client_socket, const Session* session);
+void registry_remove(RegistrySlab* slab, RegistryEntry* entry);
+
+static inline void registry_count(RegistryEntry* entry, int from_client, uint64_t bytes) {
+    if (entry != NULL) {
+        atomic_uint_least64_t* counter = from_client ? &entry->from_client : &entry->to_client;
+        atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + bytes, memory_order_relaxed);
+    }
+}
+
+static inline void registry_offloaded(RegistryEntry* entry) {
+    if (entry != NULL) {
+        atomic_store_explicit(&entry->offloaded, 1, memory_order_relaxed);
+    }
+}
+
+// The owner of the next session of the slab the admin socket asked to close, NULL once there is
+// none. Only called by the slab's worker, which closes each one before asking for the next
+void* registry_next_kill(RegistrySlab* slab);
+
+// Position of a walk over every listed session
+typedef struct {
+    RegistrySlab* slab;
+    size_t index;
+} RegistryCursor;
+
+void registry_cursor(RegistryCursor* cursor);
+// Copies the next session out, without stopping its worker. Returns 0 once every slab has been walked.
+// Sessions added or removed during the walk may or may not be seen
+int registry_next(RegistryCursor* cursor, SessionView* view);
+// Asks the worker of the session to close it. Returns -1 if there is no such session
+ssize_t registry_kill(uint64_t id);
+
+// Routes being drained turn new logins away, the players already on them stay. Returns -1 if
+// there is no room for another drained route
+ssize_t registry_drain(const char* route, int drain);
+int registry_draining(const char* route);
+// Routes being drained, separated by newlines, into a buffer of the given size
+void registry_drained(char* buffer, size_t size);
+
+#endif // REGISTRY_H
@@ -0,0 +1,184 @@
+#include "reload.h"
+#include "servers.h"
+#include "config.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+// Editors write a file in several steps, changes this close together are folded into one reload
+#define RELOAD_DEBOUNCE_MS 200
+
+typedef struct {
+    char filename[PATH_MAX];
+    const char* basename;       // Points into filename
+    int signal_fd;
+    int inotify_fd;             // -1 unless watch_config is set
+} Reloader;
+
+static Reloader reloader;
+
+ssize_t reload_now(const char* filename) {
+    char message[PATH_MAX + 512]; // Room for the longest filename and numbers
+
+    if (reload_dictionary(filename) != 0) {
+        snprintf(message, sizeof(message), "Reloading %s failed, keeping the current servers", filename);
+        printf("%s\n", message);
+        log_error(message);
+        return -1;
+    }
+
+    RoutesLoadStats stats;
+    routes_load_stats(&stats);
+
+    snprintf(message, sizeof(message), "Reloaded %zu servers from %s in %.2f ms", stats.entries, filename, stats.milliseconds);
+    printf("%s\n", message);
+    log_info(message);
+    return 0;
+}
+
+// Returns 1 if any of the queued events touched the config file
+static int drain_inotify(int inotify_fd, const char* basename) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    for (;;) {
+        ssize_t length = read(inotify_fd, events, sizeof(events));
+        if (length <= 0) {
+            return changed;
+        }
+
+        for (char* cursor = events; cursor < events + length;) {
+            struct inotify_event* event = (struct inotify_event*)cursor;
+            if (event->len > 0 && strcmp(event->name, basename) == 0) {
+                changed = 1;
+            }
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void* reload_thread(void* arg) {
+    Reloader* self = arg;
+    struct pollfd fds[2] = {
+        { .fd = self->signal_fd, .events = POLLIN },
+        { .fd = self->inotify_fd, .events = POLLIN },
+    };
+    nfds_t count = self->inotify_fd >= 0 ? 2 : 1;
+
+    for (;;) {
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return NULL;
+        }
+
+        int reload = 0;
+
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(self->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                reload = 1;
+            }
+        }
+
+        if (count > 1 && (fds[1].revents & POLLIN) && drain_inotify(self->inotify_fd, self->basename)) {
+            // Wait for the writer to settle before reading a half written file
+            while (poll(&fds[1], 1, RELOAD_DEBOUNCE_MS) > 0) {
+                drain_inotify(self->inotify_fd, self->basename);
+            }
+            reload = 1;
+        }
+
+        if (reload) {
+            reload_now(self->filename);
+        }
+    }
+
+    return NULL;
+}
+
+// Watches the directory rather than the file, saving usually replaces the file with a new inode
+static int watch_file(Reloader* self) {
+    char directory[PATH_MAX];
+    strcpy(directory, self->filename);
+
+    char* slash = strrchr(directory, '/');
+    if (slash == NULL) {
+        strcpy(directory, ".");
+    } else if (slash == directory) {
+        slash[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1 failed");
+        return -1;
+    }
+
+    if (inotify_add_watch(inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("inotify_add_watch failed");
+        close(inotify_fd);
+        return -1;
+    }
+
+    return inotify_fd;
+}
+
+ssize_t reload_start(const char* filename) {
+    if (strlen(filename) >= sizeof(reloader.filename)) {
+        printf("Config path too long\n");
+        return -1;
+    }
+
+    strcpy(reloader.filename, filename);
+    const char* slash = strrchr(reloader.filename, '/');
+    reloader.basename = slash ? slash + 1 : reloader.filename;
+    reloader.inotify_fd = -1;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        perror("pthread_sigmask failed");
+        return -1;
+    }
+
+    reloader.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (reloader.signal_fd < 0) {
+        perror("signalfd failed");
+        return -1;
+    }
+
+    // Not fatal, SIGHUP still reloads
+    if (config.watch_config) {
+        reloader.inotify_fd = watch_file(&reloader);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reload_thread, &reloader) != 0) {
+        perror("Error creating the reload thread");
+        close(reloader.signal_fd);
+        if (reloader.inotify_fd >= 0) {
+            close(reloader.inotify_fd);
+        }
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
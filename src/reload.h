@@ -0,0 +1,15 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+// Blocks SIGHUP in the calling thread, call it before starting any other thread so they inherit the mask.
+// A background thread then reloads the file on SIGHUP, and on changes to it when watch_config is set
+ssize_t reload_start(const char* filename);
+
+// Reloads the file right away and reports the outcome, returns 0 if the new servers are live
+ssize_t reload_now(const char* filename);
+
+#endif // RELOAD_H
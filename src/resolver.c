@@ -0,0 +1,857 @@
+#include "resolver.h"
+#include "config.h"
+#include "dns.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#define MC_SRV_PREFIX "_minecraft._tcp."
+#define MAX_EVENTS 64
+#define AAAA_GRACE_MS 50 // How long an IPv4 answer waits for the IPv6 one before going without it
+
+enum QueryResult {
+    QUERY_PENDING,
+    QUERY_FOUND,
+    QUERY_EMPTY,    // The name exists without records of this type, or doesn't exist at all
+    QUERY_FAILED    // No nameserver gave an answer
+};
+
+struct Lookup;
+
+// A single question, asked over UDP and repeated over TCP when the answer doesn't fit in a datagram
+typedef struct {
+    struct Lookup* lookup;
+    char name[NS_MAXDNAME];
+    uint16_t type;
+    uint16_t id;
+    int fd;                         // -1 while no attempt is in flight
+    uint8_t tcp;
+    uint8_t sending;                // TCP: still writing the query
+    size_t attempt;
+    size_t server;
+    uint64_t deadline;
+    uint8_t* stream;                // TCP: the length prefixed query going out, then the answer coming in
+    size_t stream_length;
+    size_t stream_offset;
+    enum QueryResult result;
+    DnsAddress addresses[DNS_MAX_ADDRESSES]; // For SRV, the target's addresses from the additional section
+    size_t count;
+    uint32_t ttl;                   // Lowest TTL of the records taken, or the negative TTL of an empty answer
+    unsigned short port;            // SRV port
+    char target[NS_MAXDNAME];       // SRV target
+} Query;
+
+// Everything in flight for one name. The SRV, A and AAAA queries are sent together, the address
+// answers are only used if there is no SRV record, otherwise the SRV target is looked up instead
+typedef struct Lookup {
+    char name[NS_MAXDNAME];
+    ResolveRequest* waiters;
+    Query srv;
+    Query a;
+    Query aaaa;
+    uint8_t following_srv;          // The address queries ask for the SRV target rather than the name
+    uint8_t done;
+    struct Lookup* next;
+} Lookup;
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int epoll_fd;
+    int event_fd;                   // Signalled for new requests and on shutdown
+    _Atomic(ResolveRequest*) submitted;
+    struct sockaddr_in nameservers[MAXNS];
+    size_t nameserver_count;
+    Lookup* lookups;
+    Lookup* finished;               // Freed after the current batch of events, which may still point at them
+} resolver = { .epoll_fd = -1, .event_fd = -1 };
+
+static uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void push_request(_Atomic(ResolveRequest*)* head, ResolveRequest* request) {
+    ResolveRequest* next = atomic_load_explicit(head, memory_order_relaxed);
+    do {
+        request->next = next;
+    } while (!atomic_compare_exchange_weak_explicit(head, &next, request, memory_order_release, memory_order_relaxed));
+}
+
+static void signal_event(int event_fd) {
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Error signalling eventfd");
+    }
+}
+
+ssize_t resolve_queue_init(ResolveQueue* queue) {
+    atomic_init(&queue->head, NULL);
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd == -1) {
+        perror("Error creating eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+void resolve_queue_destroy(ResolveQueue* queue) {
+    if (queue->event_fd != -1) {
+        close(queue->event_fd);
+        queue->event_fd = -1;
+    }
+}
+
+// Takes every delivered request. The eventfd is reset first, so a request delivered
+// after the swap always leaves it readable again
+ResolveRequest* resolve_queue_take(ResolveQueue* queue) {
+    uint64_t count;
+    if (read(queue->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Error reading eventfd");
+    }
+    return atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+}
+
+socklen_t dns_answer_address(const DnsAnswer* answer, unsigned short port, unsigned char default_port, struct sockaddr_storage* address) {
+    if (answer->count == 0) {
+        return 0;
+    }
+
+    const DnsAddress* first = &answer->addresses[0];
+    if (default_port && answer->port != 0) {
+        port = answer->port;
+    }
+
+    memset(address, 0, sizeof(*address));
+    if (first->family == AF_INET6) {
+        struct sockaddr_in6* v6 = (struct sockaddr_in6*)address;
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        v6->sin6_addr = first->v6;
+        return sizeof(*v6);
+    }
+
+    struct sockaddr_in* v4 = (struct sockaddr_in*)address;
+    v4->sin_family = AF_INET;
+    v4->sin_port = htons(port);
+    v4->sin_addr = first->v4;
+    return sizeof(*v4);
+}
+
+static void deliver(ResolveRequest* request, ssize_t status, const DnsAnswer* answer) {
+    ResolveQueue* queue = request->queue;
+
+    // Refreshes only exist to update the cache
+    if (queue == NULL) {
+        free(request);
+        return;
+    }
+
+    request->status = status;
+    request->answer = *answer;
+    push_request(&queue->head, request);
+    signal_event(queue->event_fd);
+}
+
+static ssize_t encode_query(uint8_t* buffer, size_t size, uint16_t id, const char* name, uint16_t type) {
+    memset(buffer, 0, NS_HFIXEDSZ);
+    HEADER* header = (HEADER*)buffer;
+    header->id = htons(id);
+    header->rd = 1;
+    header->qdcount = htons(1);
+
+    int length = dn_comp(name, buffer + NS_HFIXEDSZ, size - NS_HFIXEDSZ - NS_QFIXEDSZ, NULL, NULL);
+    if (length < 0) {
+        return -1;
+    }
+
+    uint8_t* cursor = buffer + NS_HFIXEDSZ + length;
+    NS_PUT16(type, cursor);
+    NS_PUT16(ns_c_in, cursor);
+    return cursor - buffer;
+}
+
+static void query_close(Query* query) {
+    if (query->fd != -1) {
+        // Closing also drops the fd from the epoll set
+        close(query->fd);
+        query->fd = -1;
+    }
+    free(query->stream);
+    query->stream = NULL;
+}
+
+static uint16_t random_id() {
+    uint16_t id;
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id)) {
+        id = (uint16_t)rand();
+    }
+    return id;
+}
+
+// Sends the question to the current nameserver, over TCP after a truncated answer
+static ssize_t query_send(Query* query) {
+    query_close(query);
+
+    query->id = random_id();
+    query->deadline = now_ms() + config.dns_timeout_ms;
+
+    uint8_t packet[NS_PACKETSZ];
+    ssize_t length = encode_query(packet, sizeof(packet), query->id, query->name, query->type);
+    if (length < 0) {
+        printf("Invalid DNS name %s\n", query->name);
+        return -1;
+    }
+
+    query->fd = socket(AF_INET, (query->tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (query->fd == -1) {
+        perror("Error creating DNS socket");
+        return -1;
+    }
+
+    // A connected UDP socket only accepts datagrams coming back from the nameserver
+    const struct sockaddr_in* nameserver = &resolver.nameservers[query->server];
+    if (connect(query->fd, (const struct sockaddr*)nameserver, sizeof(*nameserver)) < 0 && errno != EINPROGRESS) {
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = query };
+
+    if (query->tcp) {
+        query->stream = malloc(2 + NS_MAXMSG);
+        if (query->stream == NULL) {
+            return -1;
+        }
+        query->stream[0] = length >> 8;
+        query->stream[1] = length & 0xFF;
+        memcpy(query->stream + 2, packet, length);
+        query->stream_length = 2 + length;
+        query->stream_offset = 0;
+        query->sending = 1;
+        event.events = EPOLLOUT;
+    } else if (send(query->fd, packet, length, 0) != length) {
+        return -1;
+    }
+
+    if (epoll_ctl(resolver.epoll_fd, EPOLL_CTL_ADD, query->fd, &event) == -1) {
+        perror("Error registering DNS socket");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void lookup_advance(Lookup* lookup);
+
+static void query_finish(Query* query, enum QueryResult result) {
+    query_close(query);
+    query->result = result;
+    lookup_advance(query->lookup);
+}
+
+// Moves on to the next nameserver, starting over with UDP
+static void query_retry(Query* query) {
+    while (++query->attempt < config.dns_attempts) {
+        query->server = (query->server + 1) % resolver.nameserver_count;
+        query->tcp = 0;
+        if (query_send(query) == 0) {
+            return;
+        }
+    }
+    query_finish(query, QUERY_FAILED);
+}
+
+static void query_begin(Query* query, Lookup* lookup, const char* name, uint16_t type) {
+    query_close(query);
+    memset(query, 0, sizeof(*query));
+    query->fd = -1;
+    query->lookup = lookup;
+    query->type = type;
+    snprintf(query->name, sizeof(query->name), "%s", name);
+
+    // Answers echo the question without the trailing dot
+    size_t length = strlen(query->name);
+    if (length > 1 && query->name[length - 1] == '.') {
+        query->name[length - 1] = '\0';
+    }
+
+    if (query_send(query) < 0) {
+        query_retry(query);
+    }
+}
+
+static void take_ttl(Query* query, uint32_t ttl) {
+    if (query->ttl == 0 || ttl < query->ttl) {
+        query->ttl = ttl;
+    }
+}
+
+// Collects the address records of one section, owner names are checked against name if given
+static void take_addresses(Query* query, ns_msg* msg, ns_sect section, const char* name) {
+    for (int i = 0; i < ns_msg_count(*msg, section) && query->count < DNS_MAX_ADDRESSES; ++i) {
+        ns_rr rr;
+        if (ns_parserr(msg, section, i, &rr) < 0 || ns_rr_class(rr) != ns_c_in ||
+            (name != NULL && strcasecmp(ns_rr_name(rr), name) != 0)) {
+            continue;
+        }
+
+        // Recursive resolvers follow CNAMEs themselves, the addresses are further down the same answer
+        DnsAddress* address = &query->addresses[query->count];
+        if ((query->type == ns_t_a || query->type == ns_t_srv) && ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == 4) {
+            address->family = AF_INET;
+            memcpy(&address->v4, ns_rr_rdata(rr), 4);
+        } else if ((query->type == ns_t_aaaa || query->type == ns_t_srv) && ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == 16) {
+            address->family = AF_INET6;
+            memcpy(&address->v6, ns_rr_rdata(rr), 16);
+        } else {
+            continue;
+        }
+
+        ++query->count;
+        take_ttl(query, ns_rr_ttl(rr));
+    }
+}
+
+// The SOA in the authority section says how long the absence of records may be cached
+static void take_negative_ttl(Query* query, ns_msg* msg) {
+    for (int i = 0; i < ns_msg_count(*msg, ns_s_ns); ++i) {
+        ns_rr rr;
+        if (ns_parserr(msg, ns_s_ns, i, &rr) < 0 || ns_rr_type(rr) != ns_t_soa) {
+            continue;
+        }
+
+        const unsigned char* rdata = ns_rr_rdata(rr);
+        const unsigned char* end = rdata + ns_rr_rdlen(rr);
+        if (ns_name_skip(&rdata, end) == 0 && ns_name_skip(&rdata, end) == 0 && end - rdata >= 20) {
+            uint32_t minimum = ns_get32(rdata + 16);
+            take_ttl(query, minimum < ns_rr_ttl(rr) ? minimum : ns_rr_ttl(rr));
+        }
+        return;
+    }
+}
+
+static void parse_records(Query* query, ns_msg* msg) {
+    if (query->type != ns_t_srv) {
+        take_addresses(query, msg, ns_s_an, NULL);
+        query->result = query->count > 0 ? QUERY_FOUND : QUERY_EMPTY;
+        return;
+    }
+
+    uint16_t best_priority = UINT16_MAX;
+
+    for (int i = 0; i < ns_msg_count(*msg, ns_s_an); ++i) {
+        ns_rr rr;
+        if (ns_parserr(msg, ns_s_an, i, &rr) < 0 || ns_rr_class(rr) != ns_c_in ||
+            ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) <= 6) {
+            continue;
+        }
+
+        uint16_t priority = ns_get16(ns_rr_rdata(rr));
+        char target[NS_MAXDNAME];
+        if (priority >= best_priority ||
+            ns_name_uncompress(ns_msg_base(*msg), ns_msg_end(*msg), ns_rr_rdata(rr) + 6, target, sizeof(target)) < 0) {
+            continue;
+        }
+
+        // A target of "." means the service is explicitly not available
+        if (target[0] == '\0' || strcmp(target, ".") == 0) {
+            continue;
+        }
+
+        best_priority = priority;
+        strcpy(query->target, target);
+        query->port = ns_get16(ns_rr_rdata(rr) + 4);
+        query->ttl = ns_rr_ttl(rr);
+        query->result = QUERY_FOUND;
+    }
+
+    if (query->result != QUERY_FOUND) {
+        query->result = QUERY_EMPTY;
+        return;
+    }
+
+    // Servers often include the target's addresses, which saves a round trip
+    take_addresses(query, msg, ns_s_ar, query->target);
+}
+
+// Returns 0 if the message isn't an answer to the query and should be ignored
+static ssize_t query_answer(Query* query, const uint8_t* message, size_t length) {
+    ns_msg msg;
+    ns_rr question;
+
+    if (ns_initparse(message, length, &msg) < 0 || ns_msg_id(msg) != query->id || !ns_msg_getflag(msg, ns_f_qr) ||
+        ns_parserr(&msg, ns_s_qd, 0, &question) < 0 || ns_rr_type(question) != query->type ||
+        strcasecmp(ns_rr_name(question), query->name) != 0) {
+        return 0;
+    }
+
+    if (ns_msg_getflag(msg, ns_f_tc) && !query->tcp) {
+        // The answer didn't fit, ask the same nameserver again over TCP
+        query->tcp = 1;
+        if (query_send(query) < 0) {
+            query_retry(query);
+        }
+        return 1;
+    }
+
+    switch (ns_msg_getflag(msg, ns_f_rcode)) {
+        case ns_r_noerror:
+            parse_records(query, &msg);
+            if (query->result == QUERY_EMPTY) {
+                take_negative_ttl(query, &msg);
+            }
+            query_finish(query, query->result);
+            break;
+        case ns_r_nxdomain:
+            take_negative_ttl(query, &msg);
+            query_finish(query, QUERY_EMPTY);
+            break;
+        default:
+            // SERVFAIL, REFUSED and friends, another nameserver may do better
+            query_retry(query);
+    }
+    return 1;
+}
+
+static void query_read_udp(Query* query) {
+    uint8_t message[NS_PACKETSZ];
+
+    while (query->fd != -1 && !query->tcp) {
+        ssize_t length = recv(query->fd, message, sizeof(message), 0);
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // ECONNREFUSED: nothing listens on the nameserver's port
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                query_retry(query);
+            }
+            return;
+        }
+
+        if (query_answer(query, message, length)) {
+            return;
+        }
+    }
+}
+
+static void query_stream_tcp(Query* query) {
+    while (query->fd != -1 && query->tcp) {
+        ssize_t bytes;
+        if (query->sending) {
+            bytes = send(query->fd, query->stream + query->stream_offset, query->stream_length - query->stream_offset, MSG_NOSIGNAL);
+        } else {
+            bytes = recv(query->fd, query->stream + query->stream_offset, query->stream_length - query->stream_offset, 0);
+        }
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (bytes <= 0) {
+            query_retry(query);
+            return;
+        }
+
+        query->stream_offset += bytes;
+        if (query->stream_offset < query->stream_length) {
+            continue;
+        }
+
+        if (query->sending) {
+            // The query is out, read the two byte length of the answer
+            query->sending = 0;
+            query->stream_offset = 0;
+            query->stream_length = 2;
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = query };
+            epoll_ctl(resolver.epoll_fd, EPOLL_CTL_MOD, query->fd, &event);
+        } else if (query->stream_length == 2) {
+            query->stream_length = 2 + ((query->stream[0] << 8) | query->stream[1]);
+        } else {
+            if (!query_answer(query, query->stream + 2, query->stream_length - 2)) {
+                query_retry(query);
+            }
+            return;
+        }
+    }
+}
+
+static void lookup_finish(Lookup* lookup, ssize_t status, const DnsAnswer* answer) {
+    lookup->done = 1;
+    query_close(&lookup->srv);
+    query_close(&lookup->a);
+    query_close(&lookup->aaaa);
+
+    for (Lookup** link = &resolver.lookups; *link != NULL; link = &(*link)->next) {
+        if (*link == lookup) {
+            *link = lookup->next;
+            break;
+        }
+    }
+    lookup->next = resolver.finished;
+    resolver.finished = lookup;
+
+    dns_cache_store(lookup->name, status, answer);
+
+    ResolveRequest* request = lookup->waiters;
+    while (request != NULL) {
+        ResolveRequest* next = request->next;
+        deliver(request, status, answer);
+        request = next;
+    }
+    lookup->waiters = NULL;
+}
+
+static void answer_ttl(DnsAnswer* answer, uint32_t ttl) {
+    if (ttl > 0 && (answer->ttl == 0 || ttl < answer->ttl)) {
+        answer->ttl = ttl;
+    }
+}
+
+static void answer_add(DnsAnswer* answer, const Query* query) {
+    if (query->count == 0) {
+        return;
+    }
+    for (size_t i = 0; i < query->count && answer->count < DNS_MAX_ADDRESSES; ++i) {
+        answer->addresses[answer->count++] = query->addresses[i];
+    }
+    answer_ttl(answer, query->ttl);
+}
+
+// Stops waiting for a query beyond a short grace period, it won't be retried anymore
+static void query_expedite(Query* query) {
+    uint64_t deadline = now_ms() + AAAA_GRACE_MS;
+    query->attempt = config.dns_attempts;
+    if (query->deadline > deadline) {
+        query->deadline = deadline;
+    }
+}
+
+static void lookup_advance(Lookup* lookup) {
+    Query* srv = &lookup->srv;
+    Query* a = &lookup->a;
+    Query* aaaa = &lookup->aaaa;
+    DnsAnswer answer;
+    memset(&answer, 0, sizeof(answer));
+
+    // The SRV record takes precedence, early address answers wait for it
+    if (lookup->done || srv->result == QUERY_PENDING) {
+        return;
+    }
+
+    if (srv->result == QUERY_FOUND) {
+        answer.port = srv->port;
+        answer.ttl = srv->ttl;
+
+        if (srv->count > 0) {
+            answer_add(&answer, srv);
+            lookup_finish(lookup, 0, &answer);
+            return;
+        }
+
+        if (!lookup->following_srv && strcasecmp(srv->target, lookup->name) != 0) {
+            // The address queries of the name were a guess, ask for the target instead
+            lookup->following_srv = 1;
+            query_begin(a, lookup, srv->target, ns_t_a);
+            if (!lookup->done) {
+                query_begin(aaaa, lookup, srv->target, ns_t_aaaa);
+            }
+            return;
+        }
+    }
+
+    // IPv4 is preferred, a slow IPv6 answer doesn't hold it up for long
+    if (a->result == QUERY_FOUND && aaaa->result == QUERY_PENDING) {
+        query_expedite(aaaa);
+        return;
+    }
+
+    if (a->result == QUERY_PENDING || aaaa->result == QUERY_PENDING) {
+        return;
+    }
+
+    answer_add(&answer, a);
+    answer_add(&answer, aaaa);
+
+    if (answer.count > 0) {
+        lookup_finish(lookup, 0, &answer);
+    } else {
+        // Without an SOA the cache falls back to its own negative TTL
+        answer_ttl(&answer, a->ttl);
+        answer_ttl(&answer, aaaa->ttl);
+        printf("DNS query error (%s)\n", lookup->name);
+        lookup_finish(lookup, -1, &answer);
+    }
+}
+
+static void lookup_start(ResolveRequest* request) {
+    for (Lookup* lookup = resolver.lookups; lookup != NULL; lookup = lookup->next) {
+        if (strcasecmp(lookup->name, request->name) == 0) {
+            request->next = lookup->waiters;
+            lookup->waiters = request;
+            return;
+        }
+    }
+
+    if (strlen(request->name) + strlen(MC_SRV_PREFIX) >= NS_MAXDNAME) {
+        printf("Invalid DNS name %s\n", request->name);
+        deliver(request, -1, &(DnsAnswer){0});
+        return;
+    }
+
+    Lookup* lookup = calloc(1, sizeof(Lookup));
+    if (lookup == NULL) {
+        perror("Error allocating DNS lookup");
+        deliver(request, -1, &(DnsAnswer){0});
+        return;
+    }
+
+    strcpy(lookup->name, request->name);
+    request->next = NULL;
+    lookup->waiters = request;
+    lookup->srv.fd = lookup->a.fd = lookup->aaaa.fd = -1;
+    lookup->next = resolver.lookups;
+    resolver.lookups = lookup;
+
+    char srv_name[NS_MAXDNAME];
+    snprintf(srv_name, sizeof(srv_name), "%s%s", MC_SRV_PREFIX, lookup->name);
+    query_begin(&lookup->srv, lookup, srv_name, ns_t_srv);
+    if (!lookup->done) {
+        query_begin(&lookup->a, lookup, lookup->name, ns_t_a);
+    }
+    if (!lookup->done) {
+        query_begin(&lookup->aaaa, lookup, lookup->name, ns_t_aaaa);
+    }
+}
+
+static void take_submitted() {
+    uint64_t count;
+    if (read(resolver.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Error reading eventfd");
+    }
+
+    ResolveRequest* request = atomic_exchange_explicit(&resolver.submitted, NULL, memory_order_acquire);
+    while (request != NULL) {
+        ResolveRequest* next = request->next;
+        lookup_start(request);
+        request = next;
+    }
+}
+
+static void expire_queries(uint64_t now) {
+    Lookup* lookup = resolver.lookups;
+    while (lookup != NULL) {
+        Lookup* next = lookup->next;
+        Query* queries[3] = { &lookup->srv, &lookup->a, &lookup->aaaa };
+
+        for (size_t i = 0; i < 3 && !lookup->done; ++i) {
+            if (queries[i]->result == QUERY_PENDING && queries[i]->deadline <= now) {
+                query_retry(queries[i]);
+            }
+        }
+        lookup = next;
+    }
+}
+
+static int next_timeout(uint64_t now) {
+    uint64_t deadline = UINT64_MAX;
+    for (Lookup* lookup = resolver.lookups; lookup != NULL; lookup = lookup->next) {
+        Query* queries[3] = { &lookup->srv, &lookup->a, &lookup->aaaa };
+        for (size_t i = 0; i < 3; ++i) {
+            if (queries[i]->result == QUERY_PENDING && queries[i]->deadline < deadline) {
+                deadline = queries[i]->deadline;
+            }
+        }
+    }
+
+    if (deadline == UINT64_MAX) {
+        return -1;
+    }
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+static void free_finished() {
+    while (resolver.finished != NULL) {
+        Lookup* next = resolver.finished->next;
+        free(resolver.finished);
+        resolver.finished = next;
+    }
+}
+
+static void* resolver_run(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&resolver.stopping)) {
+        int count = epoll_wait(resolver.epoll_fd, events, MAX_EVENTS, next_timeout(now_ms()));
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            Query* query = events[i].data.ptr;
+            if (query == NULL) {
+                take_submitted();
+            } else if (query->fd != -1 && !query->lookup->done) {
+                if (query->tcp) {
+                    query_stream_tcp(query);
+                } else {
+                    query_read_udp(query);
+                }
+            }
+        }
+
+        expire_queries(now_ms());
+        free_finished();
+    }
+
+    // Nobody will answer the remaining requests anymore
+    take_submitted();
+    while (resolver.lookups != NULL) {
+        lookup_finish(resolver.lookups, -1, &(DnsAnswer){0});
+    }
+    free_finished();
+    return NULL;
+}
+
+static size_t system_nameservers(struct sockaddr_in* nameservers) {
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+
+    size_t count = 0;
+    if (res_ninit(&state) == 0) {
+        for (int i = 0; i < state.nscount && count < MAXNS; ++i) {
+            if (state.nsaddr_list[i].sin_family == AF_INET) {
+                nameservers[count++] = state.nsaddr_list[i];
+            }
+        }
+        res_nclose(&state);
+    }
+
+    // Same default as the system resolver
+    if (count == 0) {
+        nameservers[0].sin_family = AF_INET;
+        nameservers[0].sin_port = htons(NS_DEFAULTPORT);
+        nameservers[0].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        count = 1;
+    }
+    return count;
+}
+
+ssize_t resolver_init(const struct sockaddr_in* nameservers, size_t count) {
+    if (resolver.running) {
+        return 0;
+    }
+
+    if (count > MAXNS) {
+        count = MAXNS;
+    }
+    if (count > 0) {
+        memcpy(resolver.nameservers, nameservers, count * sizeof(*nameservers));
+        resolver.nameserver_count = count;
+    } else {
+        resolver.nameserver_count = system_nameservers(resolver.nameservers);
+    }
+
+    atomic_store(&resolver.stopping, 0);
+    atomic_store(&resolver.submitted, NULL);
+
+    resolver.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    resolver.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolver.epoll_fd == -1 || resolver.event_fd == -1) {
+        perror("Error setting up the resolver");
+        resolver_shutdown();
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(resolver.epoll_fd, EPOLL_CTL_ADD, resolver.event_fd, &event) == -1 ||
+        pthread_create(&resolver.thread, NULL, resolver_run, NULL) != 0) {
+        perror("Error starting the resolver");
+        resolver_shutdown();
+        return -1;
+    }
+
+    resolver.running = 1;
+    return 0;
+}
+
+void resolver_shutdown() {
+    if (resolver.running) {
+        atomic_store(&resolver.stopping, 1);
+        signal_event(resolver.event_fd);
+        pthread_join(resolver.thread, NULL);
+        resolver.running = 0;
+    }
+
+    if (resolver.event_fd != -1) {
+        close(resolver.event_fd);
+        resolver.event_fd = -1;
+    }
+    if (resolver.epoll_fd != -1) {
+        close(resolver.epoll_fd);
+        resolver.epoll_fd = -1;
+    }
+}
+
+void resolver_lookup(ResolveRequest* request, const char* name, ResolveQueue* queue) {
+    request->name = name;
+    request->queue = queue;
+
+    if (!resolver.running) {
+        printf("DNS resolver not initialized\n");
+        deliver(request, -1, &(DnsAnswer){0});
+        return;
+    }
+
+    push_request(&resolver.submitted, request);
+    signal_event(resolver.event_fd);
+}
+
+void resolver_refresh(const char* name) {
+    size_t length = strlen(name);
+    ResolveRequest* request = malloc(sizeof(ResolveRequest) + length + 1);
+    if (request == NULL) {
+        perror("Error allocating DNS refresh");
+        return;
+    }
+
+    char* copy = (char*)(request + 1);
+    memcpy(copy, name, length + 1);
+    resolver_lookup(request, copy, NULL);
+}
+
+ssize_t resolver_lookup_sync(const char* name, DnsAnswer* answer) {
+    ResolveQueue queue;
+    if (resolve_queue_init(&queue) < 0) {
+        return -1;
+    }
+
+    ResolveRequest request;
+    resolver_lookup(&request, name, &queue);
+
+    while (resolve_queue_take(&queue) == NULL) {
+        struct pollfd pollfd = { .fd = queue.event_fd, .events = POLLIN };
+        poll(&pollfd, 1, -1);
+    }
+    resolve_queue_destroy(&queue);
+
+    *answer = request.answer;
+    return request.status;
+}
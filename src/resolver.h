@@ -0,0 +1,66 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define DNS_MAX_ADDRESSES 8
+
+typedef struct {
+    int family;                     // AF_INET or AF_INET6
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    };
+} DnsAddress;
+
+// Everything a lookup found for a name
+typedef struct {
+    DnsAddress addresses[DNS_MAX_ADDRESSES]; // IPv4 first
+    size_t count;
+    unsigned short port;            // Port of the SRV record, 0 without one
+    uint32_t ttl;                   // Lowest TTL of the records used, for failures the SOA's negative TTL if known
+} DnsAnswer;
+
+struct ResolveQueue;
+
+// One caller waiting for a name. Concurrent requests for the same name share one set of queries
+typedef struct ResolveRequest {
+    const char* name;               // Must stay valid until the request is delivered
+    struct ResolveQueue* queue;     // Where the request is delivered, NULL for refreshes nobody waits for
+    ssize_t status;                 // 0 if answer holds at least one address, -1 if the name couldn't be resolved
+    DnsAnswer answer;
+    struct ResolveRequest* next;
+} ResolveRequest;
+
+// Resolved requests waiting to be picked up by one thread, event_fd turns readable when there are any
+typedef struct ResolveQueue {
+    int event_fd;
+    _Atomic(ResolveRequest*) head;
+} ResolveQueue;
+
+ssize_t resolve_queue_init(ResolveQueue* queue);
+void resolve_queue_destroy(ResolveQueue* queue);
+ResolveRequest* resolve_queue_take(ResolveQueue* queue);
+
+// Fills in the answer's first address, the cache rotates them between calls. The SRV port is used
+// instead of port when default_port is set. Returns the address length, 0 if the answer is empty
+socklen_t dns_answer_address(const DnsAnswer* answer, unsigned short port, unsigned char default_port, struct sockaddr_storage* address);
+
+// Starts the resolver thread, without nameservers the ones from /etc/resolv.conf are used
+ssize_t resolver_init(const struct sockaddr_in* nameservers, size_t count);
+void resolver_shutdown();
+
+// Never blocks, the request comes back on the queue
+void resolver_lookup(ResolveRequest* request, const char* name, ResolveQueue* queue);
+ssize_t resolver_lookup_sync(const char* name, DnsAnswer* answer);
+
+// Looks the name up again in the background, the answer only goes to the cache
+void resolver_refresh(const char* name);
+
+#endif // RESOLVER_H
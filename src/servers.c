@@ -1,15 +1,112 @@
 #include "servers.h"
+#include "config.h"
+#include "metrics.h"
 
-pthread_mutex_t servers_mutex;
+#include <ctype.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BACKEND_RETRY_MS 10000  // A backend whose connect failed is only picked once the others were tried, for this long
+
+// Entries as parsed from the file, before they are packed into a RouteTable
+typedef struct {
+    char* destination;
+    unsigned short port;        // 0 if the line has no port
+    uint8_t weight;
+} ParsedBackend;
 
 typedef struct {
-    Entry* items;
+    char* source;
+    ParsedBackend* backends;
+    size_t backend_count;
+    enum BalancePolicy balance;
+    char* profile;              // Name from profile=, NULL for the default
+    uint32_t rate_mbps;         // From rate_mbps=, 0 for no limit
+    int64_t connect_timeout_ms; // From connect_timeout_ms=, -1 for the configured default
+    int64_t idle_timeout_s;     // From idle_timeout_s=, -1 for the configured default
+} ParsedEntry;
+
+typedef struct {
+    ParsedEntry* items;
     size_t count;
     size_t capacity;
+    SocketProfile* profiles;    // Names are allocated, interned into the arena once built
+    size_t profile_count;
 } Dictionary;
 
-Dictionary dictionary = {0};
+// Exact names live in an open-addressed hash table
+typedef struct {
+    uint64_t hash;
+    uint32_t entry;             // Index + 1, 0 marks an empty slot
+} Slot;
+
+// Wildcards live in a trie keyed by labels from right to left, "*.b.example" is example -> b
+typedef struct {
+    const char* label;
+    uint32_t first_child;       // Children are contiguous and sorted by label
+    uint16_t child_count;
+    uint8_t label_length;
+    int32_t entry;              // Wildcard entry for names below this node, -1 if none
+} TrieNode;
+
+struct RouteTable {
+    atomic_size_t references;
+    char* arena;                // Every string of the table, interned back to back
+    Entry* entries;
+    size_t count;
+    Backend* backends;          // Every entry's backends, back to back
+    size_t backend_count;
+    SocketProfile* profiles;
+    size_t profile_count;
+    Slot* slots;
+    size_t mask;
+    TrieNode* nodes;
+    size_t node_count;
+};
+
+// Trie node while the table is being built
+typedef struct BuildNode {
+    const char* label;
+    uint8_t label_length;
+    int32_t entry;
+    struct BuildNode** children;
+    size_t child_count;
+    size_t child_capacity;
+} BuildNode;
 
+static _Atomic(RouteTable*) routes = NULL;
+
+// Readers announce themselves in one of two counters while they pick up a reference to the table.
+// A writer swaps the table, flips the epoch and waits for the old counter to drain,
+// after which nobody can still be about to reference the old table
+static atomic_uint routes_epoch = 0;
+static struct {
+    atomic_size_t count;
+    char padding[64 - sizeof(atomic_size_t)];
+} routes_readers[2];
+
+static pthread_mutex_t routes_publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Guarded by routes_publish_mutex
+static RoutesLoadStats load_stats = {0};
+
+#define BACKEND_STATE_BUCKETS 16384
+
+// States are found by destination and port when a table is built and never freed, so connections
+// can keep pointing at them and the numbers carry over to the next table
+typedef struct BackendStateNode {
+    BackendState state;
+    unsigned short port;
+    struct BackendStateNode* next; // In its bucket
+    char destination[];
+} BackendStateNode;
+
+static BackendStateNode* backend_states[BACKEND_STATE_BUCKETS];
+static pthread_mutex_t backend_states_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const balance_policies[] = { "round_robin", "least_connections", "fastest", "username_hash", NULL };
 
 char* trim_leading_whitespace(char* str) {
     while(*str == ' ' || *str == '\t') {
@@ -18,95 +115,938 @@ char* trim_leading_whitespace(char* str) {
     return str;
 }
 
-ssize_t add_entry(const char* const source, const char* const destination, const short port) {
-    if (dictionary.count >= dictionary.capacity) {
-        if (dictionary.capacity == 0) {
-            dictionary.capacity = 8;
+// Lowercases the name, cuts it at the first NUL (Forge appends "\0FML\0" to the address) and drops trailing dots.
+// Returns the normalized length, or -1 if the name doesn't fit
+static ssize_t normalize_name(char* const normalized, const char* name) {
+    size_t length = 0;
+
+    while (name[length] != '\0') {
+        if (length >= MAX_HOSTNAME_LENGTH) {
+            return -1;
+        }
+        normalized[length] = tolower((unsigned char)name[length]);
+        ++length;
+    }
+
+    while (length > 0 && normalized[length - 1] == '.') {
+        --length;
+    }
+
+    normalized[length] = '\0';
+    return length;
+}
+
+static uint64_t hash_name(const char* name, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int compare_labels(const char* a, size_t a_length, const char* b, size_t b_length) {
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (result != 0) {
+        return result;
+    }
+    return a_length < b_length ? -1 : a_length > b_length;
+}
+
+static void parsed_entry_free(ParsedEntry* entry) {
+    free(entry->source);
+    free(entry->profile);
+    for (size_t i = 0; i < entry->backend_count; ++i) {
+        free(entry->backends[i].destination);
+    }
+    free(entry->backends);
+}
+
+static void dictionary_free(Dictionary* dictionary) {
+    for (size_t i = 0; i < dictionary->count; ++i) {
+        parsed_entry_free(&dictionary->items[i]);
+    }
+    free(dictionary->items);
+    for (size_t i = 0; i < dictionary->profile_count; ++i) {
+        free((char*)dictionary->profiles[i].name);
+    }
+    free(dictionary->profiles);
+    memset(dictionary, 0, sizeof(*dictionary));
+}
+
+// Takes over the backends of parsed once the entry is added
+ssize_t add_entry(Dictionary* dictionary, const char* const source, ParsedEntry* parsed) {
+    char normalized[MAX_HOSTNAME_LENGTH + 1];
+    if (normalize_name(normalized, source) <= 0) {
+        printf("Invalid server name: %s\n", source);
+        return -1;
+    }
+
+    if (dictionary->count >= dictionary->capacity) {
+        if (dictionary->capacity == 0) {
+            dictionary->capacity = 8;
         } else {
-            dictionary.capacity *= 2;
+            dictionary->capacity *= 2;
         }
-        dictionary.items = realloc(dictionary.items, sizeof(Entry) * dictionary.capacity);
-        if (dictionary.items == NULL) {
+        ParsedEntry* items = realloc(dictionary->items, sizeof(ParsedEntry) * dictionary->capacity);
+        if (items == NULL) {
             perror("Error allocating memory");
             return -1;
         }
+        dictionary->items = items;
     }
-    
-    strncpy(dictionary.items[dictionary.count].source, source, sizeof(dictionary.items[dictionary.count].source));
-    strncpy(dictionary.items[dictionary.count].destination, destination, sizeof(dictionary.items[dictionary.count].destination));
-    dictionary.items[dictionary.count].port = port;
 
-    ++dictionary.count;
+    ParsedEntry* entry = &dictionary->items[dictionary->count];
+    *entry = *parsed;
+    entry->source = strdup(normalized);
+    if (entry->source == NULL) {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    memset(parsed, 0, sizeof(*parsed));
+    ++dictionary->count;
     return 0;
 }
 
+// Reads the N of a "name=N" route option, which must be within 0 and max
+static ssize_t parse_route_number(const char* token, size_t name_length, long max, long* value) {
+    char* end;
+    *value = strtol(token + name_length, &end, 10);
+    if (end == token + name_length || *end != '\0' || *value < 0 || *value > max) {
+        printf("Invalid value: %s\n", token);
+        return -1;
+    }
+    return 0;
+}
 
-ssize_t load_dictionary(const char* filename) {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Failed to open the file\n");
+// Parses "destination[:port] [weight=N] ... [balance=policy] [profile=name] [rate_mbps=N] [connect_timeout_ms=N]
+// [idle_timeout_s=N]", every destination is one backend
+static ssize_t parse_backends(char* value, ParsedEntry* entry) {
+    for (char* token = strtok(value, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        if (strncmp(token, "profile=", 8) == 0) {
+            free(entry->profile);
+            entry->profile = strdup(token + 8);
+            if (entry->profile == NULL) {
+                perror("Error allocating memory");
+                return -1;
+            }
+            continue;
+        }
+
+        long number;
+        if (strncmp(token, "rate_mbps=", 10) == 0) {
+            if (parse_route_number(token, 10, UINT32_MAX, &number) < 0) {
+                return -1;
+            }
+            entry->rate_mbps = number;
+            continue;
+        }
+        if (strncmp(token, "connect_timeout_ms=", 19) == 0) {
+            if (parse_route_number(token, 19, UINT32_MAX, &number) < 0) {
+                return -1;
+            }
+            entry->connect_timeout_ms = number;
+            continue;
+        }
+        if (strncmp(token, "idle_timeout_s=", 15) == 0) {
+            if (parse_route_number(token, 15, UINT32_MAX / 1000, &number) < 0) {
+                return -1;
+            }
+            entry->idle_timeout_s = number;
+            continue;
+        }
+
+        if (strncmp(token, "balance=", 8) == 0) {
+            size_t policy = 0;
+            while (balance_policies[policy] != NULL && strcmp(balance_policies[policy], token + 8) != 0) {
+                ++policy;
+            }
+            if (balance_policies[policy] == NULL) {
+                printf("Unknown balance policy: %s\n", token + 8);
+                return -1;
+            }
+            entry->balance = policy;
+            continue;
+        }
+
+        // A weight belongs to the destination in front of it
+        if (strncmp(token, "weight=", 7) == 0) {
+            char* end;
+            long weight = strtol(token + 7, &end, 10);
+            if (entry->backend_count == 0 || end == token + 7 || *end != '\0' || weight < 1 || weight > MAX_BACKEND_WEIGHT) {
+                printf("Invalid weight: %s\n", token);
+                return -1;
+            }
+            entry->backends[entry->backend_count - 1].weight = weight;
+            continue;
+        }
+
+        if (entry->backend_count >= MAX_ROUTE_BACKENDS) {
+            printf("More than %d backends\n", MAX_ROUTE_BACKENDS);
+            return -1;
+        }
+
+        long port = 0;
+        char* colon = strchr(token, ':');
+        if (colon != NULL) {
+            char* end;
+            *colon = '\0';
+            port = strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || port <= 0 || port > 65535) {
+                printf("Invalid port: %s\n", colon + 1);
+                return -1;
+            }
+        }
+        if (token[0] == '\0') {
+            printf("Invalid destination\n");
+            return -1;
+        }
+
+        ParsedBackend* backends = realloc(entry->backends, (entry->backend_count + 1) * sizeof(ParsedBackend));
+        if (backends == NULL) {
+            perror("Error allocating memory");
+            return -1;
+        }
+        entry->backends = backends;
+
+        ParsedBackend* backend = &entry->backends[entry->backend_count];
+        backend->destination = strdup(token);
+        backend->port = port;
+        backend->weight = 1;
+        if (backend->destination == NULL) {
+            perror("Error allocating memory");
+            return -1;
+        }
+        ++entry->backend_count;
+    }
+
+    if (entry->backend_count == 0) {
+        printf("No destination\n");
+        return -1;
+    }
+    return 0;
+}
+
+static size_t hash_backend(const char* destination, unsigned short port) {
+    size_t hash = 2166136261u;
+    for (; *destination != '\0'; ++destination) {
+        hash = (hash ^ (unsigned char)*destination) * 16777619u;
+    }
+    hash = (hash ^ (port & 0xFF)) * 16777619u;
+    hash = (hash ^ (port >> 8)) * 16777619u;
+    return hash % BACKEND_STATE_BUCKETS;
+}
+
+static BackendState* backend_state_find(const char* destination, unsigned short port) {
+    size_t bucket = hash_backend(destination, port);
+    pthread_mutex_lock(&backend_states_mutex);
+
+    BackendStateNode* node = backend_states[bucket];
+    while (node != NULL && (node->port != port || strcmp(node->destination, destination) != 0)) {
+        node = node->next;
+    }
+
+    if (node == NULL) {
+        size_t length = strlen(destination);
+        node = calloc(1, sizeof(BackendStateNode) + length + 1);
+        if (node != NULL) {
+            node->port = port;
+            memcpy(node->destination, destination, length + 1);
+            node->next = backend_states[bucket];
+            backend_states[bucket] = node;
+        }
+    }
+
+    pthread_mutex_unlock(&backend_states_mutex);
+    return node == NULL ? NULL : &node->state;
+}
+
+static void build_node_free(BuildNode* node) {
+    for (size_t i = 0; i < node->child_count; ++i) {
+        build_node_free(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+}
+
+static BuildNode* build_node_child(BuildNode* node, const char* label, size_t label_length) {
+    for (size_t i = 0; i < node->child_count; ++i) {
+        if (compare_labels(node->children[i]->label, node->children[i]->label_length, label, label_length) == 0) {
+            return node->children[i];
+        }
+    }
+
+    if (node->child_count >= node->child_capacity) {
+        size_t capacity = node->child_capacity == 0 ? 4 : node->child_capacity * 2;
+        BuildNode** children = realloc(node->children, capacity * sizeof(BuildNode*));
+        if (children == NULL) {
+            return NULL;
+        }
+        node->children = children;
+        node->child_capacity = capacity;
+    }
+
+    BuildNode* child = calloc(1, sizeof(BuildNode));
+    if (child == NULL) {
+        return NULL;
+    }
+    child->label = label;
+    child->label_length = label_length;
+    child->entry = -1;
+
+    node->children[node->child_count++] = child;
+    return child;
+}
+
+static int compare_build_nodes(const void* a, const void* b) {
+    const BuildNode* left = *(BuildNode* const*)a;
+    const BuildNode* right = *(BuildNode* const*)b;
+    return compare_labels(left->label, left->label_length, right->label, right->label_length);
+}
+
+static size_t build_node_count(BuildNode* node) {
+    size_t count = 1;
+    for (size_t i = 0; i < node->child_count; ++i) {
+        count += build_node_count(node->children[i]);
+    }
+    return count;
+}
+
+// Lays the trie out breadth first, so the children of every node end up next to each other
+static ssize_t freeze_trie(RouteTable* table, BuildNode* root) {
+    table->node_count = build_node_count(root);
+    table->nodes = calloc(table->node_count, sizeof(TrieNode));
+    BuildNode** queue = calloc(table->node_count, sizeof(BuildNode*));
+    if (table->nodes == NULL || queue == NULL) {
+        free(queue);
         return -1;
     }
 
-    if (pthread_mutex_init(&servers_mutex, NULL) != 0) {
-        perror("Error creating servers mutex");
+    size_t tail = 0;
+    queue[tail++] = root;
+
+    for (size_t head = 0; head < tail; ++head) {
+        BuildNode* node = queue[head];
+        if (node->child_count > 1) {
+            qsort(node->children, node->child_count, sizeof(BuildNode*), compare_build_nodes);
+        }
+
+        TrieNode* frozen = &table->nodes[head];
+        frozen->label = node->label;
+        frozen->label_length = node->label_length;
+        frozen->entry = node->entry;
+        frozen->first_child = tail;
+        frozen->child_count = node->child_count;
+
+        for (size_t i = 0; i < node->child_count; ++i) {
+            queue[tail++] = node->children[i];
+        }
+    }
+
+    free(queue);
+    return 0;
+}
+
+// Adds "*.b.example" (or the catch-all "*") to the trie under example -> b
+static ssize_t trie_insert(BuildNode* root, const char* source, int32_t entry) {
+    const char* end = source + strlen(source);
+    const char* stop = source + 1; // Skip the '*'
+    BuildNode* node = root;
+
+    while (end > stop) {
+        const char* label = end;
+        while (label > stop && label[-1] != '.') {
+            --label;
+        }
+
+        if (end > label) {
+            node = build_node_child(node, label, end - label);
+            if (node == NULL) {
+                return -1;
+            }
+        }
+        end = label - 1;
+    }
+
+    // The first definition of a name wins
+    if (node->entry == -1) {
+        node->entry = entry;
+    }
+    return 0;
+}
+
+static const SocketProfile* dictionary_profile(const Dictionary* dictionary, const char* name) {
+    for (size_t i = 0; i < dictionary->profile_count; ++i) {
+        if (strcmp(dictionary->profiles[i].name, name) == 0) {
+            return &dictionary->profiles[i];
+        }
+    }
+    return strcmp(name, default_socket_profile.name) == 0 ? &default_socket_profile : NULL;
+}
+
+// Parses "profile <name> [key=value] ...", a name can only be defined once
+static ssize_t add_profile(Dictionary* dictionary, const char* name, char* options) {
+    for (size_t i = 0; i < dictionary->profile_count; ++i) {
+        if (strcmp(dictionary->profiles[i].name, name) == 0) {
+            printf("Profile %s defined twice\n", name);
+            return -1;
+        }
+    }
+
+    SocketProfile* profiles = realloc(dictionary->profiles, (dictionary->profile_count + 1) * sizeof(SocketProfile));
+    if (profiles == NULL) {
+        perror("Error allocating memory");
+        return -1;
+    }
+    dictionary->profiles = profiles;
+
+    SocketProfile* profile = &dictionary->profiles[dictionary->profile_count];
+    profile->name = strdup(name);
+    if (profile->name == NULL) {
+        perror("Error allocating memory");
+        return -1;
+    }
+    ++dictionary->profile_count;
+
+    char empty[] = "";
+    return socket_profile_parse(profile, options != NULL ? options : empty);
+}
+
+static void table_free(RouteTable* table) {
+    if (table == NULL) {
+        return;
+    }
+    free(table->arena);
+    free(table->entries);
+    free(table->backends);
+    free(table->profiles);
+    free(table->slots);
+    free(table->nodes);
+    free(table);
+}
+
+static RouteTable* table_build(const Dictionary* dictionary) {
+    RouteTable* table = calloc(1, sizeof(RouteTable));
+    if (table == NULL) {
+        return NULL;
+    }
+    atomic_init(&table->references, 1);
+
+    size_t arena_size = 1;
+    size_t backend_count = 0;
+    for (size_t i = 0; i < dictionary->count; ++i) {
+        arena_size += strlen(dictionary->items[i].source) + 1;
+        for (size_t j = 0; j < dictionary->items[i].backend_count; ++j) {
+            arena_size += strlen(dictionary->items[i].backends[j].destination) + 1;
+        }
+        backend_count += dictionary->items[i].backend_count;
+    }
+    for (size_t i = 0; i < dictionary->profile_count; ++i) {
+        arena_size += strlen(dictionary->profiles[i].name) + 1;
+    }
+
+    size_t capacity = 16;
+    while (capacity < dictionary->count * 2) {
+        capacity *= 2;
+    }
+
+    table->arena = malloc(arena_size);
+    table->entries = calloc(dictionary->count + 1, sizeof(Entry));
+    table->backends = calloc(backend_count + 1, sizeof(Backend));
+    table->backend_count = backend_count;
+    table->profiles = calloc(dictionary->profile_count + 1, sizeof(SocketProfile));
+    table->profile_count = dictionary->profile_count;
+    table->slots = calloc(capacity, sizeof(Slot));
+    table->mask = capacity - 1;
+
+    BuildNode* root = calloc(1, sizeof(BuildNode));
+    if (table->arena == NULL || table->entries == NULL || table->backends == NULL || table->profiles == NULL ||
+        table->slots == NULL || root == NULL) {
+        free(root);
+        table_free(table);
+        return NULL;
+    }
+    root->entry = -1;
+
+    char* cursor = table->arena;
+    for (size_t i = 0; i < dictionary->profile_count; ++i) {
+        size_t name_length = strlen(dictionary->profiles[i].name);
+        table->profiles[i] = dictionary->profiles[i];
+        memcpy(cursor, dictionary->profiles[i].name, name_length + 1);
+        table->profiles[i].name = cursor;
+        cursor += name_length + 1;
+    }
+
+    Backend* backend = table->backends;
+    for (size_t i = 0; i < dictionary->count; ++i) {
+        const ParsedEntry* parsed = &dictionary->items[i];
+        Entry* entry = &table->entries[table->count];
+
+        size_t source_length = strlen(parsed->source);
+        memcpy(cursor, parsed->source, source_length + 1);
+        entry->source = cursor;
+        cursor += source_length + 1;
+
+        entry->backends = backend;
+        entry->backend_count = parsed->backend_count;
+        entry->balance = parsed->balance;
+        entry->metrics = metrics_route(entry->source);
+        entry->profile = routes_profile(table, parsed->profile != NULL ? parsed->profile : default_socket_profile.name);
+        entry->bandwidth = shaper_route(entry->source, parsed->rate_mbps);
+        entry->connect_timeout_ms = (uint32_t)(parsed->connect_timeout_ms >= 0 ? parsed->connect_timeout_ms : (int64_t)config.connect_timeout_ms);
+        entry->idle_timeout_s = (uint32_t)(parsed->idle_timeout_s >= 0 ? parsed->idle_timeout_s : (int64_t)config.idle_timeout_s);
+        for (size_t j = 0; j < parsed->backend_count; ++j, ++backend) {
+            size_t destination_length = strlen(parsed->backends[j].destination);
+            memcpy(cursor, parsed->backends[j].destination, destination_length + 1);
+            backend->destination = cursor;
+            cursor += destination_length + 1;
+
+            backend->port = parsed->backends[j].port != 0 ? parsed->backends[j].port : 25565;
+            backend->default_port = parsed->backends[j].port == 0;
+            backend->weight = parsed->backends[j].weight;
+            backend->state = backend_state_find(backend->destination, backend->port);
+            if (backend->state == NULL) {
+                build_node_free(root);
+                table_free(table);
+                return NULL;
+            }
+        }
+
+        if (entry->source[0] == '*' && (entry->source[1] == '.' || entry->source[1] == '\0')) {
+            if (trie_insert(root, entry->source, table->count) < 0) {
+                build_node_free(root);
+                table_free(table);
+                return NULL;
+            }
+            ++table->count;
+            continue;
+        }
+
+        uint64_t hash = hash_name(entry->source, source_length);
+        size_t slot = hash & table->mask;
+        int duplicate = 0;
+        while (table->slots[slot].entry != 0) {
+            const Entry* existing = &table->entries[table->slots[slot].entry - 1];
+            if (table->slots[slot].hash == hash && strcmp(existing->source, entry->source) == 0) {
+                duplicate = 1; // The first definition of a name wins
+                break;
+            }
+            slot = (slot + 1) & table->mask;
+        }
+
+        if (!duplicate) {
+            table->slots[slot].hash = hash;
+            table->slots[slot].entry = table->count + 1;
+        }
+        ++table->count;
+    }
+
+    ssize_t frozen = freeze_trie(table, root);
+    build_node_free(root);
+    if (frozen < 0) {
+        table_free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+static const TrieNode* trie_child(const RouteTable* table, const TrieNode* node, const char* label, size_t label_length) {
+    size_t low = node->first_child;
+    size_t high = node->first_child + node->child_count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        const TrieNode* child = &table->nodes[middle];
+        int result = compare_labels(child->label, child->label_length, label, label_length);
+        if (result == 0) {
+            return child;
+        }
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+Entry* routes_find(const RouteTable* table, const char* key) {
+    char name[MAX_HOSTNAME_LENGTH + 1];
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    ssize_t length = normalize_name(name, key);
+    if (length <= 0) {
+        return NULL;
+    }
+
+    // Exact match
+    uint64_t hash = hash_name(name, length);
+    for (size_t slot = hash & table->mask; table->slots[slot].entry != 0; slot = (slot + 1) & table->mask) {
+        Entry* entry = &table->entries[table->slots[slot].entry - 1];
+        if (table->slots[slot].hash == hash && strcmp(entry->source, name) == 0) {
+            return entry;
+        }
+    }
+
+    // Wildcard match, the longest matching suffix wins
+    const TrieNode* node = &table->nodes[0];
+    int32_t best = node->entry;
+    const char* end = name + length;
+
+    while (end > name) {
+        const char* label = end;
+        while (label > name && label[-1] != '.') {
+            --label;
+        }
+
+        node = trie_child(table, node, label, end - label);
+        if (node == NULL) {
+            break;
+        }
+
+        // A wildcard only covers names with at least one more label in front of it
+        if (label > name && node->entry != -1) {
+            best = node->entry;
+        }
+        end = label - 1;
+    }
+
+    return best == -1 ? NULL : &table->entries[best];
+}
+
+const SocketProfile* routes_profile(const RouteTable* table, const char* name) {
+    for (size_t i = 0; i < table->profile_count; ++i) {
+        if (strcmp(table->profiles[i].name, name) == 0) {
+            return &table->profiles[i];
+        }
+    }
+    return strcmp(name, default_socket_profile.name) == 0 ? &default_socket_profile : NULL;
+}
+
+size_t routes_count(const RouteTable* table) {
+    return table == NULL ? 0 : table->count;
+}
+
+size_t routes_backend_count(const RouteTable* table) {
+    return table == NULL ? 0 : table->backend_count;
+}
+
+const Backend* routes_backend(const RouteTable* table, size_t index) {
+    return &table->backends[index];
+}
+
+void routes_dump(FILE* out) {
+    static const char* const health_names[] = { "unknown", "up", "degraded", "down" };
+    RouteTable* table = routes_acquire();
+
+    for (size_t i = 0; i < routes_count(table); ++i) {
+        const Entry* entry = &table->entries[i];
+        fprintf(out, "%s balance=%s profile=%s connect_timeout_ms=%u idle_timeout_s=%u%s\n", entry->source,
+                balance_policies[entry->balance], entry->profile->name, entry->connect_timeout_ms, entry->idle_timeout_s,
+                entry->bandwidth != NULL ? " shaped" : "");
+        for (uint32_t j = 0; j < entry->backend_count; ++j) {
+            const Backend* backend = &entry->backends[j];
+            fprintf(out, "    %s:%u weight=%u health=%s active=%u rtt_us=%u\n", backend->destination, backend->port, backend->weight,
+                    health_names[atomic_load_explicit(&backend->state->health, memory_order_relaxed) & 3],
+                    atomic_load_explicit(&backend->state->active, memory_order_relaxed),
+                    atomic_load_explicit(&backend->state->rtt_us, memory_order_relaxed));
+        }
+    }
+
+    routes_release(table);
+}
+
+static uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb33fe1a85ec3ULL;
+    return value ^ (value >> 33);
+}
+
+// Rendezvous hashing: every backend draws a number per unit of weight from the username and its own
+// address, the lowest draw wins. Adding or removing a backend only moves the players it wins or won
+static uint64_t username_score(const Backend* backend, uint64_t username) {
+    uint64_t seed = username ^ hash_name(backend->destination, strlen(backend->destination)) ^ backend->port;
+    uint64_t best = UINT64_MAX;
+    for (uint64_t i = 0; i < backend->weight; ++i) {
+        uint64_t score = mix(seed + i * 0x9e3779b97f4a7c15ULL);
+        if (score < best) {
+            best = score;
+        }
+    }
+    return best;
+}
+
+// Round robin walks the backends in proportion to their weights
+static uint32_t weighted_start(const Entry* entry, uint32_t rotation) {
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < entry->backend_count; ++i) {
+        total += entry->backends[i].weight;
+    }
+
+    uint32_t position = rotation % total;
+    for (uint32_t i = 0; i < entry->backend_count; ++i) {
+        if (position < entry->backends[i].weight) {
+            return i;
+        }
+        position -= entry->backends[i].weight;
+    }
+    return 0;
+}
+
+// Lower is better, ties go to the backend closest to the rotation's start
+static uint64_t backend_score(const Entry* entry, const Backend* backend, uint64_t username) {
+    switch (entry->balance) {
+        case BALANCE_LEAST_CONNECTIONS:
+            return ((uint64_t)atomic_load_explicit(&backend->state->active, memory_order_relaxed) << 16) / backend->weight;
+        case BALANCE_FASTEST:
+            // Backends without a measurement yet come first, so all of them get one
+            return ((uint64_t)atomic_load_explicit(&backend->state->rtt_us, memory_order_relaxed) << 16) / backend->weight;
+        case BALANCE_USERNAME_HASH:
+            return username_score(backend, username);
+        case BALANCE_ROUND_ROBIN:
+        default:
+            return 0;
+    }
+}
+
+ssize_t entry_select_backend(Entry* entry, const char* username, uint64_t tried) {
+    uint32_t count = entry->backend_count;
+    uint32_t rotation = atomic_fetch_add_explicit(&entry->rotation, 1, memory_order_relaxed);
+    uint32_t start = entry->balance == BALANCE_ROUND_ROBIN ? weighted_start(entry, rotation) : rotation % count;
+    uint64_t username_hash = entry->balance == BALANCE_USERNAME_HASH ? hash_name(username, strlen(username)) : 0;
+    uint64_t now = now_ms();
+
+    // Healthy backends first, then degraded ones, then those a join failed to reach recently.
+    // Backends the health checker found down are never picked
+    for (int round = 0; round < 3; ++round) {
+        ssize_t best = -1;
+        uint64_t best_score = UINT64_MAX;
+
+        for (uint32_t n = 0; n < count; ++n) {
+            uint32_t i = (start + n) % count;
+            const Backend* backend = &entry->backends[i];
+            if (tried & (1ULL << i)) {
+                continue;
+            }
+
+            unsigned health = atomic_load_explicit(&backend->state->health, memory_order_relaxed);
+            uint64_t failed = atomic_load_explicit(&backend->state->failed_ms, memory_order_relaxed);
+            int recently_failed = failed != 0 && now - failed < BACKEND_RETRY_MS;
+            int rank = health == BACKEND_DOWN ? 3 : recently_failed ? 2 : health == BACKEND_DEGRADED;
+            if (rank != round) {
+                continue;
+            }
+
+            uint64_t score = backend_score(entry, backend, username_hash);
+            if (best == -1 || score < best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+
+        if (best != -1) {
+            return best;
+        }
+    }
+
+    return -1;
+}
+
+void backend_connected(BackendState* state, uint32_t rtt_us) {
+    atomic_fetch_add_explicit(&state->active, 1, memory_order_relaxed);
+    atomic_store_explicit(&state->failed_ms, 0, memory_order_relaxed);
+
+    if (rtt_us != 0) {
+        // Concurrent updates may lose a sample, which a moving average shrugs off
+        uint32_t smoothed = atomic_load_explicit(&state->rtt_us, memory_order_relaxed);
+        smoothed = smoothed == 0 ? rtt_us : smoothed - smoothed / 8 + rtt_us / 8;
+        atomic_store_explicit(&state->rtt_us, smoothed > 0 ? smoothed : 1, memory_order_relaxed);
+    }
+}
+
+void backend_disconnected(BackendState* state) {
+    atomic_fetch_sub_explicit(&state->active, 1, memory_order_relaxed);
+}
+
+void backend_failed(BackendState* state) {
+    atomic_store_explicit(&state->failed_ms, now_ms(), memory_order_relaxed);
+}
+
+RouteTable* routes_acquire() {
+    unsigned epoch = atomic_load(&routes_epoch) & 1;
+    atomic_fetch_add(&routes_readers[epoch].count, 1);
+
+    RouteTable* table = atomic_load(&routes);
+    if (table != NULL) {
+        atomic_fetch_add_explicit(&table->references, 1, memory_order_relaxed);
+    }
+
+    atomic_fetch_sub_explicit(&routes_readers[epoch].count, 1, memory_order_release);
+    return table;
+}
+
+void routes_release(RouteTable* table) {
+    if (table != NULL && atomic_fetch_sub_explicit(&table->references, 1, memory_order_acq_rel) == 1) {
+        table_free(table);
+    }
+}
+
+// Makes the table visible to new lookups, the previous one is freed once its last reader lets go
+static void routes_publish(RouteTable* table, double milliseconds) {
+    pthread_mutex_lock(&routes_publish_mutex);
+
+    RouteTable* previous = atomic_exchange(&routes, table);
+    unsigned epoch = atomic_fetch_add(&routes_epoch, 1) & 1;
+
+    // Readers still in the old epoch may have loaded the previous table without referencing it yet
+    while (atomic_load(&routes_readers[epoch].count) != 0) {
+        sched_yield();
+    }
+
+    load_stats.entries = table->count;
+    load_stats.milliseconds = milliseconds;
+    ++load_stats.generation;
+
+    pthread_mutex_unlock(&routes_publish_mutex);
+
+    routes_release(previous);
+}
+
+static double elapsed_milliseconds(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Global options are only applied on the initial load, the running workers can't be resized
+static ssize_t parse_dictionary(const char* filename, Dictionary* dictionary, int apply_options) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Failed to open the file\n");
         return -1;
     }
 
     char* line = NULL;
     size_t len;
-    while (getline(&line, &len, file) != -1) {
+    ssize_t result = 0;
+
+    while (result == 0 && getline(&line, &len, file) != -1) {
         if (line[0] == '#') {
             continue;
         }
 
         char* source = strtok(line, " \t");
+
+        // Global options: set <key> <value>
+        if (source && strcmp(source, "set") == 0) {
+            char* key = strtok(NULL, " \t");
+            char* option = strtok(NULL, "\r\n");
+            option = option ? trim_leading_whitespace(option) : NULL;
+            if (option) {
+                size_t length = strlen(option);
+                while (length > 0 && (option[length - 1] == ' ' || option[length - 1] == '\t')) {
+                    option[--length] = '\0';
+                }
+            }
+            if (!key || !option || !*option || (apply_options && config_set(key, option) < 0)) {
+                printf("Invalid option line\n");
+                result = -1;
+            }
+            continue;
+        }
+
+        // Socket options for routes and the listener: profile <name> <key>=<value> ...
+        if (source && strcmp(source, "profile") == 0) {
+            char* name = strtok(NULL, " \t\r\n");
+            if (!name || add_profile(dictionary, name, strtok(NULL, "\n")) < 0) {
+                printf("Invalid profile line\n");
+                result = -1;
+            }
+            continue;
+        }
+
         char* value = strtok(NULL, "\n");
         if (source && value) {
-            char* destination = strtok(value, ":");
-            destination = trim_leading_whitespace(destination);
-            char* port_str = strtok(NULL, "");
-            short port = port_str ? atoi(port_str) : 25565;
-            if (add_entry(source, destination, port) < 0) {
-                perror("Error adding entry");
-                return -1;
+            ParsedEntry parsed = { .balance = BALANCE_ROUND_ROBIN, .connect_timeout_ms = -1, .idle_timeout_s = -1 };
+            if (parse_backends(value, &parsed) < 0 || add_entry(dictionary, source, &parsed) < 0) {
+                printf("Error adding entry %s\n", source);
+                parsed_entry_free(&parsed);
+                result = -1;
             }
         }
     }
 
+    free(line);
+
+    // Profiles may be defined below the routes using them
+    for (size_t i = 0; result == 0 && i < dictionary->count; ++i) {
+        const char* profile = dictionary->items[i].profile;
+        if (profile != NULL && dictionary_profile(dictionary, profile) == NULL) {
+            printf("Unknown profile %s for %s\n", profile, dictionary->items[i].source);
+            result = -1;
+        }
+    }
+
     if (fclose(file) != 0) {
         perror("Error closing the file");
-        return -1;
+        result = -1;
     }
 
-    return 0;
+    return result;
 }
 
-Entry* find_entry(const char* key) {
-    pthread_mutex_lock(&servers_mutex);
+static ssize_t publish_dictionary(const char* filename, int apply_options) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Dictionary dictionary = {0};
+    ssize_t result = parse_dictionary(filename, &dictionary, apply_options);
 
-    for (size_t i = 0; i < dictionary.count; i++) {
-        if (strcmp(dictionary.items[i].source, key) == 0) {
-            pthread_mutex_unlock(&servers_mutex);
-            return &dictionary.items[i];
+    if (result == 0) {
+        RouteTable* table = table_build(&dictionary);
+        if (table == NULL) {
+            perror("Error building the server index");
+            result = -1;
+        } else {
+            routes_publish(table, elapsed_milliseconds(&start));
         }
     }
 
-    // Wildcard match
-    char* domain = strchr(key, '.');
-    if (domain) {
-        char wildcard_source[256];
-        snprintf(wildcard_source, sizeof(wildcard_source), "*%s", domain);
-
-        for (size_t i = 0; i < dictionary.count; i++) {
-            if (strcmp(dictionary.items[i].source, wildcard_source) == 0) {
-                pthread_mutex_unlock(&servers_mutex);
-                return &dictionary.items[i];
-            }
-        }
+    if (result != 0) {
+        pthread_mutex_lock(&routes_publish_mutex);
+        ++load_stats.failures;
+        pthread_mutex_unlock(&routes_publish_mutex);
     }
 
-    pthread_mutex_unlock(&servers_mutex);
+    dictionary_free(&dictionary);
+    return result;
+}
 
-    return NULL;
-}
\ No newline at end of file
+ssize_t load_dictionary(const char* filename) {
+    return publish_dictionary(filename, 1);
+}
+
+// Builds a fresh table from the file and swaps it in, on any error the current table stays in place.
+// Sessions that already routed keep their backend, new handshakes see the new table right away
+ssize_t reload_dictionary(const char* filename) {
+    return publish_dictionary(filename, 0);
+}
+
+void routes_load_stats(RoutesLoadStats* stats) {
+    pthread_mutex_lock(&routes_publish_mutex);
+    *stats = load_stats;
+    pthread_mutex_unlock(&routes_publish_mutex);
+}
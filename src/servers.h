@@ -4,18 +4,101 @@
 #define _GNU_SOURCE
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
+#include "metrics.h"
+#include "profiles.h"
+#include "shaper.h"
+
+#define MAX_HOSTNAME_LENGTH 255
+
+#define MAX_ROUTE_BACKENDS 64   // Failover remembers the backends it tried in a 64 bit mask
+#define MAX_BACKEND_WEIGHT 100
+
+enum BalancePolicy {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONNECTIONS,
+    BALANCE_FASTEST,            // Lowest smoothed round trip time measured on its connections
+    BALANCE_USERNAME_HASH       // A player keeps landing on the same backend while the set doesn't change
+};
+
+enum BackendHealth {
+    BACKEND_UNKNOWN,            // Not probed yet, or health checks are off
+    BACKEND_UP,
+    BACKEND_DEGRADED,           // Answering slowly, or failed its last probes but not enough of them to be down
+    BACKEND_DOWN                // Never picked, joins go to the other backends or fail right away
+};
+
+// Live numbers of one destination:port, shared by every route naming it and kept across reloads.
+// Written by the connections and the health checker, read by every selection without locks
+typedef struct {
+    atomic_uint active;         // Connections forwarded to it right now
+    atomic_uint rtt_us;         // Smoothed, 0 until its first connection
+    atomic_uint_least64_t failed_ms; // Monotonic time of the last failed connect, 0 if none
+    atomic_uint health;         // enum BackendHealth
+    atomic_uint probe_us;       // How long the last successful probe took
+    void* probe;                // The health checker's probe of it, only touched by that thread
+} BackendState;
+
 typedef struct {
-    char source[256];
-    char destination[256];
-    short port;
+    const char* destination;
+    unsigned short port;
+    unsigned char default_port;  // No port in servers.conf, the port of an SRV record takes precedence
+    uint8_t weight;
+    BackendState* state;
+} Backend;
+
+typedef struct {
+    const char* source;         // Normalized name, interned in the table's arena
+    Backend* backends;
+    uint32_t backend_count;
+    enum BalancePolicy balance;
+    atomic_uint rotation;       // Round robin position, and the tie breaker of the other policies
+    RouteMetrics* metrics;      // Shared with the same name in other tables, NULL if it couldn't be allocated
+    const SocketProfile* profile; // Applied to the client once routed and to its backend sockets
+    TokenBucket* bandwidth;     // Shared by the route's sessions, NULL without rate_mbps
+    uint32_t connect_timeout_ms; // Per backend tried, 0 waits as long as the kernel does
+    uint32_t idle_timeout_s;    // Sessions without traffic for this long are closed, 0 to keep them
 } Entry;
 
+// Immutable snapshot of servers.conf, readers hold a reference while they use its entries
+typedef struct RouteTable RouteTable;
+
+// Outcome of the most recent load of servers.conf
+typedef struct {
+    size_t entries;
+    double milliseconds;
+    size_t generation;          // Number of tables published so far
+    size_t failures;            // Reloads rejected because the file didn't parse
+} RoutesLoadStats;
+
 ssize_t load_dictionary(const char* filename);
-Entry* find_entry(const char* key);
+ssize_t reload_dictionary(const char* filename);
+void routes_load_stats(RoutesLoadStats* stats);
+
+RouteTable* routes_acquire();
+void routes_release(RouteTable* table);
+Entry* routes_find(const RouteTable* table, const char* key);
+size_t routes_count(const RouteTable* table);
+// The profile defined with that name, the built-in one for "default" unless the file overrides it, NULL if none
+const SocketProfile* routes_profile(const RouteTable* table, const char* name);
+// Every backend of every entry, in file order
+size_t routes_backend_count(const RouteTable* table);
+const Backend* routes_backend(const RouteTable* table, size_t index);
+// Writes every entry of the table in use with its backends and their live numbers, one line each
+void routes_dump(FILE* out);
+
+// Picks the backend for a connection among those not in the tried mask.
+// Returns its index, -1 if every backend has been tried
+ssize_t entry_select_backend(Entry* entry, const char* username, uint64_t tried);
+// Connection accounting for the selection, rtt_us 0 when it couldn't be measured
+void backend_connected(BackendState* state, uint32_t rtt_us);
+void backend_disconnected(BackendState* state);
+void backend_failed(BackendState* state);
 
-#endif // SERVERS_H
\ No newline at end of file
+#endif // SERVERS_H
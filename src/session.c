@@ -0,0 +1,372 @@
+#include "session.h"
+#include "servers.h"
+#include "packet-tools.h"
+#include "dns.h"
+#include "config.h"
+#include "buffers.h"
+#include "limiter.h"
+#include "registry.h"
+
+#include <time.h>
+#include <netinet/tcp.h>
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+ssize_t session_init(Session* session) {
+    memset(session, 0, sizeof(*session));
+
+    session->handshake = buffer_alloc(HANDSHAKE_BUFFER_SIZE);
+    if (session->handshake == NULL) {
+        return -1;
+    }
+
+    session->state = SESSION_HANDSHAKE;
+    session->handshaking = 1;
+    packet_decoder_init(&session->decoder);
+    trace_mark(&session->trace, TRACE_ACCEPTED);
+    metrics_add(GLOBAL_ACCEPTED, 1);
+    return 0;
+}
+
+// Gives back the handshake slot limiter_admit handed out when the connection was accepted
+static void session_handshake_done(Session* session) {
+    if (session->handshaking) {
+        limiter_handshake_done();
+        session->handshaking = 0;
+    }
+}
+
+void session_destroy(Session* session) {
+    trace_finish(&session->trace, session->server_ip_address, session->username, session->resolved_address);
+    session_handshake_done(session);
+    status_response_release(session->status);
+    session->status = NULL;
+    if (session->backend_active) {
+        backend_disconnected(session->backend_state);
+        session->backend_active = 0;
+    }
+    metrics_route_add(session->metrics, ROUTE_SESSIONS_CLOSED, 1);
+    session->metrics = NULL;
+    metrics_add(GLOBAL_CLOSED, 1);
+    routes_release(session->routes);
+    session->routes = NULL;
+    session->entry = NULL;
+    buffer_free(session->handshake);
+    free(session->server_ip_address);
+    free(session->destination);
+    session->handshake = NULL;
+    session->server_ip_address = NULL;
+    session->destination = NULL;
+}
+
+static ssize_t session_handshake_parse(Session* session) {
+    enum PacketStatus status = packet_decoder_feed(&session->decoder, session->handshake, session->handshake_length);
+
+    if (status == PACKET_MALFORMED) {
+        return -1;
+    }
+    if (status == PACKET_NEED_MORE) {
+        return session->handshake_length >= HANDSHAKE_BUFFER_SIZE ? -1 : 0;
+    }
+
+    // Forge and BungeeCord append their data to the hostname after a NUL
+    const PacketDecoder* decoder = &session->decoder;
+    const char* address = session->handshake + decoder->server_address.offset;
+    size_t address_length = strnlen(address, decoder->server_address.length);
+
+    if (address_length == 0 || address_length >= 256) {
+        return -1;
+    }
+
+    session->server_ip_address = strndup(address, address_length);
+    if (session->server_ip_address == NULL) {
+        return -1;
+    }
+
+    session->is_login = decoder->next_state != PACKET_STATE_STATUS;
+    if (session->is_login) {
+        if (decoder->username.length >= sizeof(session->username)) {
+            return -1;
+        }
+        memcpy(session->username, session->handshake + decoder->username.offset, decoder->username.length);
+        session->username[decoder->username.length] = '\0';
+    }
+
+    return 1;
+}
+
+// Feeds the newly buffered bytes to the decoder, which picks up where the last read stopped.
+// Returns 1 when ready to route, 0 if more bytes are needed, -1 if the packet is malformed
+ssize_t session_handshake_ready(Session* session) {
+    ssize_t ready = session_handshake_parse(session);
+    if (ready < 0) {
+        metrics_add(GLOBAL_ERROR_MALFORMED, 1);
+    } else if (ready == 1) {
+        trace_mark(&session->trace, TRACE_HANDSHAKE);
+    }
+    return ready;
+}
+
+// Connects to the first address of the answer, the cache already rotates them between sessions
+static ssize_t session_set_backend(Session* session, const DnsAnswer* answer) {
+    session->backend_length = dns_answer_address(answer, session->port, session->default_port, &session->backend);
+    if (session->backend_length == 0) {
+        printf("Could not resolve the hostname\n");
+        metrics_route_add(session->metrics, ROUTE_ERROR_RESOLVE, 1);
+        return -1;
+    }
+
+    const DnsAddress* address = &answer->addresses[0];
+    inet_ntop(address->family, &address->v4, session->resolved_address, sizeof(session->resolved_address));
+    trace_mark(&session->trace, TRACE_RESOLVED);
+    return 0;
+}
+
+// Server list pings are answered from the status cache when it has the route's response
+static int session_answer_status(Session* session, Entry* entry) {
+    if (session->is_login || config.status_cache_ttl_ms == 0) {
+        return 0;
+    }
+
+    // Refreshes are balanced like logins, there is no username to hash
+    ssize_t index = entry_select_backend(entry, "", 0);
+    const Backend* backend = &entry->backends[index < 0 ? 0 : index];
+
+    StatusTarget target = {
+        .hostname = session->server_ip_address,
+        .destination = backend->destination,
+        .port = backend->port,
+        .default_port = backend->default_port,
+        .protocol_version = session->decoder.protocol_version,
+    };
+    session->status = status_cache_lookup(entry->source, &target);
+    if (session->status == NULL) {
+        return 0;
+    }
+
+    session->status_position = session->decoder.position;
+    session->state = SESSION_STATUS;
+    metrics_route_add(session->metrics, ROUTE_STATUS_CACHED, 1);
+    return 1;
+}
+
+// Picks the next untried backend of the route and looks its address up.
+// Returns 0 once the address is known, 1 if it is being resolved, -1 if no backend is left
+static ssize_t session_next_backend(Session* session, ResolveQueue* queue) {
+    while (1) {
+        ssize_t index = entry_select_backend(session->entry, session->username, session->tried);
+        if (index < 0) {
+            printf("No backend left for %s\n", session->server_ip_address);
+            metrics_route_add(session->metrics, ROUTE_ERROR_NO_BACKEND, 1);
+            return -1;
+        }
+
+        const Backend* backend = &session->entry->backends[index];
+        session->tried |= 1ULL << index;
+        session->backend_state = backend->state;
+        session->port = backend->port;
+        session->default_port = backend->default_port;
+
+        free(session->destination);
+        session->destination = strdup(backend->destination);
+        if (session->destination == NULL) {
+            perror("Error allocating memory");
+            return -1;
+        }
+
+        // IP addresses and cached names connect right away, anything else goes to the resolver
+        DnsAnswer answer;
+        switch (dns_cache_lookup(session->destination, &answer)) {
+            case DNS_CACHE_HIT:
+                metrics_route_add(session->metrics, ROUTE_DNS_HITS, 1);
+                if (session_set_backend(session, &answer) == 0) {
+                    return 0;
+                }
+                break;
+            case DNS_CACHE_NEGATIVE:
+                printf("Could not resolve the hostname\n");
+                metrics_route_add(session->metrics, ROUTE_DNS_HITS, 1);
+                metrics_route_add(session->metrics, ROUTE_ERROR_RESOLVE, 1);
+                break;
+            case DNS_CACHE_MISS:
+                metrics_route_add(session->metrics, ROUTE_DNS_MISSES, 1);
+                resolver_lookup(&session->resolve, session->destination, queue);
+                return 1;
+        }
+
+        backend_failed(session->backend_state);
+    }
+}
+
+// Looks up the route for the handshake. Returns 0 once the backend address is known, 1 if its
+// hostname is being resolved and the session comes back on the queue, 2 if the status cache
+// answers the ping and there is no backend, -1 if there is no route
+ssize_t session_route(Session* session, ResolveQueue* queue) {
+    session_handshake_done(session);
+
+    // Find the server in the dictionary, the table can't be freed while we hold it
+    RouteTable* routes = routes_acquire();
+    Entry* entry = routes_find(routes, session->server_ip_address);
+
+    // Exit if the target server is not found
+    if (entry == NULL) {
+        printf("Server not found (%s)\n", session->server_ip_address);
+        metrics_add(GLOBAL_ERROR_UNKNOWN_ROUTE, 1);
+        routes_release(routes);
+        return -1;
+    }
+
+    // Players already on a drained route stay, new ones are turned away
+    if (session->is_login && registry_draining(entry->source)) {
+        printf("Route %s is drained\n", entry->source);
+        metrics_route_add(metrics_route_slot(entry->metrics), ROUTE_DRAINED, 1);
+        routes_release(routes);
+        return -1;
+    }
+
+    session->metrics = metrics_route_slot(entry->metrics);
+    session->routed_us = now_us();
+    trace_mark(&session->trace, TRACE_ROUTED);
+    metrics_route_add(session->metrics, ROUTE_SESSIONS, 1);
+
+    if (session_answer_status(session, entry)) {
+        routes_release(routes);
+        return 2;
+    }
+
+    // The table stays referenced until the backend is connected, a failed connect moves on to the next backend
+    session->routes = routes;
+    session->entry = entry;
+    return session_next_backend(session, queue);
+}
+
+// Fails over to the next backend of the route, returns like session_route
+static ssize_t session_fail_over(Session* session, ResolveQueue* queue) {
+    if (session->entry == NULL) {
+        return -1;
+    }
+
+    backend_failed(session->backend_state);
+    return session_next_backend(session, queue);
+}
+
+// Picks up the result of the lookup started for the current backend, returns like session_route
+ssize_t session_resolved(Session* session, ResolveQueue* queue) {
+    if (session->resolve.status != 0) {
+        printf("Could not resolve the hostname\n");
+        metrics_route_add(session->metrics, ROUTE_ERROR_RESOLVE, 1);
+        return session_fail_over(session, queue);
+    }
+
+    if (session_set_backend(session, &session->resolve.answer) < 0) {
+        return session_fail_over(session, queue);
+    }
+    return 0;
+}
+
+// The current backend couldn't be connected to, fails over to the next one of the route.
+// Returns like session_route
+ssize_t session_backend_failed(Session* session, ResolveQueue* queue) {
+    metrics_route_add(session->metrics, ROUTE_ERROR_CONNECT, 1);
+    return session_fail_over(session, queue);
+}
+
+// Counts the connection towards the backend and samples the round trip time the kernel measured
+void session_connected(Session* session, int server_socket) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    uint32_t rtt_us = getsockopt(server_socket, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 ? info.tcpi_rtt : 0;
+
+    trace_mark(&session->trace, TRACE_CONNECTED);
+    backend_connected(session->backend_state, rtt_us);
+    session->backend_active = 1;
+    metrics_route_latency(session->metrics, now_us() - session->routed_us);
+
+    routes_release(session->routes);
+    session->routes = NULL;
+    session->entry = NULL;
+}
+
+// Answers the next Status Request or Ping buffered so far. The reply points into the session and
+// stays valid as long as it, the caller sends it and only calls again once it is out.
+// Returns 1 once the reply is the Pong and the connection can be closed after it, 0 to send the
+// reply if there is one and then wait for more bytes, -1 if the client broke the protocol
+ssize_t session_status_advance(Session* session, const char** reply, uint32_t* reply_length) {
+    *reply = NULL;
+    *reply_length = 0;
+
+    int32_t packet_length;
+    const char* packet = session->handshake + session->status_position;
+    uint32_t available = session->handshake_length - session->status_position;
+    ssize_t header = varint_decode(packet, available, &packet_length);
+
+    if (header < 0 || (header > 0 && (packet_length <= 0 || packet_length > 9))) {
+        metrics_add(GLOBAL_ERROR_MALFORMED, 1);
+        return -1;
+    }
+    if (header == 0 || available < header + (uint32_t)packet_length) {
+        if (session->handshake_length >= HANDSHAKE_BUFFER_SIZE) {
+            metrics_add(GLOBAL_ERROR_MALFORMED, 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Status Request: no fields, answered once
+    if (packet[header] == 0x00 && packet_length == 1 && !session->status_sent) {
+        *reply = session->status->data;
+        *reply_length = session->status->length;
+        session->status_sent = 1;
+        session->status_position += header + packet_length;
+        return 0;
+    }
+
+    // Ping: the Pong is the same packet sent back
+    if (packet[header] == 0x01 && packet_length == 9) {
+        *reply = packet;
+        *reply_length = header + packet_length;
+        session->status_position += header + packet_length;
+        return 1;
+    }
+
+    metrics_add(GLOBAL_ERROR_MALFORMED, 1);
+    return -1;
+}
+
+// Hands the buffered client bytes over to the caller, who becomes responsible for freeing them with buffer_free
+char* session_take_handshake(Session* session, uint32_t* length) {
+    char* handshake = session->handshake;
+    *length = session->handshake_length;
+    metrics_route_add(session->metrics, ROUTE_BYTES_FROM_CLIENT, session->handshake_length);
+
+    session->handshake = NULL;
+    session->handshake_length = 0;
+    return handshake;
+}
+
+void session_log(Session* session, int client_socket, enum LogConnectionType connection_type) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_length = sizeof(client_address);
+
+    // Only players joining the server are logged
+    if (session->is_login != 1) {
+        return;
+    }
+
+    // Get the client's IP address
+    if (getpeername(client_socket, (struct sockaddr *)&client_address, &client_address_length) == -1) {
+        perror("getpeername failed");
+        return;
+    }
+
+    // Convert the client's IP address to a string
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_address.sin_addr, client_ip, sizeof(client_ip));
+
+    // Log the connection
+    log_connection(session->username, client_ip, session->server_ip_address, session->resolved_address, connection_type);
+}
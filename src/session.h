@@ -0,0 +1,73 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "packet-tools.h"
+#include "resolver.h"
+#include "servers.h"
+#include "status.h"
+#include "trace.h"
+
+#define HANDSHAKE_BUFFER_SIZE 1024 // Handshake + Login Start, with room for Forge suffixes
+
+enum SessionState {
+    SESSION_HANDSHAKE, // Reading the handshake from the client
+    SESSION_STATUS,    // Answering a server list ping from the status cache, there is no backend
+    SESSION_RESOLVE,   // Waiting for the resolver to look up the backend's hostname
+    SESSION_CONNECT,   // Waiting for the backend connect() to complete
+    SESSION_PIPE,      // Forwarding bytes in both directions
+    SESSION_CLOSED     // Torn down, waiting to be freed at the end of the event batch
+};
+
+// Per-connection protocol state shared by the I/O backends
+typedef struct {
+    enum SessionState state;
+    int is_login;
+    uint8_t handshaking;        // Holds one of the limiter's handshake slots, given back once routed
+    char* handshake;            // Bytes received before the backend was connected, replayed on connect
+    uint32_t handshake_length;
+    PacketDecoder decoder;      // Frames the handshake and Login Start as the bytes trickle in
+    char* server_ip_address;    // Hostname the client asked for
+    RouteTable* routes;         // Held from routing until the backend is connected, failover picks from it
+    Entry* entry;
+    uint64_t tried;             // Backends of the entry tried so far, by index
+    BackendState* backend_state; // Backend being connected to, or forwarded to
+    uint8_t backend_active;     // Counted in the backend's active connections
+    RouteSlot* metrics;         // This thread's counters of the route, NULL until routed
+    uint64_t routed_us;         // When the handshake was complete, connect latency is measured from here
+    char* destination;          // Backend hostname from the route, copied so it outlives the route table
+    char username[32];
+    char resolved_address[INET6_ADDRSTRLEN];
+    unsigned short port;        // Port from servers.conf
+    unsigned char default_port; // servers.conf gave no port, an SRV port wins
+    struct sockaddr_storage backend;
+    socklen_t backend_length;
+    ResolveRequest resolve;
+    StatusResponse* status;     // Cached response being served
+    uint32_t status_position;   // Next unanswered packet in the handshake buffer
+    uint8_t status_sent;
+    SessionTrace trace;
+} Session;
+
+// The connection must have been admitted by limiter_admit, the session owns its handshake slot
+ssize_t session_init(Session* session);
+void session_destroy(Session* session);
+ssize_t session_handshake_ready(Session* session);
+ssize_t session_route(Session* session, ResolveQueue* queue);
+ssize_t session_resolved(Session* session, ResolveQueue* queue);
+ssize_t session_backend_failed(Session* session, ResolveQueue* queue);
+void session_connected(Session* session, int server_socket);
+ssize_t session_status_advance(Session* session, const char** reply, uint32_t* reply_length);
+char* session_take_handshake(Session* session, uint32_t* length);
+void session_log(Session* session, int client_socket, enum LogConnectionType connection_type);
+
+#endif // SESSION_H
@@ -0,0 +1,217 @@
+#include "shaper.h"
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUTE_BUCKETS 256
+
+typedef struct RouteBucket {
+    TokenBucket bucket;
+    char* route;
+    struct RouteBucket* next;
+} RouteBucket;
+
+static struct {
+    pthread_mutex_t mutex;          // Only guards creating route buckets
+    RouteBucket* buckets[ROUTE_BUCKETS];
+    TokenBucket global;
+} shaper = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+uint64_t shaper_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t burst_ns() {
+    return (config.shaping_burst_ms > 0 ? config.shaping_burst_ms : 1) * 1000000;
+}
+
+void token_bucket_set(TokenBucket* bucket, uint64_t rate, uint64_t burst_ns) {
+    atomic_store_explicit(&bucket->burst_ns, burst_ns, memory_order_relaxed);
+    atomic_store_explicit(&bucket->rate, rate, memory_order_relaxed);
+}
+
+size_t token_bucket_available(TokenBucket* bucket, uint64_t now_ns) {
+    uint64_t rate = atomic_load_explicit(&bucket->rate, memory_order_relaxed);
+    if (rate == 0) {
+        return SIZE_MAX;
+    }
+
+    uint64_t burst = atomic_load_explicit(&bucket->burst_ns, memory_order_relaxed);
+    uint64_t full = atomic_load_explicit(&bucket->full_ns, memory_order_relaxed);
+    uint64_t ahead = full > now_ns ? full - now_ns : 0;
+    if (ahead >= burst) {
+        return 0;
+    }
+    // In microseconds, bytes per second times nanoseconds would overflow past a few seconds of burst
+    return (burst - ahead) / 1000 * rate / 1000000;
+}
+
+void token_bucket_charge(TokenBucket* bucket, size_t bytes, uint64_t now_ns) {
+    uint64_t rate = atomic_load_explicit(&bucket->rate, memory_order_relaxed);
+    if (rate == 0 || bytes == 0) {
+        return;
+    }
+
+    uint64_t cost = (uint64_t)bytes * 1000000000 / rate;
+    uint64_t full = atomic_load_explicit(&bucket->full_ns, memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = (full > now_ns ? full : now_ns) + cost;
+    } while (!atomic_compare_exchange_weak_explicit(&bucket->full_ns, &full, next, memory_order_relaxed, memory_order_relaxed));
+}
+
+void shaper_init() {
+    token_bucket_set(&shaper.global, (uint64_t)config.shaping_global_mbps * 125000, burst_ns());
+}
+
+static size_t hash_route(const char* route) {
+    size_t hash = 2166136261u;
+    for (; *route != '\0'; ++route) {
+        hash = (hash ^ (unsigned char)*route) * 16777619u;
+    }
+    return hash % ROUTE_BUCKETS;
+}
+
+TokenBucket* shaper_route(const char* route, uint64_t rate_mbps) {
+    size_t index = hash_route(route);
+
+    pthread_mutex_lock(&shaper.mutex);
+    RouteBucket* found = shaper.buckets[index];
+    while (found != NULL && strcmp(found->route, route) != 0) {
+        found = found->next;
+    }
+
+    if (found == NULL && rate_mbps > 0) {
+        found = calloc(1, sizeof(RouteBucket));
+        if (found != NULL && (found->route = strdup(route)) == NULL) {
+            free(found);
+            found = NULL;
+        }
+        if (found != NULL) {
+            found->next = shaper.buckets[index];
+            shaper.buckets[index] = found;
+        }
+    }
+    pthread_mutex_unlock(&shaper.mutex);
+
+    if (found == NULL) {
+        return NULL;
+    }
+
+    // Sessions still holding the bucket of a route whose limit was removed stop being limited
+    token_bucket_set(&found->bucket, rate_mbps * 125000, burst_ns());
+    return rate_mbps > 0 ? &found->bucket : NULL;
+}
+
+int shaped_flow_init(ShapedFlow* flow, TokenBucket* route) {
+    memset(flow, 0, sizeof(*flow));
+    flow->route = route;
+    token_bucket_set(&flow->session, (uint64_t)config.shaping_session_kbps * 125, burst_ns());
+    return route != NULL || config.shaping_session_kbps > 0 || config.shaping_global_mbps > 0;
+}
+
+size_t shaped_flow_grant(ShapedFlow* flow, uint64_t now_ns, enum ShapingScope* limited) {
+    size_t session = token_bucket_available(&flow->session, now_ns);
+    size_t route = flow->route != NULL ? token_bucket_available(flow->route, now_ns) : SIZE_MAX;
+    size_t global = token_bucket_available(&shaper.global, now_ns);
+
+    size_t grant = session;
+    *limited = SHAPING_SESSION;
+    if (route < grant) {
+        grant = route;
+        *limited = SHAPING_ROUTE;
+    }
+    if (global < grant) {
+        grant = global;
+        *limited = SHAPING_GLOBAL;
+    }
+
+    if (flow->backlogged) {
+        return grant < flow->deficit ? grant : flow->deficit;
+    }
+
+    // The shared buckets go into debt for it, the backlog pays it back
+    if (grant < config.shaping_interactive_bytes && *limited != SHAPING_SESSION) {
+        size_t interactive = session < config.shaping_interactive_bytes ? session : config.shaping_interactive_bytes;
+        if (interactive > grant) {
+            metrics_add(GLOBAL_SHAPING_INTERACTIVE, 1);
+            grant = interactive;
+        }
+    }
+    return grant;
+}
+
+void shaped_flow_charge(ShapedFlow* flow, size_t bytes, uint64_t now_ns) {
+    token_bucket_charge(&flow->session, bytes, now_ns);
+    if (flow->route != NULL) {
+        token_bucket_charge(flow->route, bytes, now_ns);
+    }
+    token_bucket_charge(&shaper.global, bytes, now_ns);
+    flow->deficit = bytes < flow->deficit ? flow->deficit - bytes : 0;
+}
+
+void shaped_queue_push(ShapedQueue* queue, ShapedFlow* flow, enum ShapingScope limited, RouteSlot* metrics) {
+    if (flow->queued) {
+        return;
+    }
+
+    if (!flow->backlogged) {
+        static const enum GlobalCounter counters[SHAPING_SCOPES] = {
+            GLOBAL_SHAPING_QUEUED_SESSION,
+            GLOBAL_SHAPING_QUEUED_ROUTE,
+            GLOBAL_SHAPING_QUEUED_GLOBAL,
+        };
+        metrics_add(counters[limited], 1);
+        metrics_route_add(metrics, ROUTE_SHAPING_QUEUED, 1);
+        flow->backlogged = 1;
+        flow->deficit = 0;
+    }
+
+    flow->prev = queue->tail;
+    flow->next = NULL;
+    if (queue->tail != NULL) {
+        queue->tail->next = flow;
+    } else {
+        queue->head = flow;
+    }
+    queue->tail = flow;
+    flow->queued = 1;
+    ++queue->count;
+}
+
+static void unlink_flow(ShapedQueue* queue, ShapedFlow* flow) {
+    if (flow->prev != NULL) {
+        flow->prev->next = flow->next;
+    } else {
+        queue->head = flow->next;
+    }
+    if (flow->next != NULL) {
+        flow->next->prev = flow->prev;
+    } else {
+        queue->tail = flow->prev;
+    }
+    flow->prev = flow->next = NULL;
+    flow->queued = 0;
+    --queue->count;
+}
+
+ShapedFlow* shaped_queue_pop(ShapedQueue* queue) {
+    ShapedFlow* flow = queue->head;
+    if (flow != NULL) {
+        unlink_flow(queue, flow);
+    }
+    return flow;
+}
+
+void shaped_queue_finish(ShapedQueue* queue, ShapedFlow* flow) {
+    if (flow->queued) {
+        unlink_flow(queue, flow);
+    }
+    flow->backlogged = 0;
+    flow->deficit = 0;
+}
@@ -0,0 +1,78 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "metrics.h"
+
+#define SHAPING_QUANTUM 16384       // Bytes a backlogged session is granted per round, one chunk packet or so
+#define SHAPING_TICK_MS 2           // How often a worker with backlogged sessions hands out more
+
+enum ShapingScope {
+    SHAPING_SESSION,
+    SHAPING_ROUTE,
+    SHAPING_GLOBAL,
+    SHAPING_SCOPES
+};
+
+// A token bucket of bytes, kept as the time it will be full again (GCRA) so a charge is one atomic
+// update. Charges may overdraw it, the bytes after them then wait for the debt to be paid back
+typedef struct {
+    atomic_uint_least64_t rate;     // Bytes per second, 0 for no limit
+    atomic_uint_least64_t burst_ns; // How far ahead of now full_ns may be before nothing is available
+    atomic_uint_least64_t full_ns;
+} TokenBucket;
+
+// One direction of a session being shaped, the worker queues it while its buckets are empty
+typedef struct ShapedFlow {
+    TokenBucket session;
+    TokenBucket* route;         // Shared by the route's sessions across reloads, NULL if the route has no rate_mbps
+    uint32_t deficit;           // Bytes the scheduler granted that haven't been read yet
+    uint8_t backlogged;         // Only the scheduler reads it, events just flush what was already read
+    uint8_t queued;             // Linked in the queue, a backlogged flow being served isn't
+    struct ShapedFlow* prev;
+    struct ShapedFlow* next;
+} ShapedFlow;
+
+// Flows of one worker waiting for bandwidth, served round robin a quantum at a time (deficit round robin)
+typedef struct {
+    ShapedFlow* head;
+    ShapedFlow* tail;
+    size_t count;
+} ShapedQueue;
+
+uint64_t shaper_now_ns();
+
+void token_bucket_set(TokenBucket* bucket, uint64_t rate, uint64_t burst_ns);
+// Bytes that can go out right now, SIZE_MAX without a limit
+size_t token_bucket_available(TokenBucket* bucket, uint64_t now_ns);
+void token_bucket_charge(TokenBucket* bucket, size_t bytes, uint64_t now_ns);
+
+// Sets the global bucket from the config
+void shaper_init();
+// The bucket of a route, created on first use and kept for the life of the process. Its rate is
+// set from rate_mbps on every load, 0 turns it off
+TokenBucket* shaper_route(const char* route, uint64_t rate_mbps);
+
+// Sets up the flow of a newly routed session. Returns 0 if nothing limits it, it then needn't be shaped
+int shaped_flow_init(ShapedFlow* flow, TokenBucket* route);
+// How much the flow may read now, a backlogged flow at most its deficit. Outside the backlog, small
+// reads still go through when only the shared buckets are empty, so interactive traffic isn't stuck
+// behind bulk transfers. Sets the bucket that limited the grant
+size_t shaped_flow_grant(ShapedFlow* flow, uint64_t now_ns, enum ShapingScope* limited);
+void shaped_flow_charge(ShapedFlow* flow, size_t bytes, uint64_t now_ns);
+
+// Queues a flow that used up its grant with bytes left to read, or puts a served one back at the tail.
+// Newly queued flows are counted by the bucket that limited them
+void shaped_queue_push(ShapedQueue* queue, ShapedFlow* flow, enum ShapingScope limited, RouteSlot* metrics);
+// Takes the next flow to serve, it stays backlogged until pushed back or finished
+ShapedFlow* shaped_queue_pop(ShapedQueue* queue);
+// Once the flow has nothing left to read, or its connection closes
+void shaped_queue_finish(ShapedQueue* queue, ShapedFlow* flow);
+
+#endif // SHAPER_H
@@ -0,0 +1,230 @@
+#include "sockmap.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define VERIFIER_LOG_SIZE 4096
+#define STATE_CLOSE_WAIT 8          // TCP_CLOSE_WAIT, the peer's FIN came in
+
+#define INSN(c, d, s, o, i) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+
+static struct {
+    int sockets;                    // Sockhash of the handed over sockets, by cookie
+    int peers;                      // Hash of the cookie of each socket's peer, by its own cookie
+    int program;
+    int enabled;
+} sockmap = { .sockets = -1, .peers = -1, .program = -1 };
+
+static long bpf(int command, union bpf_attr* attributes) {
+    return syscall(__NR_bpf, command, attributes, sizeof(*attributes));
+}
+
+static int map_create(enum bpf_map_type type, uint32_t key_size, uint32_t value_size, uint32_t flags) {
+    union bpf_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.map_type = type;
+    attributes.key_size = key_size;
+    attributes.value_size = value_size;
+    attributes.max_entries = SOCKMAP_CAPACITY;
+    attributes.map_flags = flags;
+    return bpf(BPF_MAP_CREATE, &attributes);
+}
+
+static long map_update(int map, const void* key, const void* value) {
+    union bpf_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.map_fd = map;
+    attributes.key = (uint64_t)(uintptr_t)key;
+    attributes.value = (uint64_t)(uintptr_t)value;
+    attributes.flags = BPF_ANY;
+    return bpf(BPF_MAP_UPDATE_ELEM, &attributes);
+}
+
+static void map_delete(int map, const void* key) {
+    union bpf_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.map_fd = map;
+    attributes.key = (uint64_t)(uintptr_t)key;
+    bpf(BPF_MAP_DELETE_ELEM, &attributes);
+}
+
+// Stream verdict for every chunk arriving on a handed over socket: looks up the socket's peer and
+// sends the chunk out of it. Sockets without a peer keep their bytes, as if they weren't in the map
+static int load_program() {
+    struct bpf_insn code[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+        INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, sockmap.peers),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 7, 0),
+        // The peer's cookie is its key in the sockhash
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, sockmap.sockets),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    static char log[VERIFIER_LOG_SIZE];
+    union bpf_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attributes.insns = (uint64_t)(uintptr_t)code;
+    attributes.insn_cnt = sizeof(code) / sizeof(code[0]);
+    attributes.license = (uint64_t)(uintptr_t)"Dual MIT/GPL";
+    attributes.log_buf = (uint64_t)(uintptr_t)log;
+    attributes.log_size = sizeof(log);
+    attributes.log_level = 1;
+
+    int program = bpf(BPF_PROG_LOAD, &attributes);
+    if (program < 0 && errno != EPERM && log[0] != '\0') {
+        printf("The sockmap program was rejected:\n%s", log);
+    }
+    return program;
+}
+
+ssize_t sockmap_init() {
+    sockmap.sockets = map_create(BPF_MAP_TYPE_SOCKHASH, sizeof(uint64_t), sizeof(uint32_t), 0);
+    if (sockmap.sockets < 0) {
+        perror("Error creating the sockmap");
+        return -1;
+    }
+
+    sockmap.peers = map_create(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint64_t), BPF_F_NO_PREALLOC);
+    if (sockmap.peers < 0) {
+        perror("Error creating the sockmap peers");
+        close(sockmap.sockets);
+        return -1;
+    }
+
+    sockmap.program = load_program();
+    if (sockmap.program < 0) {
+        perror("Error loading the sockmap program");
+        close(sockmap.peers);
+        close(sockmap.sockets);
+        return -1;
+    }
+
+    union bpf_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.target_fd = sockmap.sockets;
+    attributes.attach_bpf_fd = sockmap.program;
+    attributes.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+    if (bpf(BPF_PROG_ATTACH, &attributes) < 0) {
+        perror("Error attaching the sockmap program");
+        close(sockmap.program);
+        close(sockmap.peers);
+        close(sockmap.sockets);
+        return -1;
+    }
+
+    sockmap.enabled = 1;
+    return 0;
+}
+
+int sockmap_enabled() {
+    return sockmap.enabled;
+}
+
+// Bytes the socket received and bytes written to it so far, sent or still queued
+static ssize_t socket_counts(int fd, uint64_t* received, uint64_t* written) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    int queued;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1 ||
+        length < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received) ||
+        ioctl(fd, SIOCOUTQ, &queued) == -1) {
+        return -1;
+    }
+    // The FIN takes a sequence number too, the sockets are never shut down from this side
+    *received = info.tcpi_bytes_received - (info.tcpi_state == STATE_CLOSE_WAIT);
+    *written = info.tcpi_bytes_acked + queued;
+    return 0;
+}
+
+ssize_t sockmap_attach(int client, int server, SockmapPair* pair) {
+    socklen_t length = sizeof(uint64_t);
+    if (getsockopt(client, SOL_SOCKET, SO_COOKIE, &pair->client_cookie, &length) == -1 ||
+        getsockopt(server, SOL_SOCKET, SO_COOKIE, &pair->server_cookie, &length) == -1 ||
+        socket_counts(client, &pair->client_received, &pair->client_written) < 0 ||
+        socket_counts(server, &pair->server_received, &pair->server_written) < 0) {
+        return -1;
+    }
+
+    uint32_t client_fd = client, server_fd = server;
+    if (map_update(sockmap.peers, &pair->client_cookie, &pair->server_cookie) < 0 ||
+        map_update(sockmap.peers, &pair->server_cookie, &pair->client_cookie) < 0 ||
+        map_update(sockmap.sockets, &pair->server_cookie, &server_fd) < 0 ||
+        map_update(sockmap.sockets, &pair->client_cookie, &client_fd) < 0) {
+        int error = errno;
+        map_delete(sockmap.sockets, &pair->server_cookie);
+        sockmap_detach(pair);
+        errno = error;
+        return -1;
+    }
+
+    // The program only runs as bytes arrive. Setting the low watermark tells a socket to look at its
+    // queue again, so bytes that came in before it was added go first
+    int one = 1;
+    setsockopt(server, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+    setsockopt(client, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+    return 0;
+}
+
+void sockmap_detach(const SockmapPair* pair) {
+    map_delete(sockmap.peers, &pair->client_cookie);
+    map_delete(sockmap.peers, &pair->server_cookie);
+}
+
+ssize_t sockmap_forwarded(int client, int server, const SockmapPair* pair, uint64_t* from_client, uint64_t* to_client) {
+    uint64_t client_received, server_received, written;
+    if (socket_counts(client, &client_received, &written) < 0 || socket_counts(server, &server_received, &written) < 0) {
+        return -1;
+    }
+    *from_client = client_received - pair->client_received;
+    *to_client = server_received - pair->server_received;
+    return 0;
+}
+
+int sockmap_flushed(int client, int server, const SockmapPair* pair, int from_client) {
+    uint64_t client_received, client_written, server_received, server_written;
+    if (socket_counts(client, &client_received, &client_written) < 0 ||
+        socket_counts(server, &server_received, &server_written) < 0) {
+        return 1;
+    }
+    if (from_client) {
+        return server_written - pair->server_written >= client_received - pair->client_received;
+    }
+    return client_written - pair->client_written >= server_received - pair->server_received;
+}
+
+uint64_t sockmap_idle_ms(int client, int server) {
+    struct tcp_info client_info, server_info;
+    socklen_t length = sizeof(client_info);
+    if (getsockopt(client, IPPROTO_TCP, TCP_INFO, &client_info, &length) == -1) {
+        return 0;
+    }
+    length = sizeof(server_info);
+    if (getsockopt(server, IPPROTO_TCP, TCP_INFO, &server_info, &length) == -1) {
+        return 0;
+    }
+    return client_info.tcpi_last_data_recv < server_info.tcpi_last_data_recv ? client_info.tcpi_last_data_recv : server_info.tcpi_last_data_recv;
+}
@@ -0,0 +1,42 @@
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SOCKMAP_CAPACITY 131072     // Sockets the kernel may forward for at once, sessions past it stay in userspace
+#define SOCKMAP_DRAIN_MS 1000       // How long a closing session waits for the kernel to forward its last bytes
+
+// A session whose sockets the kernel forwards between. The byte counts are the sockets' when they
+// were handed over, userspace counted everything before
+typedef struct {
+    uint64_t client_cookie;
+    uint64_t server_cookie;
+    uint64_t client_received;
+    uint64_t server_received;
+    uint64_t client_written;
+    uint64_t server_written;
+} SockmapPair;
+
+// Loads the verdict program and its maps. Returns -1 if BPF isn't permitted or the kernel lacks
+// sockmap support, sessions are then forwarded in userspace
+ssize_t sockmap_init();
+int sockmap_enabled();
+
+// Hands a session's connected sockets to the kernel, which forwards whatever arrives on one out of
+// the other from then on, bytes already queued on them included. Nothing may be waiting in userspace
+// to be written to either. Returns -1 if they couldn't be added, they are left as they were
+ssize_t sockmap_attach(int client, int server, SockmapPair* pair);
+// Forgets the pair before its sockets are closed, closing them takes them out of the sockmap
+void sockmap_detach(const SockmapPair* pair);
+
+// Bytes received from the client and the server since the sockets were handed over
+ssize_t sockmap_forwarded(int client, int server, const SockmapPair* pair, uint64_t* from_client, uint64_t* to_client);
+// Whether everything the kernel received from one side went out of the other
+int sockmap_flushed(int client, int server, const SockmapPair* pair, int from_client);
+// Milliseconds since data last arrived on either socket
+uint64_t sockmap_idle_ms(int client, int server);
+
+#endif // SOCKMAP_H
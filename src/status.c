@@ -0,0 +1,653 @@
+#include "status.h"
+#include "config.h"
+#include "dns.h"
+#include "packet-tools.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define STATUS_SHARDS 16            // Must be a power of two
+#define MAX_EVENTS 64
+#define MAX_ROUTE_LENGTH 256
+
+typedef struct StatusEntry {
+    char route[MAX_ROUTE_LENGTH];
+    uint64_t hash;
+    StatusResponse* response;       // NULL until the first refresh, or after a failed one without a fallback MOTD
+    uint64_t expires;               // Refreshed by the first lookup from here on, in monotonic ms
+    uint8_t refreshing;
+    struct StatusEntry* next;
+} StatusEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    StatusEntry* entries;
+    StatusCacheStats stats;
+} StatusShard;
+
+enum FetchPhase {
+    FETCH_RESOLVE,
+    FETCH_CONNECT,
+    FETCH_RECEIVE,
+    FETCH_DONE
+};
+
+// Asks the backend for its status the way a client would, with a handshake and a Status Request
+typedef struct StatusFetch {
+    StatusEntry* entry;
+    char* hostname;
+    char* destination;
+    unsigned short port;
+    unsigned char default_port;
+    int32_t protocol_version;
+    enum FetchPhase phase;
+    int fd;
+    uint64_t deadline;
+    ResolveRequest resolve;
+    char* buffer;                   // The request going out, then the response coming in
+    size_t length;
+    size_t offset;
+    size_t capacity;
+    struct StatusFetch* next;
+} StatusFetch;
+
+static struct {
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    int epoll_fd;
+    int event_fd;                   // Signalled for new fetches and on shutdown
+    _Atomic(StatusFetch*) submitted;
+    ResolveQueue resolved;
+    StatusFetch* fetches;
+    StatusFetch* finished;          // Freed after the current batch of events, which may still point at them
+    StatusShard shards[STATUS_SHARDS];
+} status = { .epoll_fd = -1, .event_fd = -1, .resolved = { .event_fd = -1 } };
+
+static uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t hash_route(const char* route) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *route != '\0'; ++route) {
+        hash ^= (unsigned char)*route;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void status_response_release(StatusResponse* response) {
+    if (response != NULL && atomic_fetch_sub(&response->references, 1) == 1) {
+        free(response);
+    }
+}
+
+static StatusResponse* response_create(const char* data, size_t length) {
+    StatusResponse* response = malloc(sizeof(StatusResponse) + length);
+    if (response == NULL) {
+        perror("Error allocating status response");
+        return NULL;
+    }
+
+    atomic_init(&response->references, 1);
+    response->length = length;
+    memcpy(response->data, data, length);
+    return response;
+}
+
+// Shown while the backend doesn't answer, with the client's own protocol so it isn't flagged as outdated
+static StatusResponse* response_fallback(int32_t protocol_version) {
+    const char* motd = config.status_fallback_motd;
+    if (motd[0] == '\0' || strcmp(motd, "none") == 0) {
+        return NULL;
+    }
+
+    char escaped[1024];
+    size_t length = 0;
+    for (const char* c = motd; *c != '\0' && length + 7 < sizeof(escaped); ++c) {
+        if (*c == '"' || *c == '\\') {
+            escaped[length++] = '\\';
+            escaped[length++] = *c;
+        } else if ((unsigned char)*c < 0x20) {
+            length += snprintf(escaped + length, sizeof(escaped) - length, "\\u%04x", (unsigned char)*c);
+        } else {
+            escaped[length++] = *c;
+        }
+    }
+    escaped[length] = '\0';
+
+    char json[1280];
+    int json_length = snprintf(json, sizeof(json),
+        "{\"version\":{\"name\":\"Offline\",\"protocol\":%d},\"players\":{\"max\":0,\"online\":0},\"description\":{\"text\":\"%s\"}}",
+        protocol_version, escaped);
+
+    char packet[1300];
+    char fields[8];
+    size_t fields_length = varint_encode(fields, json_length);
+    size_t packet_length = varint_encode(packet, 1 + fields_length + json_length);
+    packet[packet_length++] = 0x00;
+    memcpy(packet + packet_length, fields, fields_length);
+    packet_length += fields_length;
+    memcpy(packet + packet_length, json, json_length);
+    packet_length += json_length;
+
+    return response_create(packet, packet_length);
+}
+
+static StatusShard* shard_of(uint64_t hash) {
+    return &status.shards[hash & (STATUS_SHARDS - 1)];
+}
+
+static void push_fetch(StatusFetch* fetch) {
+    StatusFetch* next = atomic_load_explicit(&status.submitted, memory_order_relaxed);
+    do {
+        fetch->next = next;
+    } while (!atomic_compare_exchange_weak_explicit(&status.submitted, &next, fetch, memory_order_release, memory_order_relaxed));
+
+    uint64_t one = 1;
+    if (write(status.event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Error signalling eventfd");
+    }
+}
+
+static void fetch_free(StatusFetch* fetch) {
+    if (fetch->fd != -1) {
+        close(fetch->fd);
+    }
+    free(fetch->hostname);
+    free(fetch->destination);
+    free(fetch->buffer);
+    free(fetch);
+}
+
+static void refresh_start(StatusEntry* entry, const StatusTarget* target) {
+    StatusFetch* fetch = calloc(1, sizeof(StatusFetch));
+    if (fetch != NULL) {
+        fetch->hostname = strdup(target->hostname);
+        fetch->destination = strdup(target->destination);
+    }
+
+    if (fetch == NULL || fetch->hostname == NULL || fetch->destination == NULL) {
+        perror("Error allocating status refresh");
+        if (fetch != NULL) {
+            fetch->fd = -1;
+            fetch_free(fetch);
+        }
+
+        StatusShard* shard = shard_of(entry->hash);
+        pthread_mutex_lock(&shard->mutex);
+        entry->refreshing = 0;
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
+
+    fetch->entry = entry;
+    fetch->port = target->port;
+    fetch->default_port = target->default_port;
+    fetch->protocol_version = target->protocol_version;
+    fetch->fd = -1;
+    push_fetch(fetch);
+}
+
+StatusResponse* status_cache_lookup(const char* route, const StatusTarget* target) {
+    if (!status.running || strlen(route) >= MAX_ROUTE_LENGTH) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_route(route);
+    StatusShard* shard = shard_of(hash);
+    StatusEntry* start = NULL;
+    StatusResponse* response = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    StatusEntry* entry = shard->entries;
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->route, route) != 0)) {
+        entry = entry->next;
+    }
+
+    // Routes come from servers.conf, so there are only ever as many entries as lines there
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(StatusEntry));
+        if (entry == NULL) {
+            perror("Error allocating status cache entry");
+            pthread_mutex_unlock(&shard->mutex);
+            return NULL;
+        }
+        strcpy(entry->route, route);
+        entry->hash = hash;
+        entry->next = shard->entries;
+        shard->entries = entry;
+        ++shard->stats.routes;
+    }
+
+    response = entry->response;
+    if (response != NULL) {
+        atomic_fetch_add(&response->references, 1);
+        ++shard->stats.hits;
+    } else {
+        ++shard->stats.misses;
+    }
+
+    if ((response == NULL || now_ms() >= entry->expires) && !entry->refreshing) {
+        entry->refreshing = 1;
+        ++shard->stats.refreshes;
+        start = entry;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (start != NULL) {
+        refresh_start(start, target);
+    }
+    return response;
+}
+
+// Swaps in the new response, connections still sending the old one keep it alive
+static void fetch_finish(StatusFetch* fetch, StatusResponse* response) {
+    if (response == NULL) {
+        response = response_fallback(fetch->protocol_version);
+    }
+
+    StatusEntry* entry = fetch->entry;
+    StatusShard* shard = shard_of(entry->hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    StatusResponse* previous = entry->response;
+    entry->response = response;
+    entry->expires = now_ms() + config.status_cache_ttl_ms;
+    entry->refreshing = 0;
+    pthread_mutex_unlock(&shard->mutex);
+
+    status_response_release(previous);
+
+    for (StatusFetch** link = &status.fetches; *link != NULL; link = &(*link)->next) {
+        if (*link == fetch) {
+            *link = fetch->next;
+            break;
+        }
+    }
+
+    if (fetch->fd != -1) {
+        close(fetch->fd);
+        fetch->fd = -1;
+    }
+    fetch->phase = FETCH_DONE;
+    fetch->next = status.finished;
+    status.finished = fetch;
+}
+
+static void fetch_fail(StatusFetch* fetch, const char* reason) {
+    printf("Status refresh of %s failed: %s\n", fetch->hostname, reason);
+
+    StatusShard* shard = shard_of(fetch->entry->hash);
+    pthread_mutex_lock(&shard->mutex);
+    ++shard->stats.failures;
+    pthread_mutex_unlock(&shard->mutex);
+
+    fetch_finish(fetch, NULL);
+}
+
+// Handshake with next state status, then the Status Request
+static ssize_t fetch_prepare_request(StatusFetch* fetch) {
+    fetch->capacity = STATUS_REQUEST_MAX_LENGTH;
+    fetch->buffer = malloc(fetch->capacity);
+    if (fetch->buffer == NULL) {
+        return -1;
+    }
+
+    fetch->length = status_request_encode(fetch->buffer, fetch->protocol_version, fetch->hostname, fetch->port);
+    fetch->offset = 0;
+    return 0;
+}
+
+static void fetch_connect(StatusFetch* fetch, const DnsAnswer* answer) {
+    // The handshake carries the port that is connected to
+    if (fetch->default_port && answer->port != 0) {
+        fetch->port = answer->port;
+    }
+
+    struct sockaddr_storage backend;
+    socklen_t backend_length = dns_answer_address(answer, fetch->port, 0, &backend);
+    if (backend_length == 0) {
+        fetch_fail(fetch, "no address");
+        return;
+    }
+
+    if (fetch_prepare_request(fetch) < 0) {
+        fetch_fail(fetch, "out of memory");
+        return;
+    }
+
+    fetch->fd = socket(backend.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fetch->fd == -1 || (connect(fetch->fd, (struct sockaddr*)&backend, backend_length) < 0 && errno != EINPROGRESS)) {
+        fetch_fail(fetch, strerror(errno));
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = fetch };
+    if (epoll_ctl(status.epoll_fd, EPOLL_CTL_ADD, fetch->fd, &event) == -1) {
+        fetch_fail(fetch, strerror(errno));
+        return;
+    }
+    fetch->phase = FETCH_CONNECT;
+}
+
+static void fetch_start(StatusFetch* fetch) {
+    fetch->next = status.fetches;
+    status.fetches = fetch;
+    fetch->deadline = now_ms() + config.status_timeout_ms;
+    fetch->phase = FETCH_RESOLVE;
+
+    DnsAnswer answer;
+    switch (dns_cache_lookup(fetch->destination, &answer)) {
+        case DNS_CACHE_HIT:
+            fetch_connect(fetch, &answer);
+            return;
+        case DNS_CACHE_NEGATIVE:
+            fetch_fail(fetch, "could not resolve the hostname");
+            return;
+        case DNS_CACHE_MISS:
+            resolver_lookup(&fetch->resolve, fetch->destination, &status.resolved);
+            return;
+    }
+}
+
+static void fetch_send(StatusFetch* fetch) {
+    while (fetch->offset < fetch->length) {
+        ssize_t sent = send(fetch->fd, fetch->buffer + fetch->offset, fetch->length - fetch->offset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            fetch_fail(fetch, strerror(errno));
+            return;
+        }
+        fetch->offset += sent;
+    }
+
+    // The buffer is reused for the response
+    fetch->length = 0;
+    fetch->phase = FETCH_RECEIVE;
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = fetch };
+    if (epoll_ctl(status.epoll_fd, EPOLL_CTL_MOD, fetch->fd, &event) == -1) {
+        fetch_fail(fetch, strerror(errno));
+    }
+}
+
+static void fetch_receive(StatusFetch* fetch) {
+    for (;;) {
+        if (fetch->length == fetch->capacity) {
+            size_t capacity = fetch->capacity * 2 < STATUS_RESPONSE_MAX_LENGTH ? fetch->capacity * 2 : STATUS_RESPONSE_MAX_LENGTH;
+            char* buffer = capacity > fetch->capacity ? realloc(fetch->buffer, capacity) : NULL;
+            if (buffer == NULL) {
+                fetch_fail(fetch, "response too large");
+                return;
+            }
+            fetch->buffer = buffer;
+            fetch->capacity = capacity;
+        }
+
+        ssize_t received = recv(fetch->fd, fetch->buffer + fetch->length, fetch->capacity - fetch->length, 0);
+        if (received == 0) {
+            fetch_fail(fetch, "connection closed");
+            return;
+        }
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return;
+            }
+            fetch_fail(fetch, strerror(errno));
+            return;
+        }
+        fetch->length += received;
+
+        size_t length;
+        enum PacketStatus complete = status_response_decode(fetch->buffer, fetch->length, &length);
+        if (complete == PACKET_MALFORMED) {
+            fetch_fail(fetch, "invalid response");
+            return;
+        }
+        if (complete == PACKET_READY) {
+            fetch_finish(fetch, response_create(fetch->buffer, length));
+            return;
+        }
+    }
+}
+
+static void fetch_ready(StatusFetch* fetch) {
+    if (fetch->phase == FETCH_CONNECT) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(fetch->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+            fetch_fail(fetch, strerror(error != 0 ? error : errno));
+            return;
+        }
+        fetch_send(fetch);
+    } else if (fetch->phase == FETCH_RECEIVE) {
+        fetch_receive(fetch);
+    }
+}
+
+static void take_submitted() {
+    uint64_t count;
+    if (read(status.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Error reading eventfd");
+    }
+
+    StatusFetch* fetch = atomic_exchange_explicit(&status.submitted, NULL, memory_order_acquire);
+    while (fetch != NULL) {
+        StatusFetch* next = fetch->next;
+        fetch_start(fetch);
+        fetch = next;
+    }
+}
+
+static void take_resolved() {
+    ResolveRequest* request = resolve_queue_take(&status.resolved);
+    while (request != NULL) {
+        ResolveRequest* next = request->next;
+        StatusFetch* fetch = (StatusFetch*)((char*)request - offsetof(StatusFetch, resolve));
+        fetch->phase = FETCH_CONNECT;
+
+        if (request->status != 0) {
+            fetch_fail(fetch, "could not resolve the hostname");
+        } else {
+            fetch_connect(fetch, &request->answer);
+        }
+        request = next;
+    }
+}
+
+// Fetches waiting on the resolver are failed once it answers, it has its own timeouts
+static void expire_fetches(uint64_t now) {
+    StatusFetch* fetch = status.fetches;
+    while (fetch != NULL) {
+        StatusFetch* next = fetch->next;
+        if (fetch->phase != FETCH_RESOLVE && fetch->deadline <= now) {
+            fetch_fail(fetch, "timed out");
+        }
+        fetch = next;
+    }
+}
+
+static int next_timeout(uint64_t now) {
+    uint64_t deadline = UINT64_MAX;
+    for (StatusFetch* fetch = status.fetches; fetch != NULL; fetch = fetch->next) {
+        if (fetch->phase != FETCH_RESOLVE && fetch->deadline < deadline) {
+            deadline = fetch->deadline;
+        }
+    }
+
+    if (deadline == UINT64_MAX) {
+        return -1;
+    }
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+static void free_finished() {
+    while (status.finished != NULL) {
+        StatusFetch* next = status.finished->next;
+        fetch_free(status.finished);
+        status.finished = next;
+    }
+}
+
+static void* status_run(void* arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!atomic_load(&status.stopping)) {
+        int count = epoll_wait(status.epoll_fd, events, MAX_EVENTS, next_timeout(now_ms()));
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            StatusFetch* fetch = events[i].data.ptr;
+            if (fetch == NULL) {
+                take_submitted();
+            } else if (events[i].data.ptr == &status.resolved) {
+                take_resolved();
+            } else if (fetch->phase != FETCH_DONE) {
+                fetch_ready(fetch);
+            }
+        }
+
+        expire_fetches(now_ms());
+        free_finished();
+    }
+
+    return NULL;
+}
+
+ssize_t status_cache_init() {
+    if (status.running) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < STATUS_SHARDS; ++i) {
+        pthread_mutex_init(&status.shards[i].mutex, NULL);
+    }
+
+    atomic_store(&status.stopping, 0);
+    atomic_store(&status.submitted, NULL);
+
+    status.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    status.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (status.epoll_fd == -1 || status.event_fd == -1 || resolve_queue_init(&status.resolved) < 0) {
+        perror("Error setting up the status cache");
+        status_cache_shutdown();
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event resolved = { .events = EPOLLIN, .data.ptr = &status.resolved };
+    if (epoll_ctl(status.epoll_fd, EPOLL_CTL_ADD, status.event_fd, &event) == -1 ||
+        epoll_ctl(status.epoll_fd, EPOLL_CTL_ADD, status.resolved.event_fd, &resolved) == -1 ||
+        pthread_create(&status.thread, NULL, status_run, NULL) != 0) {
+        perror("Error starting the status cache");
+        status_cache_shutdown();
+        return -1;
+    }
+
+    status.running = 1;
+    return 0;
+}
+
+// Lookups still being resolved are waited for, the resolver holds on to their requests
+void status_cache_shutdown() {
+    if (status.running) {
+        atomic_store(&status.stopping, 1);
+        uint64_t one = 1;
+        if (write(status.event_fd, &one, sizeof(one)) < 0) {
+            perror("Error signalling eventfd");
+        }
+        pthread_join(status.thread, NULL);
+        status.running = 0;
+    }
+
+    // Fetches handed to the resolver can only be freed once it gives them back
+    for (;;) {
+        StatusFetch* fetch = status.fetches;
+        while (fetch != NULL && fetch->phase != FETCH_RESOLVE) {
+            fetch = fetch->next;
+        }
+        if (fetch == NULL) {
+            break;
+        }
+
+        struct pollfd pollfd = { .fd = status.resolved.event_fd, .events = POLLIN };
+        poll(&pollfd, 1, -1);
+        for (ResolveRequest* request = resolve_queue_take(&status.resolved); request != NULL; request = request->next) {
+            ((StatusFetch*)((char*)request - offsetof(StatusFetch, resolve)))->phase = FETCH_CONNECT;
+        }
+    }
+
+    while (status.fetches != NULL) {
+        StatusFetch* next = status.fetches->next;
+        fetch_free(status.fetches);
+        status.fetches = next;
+    }
+    free_finished();
+
+    StatusFetch* fetch = atomic_exchange(&status.submitted, NULL);
+    while (fetch != NULL) {
+        StatusFetch* next = fetch->next;
+        fetch_free(fetch);
+        fetch = next;
+    }
+
+    for (size_t i = 0; i < STATUS_SHARDS; ++i) {
+        StatusEntry* entry = status.shards[i].entries;
+        while (entry != NULL) {
+            StatusEntry* next = entry->next;
+            status_response_release(entry->response);
+            free(entry);
+            entry = next;
+        }
+        status.shards[i].entries = NULL;
+        memset(&status.shards[i].stats, 0, sizeof(status.shards[i].stats));
+    }
+
+    resolve_queue_destroy(&status.resolved);
+    if (status.event_fd != -1) {
+        close(status.event_fd);
+        status.event_fd = -1;
+    }
+    if (status.epoll_fd != -1) {
+        close(status.epoll_fd);
+        status.epoll_fd = -1;
+    }
+}
+
+void status_cache_stats(StatusCacheStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i < STATUS_SHARDS; ++i) {
+        StatusShard* shard = &status.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->routes += shard->stats.routes;
+        stats->hits += shard->stats.hits;
+        stats->misses += shard->stats.misses;
+        stats->refreshes += shard->stats.refreshes;
+        stats->failures += shard->stats.failures;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
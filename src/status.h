@@ -0,0 +1,44 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A Status Response packet, length prefix included, shared by every connection sending it
+typedef struct {
+    atomic_size_t references;
+    uint32_t length;
+    char data[];
+} StatusResponse;
+
+// Where a route's status comes from, copied by the refresh
+typedef struct {
+    const char* hostname;           // Sent to the backend in the handshake, as the client asked for it
+    const char* destination;
+    unsigned short port;
+    unsigned char default_port;     // An SRV port wins over port
+    int32_t protocol_version;
+} StatusTarget;
+
+typedef struct {
+    size_t routes;
+    size_t hits;
+    size_t misses;
+    size_t refreshes;
+    size_t failures;
+} StatusCacheStats;
+
+// Starts the thread refreshing cached responses
+ssize_t status_cache_init();
+void status_cache_shutdown();
+
+// Never blocks. Returns a reference to the route's cached response, NULL if the ping should go to the
+// backend. A missing or expired response is refreshed in the background, at most one refresh per route
+StatusResponse* status_cache_lookup(const char* route, const StatusTarget* target);
+void status_response_release(StatusResponse* response);
+void status_cache_stats(StatusCacheStats* stats);
+
+#endif // STATUS_H
@@ -1,11 +1,35 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 
 #include "../dns.h"
 #include "../packet-tools.h"
 #include "../servers.h"
+#include "../config.h"
+#include "../resolver.h"
+#include "../metrics.h"
+#include "../buffers.h"
+#include "../limiter.h"
+#include "../shaper.h"
+#include "../timers.h"
+#include "../sockmap.h"
+#include "../trace.h"
+#include "../registry.h"
 
 void test_dns_query() {
     char output_address[16];
@@ -62,25 +86,1200 @@ void test_server_dictionary() {
 
     assert(result == 0);
 
-    Entry* entry = find_entry("minecraft.local.igric");
+    RouteTable* routes = routes_acquire();
+    Entry* entry = routes_find(routes, "minecraft.local.igric");
 
     assert(entry != NULL);
     assert(strcmp(entry->source, "minecraft.local.igric") == 0);
-    assert(strcmp(entry->destination, "wynncraft.com") == 0);
-    assert(entry->port == 25565);
+    assert(strcmp(entry->backends[0].destination, "wynncraft.com") == 0);
+    assert(entry->backends[0].port == 25565);
 
-    entry = find_entry("pi.igric");
+    entry = routes_find(routes, "pi.igric");
 
     assert(entry != NULL);
     assert(strcmp(entry->source, "pi.igric") == 0);
-    assert(strcmp(entry->destination, "192.168.1.5") == 0);
-    assert(entry->port == 25577);
+    assert(strcmp(entry->backends[0].destination, "192.168.1.5") == 0);
+    assert(entry->backends[0].port == 25577);
+    routes_release(routes);
+}
+
+void test_route_index() {
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+
+    assert(file != NULL);
+    fprintf(file, "Play.Example.    10.0.0.1:25566\n");
+    fprintf(file, "*.example        10.0.0.2\n");
+    fprintf(file, "*.eu.example     10.0.0.3:25567\n");
+    fprintf(file, "play.example     10.0.0.4\n");
+    fprintf(file, "*                10.0.0.9\n");
+    fclose(file);
+
+    ssize_t result = load_dictionary(path);
+    unlink(path);
+
+    assert(result == 0);
+
+    // Names are matched case-insensitively, without trailing dots and Forge suffixes
+    RouteTable* routes = routes_acquire();
+    Entry* entry = routes_find(routes, "play.example");
+
+    assert(entry != NULL);
+    assert(strcmp(entry->backends[0].destination, "10.0.0.1") == 0);
+    assert(entry->backends[0].port == 25566);
+    assert(routes_find(routes, "PLAY.example.") == entry);
+    assert(routes_find(routes, "play.example\0FML\0") == entry);
+
+    // The longest wildcard suffix wins, at any depth
+    entry = routes_find(routes, "lobby.example");
+
+    assert(entry != NULL);
+    assert(strcmp(entry->backends[0].destination, "10.0.0.2") == 0);
+
+    entry = routes_find(routes, "a.b.eu.example");
+
+    assert(entry != NULL);
+    assert(strcmp(entry->backends[0].destination, "10.0.0.3") == 0);
+    assert(entry->backends[0].port == 25567);
+
+    // A wildcard doesn't cover its own domain, the catch-all does
+    entry = routes_find(routes, "eu.example");
+
+    assert(entry != NULL);
+    assert(strcmp(entry->backends[0].destination, "10.0.0.2") == 0);
+
+    entry = routes_find(routes, "example");
+
+    assert(entry != NULL);
+    assert(strcmp(entry->backends[0].destination, "10.0.0.9") == 0);
+    routes_release(routes);
+}
+
+void test_reload() {
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+
+    assert(file != NULL);
+    fprintf(file, "old.example    10.0.0.1\n");
+    fclose(file);
+
+    assert(load_dictionary(path) == 0);
+
+    // A reader holding the old table keeps seeing it after the swap
+    RouteTable* old = routes_acquire();
+    RoutesLoadStats before;
+    routes_load_stats(&before);
+
+    file = fopen(path, "w");
+    fprintf(file, "set workers 99\n");
+    fprintf(file, "new.example    10.0.0.2:25570\n");
+    fprintf(file, "*.new.example  10.0.0.3\n");
+    fclose(file);
+
+    size_t workers = config.workers;
+
+    assert(reload_dictionary(path) == 0);
+    assert(config.workers == workers);
+    RouteTable* routes = routes_acquire();
+    assert(routes_find(routes, "old.example") == NULL);
+    assert(routes_find(routes, "new.example")->backends[0].port == 25570);
+    assert(routes_find(old, "old.example") != NULL);
+    routes_release(old);
+
+    RoutesLoadStats after;
+    routes_load_stats(&after);
+
+    assert(after.entries == 2);
+    assert(after.generation == before.generation + 1);
+
+    // A broken file leaves the current table in place
+    file = fopen(path, "w");
+    fprintf(file, "broken.example 10.0.0.4:99999\n");
+    fclose(file);
+
+    assert(reload_dictionary(path) != 0);
+    assert(routes_find(routes, "new.example") != NULL);
+    assert(routes_find(routes, "broken.example") == NULL);
+    routes_release(routes);
+
+    routes_load_stats(&after);
+    assert(after.failures == before.failures + 1);
+
+    unlink(path);
+}
+
+void test_route_backends() {
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+
+    assert(file != NULL);
+    fprintf(file, "single.example  10.1.0.1\n");
+    fprintf(file, "lobby.example   10.1.0.1:25566 weight=3 10.1.0.2:25566\n");
+    fprintf(file, "least.example   10.1.0.3 10.1.0.4 balance=least_connections\n");
+    fprintf(file, "sticky.example  10.1.0.5 10.1.0.6 10.1.0.7 balance=username_hash\n");
+    fclose(file);
+
+    assert(load_dictionary(path) == 0);
+
+    RouteTable* routes = routes_acquire();
+    Entry* entry = routes_find(routes, "single.example");
+
+    assert(entry->backend_count == 1);
+    assert(entry->backends[0].port == 25565);
+    assert(entry->backends[0].default_port == 1);
+
+    // Round robin hands out backends in proportion to their weights
+    entry = routes_find(routes, "lobby.example");
+    assert(entry->backend_count == 2);
+    assert(entry->backends[0].weight == 3 && entry->backends[1].weight == 1);
+
+    size_t picked[2] = {0};
+    for (int i = 0; i < 400; ++i) {
+        ++picked[entry_select_backend(entry, "", 0)];
+    }
+    assert(picked[0] == 300 && picked[1] == 100);
+
+    // Failover skips the backends already tried, until none is left
+    ssize_t first = entry_select_backend(entry, "", 0);
+    ssize_t second = entry_select_backend(entry, "", 1ULL << first);
+    assert(second == !first);
+    assert(entry_select_backend(entry, "", 3) == -1);
+
+    // The backend with fewer connections wins
+    entry = routes_find(routes, "least.example");
+    backend_connected(entry->backends[0].state, 0);
+    for (int i = 0; i < 4; ++i) {
+        assert(entry_select_backend(entry, "", 0) == 1);
+    }
+    backend_disconnected(entry->backends[0].state);
+
+    // A player sticks to its backend, and a failed connect moves only the players it held
+    entry = routes_find(routes, "sticky.example");
+    ssize_t home = entry_select_backend(entry, "Steve", 0);
+    for (int i = 0; i < 8; ++i) {
+        assert(entry_select_backend(entry, "Steve", 0) == home);
+    }
+    backend_failed(entry->backends[home].state);
+    assert(entry_select_backend(entry, "Steve", 0) != home);
+    assert(entry_select_backend(entry, "Steve", 1ULL << home) == entry_select_backend(entry, "Steve", 0));
+
+    // Backend states outlive the table, a reload keeps counting on them
+    BackendState* state = entry->backends[0].state;
+    routes_release(routes);
+    assert(load_dictionary(path) == 0);
+    routes = routes_acquire();
+    assert(routes_find(routes, "sticky.example")->backends[0].state == state);
+    routes_release(routes);
+
+    // Weights need a destination in front of them, policies must exist
+    file = fopen(path, "w");
+    fprintf(file, "bad.example weight=2 10.1.0.1\n");
+    fclose(file);
+    assert(load_dictionary(path) != 0);
+
+    file = fopen(path, "w");
+    fprintf(file, "bad.example 10.1.0.1 balance=random\n");
+    fclose(file);
+    assert(load_dictionary(path) != 0);
+
+    unlink(path);
+}
+
+void test_socket_profiles() {
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+
+    assert(file != NULL);
+    fprintf(file, "plain.example   10.1.0.1\n");
+    fprintf(file, "game.example    10.1.0.2 profile=game\n");
+    fprintf(file, "profile game nodelay=on quickack=on notsent_lowat=16384 keepalive=60,10,5 sndbuf=65536\n");
+    fclose(file);
+    assert(load_dictionary(path) == 0);
+
+    // Routes without profile= get the built-in default, profiles may be defined below their routes
+    RouteTable* routes = routes_acquire();
+    assert(routes_find(routes, "plain.example")->profile == &default_socket_profile);
+    const SocketProfile* profile = routes_find(routes, "game.example")->profile;
+    assert(strcmp(profile->name, "game") == 0);
+    assert(profile->nodelay == 1 && profile->quickack == 1 && profile->fastopen == PROFILE_UNSET);
+    assert(profile->keepalive_idle_s == 60 && profile->keepalive_interval_s == 10 && profile->keepalive_count == 5);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    socket_profile_backend(fd, profile, 0);
+    int value;
+    socklen_t length = sizeof(value);
+    assert(getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, &length) == 0 && value == 1);
+    assert(getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, &length) == 0 && value == 16384);
+    assert(getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, &length) == 0 && value == 1);
+    assert(getsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &value, &length) == 0 && value == 5);
+    close(fd);
+    routes_release(routes);
+
+    // A file can override the default, unknown names, options and duplicates are rejected
+    file = fopen(path, "w");
+    fprintf(file, "plain.example 10.1.0.1\nprofile default nodelay=off\n");
+    fclose(file);
+    assert(load_dictionary(path) == 0);
+    routes = routes_acquire();
+    assert(routes_find(routes, "plain.example")->profile->nodelay == 0);
+    routes_release(routes);
+
+    const char* invalid[] = {
+        "bad.example 10.1.0.1 profile=missing\n",
+        "profile game nagle=off\n",
+        "profile game keepalive=60,10\n",
+        "profile game nodelay=on\nprofile game nodelay=off\n",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        file = fopen(path, "w");
+        fputs(invalid[i], file);
+        fclose(file);
+        assert(load_dictionary(path) != 0);
+    }
+
+    unlink(path);
+}
+
+void test_backend_health() {
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+
+    assert(file != NULL);
+    fprintf(file, "health.example  10.2.0.1 10.2.0.2 10.2.0.3\n");
+    fclose(file);
+
+    assert(load_dictionary(path) == 0);
+    RouteTable* routes = routes_acquire();
+    Entry* entry = routes_find(routes, "health.example");
+    for (int i = 0; i < 3; ++i) {
+        atomic_store(&entry->backends[i].state->health, BACKEND_UP);
+    }
+
+    // Down backends are never picked, degraded ones only once the healthy ones were tried
+    atomic_store(&entry->backends[0].state->health, BACKEND_DOWN);
+    atomic_store(&entry->backends[1].state->health, BACKEND_DEGRADED);
+    for (int i = 0; i < 8; ++i) {
+        assert(entry_select_backend(entry, "", 0) == 2);
+    }
+    assert(entry_select_backend(entry, "", 1ULL << 2) == 1);
+    assert(entry_select_backend(entry, "", (1ULL << 2) | (1ULL << 1)) == -1);
+
+    // With every backend down a join fails without trying any
+    atomic_store(&entry->backends[1].state->health, BACKEND_DOWN);
+    atomic_store(&entry->backends[2].state->health, BACKEND_DOWN);
+    assert(entry_select_backend(entry, "", 0) == -1);
+
+    // The table lists every backend once per route for the health checker
+    size_t found = 0;
+    for (size_t i = 0; i < routes_backend_count(routes); ++i) {
+        found += routes_backend(routes, i)->state == entry->backends[0].state;
+    }
+    assert(found == 1);
+
+    for (int i = 0; i < 3; ++i) {
+        atomic_store(&entry->backends[i].state->health, BACKEND_UNKNOWN);
+    }
+    routes_release(routes);
+    unlink(path);
+}
+
+void test_status_ping() {
+    char buffer[STATUS_REQUEST_MAX_LENGTH];
+    size_t length = status_request_encode(buffer, -1, "play.example", 25565);
+
+    // Handshake with next state 1, then the empty Status Request
+    assert(length == 25);
+    assert(buffer[0] == 22 && buffer[1] == 0x00);
+    assert(buffer[length - 2] == 1 && buffer[length - 1] == 0x00);
+
+    // A Status Response is ready once its whole packet arrived
+    char response[] = { 5, 0x00, 3, '{', '}', ' ' };
+    size_t response_length;
+    assert(status_response_decode(response, 2, &response_length) == PACKET_NEED_MORE);
+    assert(status_response_decode(response, 6, &response_length) == PACKET_READY);
+    assert(response_length == 6);
+
+    char wrong[] = { 2, 0x01, 0 };
+    assert(status_response_decode(wrong, 3, &response_length) == PACKET_MALFORMED);
+}
+
+void test_metrics() {
+    // Exact below 16 us, then 8 buckets per power of two
+    assert(metrics_latency_bucket(0) == 0);
+    assert(metrics_latency_bucket(15) == 15);
+    assert(metrics_latency_bucket(16) == 16);
+    assert(metrics_latency_bucket(18) == 17);
+    assert(metrics_latency_bucket(32) == 24);
+    assert(metrics_latency_bucket(1ULL << 40) == METRICS_LATENCY_BUCKETS - 1);
+
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+
+    assert(file != NULL);
+    fprintf(file, "metrics.example  10.3.0.1\n");
+    fclose(file);
+    assert(load_dictionary(path) == 0);
+
+    // Routes keep their counters across reloads
+    RouteTable* routes = routes_acquire();
+    RouteMetrics* route = routes_find(routes, "metrics.example")->metrics;
+    routes_release(routes);
+    assert(route != NULL);
+    assert(load_dictionary(path) == 0);
+    routes = routes_acquire();
+    assert(routes_find(routes, "metrics.example")->metrics == route);
+    routes_release(routes);
+
+    RouteSlot* slot = metrics_route_slot(route);
+    assert(slot != NULL && metrics_route_slot(route) == slot);
+    metrics_route_add(slot, ROUTE_SESSIONS, 3);
+    metrics_route_add(slot, ROUTE_SESSIONS_CLOSED, 1);
+    metrics_route_add(slot, ROUTE_BYTES_TO_CLIENT, 4096);
+    metrics_route_latency(slot, 100);
+    metrics_route_latency(slot, 300);
+    metrics_route_latency(slot, 5000000);
+
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+    metrics_render(out);
+    fclose(out);
+
+    assert(strstr(text, "mcproxy_route_sessions_total{route=\"metrics.example\"} 3\n") != NULL);
+    assert(strstr(text, "mcproxy_route_sessions_active{route=\"metrics.example\"} 2\n") != NULL);
+    assert(strstr(text, "mcproxy_route_bytes_total{route=\"metrics.example\",direction=\"to_client\"} 4096\n") != NULL);
+    assert(strstr(text, "mcproxy_route_connect_seconds_bucket{route=\"metrics.example\",le=\"0.000128\"} 1\n") != NULL);
+    assert(strstr(text, "mcproxy_route_connect_seconds_bucket{route=\"metrics.example\",le=\"0.000512\"} 2\n") != NULL);
+    assert(strstr(text, "mcproxy_route_connect_seconds_bucket{route=\"metrics.example\",le=\"+Inf\"} 3\n") != NULL);
+    assert(strstr(text, "mcproxy_route_connect_seconds_sum{route=\"metrics.example\"} 5.000400\n") != NULL);
+
+    // What an upgraded process waits on before it exits
+    uint64_t active = metrics_connections_active();
+    metrics_add(GLOBAL_ACCEPTED, 2);
+    metrics_add(GLOBAL_CLOSED, 1);
+    assert(metrics_connections_active() == active + 1);
+
+    free(text);
+    unlink(path);
+}
+
+void test_buffers() {
+    BufferStats before, stats;
+    buffers_stats(&before);
+
+    // Sizes round up to their class, a freed buffer is reused by the next allocation of the class
+    char* small = buffer_alloc(100);
+    char* large = buffer_alloc(40000);
+    assert(small != NULL && large != NULL);
+    memset(small, 1, 1024);
+    memset(large, 2, 40000);
+
+    buffers_stats(&stats);
+    assert(stats.in_use == before.in_use + 1024 + 40000);
+    assert(stats.classes[0].in_use == before.classes[0].in_use + 1);
+    assert(stats.high_water >= stats.in_use);
+
+    buffer_free(small);
+    buffer_free(large);
+    assert(buffer_alloc(1000) == small);
+    buffer_free(small);
+
+    buffers_stats(&stats);
+    assert(stats.in_use == before.in_use);
+    assert(stats.classes[0].cached >= 1);
+
+    // The budget only reports pressure, allocations still succeed past it
+    size_t budget = config.memory_budget_mb;
+    config.memory_budget_mb = 1;
+    assert(!buffers_under_pressure());
+    char* buffers[40];
+    for (int i = 0; i < 40; ++i) {
+        buffers[i] = buffer_alloc(32768);
+        assert(buffers[i] != NULL);
+    }
+    assert(buffers_under_pressure());
+    for (int i = 0; i < 40; ++i) {
+        buffer_free(buffers[i]);
+    }
+    assert(!buffers_under_pressure());
+    config.memory_budget_mb = budget;
+}
+
+void test_limiter() {
+    size_t rate = config.connection_rate, burst = config.connection_burst, handshakes = config.max_handshakes;
+    limiter_init();
+
+    // A burst goes through, the next connection is over the rate, another address is unaffected
+    config.connection_rate = 1;
+    config.connection_burst = 3;
+    config.max_handshakes = 0;
+    struct sockaddr_in first = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(0xC0000201) };
+    struct sockaddr_in second = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(0xC0000202) };
+    for (int i = 0; i < 3; ++i) {
+        assert(limiter_admit((struct sockaddr*)&first, sizeof(first)) == ADMIT);
+    }
+    assert(limiter_admit((struct sockaddr*)&first, sizeof(first)) == REJECT_RATE);
+    assert(limiter_admit((struct sockaddr*)&second, sizeof(second)) == ADMIT);
+
+    // IPv6 addresses share the budget of their /64
+    struct sockaddr_in6 host = { .sin6_family = AF_INET6 };
+    inet_pton(AF_INET6, "2001:db8:1:2::1", &host.sin6_addr);
+    struct sockaddr_in6 neighbour = host;
+    inet_pton(AF_INET6, "2001:db8:1:2::ffff", &neighbour.sin6_addr);
+    for (int i = 0; i < 3; ++i) {
+        assert(limiter_admit((struct sockaddr*)(i % 2 ? &host : &neighbour), sizeof(host)) == ADMIT);
+    }
+    assert(limiter_admit((struct sockaddr*)&neighbour, sizeof(neighbour)) == REJECT_RATE);
+
+    LimiterStats stats;
+    limiter_stats(&stats);
+    assert(stats.tracked >= 3);
+    assert(stats.handshakes >= 7);
+    for (int i = 0; i < 7; ++i) {
+        limiter_handshake_done();
+    }
+
+    // Past the handshake cap new connections wait for one to finish
+    config.connection_rate = 0;
+    limiter_stats(&stats);
+    size_t active = stats.handshakes;
+    config.max_handshakes = active + 2;
+    assert(limiter_admit((struct sockaddr*)&first, sizeof(first)) == ADMIT);
+    assert(limiter_admit((struct sockaddr*)&first, sizeof(first)) == ADMIT);
+    assert(limiter_admit((struct sockaddr*)&first, sizeof(first)) == REJECT_HANDSHAKES);
+    limiter_handshake_done();
+    assert(limiter_admit((struct sockaddr*)&first, sizeof(first)) == ADMIT);
+    limiter_handshake_done();
+    limiter_handshake_done();
+
+    config.connection_rate = rate;
+    config.connection_burst = burst;
+    config.max_handshakes = handshakes;
+}
+
+// Tiny DNS server for the resolver tests, serving a fixed zone over UDP and TCP on the same port
+typedef struct {
+    int udp;
+    int tcp;
+    struct sockaddr_in address;
+    atomic_int stop;
+    atomic_int slow_queries;
+    atomic_int dropped;
+} StubDns;
+
+static uint8_t* stub_record(uint8_t* cursor, uint16_t type, const uint8_t* data, uint16_t length) {
+    *cursor++ = 0xC0;               // Pointer to the question name
+    *cursor++ = NS_HFIXEDSZ;
+    NS_PUT16(type, cursor);
+    NS_PUT16(ns_c_in, cursor);
+    NS_PUT32(60, cursor);
+    NS_PUT16(length, cursor);
+    memcpy(cursor, data, length);
+    return cursor + length;
+}
+
+// Returns the length of the answer, 0 to drop the query
+static size_t stub_answer(StubDns* stub, const uint8_t* query, size_t length, uint8_t* answer, int tcp) {
+    char name[NS_MAXDNAME];
+    int name_length = dn_expand(query, query + length, query + NS_HFIXEDSZ, name, sizeof(name));
+    assert(name_length > 0);
+
+    size_t question = NS_HFIXEDSZ + name_length + NS_QFIXEDSZ;
+    uint16_t type = ns_get16(query + NS_HFIXEDSZ + name_length);
+    memcpy(answer, query, question);
+    answer[2] = 0x81;               // Response, recursion desired
+    answer[3] = 0x80;               // Recursion available, NOERROR
+
+    uint8_t* cursor = answer + question;
+    uint16_t count = 1;
+    uint8_t a[4];
+
+    if (strcasecmp(name, "_minecraft._tcp.srv.test") == 0 && type == ns_t_srv) {
+        uint8_t srv[6 + 32] = { 0, 0, 0, 5, 25570 >> 8, 25570 & 0xFF };
+        int target = dn_comp("backend.test", srv + 6, sizeof(srv) - 6, NULL, NULL);
+        cursor = stub_record(cursor, ns_t_srv, srv, 6 + target);
+    } else if (strcasecmp(name, "backend.test") == 0 && type == ns_t_a) {
+        inet_pton(AF_INET, "10.1.2.3", a);
+        cursor = stub_record(cursor, ns_t_a, a, 4);
+    } else if (strcasecmp(name, "plain.test") == 0 && type == ns_t_a) {
+        inet_pton(AF_INET, "10.0.0.7", a);
+        cursor = stub_record(cursor, ns_t_a, a, 4);
+        inet_pton(AF_INET, "10.0.0.17", a);
+        cursor = stub_record(cursor, ns_t_a, a, 4);
+        count = 2;
+    } else if (strcasecmp(name, "plain.test") == 0 && type == ns_t_aaaa) {
+        uint8_t aaaa[16];
+        inet_pton(AF_INET6, "fd00::7", aaaa);
+        cursor = stub_record(cursor, ns_t_aaaa, aaaa, 16);
+    } else if (strcasecmp(name, "big.test") == 0 && type == ns_t_a) {
+        if (!tcp) {
+            answer[2] |= 0x02;      // Truncated, the answer is only given over TCP
+            return question;
+        }
+        inet_pton(AF_INET, "10.9.9.9", a);
+        cursor = stub_record(cursor, ns_t_a, a, 4);
+    } else if (strcasecmp(name, "drop.test") == 0 && type == ns_t_a) {
+        if (atomic_fetch_add(&stub->dropped, 1) == 0) {
+            return 0;
+        }
+        inet_pton(AF_INET, "10.0.0.8", a);
+        cursor = stub_record(cursor, ns_t_a, a, 4);
+    } else if (strcasecmp(name, "slow.test") == 0 && type == ns_t_a) {
+        atomic_fetch_add(&stub->slow_queries, 1);
+        usleep(100 * 1000);
+        inet_pton(AF_INET, "10.0.0.6", a);
+        cursor = stub_record(cursor, ns_t_a, a, 4);
+    } else {
+        answer[3] |= ns_r_nxdomain;
+        count = 0;
+    }
+
+    answer[6] = 0;
+    answer[7] = count;
+    return cursor - answer;
+}
+
+static void* stub_dns_run(void* arg) {
+    StubDns* stub = arg;
+    uint8_t query[NS_PACKETSZ];
+    uint8_t answer[NS_PACKETSZ];
+
+    while (!atomic_load(&stub->stop)) {
+        struct pollfd fds[2] = { { .fd = stub->udp, .events = POLLIN }, { .fd = stub->tcp, .events = POLLIN } };
+        if (poll(fds, 2, 50) <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in peer;
+            socklen_t peer_length = sizeof(peer);
+            ssize_t length = recvfrom(stub->udp, query, sizeof(query), 0, (struct sockaddr*)&peer, &peer_length);
+            size_t reply = length > 0 ? stub_answer(stub, query, length, answer, 0) : 0;
+            if (reply > 0) {
+                sendto(stub->udp, answer, reply, 0, (struct sockaddr*)&peer, peer_length);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int client = accept(stub->tcp, NULL, NULL);
+            uint8_t prefix[2];
+            if (client >= 0 && recv(client, prefix, 2, MSG_WAITALL) == 2) {
+                size_t length = (prefix[0] << 8) | prefix[1];
+                if (recv(client, query, length, MSG_WAITALL) == (ssize_t)length) {
+                    size_t reply = stub_answer(stub, query, length, answer + 2, 1);
+                    answer[0] = reply >> 8;
+                    answer[1] = reply & 0xFF;
+                    send(client, answer, reply + 2, MSG_NOSIGNAL);
+                }
+            }
+            if (client >= 0) {
+                close(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_shaper() {
+    size_t global = config.shaping_global_mbps, session = config.shaping_session_kbps;
+    size_t burst = config.shaping_burst_ms, interactive = config.shaping_interactive_bytes;
+    config.shaping_global_mbps = 0;
+    config.shaping_session_kbps = 0;
+    config.shaping_burst_ms = 100;
+    config.shaping_interactive_bytes = 512;
+    shaper_init();
+
+    // 1 MB/s with 100 ms of burst holds 100 KB, charges draw it down and time fills it back up
+    TokenBucket bucket = {0};
+    uint64_t now = 1000000000000ULL;
+    assert(token_bucket_available(&bucket, now) == SIZE_MAX);
+    token_bucket_set(&bucket, 1000000, 100000000);
+    assert(token_bucket_available(&bucket, now) == 100000);
+    token_bucket_charge(&bucket, 60000, now);
+    assert(token_bucket_available(&bucket, now) == 40000);
+    token_bucket_charge(&bucket, 60000, now);
+    assert(token_bucket_available(&bucket, now) == 0);
+    assert(token_bucket_available(&bucket, now + 20000000) == 0);
+    assert(token_bucket_available(&bucket, now + 30000000) == 10000);
+    assert(token_bucket_available(&bucket, now + 1000000000) == 100000);
+
+    // Route buckets outlive reloads, a route without a rate isn't limited
+    assert(shaper_route("shaped.example.com", 0) == NULL);
+    TokenBucket* route = shaper_route("shaped.example.com", 8);
+    assert(route != NULL && shaper_route("shaped.example.com", 8) == route);
+    assert(token_bucket_available(route, shaper_now_ns()) == 100000);
+
+    // Unlimited sessions skip the shaper, the route bucket limits a flow once the session's is larger
+    ShapedFlow unlimited, flows[3];
+    assert(shaped_flow_init(&unlimited, NULL) == 0);
+    config.shaping_session_kbps = 16000;
+    enum ShapingScope limited;
+    for (int i = 0; i < 3; ++i) {
+        assert(shaped_flow_init(&flows[i], route) == 1);
+    }
+    now = shaper_now_ns();
+    assert(shaped_flow_grant(&flows[0], now, &limited) == 100000 && limited == SHAPING_ROUTE);
+
+    // With the route bucket empty small reads still go through, bulk ones wait in the backlog
+    shaped_flow_charge(&flows[0], 100000, now);
+    assert(token_bucket_available(&flows[0].session, now) == 100000);
+    assert(shaped_flow_grant(&flows[1], now, &limited) == 512 && limited == SHAPING_ROUTE);
+
+    // An empty session bucket isn't bypassed
+    shaped_flow_charge(&flows[0], 100000, now);
+    assert(shaped_flow_grant(&flows[0], now, &limited) == 0 && limited == SHAPING_SESSION);
+
+    // Backlogged flows are served round robin and only get what their deficit allows
+    ShapedQueue queue = {0};
+    RouteSlot* slot = metrics_route_slot(metrics_route("shaped.example.com"));
+    for (int i = 0; i < 3; ++i) {
+        shaped_queue_push(&queue, &flows[i], SHAPING_ROUTE, slot);
+    }
+    shaped_queue_push(&queue, &flows[0], SHAPING_ROUTE, slot);
+    assert(queue.count == 3);
+    shaped_queue_finish(&queue, &flows[1]);
+    assert(queue.count == 2 && !flows[1].backlogged);
+
+    ShapedFlow* next = shaped_queue_pop(&queue);
+    assert(next == &flows[0] && next->backlogged && !next->queued);
+    next->deficit = SHAPING_QUANTUM;
+    assert(shaped_flow_grant(next, now + 1000000000, &limited) == SHAPING_QUANTUM);
+    shaped_flow_charge(next, 1000, now + 1000000000);
+    assert(next->deficit == SHAPING_QUANTUM - 1000);
+    shaped_queue_push(&queue, next, SHAPING_ROUTE, slot);
+    assert(shaped_queue_pop(&queue) == &flows[2]);
+    assert(shaped_queue_pop(&queue) == &flows[0]);
+    assert(shaped_queue_pop(&queue) == NULL && queue.count == 0);
+
+    shaper_route("shaped.example.com", 0);
+    config.shaping_global_mbps = global;
+    config.shaping_session_kbps = session;
+    config.shaping_burst_ms = burst;
+    config.shaping_interactive_bytes = interactive;
+    shaper_init();
+}
+
+static int compare_timers(const void* a, const void* b) {
+    uint64_t first = (*(const Timer* const*)a)->at_ms, second = (*(const Timer* const*)b)->at_ms;
+    return (first > second) - (first < second);
+}
+
+void test_timers() {
+    // Timers from a millisecond to past what the wheel spans, some moved or cancelled
+    enum { COUNT = 2000 };
+    static Timer timers[COUNT];
+    Timer* sorted[COUNT];
+    TimerWheel wheel;
+    uint64_t now = 1000;
+    timer_wheel_init(&wheel, now);
+    assert(timer_wait_ms(&wheel, now) == -1);
+
+    uint64_t seed = 42;
+    size_t armed = 0;
+    for (size_t i = 0; i < COUNT; ++i) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t delay = (seed >> 33) % (i % 4 == 0 ? 64 : i % 4 == 1 ? 5000 : i % 4 == 2 ? 600000 : 20000000);
+        timer_arm(&wheel, &timers[i], now + delay);
+        if (i % 50 == 0) {
+            timer_cancel(&wheel, &timers[i]);
+            continue;
+        }
+        if (i % 7 == 0) {
+            timer_arm(&wheel, &timers[i], now + delay / 2);
+        }
+        sorted[armed++] = &timers[i];
+    }
+    for (size_t i = 0; i < COUNT; i += 50) {
+        assert(!timers[i].armed);
+    }
+    qsort(sorted, armed, sizeof(Timer*), compare_timers);
+
+    // Sleeping as long as the wheel says never misses a timer: each one comes out right on time
+    size_t next = 0, expired = 0;
+    int wait;
+    while ((wait = timer_wait_ms(&wheel, now)) >= 0) {
+        now += wait;
+        Timer* timer;
+        while ((timer = timer_expired(&wheel, now)) != NULL) {
+            assert(timer->at_ms == now && !timer->armed);
+            ++expired;
+        }
+        while (next < armed && sorted[next]->at_ms <= now) {
+            assert(!sorted[next++]->armed);
+        }
+        assert(next == armed || sorted[next]->armed);
+    }
+    assert(expired == armed && wheel.count == 0);
+
+    // Overdue timers expire on the next look, and a long wait doesn't walk every millisecond
+    Timer late = {0};
+    timer_arm(&wheel, &late, now - 10);
+    assert(timer_wait_ms(&wheel, now) <= 1);
+    assert(timer_expired(&wheel, now + 1) == &late);
+    timer_arm(&wheel, &late, now + 3600000);
+    assert(timer_expired(&wheel, now + 3599999) == NULL);
+    assert(timer_expired(&wheel, now + 3600000) == &late);
+
+    // Routes pick their own timeouts, the others get the configured ones
+    char path[] = "/tmp/mc-proxy-servers-XXXXXX";
+    FILE* file = fdopen(mkstemp(path), "w");
+    assert(file != NULL);
+    fprintf(file, "plain.example 10.1.0.1\nslow.example 10.1.0.2 connect_timeout_ms=20000 idle_timeout_s=0\n");
+    fclose(file);
+    assert(load_dictionary(path) == 0);
+    RouteTable* routes = routes_acquire();
+    Entry* plain = routes_find(routes, "plain.example");
+    Entry* slow = routes_find(routes, "slow.example");
+    assert(plain->connect_timeout_ms == config.connect_timeout_ms && plain->idle_timeout_s == config.idle_timeout_s);
+    assert(slow->connect_timeout_ms == 20000 && slow->idle_timeout_s == 0);
+    routes_release(routes);
+
+    file = fopen(path, "w");
+    fputs("bad.example 10.1.0.1 idle_timeout_s=-1\n", file);
+    fclose(file);
+    assert(load_dictionary(path) != 0);
+
+    // The global timeouts are bounded like the routes' own
+    file = fopen(path, "w");
+    fputs("set idle_timeout_s 5000000000\nplain.example 10.1.0.1\n", file);
+    fclose(file);
+    assert(load_dictionary(path) != 0);
+    unlink(path);
+}
+
+// A connected loopback pair, the proxy's end in proxy_end
+static int loopback_pair(int* proxy_end) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(bind(listener, (struct sockaddr*)&address, sizeof(address)) == 0 && listen(listener, 1) == 0);
+    assert(getsockname(listener, (struct sockaddr*)&address, &length) == 0);
+
+    int peer = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(peer, (struct sockaddr*)&address, sizeof(address)) == 0);
+    *proxy_end = accept(listener, NULL, NULL);
+    assert(*proxy_end != -1);
+    close(listener);
+    return peer;
+}
+
+static size_t read_all(int fd, char* buffer, size_t length) {
+    size_t total = 0;
+    struct pollfd readable = { .fd = fd, .events = POLLIN };
+    while (total < length && poll(&readable, 1, 1000) == 1) {
+        ssize_t bytes = recv(fd, buffer + total, length - total, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        total += bytes;
+    }
+    return total;
+}
+
+void test_sockmap() {
+    // Needs CAP_BPF and CAP_NET_ADMIN, the proxy splices without them
+    if (sockmap_init() < 0) {
+        printf("Skipping the sockmap test, BPF isn't permitted\n");
+        return;
+    }
+    assert(sockmap_enabled());
+
+    int client, server;
+    int player = loopback_pair(&client);
+    int backend = loopback_pair(&server);
+
+    // Bytes that arrived before the sockets were handed over go first, and aren't counted again
+    assert(send(player, "early", 5, 0) == 5);
+    usleep(10000);
+    SockmapPair pair;
+    assert(sockmap_attach(client, server, &pair) == 0);
+    static char sent[1 << 20], received[1 << 20];
+    assert(read_all(backend, received, 5) == 5 && memcmp(received, "early", 5) == 0);
+
+    for (size_t i = 0; i < sizeof(sent); ++i) {
+        sent[i] = (char)(i * 7);
+    }
+    assert(send(backend, sent, 4096, 0) == 4096);
+    assert(read_all(player, received, 4096) == 4096 && memcmp(received, sent, 4096) == 0);
+    assert(send(player, sent, sizeof(sent), 0) == sizeof(sent));
+    assert(read_all(backend, received, sizeof(sent)) == sizeof(sent) && memcmp(received, sent, sizeof(sent)) == 0);
+
+    // The peer's FIN isn't a byte
+    close(player);
+    usleep(10000);
+    uint64_t from_client, to_client;
+    assert(sockmap_forwarded(client, server, &pair, &from_client, &to_client) == 0);
+    assert(from_client == sizeof(sent) && to_client == 4096);
+    assert(sockmap_flushed(client, server, &pair, 1));
+    assert(sockmap_idle_ms(client, server) < 1000);
+
+    sockmap_detach(&pair);
+    close(client);
+    close(server);
+    close(backend);
+}
+
+void test_trace() {
+    TraceStats before, after;
+    trace_stats(&before);
+
+    // Accepted a millisecond ago, connected 3 us after connecting and never answered
+    SessionTrace trace = {0};
+    trace_mark(&trace, TRACE_ACCEPTED);
+    trace.at_ns[TRACE_ACCEPTED] -= 1000000;
+    trace_mark(&trace, TRACE_ACCEPTED);
+    trace_mark(&trace, TRACE_CONNECTING);
+    trace.at_ns[TRACE_CONNECTED] = trace.at_ns[TRACE_CONNECTING] + 3000;
+    trace_finish(&trace, "example.com", "Steve", "127.0.0.1");
+    assert(trace.at_ns[TRACE_CLOSED] >= trace.at_ns[TRACE_CONNECTING]);
+
+    trace_stats(&after);
+    const uint64_t* connect = after.buckets[TRACE_SPAN_CONNECT];
+    assert(connect[1] == before.buckets[TRACE_SPAN_CONNECT][1]);
+    assert(connect[2] == before.buckets[TRACE_SPAN_CONNECT][2] + 1);
+    assert(connect[TRACE_BUCKETS - 1] == before.buckets[TRACE_SPAN_CONNECT][TRACE_BUCKETS - 1] + 1);
+    assert(after.sum_us[TRACE_SPAN_CONNECT] == before.sum_us[TRACE_SPAN_CONNECT] + 3);
+    assert(after.buckets[TRACE_SPAN_JOIN][TRACE_BUCKETS - 1] == before.buckets[TRACE_SPAN_JOIN][TRACE_BUCKETS - 1]);
+    assert(after.dropped == before.dropped);
+
+    // Without a writer slow sessions fill the ring and the rest are dropped
+    size_t slow_ms = config.trace_slow_ms;
+    config.trace_slow_ms = 1;
+    for (size_t i = 0; i < 1000; ++i) {
+        trace_finish(&trace, "example.com", "Steve", "127.0.0.1");
+    }
+    config.trace_slow_ms = slow_ms;
+    trace_stats(&after);
+    assert(after.dropped > before.dropped && after.dropped < before.dropped + 1000);
+    assert(after.written == 0);
+}
+
+void test_registry() {
+    int wake_fd = eventfd(0, EFD_NONBLOCK);
+    RegistrySlab* slab = registry_slab(wake_fd);
+    assert(slab != NULL);
+
+    int client;
+    int player = loopback_pair(&client);
+    Session session = { .server_ip_address = "play.example.com" };
+    strcpy(session.username, "Steve");
+    strcpy(session.resolved_address, "10.0.0.1");
+
+    // Sessions past the first chunk, every one listed once
+    enum { COUNT = REGISTRY_CHUNK + 10 };
+    static RegistryEntry* entries[COUNT];
+    static int owners[COUNT];
+    for (size_t i = 0; i < COUNT; ++i) {
+        entries[i] = registry_add(slab, &owners[i], client, &session);
+        assert(entries[i] != NULL);
+    }
+    registry_count(entries[5], 1, 100);
+    registry_count(entries[5], 0, 7);
+    registry_offloaded(entries[5]);
+
+    RegistryCursor cursor;
+    SessionView view;
+    uint64_t kill_id = 0;
+    size_t listed = 0;
+    registry_cursor(&cursor);
+    while (registry_next(&cursor, &view)) {
+        assert(strcmp(view.address, "127.0.0.1") == 0 && strcmp(view.username, "Steve") == 0);
+        assert(strcmp(view.route, "play.example.com") == 0 && strcmp(view.backend, "10.0.0.1") == 0);
+        if (view.from_client == 100) {
+            assert(view.to_client == 7 && view.offloaded);
+            kill_id = view.id;
+        }
+        ++listed;
+    }
+    assert(listed == COUNT && kill_id != 0);
+
+    // The worker is woken up and finds the owner, a session that left in between is never killed
+    assert(registry_kill(kill_id) == 0);
+    uint64_t wakeups;
+    assert(read(wake_fd, &wakeups, sizeof(wakeups)) == sizeof(wakeups));
+    assert(registry_next_kill(slab) == &owners[5]);
+    registry_remove(slab, entries[5]);
+    assert(registry_next_kill(slab) == NULL);
+    assert(registry_kill(kill_id) == -1);
+
+    // Freed entries are reused before the slab grows
+    assert(registry_add(slab, &owners[5], client, &session) == entries[5]);
+    for (size_t i = 0; i < COUNT; ++i) {
+        registry_remove(slab, entries[i]);
+    }
+    registry_cursor(&cursor);
+    assert(!registry_next(&cursor, &view));
+
+    assert(!registry_draining("play.example.com"));
+    assert(registry_drain("play.example.com", 1) == 0);
+    assert(registry_drain("play.example.com", 1) == 0);
+    assert(registry_draining("PLAY.example.com") && !registry_draining("example.com"));
+    char drained[512];
+    registry_drained(drained, sizeof(drained));
+    assert(strcmp(drained, "play.example.com\n") == 0);
+    assert(registry_drain("play.example.com", 0) == 0);
+    assert(!registry_draining("play.example.com"));
+
+    close(player);
+    close(client);
+    close(wake_fd);
+}
+
+void test_resolver() {
+    StubDns stub = {0};
+    socklen_t address_length = sizeof(stub.address);
+
+    stub.address.sin_family = AF_INET;
+    stub.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    stub.udp = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(bind(stub.udp, (struct sockaddr*)&stub.address, sizeof(stub.address)) == 0);
+    assert(getsockname(stub.udp, (struct sockaddr*)&stub.address, &address_length) == 0);
+    stub.tcp = socket(AF_INET, SOCK_STREAM, 0);
+    assert(bind(stub.tcp, (struct sockaddr*)&stub.address, sizeof(stub.address)) == 0);
+    assert(listen(stub.tcp, 16) == 0);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, stub_dns_run, &stub) == 0);
+
+    resolver_shutdown();
+    config.dns_timeout_ms = 200;
+    assert(resolver_init(&stub.address, 1) == 0);
+
+    DnsAnswer answer;
+    char address[INET6_ADDRSTRLEN];
+
+    // The SRV target and port are followed, otherwise the name's own records are used
+    assert(resolver_lookup_sync("srv.test", &answer) == 0);
+    assert(answer.count == 1 && answer.port == 25570);
+    assert(strcmp(inet_ntop(AF_INET, &answer.addresses[0].v4, address, sizeof(address)), "10.1.2.3") == 0);
+
+    // Every A and AAAA record is kept, IPv4 first
+    assert(resolver_lookup_sync("plain.test", &answer) == 0);
+    assert(answer.count == 3 && answer.port == 0 && answer.ttl == 60);
+    assert(strcmp(inet_ntop(AF_INET, &answer.addresses[1].v4, address, sizeof(address)), "10.0.0.17") == 0);
+    assert(answer.addresses[2].family == AF_INET6);
+    assert(strcmp(inet_ntop(AF_INET6, &answer.addresses[2].v6, address, sizeof(address)), "fd00::7") == 0);
+
+    // Truncated answers are asked again over TCP, lost ones are retried
+    assert(resolver_lookup_sync("big.test", &answer) == 0);
+    assert(strcmp(inet_ntop(AF_INET, &answer.addresses[0].v4, address, sizeof(address)), "10.9.9.9") == 0);
+    assert(resolver_lookup_sync("drop.test", &answer) == 0);
+    assert(strcmp(inet_ntop(AF_INET, &answer.addresses[0].v4, address, sizeof(address)), "10.0.0.8") == 0);
+
+    assert(resolver_lookup_sync("missing.test", &answer) == -1);
+
+    // Concurrent lookups of the same name share one query
+    ResolveQueue queue;
+    ResolveRequest requests[8];
+    assert(resolve_queue_init(&queue) == 0);
+
+    for (size_t i = 0; i < 8; ++i) {
+        resolver_lookup(&requests[i], "slow.test", &queue);
+    }
+
+    size_t done = 0;
+    while (done < 8) {
+        struct pollfd pollfd = { .fd = queue.event_fd, .events = POLLIN };
+        poll(&pollfd, 1, 1000);
+        for (ResolveRequest* request = resolve_queue_take(&queue); request != NULL; request = request->next) {
+            assert(request->status == 0);
+            assert(strcmp(inet_ntop(AF_INET, &request->answer.addresses[0].v4, address, sizeof(address)), "10.0.0.6") == 0);
+            ++done;
+        }
+    }
+
+    assert(atomic_load(&stub.slow_queries) == 1);
+
+    resolve_queue_destroy(&queue);
+    resolver_shutdown();
+    atomic_store(&stub.stop, 1);
+    pthread_join(thread, NULL);
+    close(stub.udp);
+    close(stub.tcp);
+}
+
+void test_dns_cache() {
+    assert(dns_cache_init(64) == 0);
+
+    DnsAnswer answer = { .count = 2, .ttl = 1 };
+    answer.addresses[0].family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.1", &answer.addresses[0].v4);
+    answer.addresses[1].family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.2", &answer.addresses[1].v4);
+
+    DnsAnswer cached;
+    assert(dns_cache_lookup("cached.test", &cached) == DNS_CACHE_MISS);
+    dns_cache_store("cached.test", 0, &answer);
+
+    // Hits rotate through the addresses
+    assert(dns_cache_lookup("Cached.Test", &cached) == DNS_CACHE_HIT);
+    assert(cached.count == 2 && cached.addresses[0].v4.s_addr == answer.addresses[0].v4.s_addr);
+    assert(dns_cache_lookup("cached.test", &cached) == DNS_CACHE_HIT);
+    assert(cached.addresses[0].v4.s_addr == answer.addresses[1].v4.s_addr);
+
+    // Failures are remembered for a moment
+    dns_cache_store("failed.test", -1, &(DnsAnswer){0});
+    assert(dns_cache_lookup("failed.test", &cached) == DNS_CACHE_NEGATIVE);
+
+    // Once expired, the answer is still served while it is refreshed, and kept if the refresh fails
+    sleep(2);
+    assert(dns_cache_lookup("cached.test", &cached) == DNS_CACHE_HIT);
+    dns_cache_store("cached.test", -1, &(DnsAnswer){0});
+    assert(dns_cache_lookup("cached.test", &cached) == DNS_CACHE_HIT);
+
+    DnsCacheStats stats;
+    dns_cache_stats(&stats);
+    assert(stats.entries == 2 && stats.stale_hits == 2 && stats.negative_hits == 1);
+
+    // With both families each one rotates on its own and IPv4 always comes first, whatever order they were stored in
+    DnsAnswer mixed = { .count = 4, .ttl = 60 };
+    const char* stored[] = { "2001:db8::1", "10.0.1.1", "10.0.1.2", "2001:db8::2" };
+    for (size_t i = 0; i < 4; ++i) {
+        mixed.addresses[i].family = strchr(stored[i], ':') != NULL ? AF_INET6 : AF_INET;
+        inet_pton(mixed.addresses[i].family, stored[i], &mixed.addresses[i].v6);
+    }
+    dns_cache_store("mixed.test", 0, &mixed);
+    for (size_t i = 0; i < 4; ++i) {
+        assert(dns_cache_lookup("mixed.test", &cached) == DNS_CACHE_HIT);
+        assert(cached.count == 4);
+        assert(cached.addresses[0].v4.s_addr == mixed.addresses[1 + i % 2].v4.s_addr);
+        assert(cached.addresses[1].v4.s_addr == mixed.addresses[1 + (i + 1) % 2].v4.s_addr);
+        assert(memcmp(&cached.addresses[2].v6, &mixed.addresses[i % 2 == 0 ? 0 : 3].v6, sizeof(struct in6_addr)) == 0);
+        assert(cached.addresses[3].family == AF_INET6);
+
+        struct sockaddr_storage address;
+        assert(dns_answer_address(&cached, 25565, 0, &address) == sizeof(struct sockaddr_in));
+    }
+
+    // IP addresses never reach the cache
+    assert(dns_cache_lookup("2001:db8::1", &cached) == DNS_CACHE_HIT);
+    assert(cached.addresses[0].family == AF_INET6);
+
+    dns_cache_destroy();
+}
+
+static size_t put_varint(char* buffer, uint32_t value) {
+    size_t length = 0;
+    do {
+        buffer[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buffer[length] |= 0x80;
+        }
+        ++length;
+    } while (value != 0);
+    return length;
+}
+
+// Length prefixed packet with id 0 around the given fields
+static size_t put_packet(char* buffer, const char* fields, size_t fields_length) {
+    size_t length = put_varint(buffer, fields_length + 1);
+    buffer[length++] = 0x00;
+    memcpy(buffer + length, fields, fields_length);
+    return length + fields_length;
+}
+
+static size_t put_handshake(char* buffer, const char* address, size_t address_length, int next_state, const char* username) {
+    char fields[512];
+    size_t length = put_varint(fields, 767);
+    length += put_varint(fields + length, address_length);
+    memcpy(fields + length, address, address_length);
+    length += address_length;
+    fields[length++] = 0x63;
+    fields[length++] = 0xDD;
+    length += put_varint(fields + length, next_state);
+
+    size_t total = put_packet(buffer, fields, length);
+    if (username != NULL) {
+        length = put_varint(fields, strlen(username));
+        memcpy(fields + length, username, strlen(username));
+        length += strlen(username);
+        memset(fields + length, 0xAB, 16);
+        total += put_packet(buffer + total, fields, length + 16);
+    }
+    return total;
+}
+
+void test_packet_decoder() {
+    const uint32_t values[] = { 0, 1, 127, 128, 255, 25565, 2097151, 2147483647, 0xFFFFFFFF };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        char buffer[16] = {0};
+        size_t length = put_varint(buffer, values[i]);
+        int32_t value;
+
+        // Padded, exact and cut short
+        assert(varint_decode(buffer, sizeof(buffer), &value) == (ssize_t)length && (uint32_t)value == values[i]);
+        assert(varint_decode(buffer, length, &value) == (ssize_t)length && (uint32_t)value == values[i]);
+        assert(varint_decode(buffer, length - 1, &value) == 0);
+    }
+
+    int32_t value;
+    assert(varint_decode("\xFF\xFF\xFF\xFF\xFF\x01\x00\x00", 8, &value) == -1);
+
+    // Handshake and Login Start pipelined, split at every possible point
+    char stream[512];
+    size_t length = put_handshake(stream, "play.example.com\0FML3\0", 22, PACKET_STATE_LOGIN, "Notch");
+
+    for (size_t split = 0; split <= length; ++split) {
+        PacketDecoder decoder;
+        packet_decoder_init(&decoder);
+
+        enum PacketStatus status = packet_decoder_feed(&decoder, stream, split);
+        assert(status == (split == length ? PACKET_READY : PACKET_NEED_MORE));
+        assert(packet_decoder_feed(&decoder, stream, length) == PACKET_READY);
+
+        assert(decoder.protocol_version == 767 && decoder.server_port == 25565 && decoder.next_state == PACKET_STATE_LOGIN);
+        assert(decoder.server_address.length == 22 && memcmp(stream + decoder.server_address.offset, "play.example.com", 16) == 0);
+        assert(decoder.username.length == 5 && memcmp(stream + decoder.username.offset, "Notch", 5) == 0);
+        assert(decoder.position == length);
+    }
+
+    // A status ping is ready without a Login Start
+    PacketDecoder decoder;
+    packet_decoder_init(&decoder);
+    length = put_handshake(stream, "play.example.com", 16, PACKET_STATE_STATUS, NULL);
+    assert(packet_decoder_feed(&decoder, stream, length) == PACKET_READY);
+    assert(decoder.username.length == 0);
+
+    // Unknown next state, wrong packet id, a string running past its packet
+    packet_decoder_init(&decoder);
+    length = put_handshake(stream, "play.example.com", 16, 7, NULL);
+    assert(packet_decoder_feed(&decoder, stream, length) == PACKET_MALFORMED);
+
+    packet_decoder_init(&decoder);
+    length = put_handshake(stream, "play.example.com", 16, PACKET_STATE_STATUS, NULL);
+    stream[1] = 0x01;
+    assert(packet_decoder_feed(&decoder, stream, length) == PACKET_MALFORMED);
+
+    packet_decoder_init(&decoder);
+    length = put_handshake(stream, "play.example.com", 16, PACKET_STATE_STATUS, NULL);
+    stream[4] = 0x7F;
+    assert(packet_decoder_feed(&decoder, stream, length) == PACKET_MALFORMED);
 }
 
 int main(void) {
+    assert(resolver_init(NULL, 0) == 0);
+
     test_dns_query();
     test_resolve_hostname();
     test_server_dictionary();
+    test_route_index();
+    test_reload();
+    test_route_backends();
+    test_socket_profiles();
+    test_backend_health();
+    test_status_ping();
+    test_metrics();
+    test_buffers();
+    test_limiter();
+    test_shaper();
+    test_timers();
+    test_sockmap();
+    test_trace();
+    test_registry();
+    test_resolver();
+    test_dns_cache();
+    test_packet_decoder();
 
     printf("All tests passed\n");
     return 0;
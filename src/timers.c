@@ -0,0 +1,176 @@
+#include "timers.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define LEVEL_SPAN(level) ((uint64_t)1 << (TIMER_LEVEL_BITS * (level)))
+
+static uint64_t rotate_right(uint64_t bits, unsigned by) {
+    by &= 63;
+    return by == 0 ? bits : (bits >> by) | (bits << (64 - by));
+}
+
+static void slot_link(TimerWheel* wheel, Timer* timer, uint16_t slot) {
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[slot];
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[slot] = timer;
+    if (slot < TIMER_DUE) {
+        wheel->occupied[slot >> TIMER_LEVEL_BITS] |= 1ULL << (slot & SLOT_MASK);
+    }
+}
+
+static void slot_unlink(TimerWheel* wheel, Timer* timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->slot] = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    if (timer->slot < TIMER_DUE && wheel->slots[timer->slot] == NULL) {
+        wheel->occupied[timer->slot >> TIMER_LEVEL_BITS] &= ~(1ULL << (timer->slot & SLOT_MASK));
+    }
+    timer->prev = timer->next = NULL;
+}
+
+// Files the timer on the level whose slots are as far apart as it is from the wheel's time. It lands
+// in a slot that comes round before the timer is due, and is spread over the levels below then
+static void place(TimerWheel* wheel, Timer* timer) {
+    uint64_t at = timer->at_ms > wheel->current ? timer->at_ms : wheel->current;
+    uint64_t delta = at - wheel->current;
+    if (delta >= LEVEL_SPAN(TIMER_LEVELS)) {
+        delta = LEVEL_SPAN(TIMER_LEVELS) - 1;
+        at = wheel->current + delta;
+    }
+
+    size_t level = 0;
+    while (delta >= LEVEL_SPAN(level + 1)) {
+        ++level;
+    }
+    slot_link(wheel, timer, level * TIMER_SLOTS + ((at >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK));
+}
+
+// Takes a whole slot off the wheel and files its timers again, or as due
+static void slot_move(TimerWheel* wheel, uint16_t slot, int due) {
+    Timer* timer = wheel->slots[slot];
+    wheel->slots[slot] = NULL;
+    wheel->occupied[slot >> TIMER_LEVEL_BITS] &= ~(1ULL << (slot & SLOT_MASK));
+
+    while (timer != NULL) {
+        Timer* next = timer->next;
+        if (due) {
+            slot_link(wheel, timer, TIMER_DUE);
+        } else {
+            place(wheel, timer);
+        }
+        timer = next;
+    }
+}
+
+// Brings the wheel up to now. Every millisecond the level 0 slot of it expires, and when a level's
+// slot comes round it is spread over the levels below first. Runs of empty slots are skipped
+static void advance(TimerWheel* wheel, uint64_t now_ms) {
+    if (wheel->count == 0) {
+        wheel->current = now_ms + 1;
+        return;
+    }
+
+    while (wheel->current <= now_ms) {
+        for (size_t level = 1; level < TIMER_LEVELS && (wheel->current & (LEVEL_SPAN(level) - 1)) == 0; ++level) {
+            slot_move(wheel, level * TIMER_SLOTS + ((wheel->current >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK), 0);
+        }
+
+        if (wheel->occupied[0] & (1ULL << (wheel->current & SLOT_MASK))) {
+            slot_move(wheel, wheel->current & SLOT_MASK, 1);
+        }
+        ++wheel->current;
+
+        // Up to the next timer on level 0 or the next cascade, whichever comes first
+        if ((wheel->current & SLOT_MASK) != 0) {
+            uint64_t ahead = wheel->occupied[0] >> (wheel->current & SLOT_MASK);
+            uint64_t next = ahead != 0 ? wheel->current + __builtin_ctzll(ahead) : (wheel->current | SLOT_MASK) + 1;
+            wheel->current = next <= now_ms ? next : now_ms + 1;
+        }
+    }
+}
+
+void timer_wheel_init(TimerWheel* wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = now_ms;
+}
+
+void timer_arm(TimerWheel* wheel, Timer* timer, uint64_t at_ms) {
+    if (timer->armed) {
+        slot_unlink(wheel, timer);
+    } else {
+        timer->armed = 1;
+        ++wheel->count;
+    }
+    timer->at_ms = at_ms;
+    place(wheel, timer);
+}
+
+void timer_cancel(TimerWheel* wheel, Timer* timer) {
+    if (!timer->armed) {
+        return;
+    }
+    slot_unlink(wheel, timer);
+    timer->armed = 0;
+    --wheel->count;
+}
+
+Timer* timer_expired(TimerWheel* wheel, uint64_t now_ms) {
+    if (wheel->slots[TIMER_DUE] == NULL) {
+        advance(wheel, now_ms);
+    }
+
+    Timer* timer = wheel->slots[TIMER_DUE];
+    if (timer != NULL) {
+        timer_cancel(wheel, timer);
+    }
+    return timer;
+}
+
+int timer_wait_ms(const TimerWheel* wheel, uint64_t now_ms) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    if (wheel->slots[TIMER_DUE] != NULL) {
+        return 0;
+    }
+
+    // Level 0 slots are single milliseconds, the others are only looked at when they come round
+    uint64_t next = UINT64_MAX;
+    if (wheel->occupied[0] != 0) {
+        next = wheel->current + __builtin_ctzll(rotate_right(wheel->occupied[0], wheel->current & SLOT_MASK));
+    }
+    for (size_t level = 1; level < TIMER_LEVELS; ++level) {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0) {
+            continue;
+        }
+
+        uint64_t span = LEVEL_SPAN(level);
+        unsigned index = (wheel->current >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+        uint64_t at;
+        if ((wheel->current & (span - 1)) == 0 && (bits & (1ULL << index))) {
+            at = wheel->current;
+        } else {
+            at = (wheel->current & ~(span - 1)) + (1 + __builtin_ctzll(rotate_right(bits, index + 1))) * span;
+        }
+        if (at < next) {
+            next = at;
+        }
+    }
+
+    if (next <= now_ms) {
+        return 0;
+    }
+    return next - now_ms > INT_MAX ? INT_MAX : (int)(next - now_ms);
+}
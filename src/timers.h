@@ -0,0 +1,52 @@
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Four levels of 64 slots of 1 ms, 64^n ms apart, cover about 4.6 hours. Later timers wait in
+// the last level and are put back when they come up
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_DUE (TIMER_LEVELS * TIMER_SLOTS) // Slot of the timers that expired but weren't taken yet
+
+enum TimerKind {
+    TIMER_HANDSHAKE,            // The client has to finish its handshake or ping by then
+    TIMER_CONNECT,              // The backend has to accept the connection by then
+    TIMER_IDLE,                 // Checked against the last activity of the session when it fires
+    TIMER_DRAIN                 // The kernel is still forwarding what a side sent before hanging up
+};
+
+typedef struct Timer {
+    struct Timer* prev;
+    struct Timer* next;
+    uint64_t at_ms;
+    uint16_t slot;
+    uint8_t armed;
+    uint8_t kind;               // enum TimerKind, set by whoever arms it
+} Timer;
+
+// Timers of one worker in a hierarchical wheel: arming, cancelling and expiring are O(1), and every
+// timer moves down at most once per level. Nothing is shared, a worker only touches its own wheel
+typedef struct {
+    Timer* slots[TIMER_DUE + 1];
+    uint64_t occupied[TIMER_LEVELS]; // A bit per slot holding timers, so empty stretches are skipped
+    uint64_t current;           // The next millisecond to be expired, earlier ones are done
+    size_t count;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel* wheel, uint64_t now_ms);
+// Arms the timer to expire at at_ms, moving it if it was armed already
+void timer_arm(TimerWheel* wheel, Timer* timer, uint64_t at_ms);
+void timer_cancel(TimerWheel* wheel, Timer* timer);
+// Takes one timer whose time has come off the wheel, NULL once there are none
+Timer* timer_expired(TimerWheel* wheel, uint64_t now_ms);
+// Milliseconds until the wheel has to be looked at again, -1 if it is empty. It may wake up early to
+// move timers down a level
+int timer_wait_ms(const TimerWheel* wheel, uint64_t now_ms);
+
+#endif // TIMERS_H
@@ -0,0 +1,334 @@
+#include "trace.h"
+
+#ifndef NO_TRACING
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define TRACE_FILE "logs/trace.jsonl"
+#define TRACE_RING_SIZE 256         // Records per thread, must be a power of two
+#define TRACE_FLUSH_MS 100          // How often the writer empties the rings
+#define TRACE_ROUTE_SIZE 256
+#define TRACE_USERNAME_SIZE 32
+
+// Read/Write
+#define MKDIR_MODE 0600
+#define FILE_MODE 0644
+
+const char* const trace_span_names[TRACE_SPANS] = { "handshake", "route", "resolve", "connect", "first_byte", "join" };
+
+static const char* const phase_names[TRACE_PHASES] = {
+    "accepted", "handshake", "routed", "resolved", "connecting", "connected", "first_byte", "closed"
+};
+
+// First and last phase of each span
+static const enum TracePhase span_phases[TRACE_SPANS][2] = {
+    { TRACE_ACCEPTED, TRACE_HANDSHAKE },
+    { TRACE_HANDSHAKE, TRACE_ROUTED },
+    { TRACE_ROUTED, TRACE_RESOLVED },
+    { TRACE_CONNECTING, TRACE_CONNECTED },
+    { TRACE_CONNECTED, TRACE_FIRST_BYTE },
+    { TRACE_ACCEPTED, TRACE_FIRST_BYTE },
+};
+
+typedef struct {
+    SessionTrace trace;
+    uint8_t slow;                   // Written for taking too long, not for being sampled
+    char route[TRACE_ROUTE_SIZE];
+    char username[TRACE_USERNAME_SIZE];
+    char backend[INET6_ADDRSTRLEN];
+} TraceRecord;
+
+// One per thread finishing sessions. The thread is the only one writing the histograms and pushing
+// records, the writer the only one taking them off
+typedef struct TraceRing {
+    _Alignas(64) atomic_size_t head;
+    size_t sessions;                // Sessions finished, for sampling
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_uint_least64_t buckets[TRACE_SPANS][TRACE_BUCKETS];
+    atomic_uint_least64_t sum_us[TRACE_SPANS];
+    atomic_size_t dropped;
+    struct TraceRing* next;
+    TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+static struct {
+    _Atomic(TraceRing*) rings;
+    int64_t realtime_offset_ns;     // Added to a monotonic stamp to get the wall clock
+    int fd;
+    int wake_fd;                    // Signalled on shutdown
+    int running;
+    pthread_t thread;
+    atomic_size_t written;
+} tracer = { .fd = -1, .wake_fd = -1 };
+
+static __thread TraceRing* thread_ring = NULL;
+
+static TraceRing* trace_ring() {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+
+    TraceRing* ring = aligned_alloc(64, sizeof(TraceRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+
+    ring->next = atomic_load_explicit(&tracer.rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&tracer.rings, &ring->next, ring, memory_order_release, memory_order_relaxed)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+static void copy_string(char* destination, const char* source, size_t size) {
+    if (source == NULL) {
+        destination[0] = '\0';
+        return;
+    }
+    size_t length = strnlen(source, size - 1);
+    memcpy(destination, source, length);
+    destination[length] = '\0';
+}
+
+void trace_finish(SessionTrace* trace, const char* route, const char* username, const char* backend) {
+    trace_mark(trace, TRACE_CLOSED);
+
+    TraceRing* ring = trace_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    const uint64_t* at = trace->at_ns;
+    for (size_t span = 0; span < TRACE_SPANS; ++span) {
+        uint64_t start = at[span_phases[span][0]], end = at[span_phases[span][1]];
+        if (start == 0 || end == 0) {
+            continue;
+        }
+
+        uint64_t us = (end - start) / 1000;
+        size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        if (bucket > TRACE_BUCKETS - 1) {
+            bucket = TRACE_BUCKETS - 1;
+        }
+        // Single writer, a plain load and store is enough
+        atomic_store_explicit(&ring->buckets[span][bucket], atomic_load_explicit(&ring->buckets[span][bucket], memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_store_explicit(&ring->sum_us[span], atomic_load_explicit(&ring->sum_us[span], memory_order_relaxed) + us, memory_order_relaxed);
+    }
+
+    // Sessions are slow by the time their backend answered, or connected, or by their whole life
+    // if it never did
+    uint64_t end = at[TRACE_FIRST_BYTE] ? at[TRACE_FIRST_BYTE] : at[TRACE_CONNECTED] ? at[TRACE_CONNECTED] : at[TRACE_CLOSED];
+    int slow = config.trace_slow_ms > 0 && end - at[TRACE_ACCEPTED] >= config.trace_slow_ms * 1000000;
+    int sampled = config.trace_sample > 0 && ring->sessions++ % config.trace_sample == 0;
+    if (!slow && !sampled) {
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    TraceRecord* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->trace = *trace;
+    record->slow = slow;
+    copy_string(record->route, route, sizeof(record->route));
+    copy_string(record->username, username, sizeof(record->username));
+    copy_string(record->backend, backend, sizeof(record->backend));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Hostnames come from the clients, they must not break out of their quotes
+static void write_json_string(FILE* out, const char* value) {
+    fputc('"', out);
+    for (; *value != '\0'; ++value) {
+        unsigned char c = *value;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void write_record(FILE* out, const TraceRecord* record) {
+    const uint64_t* at = record->trace.at_ns;
+    uint64_t wall_ns = at[TRACE_ACCEPTED] + tracer.realtime_offset_ns;
+    time_t seconds = wall_ns / 1000000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char time[32];
+    strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    fprintf(out, "{\"time\":\"%s.%06luZ\",\"reason\":\"%s\",\"route\":", time, (unsigned long)(wall_ns % 1000000000 / 1000), record->slow ? "slow" : "sampled");
+    write_json_string(out, record->route);
+    fprintf(out, ",\"username\":");
+    write_json_string(out, record->username);
+    fprintf(out, ",\"backend\":");
+    write_json_string(out, record->backend);
+
+    // Microseconds from the accept to each phase reached
+    fprintf(out, ",\"phases_us\":{");
+    const char* separator = "";
+    for (size_t phase = TRACE_ACCEPTED + 1; phase < TRACE_PHASES; ++phase) {
+        if (at[phase] != 0) {
+            fprintf(out, "%s\"%s\":%llu", separator, phase_names[phase], (unsigned long long)((at[phase] - at[TRACE_ACCEPTED]) / 1000));
+            separator = ",";
+        }
+    }
+    fprintf(out, "}}\n");
+}
+
+// Writes everything queued so far, one write per ring
+static void trace_drain() {
+    char* buffer = NULL;
+    size_t length = 0;
+
+    for (TraceRing* ring = atomic_load_explicit(&tracer.rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+
+        FILE* out = open_memstream(&buffer, &length);
+        if (out == NULL) {
+            return;
+        }
+        for (size_t position = tail; position != head; ++position) {
+            write_record(out, &ring->records[position & (TRACE_RING_SIZE - 1)]);
+        }
+        fclose(out);
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+
+        size_t offset = 0;
+        while (offset < length) {
+            ssize_t written = write(tracer.fd, buffer + offset, length - offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Error writing the trace file");
+                break;
+            }
+            offset += written;
+        }
+        if (offset == length) {
+            atomic_fetch_add_explicit(&tracer.written, head - tail, memory_order_relaxed);
+        }
+        free(buffer);
+        buffer = NULL;
+    }
+}
+
+static void* trace_run(void* arg) {
+    (void)arg;
+
+    struct pollfd wake = { .fd = tracer.wake_fd, .events = POLLIN };
+    while (poll(&wake, 1, TRACE_FLUSH_MS) == 0 || (wake.revents & POLLIN) == 0) {
+        trace_drain();
+    }
+    trace_drain();
+    return NULL;
+}
+
+// Runs from exit(), so the records of the last sessions reach the file
+static void trace_stop() {
+    if (!tracer.running) {
+        return;
+    }
+    tracer.running = 0;
+
+    uint64_t one = 1;
+    if (write(tracer.wake_fd, &one, sizeof(one)) < 0) {
+        perror("Error waking the trace writer");
+    }
+    pthread_join(tracer.thread, NULL);
+    close(tracer.fd);
+    tracer.fd = -1;
+}
+
+ssize_t trace_init() {
+    struct timespec monotonic, realtime;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    tracer.realtime_offset_ns = ((int64_t)realtime.tv_sec - monotonic.tv_sec) * 1000000000 + (realtime.tv_nsec - monotonic.tv_nsec);
+
+    struct stat st = {0};
+    if (stat("logs", &st) == -1 && mkdir("logs", MKDIR_MODE) == -1 && errno != EEXIST) {
+        perror("Error creating the logs directory");
+        return -1;
+    }
+
+    tracer.fd = open(TRACE_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, FILE_MODE);
+    if (tracer.fd < 0) {
+        perror("Error opening the trace file");
+        return -1;
+    }
+
+    tracer.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (tracer.wake_fd < 0) {
+        perror("Error creating the trace wakeup");
+        return -1;
+    }
+
+    // Signals are for the other threads, the writer must never run sigint_handler and join itself
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int error = pthread_create(&tracer.thread, NULL, trace_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (error != 0) {
+        errno = error;
+        perror("Error creating the trace writer thread");
+        return -1;
+    }
+
+    tracer.running = 1;
+    atexit(trace_stop);
+    return 0;
+}
+
+void trace_stats(TraceStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->written = atomic_load_explicit(&tracer.written, memory_order_relaxed);
+
+    for (TraceRing* ring = atomic_load_explicit(&tracer.rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        stats->dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        for (size_t span = 0; span < TRACE_SPANS; ++span) {
+            for (size_t bucket = 0; bucket < TRACE_BUCKETS; ++bucket) {
+                stats->buckets[span][bucket] += atomic_load_explicit(&ring->buckets[span][bucket], memory_order_relaxed);
+            }
+            stats->sum_us[span] += atomic_load_explicit(&ring->sum_us[span], memory_order_relaxed);
+        }
+    }
+
+    for (size_t span = 0; span < TRACE_SPANS; ++span) {
+        for (size_t bucket = 1; bucket < TRACE_BUCKETS; ++bucket) {
+            stats->buckets[span][bucket] += stats->buckets[span][bucket - 1];
+        }
+    }
+}
+
+#endif // NO_TRACING
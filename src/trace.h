@@ -0,0 +1,95 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Phases of a session, each stamped the first time it is reached. Build with -DNO_TRACING to
+// compile every stamp out
+enum TracePhase {
+    TRACE_ACCEPTED,
+    TRACE_HANDSHAKE,            // Handshake and Login Start or Status Request received
+    TRACE_ROUTED,               // The route was found in the table
+    TRACE_RESOLVED,             // The first backend address is known, from the DNS cache or the resolver
+    TRACE_CONNECTING,           // connect() issued or a pooled socket taken
+    TRACE_CONNECTED,            // The backend accepted, failovers included
+    TRACE_FIRST_BYTE,           // The backend's first answer came in
+    TRACE_CLOSED,
+    TRACE_PHASES
+};
+
+// Time between two phases, kept as a histogram per thread
+enum TraceSpan {
+    TRACE_SPAN_HANDSHAKE,       // Accepted to handshake
+    TRACE_SPAN_ROUTE,           // Handshake to routed
+    TRACE_SPAN_RESOLVE,         // Routed to resolved
+    TRACE_SPAN_CONNECT,         // Connecting to connected
+    TRACE_SPAN_FIRST_BYTE,      // Connected to the backend's first answer
+    TRACE_SPAN_JOIN,            // Accepted to the backend's first answer
+    TRACE_SPANS
+};
+
+#define TRACE_BUCKETS 28        // Powers of two from 1 us to about 67 s, and +Inf
+
+typedef struct {
+    size_t written;             // Records in the trace file
+    size_t dropped;             // Records lost because a thread's ring was full
+    // Cumulative, bucket i counts spans under 2^i us and the last one all of them
+    uint64_t buckets[TRACE_SPANS][TRACE_BUCKETS];
+    uint64_t sum_us[TRACE_SPANS];
+} TraceStats;
+
+#ifndef NO_TRACING
+
+extern const char* const trace_span_names[TRACE_SPANS];
+
+// Monotonic nanoseconds of every phase reached, 0 for the others
+typedef struct {
+    uint64_t at_ns[TRACE_PHASES];
+} SessionTrace;
+
+static inline void trace_mark(SessionTrace* trace, enum TracePhase phase) {
+    if (trace->at_ns[phase] == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        trace->at_ns[phase] = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+}
+
+// Starts the thread writing trace records to logs/trace.jsonl
+ssize_t trace_init();
+// Stamps the close and adds the session's spans to the thread's histograms. Sessions picked by
+// trace_sample or slower than trace_slow_ms are queued on the thread's ring for the writer, a full
+// ring drops them
+void trace_finish(SessionTrace* trace, const char* route, const char* username, const char* backend);
+void trace_stats(TraceStats* stats);
+
+#else
+
+typedef struct {
+    uint8_t unused;
+} SessionTrace;
+
+static inline void trace_mark(SessionTrace* trace, enum TracePhase phase) {
+    (void)trace;
+    (void)phase;
+}
+
+static inline ssize_t trace_init() {
+    return 0;
+}
+
+static inline void trace_finish(SessionTrace* trace, const char* route, const char* username, const char* backend) {
+    (void)trace;
+    (void)route;
+    (void)username;
+    (void)backend;
+}
+
+#endif // NO_TRACING
+
+#endif // TRACE_H
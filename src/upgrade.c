@@ -0,0 +1,342 @@
+#include "upgrade.h"
+#include "admin.h"
+#include "config.h"
+#include "engine.h"
+#include "exporter.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Tells the new process which descriptor leads back to the old one
+#define UPGRADE_ENV "MCPROXY_UPGRADE_FD"
+
+extern char** environ;
+
+typedef struct {
+    char* const* argv;
+    int signal_fd;
+    int parent_fd;                  // In a process started by an upgrade, -1 once the old one was told it's ready
+    pthread_mutex_t mutex;          // Guards the listeners, recorded by the main thread once they're accepted on
+    int sockets[UPGRADE_MAX_SOCKETS];
+    size_t socket_count;
+} Upgrader;
+
+static Upgrader upgrader = { .signal_fd = -1, .parent_fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void report(const char* message, int error) {
+    printf("%s\n", message);
+    if (error) {
+        log_error(message);
+    } else {
+        log_info(message);
+    }
+}
+
+// The current environment with the upgrade descriptor pointing at fd, NULL if it couldn't be allocated
+static char** child_environment(int fd) {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        ++count;
+    }
+
+    char** environment = calloc(count + 2, sizeof(char*));
+    char* variable = malloc(sizeof(UPGRADE_ENV) + 16);
+    if (environment == NULL || variable == NULL) {
+        free(environment);
+        free(variable);
+        return NULL;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) {
+            environment[kept++] = environ[i];
+        }
+    }
+    snprintf(variable, sizeof(UPGRADE_ENV) + 16, UPGRADE_ENV "=%d", fd);
+    environment[kept] = variable;
+    return environment;
+}
+
+static pid_t spawn_successor(int child_fd) {
+    char** environment = child_environment(child_fd);
+    if (environment == NULL) {
+        perror("Error preparing the upgrade");
+        return -1;
+    }
+
+    // Signals blocked for signalfd would stay blocked across exec
+    posix_spawnattr_t attributes;
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &none);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int result = posix_spawnp(&pid, upgrader.argv[0], NULL, &attributes, upgrader.argv, environment);
+    posix_spawnattr_destroy(&attributes);
+
+    // Only the last entry was allocated, the others belong to environ
+    size_t last = 0;
+    while (environment[last + 1] != NULL) {
+        ++last;
+    }
+    free(environment[last]);
+    free(environment);
+
+    if (result != 0) {
+        errno = result;
+        perror("Error starting the new binary");
+        return -1;
+    }
+    return pid;
+}
+
+static ssize_t send_listeners(int fd) {
+    pthread_mutex_lock(&upgrader.mutex);
+    size_t count = upgrader.socket_count;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_SOCKETS)] = {0};
+    uint32_t payload = count;
+    struct iovec data = { .iov_base = &payload, .iov_len = sizeof(payload) };
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), upgrader.sockets, sizeof(int) * count);
+    pthread_mutex_unlock(&upgrader.mutex);
+
+    if (sendmsg(fd, &message, MSG_NOSIGNAL) != sizeof(payload)) {
+        perror("Error sending the listeners");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 0 once the new process accepts on the listeners, -1 if it failed or took too long
+static ssize_t wait_ready(int fd) {
+    struct pollfd ready = { .fd = fd, .events = POLLIN };
+    char byte;
+    if (poll(&ready, 1, UPGRADE_READY_TIMEOUT_MS) != 1 || read(fd, &byte, 1) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t now_s() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+// Players on this process keep playing until they leave or upgrade_drain_s runs out
+static void drain(pid_t successor) {
+    char message[256];
+    uint64_t deadline = now_s() + config.upgrade_drain_s;
+    uint64_t active = metrics_connections_active();
+
+    snprintf(message, sizeof(message), "Handed the listeners to process %d, draining %llu connections",
+             successor, (unsigned long long)active);
+    report(message, 0);
+
+    while (active > 0 && now_s() < deadline) {
+        // Further SIGUSR2s are read and dropped, this process has nothing left to hand over
+        struct pollfd signals = { .fd = upgrader.signal_fd, .events = POLLIN };
+        if (poll(&signals, 1, 1000) > 0) {
+            struct signalfd_siginfo info;
+            while (read(upgrader.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                printf("Already upgraded, draining\n");
+            }
+        }
+        active = metrics_connections_active();
+    }
+
+    snprintf(message, sizeof(message), "Drained, closing %llu connections and exiting", (unsigned long long)active);
+    report(message, 0);
+    log_shutdown();
+    exit(EXIT_SUCCESS);
+}
+
+static void upgrade() {
+    pthread_mutex_lock(&upgrader.mutex);
+    size_t count = upgrader.socket_count;
+    pthread_mutex_unlock(&upgrader.mutex);
+    if (count == 0) {
+        printf("Not listening yet, ignoring the upgrade\n");
+        return;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("Error creating the upgrade socket");
+        return;
+    }
+
+    // The new process's end has to survive exec
+    int flags = fcntl(pair[1], F_GETFD);
+    fcntl(pair[1], F_SETFD, flags & ~FD_CLOEXEC);
+
+    // The metrics port and the admin socket are handed over by closing them, scrapes and commands in between fail
+    exporter_shutdown();
+    admin_shutdown();
+
+    report("Upgrading, starting the new binary", 0);
+    pid_t pid = spawn_successor(pair[1]);
+    close(pair[1]);
+
+    if (pid != -1 && send_listeners(pair[0]) == 0 && wait_ready(pair[0]) == 0) {
+        close(pair[0]);
+        engine_stop_accepting();
+        drain(pid);
+    }
+
+    close(pair[0]);
+    if (pid != -1) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    report("Upgrade failed, this process keeps serving", 1);
+    if (exporter_init() != 0) {
+        printf("The metrics listener couldn't be restarted\n");
+    }
+    if (admin_init() != 0) {
+        printf("The admin socket couldn't be restarted\n");
+    }
+}
+
+static void* upgrade_thread(void* arg) {
+    (void)arg;
+    struct pollfd signals = { .fd = upgrader.signal_fd, .events = POLLIN };
+
+    for (;;) {
+        if (poll(&signals, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return NULL;
+        }
+
+        int requested = 0;
+        struct signalfd_siginfo info;
+        while (read(upgrader.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            requested = 1;
+        }
+        if (requested) {
+            upgrade();
+        }
+    }
+
+    return NULL;
+}
+
+ssize_t upgrade_start(char* const* argv) {
+    upgrader.argv = argv;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        perror("pthread_sigmask failed");
+        return -1;
+    }
+
+    upgrader.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (upgrader.signal_fd < 0) {
+        perror("signalfd failed");
+        return -1;
+    }
+
+    // Starts before reload_start blocks SIGHUP, a SIGHUP delivered to this thread, or to the exporter and
+    // admin threads it starts again after a failed upgrade, would end the process
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, upgrade_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (error != 0) {
+        errno = error;
+        perror("Error creating the upgrade thread");
+        close(upgrader.signal_fd);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
+
+ssize_t upgrade_inherit(int* sockets, size_t max) {
+    const char* variable = getenv(UPGRADE_ENV);
+    if (variable == NULL) {
+        return 0;
+    }
+    upgrader.parent_fd = atoi(variable);
+    unsetenv(UPGRADE_ENV);
+    fcntl(upgrader.parent_fd, F_SETFD, FD_CLOEXEC);
+
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_SOCKETS)];
+    uint32_t payload;
+    struct iovec data = { .iov_base = &payload, .iov_len = sizeof(payload) };
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    if (recvmsg(upgrader.parent_fd, &message, MSG_CMSG_CLOEXEC) != sizeof(payload)) {
+        perror("Error receiving the listeners");
+        return -1;
+    }
+
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_type != SCM_RIGHTS || (message.msg_flags & MSG_CTRUNC) ||
+        header->cmsg_len != CMSG_LEN(sizeof(int) * payload) || payload == 0 || payload > max) {
+        printf("Invalid listeners from the previous process\n");
+        return -1;
+    }
+
+    memcpy(sockets, CMSG_DATA(header), sizeof(int) * payload);
+    return payload;
+}
+
+void upgrade_ready(const int* sockets, size_t count) {
+    pthread_mutex_lock(&upgrader.mutex);
+    upgrader.socket_count = count < UPGRADE_MAX_SOCKETS ? count : UPGRADE_MAX_SOCKETS;
+    memcpy(upgrader.sockets, sockets, sizeof(int) * upgrader.socket_count);
+    pthread_mutex_unlock(&upgrader.mutex);
+
+    if (upgrader.parent_fd != -1) {
+        char byte = 1;
+        if (write(upgrader.parent_fd, &byte, 1) != 1) {
+            perror("Error telling the previous process");
+        }
+        close(upgrader.parent_fd);
+        upgrader.parent_fd = -1;
+    }
+}
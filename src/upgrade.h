@@ -0,0 +1,25 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define UPGRADE_MAX_SOCKETS 253     // SCM_MAX_FD, the most descriptors one message can carry
+#define UPGRADE_READY_TIMEOUT_MS 10000
+
+// Blocks SIGUSR2 in the calling thread, call it before starting any other thread so they inherit the mask.
+// On SIGUSR2 a background thread starts argv again, hands the new process the listeners over a Unix
+// socket and, once it accepts on them, serves the connections it still has for upgrade_drain_s and exits
+ssize_t upgrade_start(char* const* argv);
+
+// In a process started by an upgrade, takes over the old process's listeners. Returns how many were
+// received, 0 if the process wasn't started by an upgrade, -1 on errors
+ssize_t upgrade_inherit(int* sockets, size_t max);
+
+// Called once the workers accept on the listeners. They are kept for the next upgrade, and the old
+// process, if there is one, is told to stop accepting and start draining
+void upgrade_ready(const int* sockets, size_t count);
+
+#endif // UPGRADE_H
@@ -0,0 +1,1169 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "buffers.h"
+#include "config.h"
+#include "limiter.h"
+#include "pool.h"
+#include "profiles.h"
+
+#define RING_ENTRIES 1024
+#define BUFFER_COUNT 256            // Provided buffers per worker, must be a power of two
+#define BUFFER_LENGTH 16384
+#define BUFFER_GROUP 0
+#define NO_BUFFER 0xFFFF            // Chunk holds the replayed handshake rather than a provided buffer
+#define NO_CHUNK 0xFFFE             // End of a send queue
+#define SPARE_CLIENT 0xFFFD         // Chunk holds bytes from the client's spare buffer
+#define SPARE_SERVER 0xFFFC         // Chunk holds bytes from the server's spare buffer
+#define STATUS_REPLY 0xFFFB         // Chunk holds a status cache answer, owned by the session
+
+#define QUEUE_PARK 8                // Queued chunks at which the source stops receiving
+
+// Operation kinds are stored in the low bits of the completion's user_data, next to the connection pointer
+enum Operation {
+    OP_ACCEPT,
+    OP_RECV_CLIENT,
+    OP_RECV_SERVER,
+    OP_SEND_CLIENT,
+    OP_SEND_SERVER,
+    OP_CONNECT,
+    OP_CANCEL,
+    OP_RESOLVE,
+    OP_TIMEOUT,
+    OP_CANCEL_ACCEPT
+};
+#define OP_MASK 0xF                 // Connections come from calloc, which aligns them to 16 bytes
+
+// Bytes received into a provided buffer, linked into the send queue of the other side.
+// A buffer is in at most one queue, so the chunks live in the ring indexed by buffer id
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+    uint16_t next;
+    uint8_t done;
+} Chunk;
+
+// One end of a proxied connection. The queue holds bytes waiting to be written to this fd
+typedef struct {
+    int fd;
+    uint8_t receiving;              // Multishot recv armed
+    uint8_t parked;                 // Receiving stopped until the peer drains its queue
+    uint8_t waiting;                // Receiving stopped until provided buffers are returned
+    uint8_t spare_receiving;        // Single-shot recv into the spare buffer in flight
+    char* spare;                    // Private buffer used when the provided buffers run dry
+    Chunk spare_chunk;
+    uint16_t sending;               // Sends of the current linked chain still in flight
+    uint16_t head;
+    uint16_t tail;
+    uint16_t cursor;                // Chunk the next send completion belongs to
+    uint16_t count;
+} UringSide;
+
+typedef struct UringConnection {
+    UringSide client;
+    UringSide server;
+    Session session;
+    char* replay;                   // Handshake bytes being forwarded to the backend
+    Chunk replay_chunk;
+    const char* reply;              // Status cache answer being sent to the client
+    Chunk reply_chunk;
+    uint8_t reply_last;             // The reply is the Pong, close once it is out
+    uint32_t inflight;              // Submitted operations that have not completed yet
+    uint8_t closing;
+    uint8_t draining;               // One side hung up, close once the other has been sent everything
+    Timer timer;                    // The deadline of the phase the connection is in
+    uint64_t active_ms;             // Last bytes received, the idle timer is checked against it
+    uint32_t idle_timeout_s;        // The route's, its entry may be gone by the time the session is idle
+    RegistryEntry* listed;          // In the worker's registry slab while the backend is connected
+} UringConnection;
+
+typedef struct {
+    int fd;
+    int server_socket;
+    uint8_t accepting;              // The multishot accept is armed and not being cancelled
+    ResolveQueue* resolved;
+    TimerWheel* timers;
+    RegistrySlab* sessions;
+    uint64_t now_ms;                // Taken once per loop, deadlines and activity don't need more
+    struct __kernel_timespec timeout;
+    uint64_t timeout_at;            // When the earliest timeout in flight wakes the loop, 0 if none is
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail;              // Local tail, published to the kernel before entering
+    unsigned submitted;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct io_uring_buf_ring* buffer_ring;
+    char* buffers;
+    uint16_t buffer_tail;
+    Chunk chunks[BUFFER_COUNT];
+
+    // Sides that ran out of provided buffers, re-armed once buffers are recycled
+    UringConnection* waiting[RING_ENTRIES];
+    uint8_t waiting_server[RING_ENTRIES];
+    size_t waiting_count;
+    uint16_t waiting_tail;          // Buffer tail when a receive last ran dry
+    uint8_t waiting_kick;           // A spare buffer was freed since
+} Uring;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void uring_destroy(Uring* ring) {
+    if (ring->buffer_ring != NULL) {
+        munmap(ring->buffer_ring, BUFFER_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(ring->buffers);
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+}
+
+static ssize_t uring_init(Uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    // Multishot receives can post many completions per submission, leave room for them
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->submitted = ring->sqe_tail;
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+// Registers a ring of provided buffers the kernel picks from for every multishot recv
+static ssize_t uring_init_buffers(Uring* ring) {
+    ring->buffer_ring = mmap(NULL, BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED) {
+        ring->buffer_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring;
+    registration.ring_entries = BUFFER_COUNT;
+    registration.bgid = BUFFER_GROUP;
+
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        return -1;
+    }
+
+    ring->buffers = malloc((size_t)BUFFER_COUNT * BUFFER_LENGTH);
+    if (ring->buffers == NULL) {
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < BUFFER_COUNT; ++i) {
+        struct io_uring_buf* buffer = &ring->buffer_ring->bufs[(ring->buffer_tail + i) & (BUFFER_COUNT - 1)];
+        buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)i * BUFFER_LENGTH);
+        buffer->len = BUFFER_LENGTH;
+        buffer->bid = i;
+    }
+    ring->buffer_tail += BUFFER_COUNT;
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Hands a provided buffer back to the kernel, published in bulk before the next submission
+static void buffer_recycle(Uring* ring, uint16_t id) {
+    struct io_uring_buf* buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (BUFFER_COUNT - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)id * BUFFER_LENGTH);
+    buffer->len = BUFFER_LENGTH;
+    buffer->bid = id;
+    ++ring->buffer_tail;
+}
+
+static ssize_t uring_submit(Uring* ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+
+    unsigned pending = ring->sqe_tail - ring->submitted;
+    int result = io_uring_enter(ring->fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (result < 0) {
+        return errno == EINTR || errno == EBUSY ? 0 : -1;
+    }
+
+    ring->submitted += result;
+    return 0;
+}
+
+static struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    // Make room by submitting what is queued so far
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_submit(ring, 0);
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ++ring->sqe_tail;
+    return sqe;
+}
+
+// Queues an operation on behalf of a connection, which stays allocated until it completes
+static struct io_uring_sqe* connection_sqe(Uring* ring, UringConnection* connection, enum Operation operation) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        printf("io_uring submission queue full\n");
+        return NULL;
+    }
+
+    sqe->user_data = (uint64_t)(uintptr_t)connection | operation;
+    ++connection->inflight;
+    return sqe;
+}
+
+static UringSide* peer_of(UringConnection* connection, UringSide* side) {
+    return side == &connection->client ? &connection->server : &connection->client;
+}
+
+static Chunk* chunk_get(Uring* ring, UringConnection* connection, uint16_t id) {
+    switch (id) {
+        case NO_BUFFER:
+            return &connection->replay_chunk;
+        case SPARE_CLIENT:
+            return &connection->client.spare_chunk;
+        case SPARE_SERVER:
+            return &connection->server.spare_chunk;
+        case STATUS_REPLY:
+            return &connection->reply_chunk;
+        default:
+            return &ring->chunks[id];
+    }
+}
+
+static char* chunk_data(Uring* ring, UringConnection* connection, uint16_t id) {
+    Chunk* chunk = chunk_get(ring, connection, id);
+    switch (id) {
+        case NO_BUFFER:
+            return connection->replay + chunk->offset;
+        case SPARE_CLIENT:
+            return connection->client.spare + chunk->offset;
+        case SPARE_SERVER:
+            return connection->server.spare + chunk->offset;
+        case STATUS_REPLY:
+            return (char*)connection->reply + chunk->offset;
+        default:
+            return ring->buffers + (size_t)id * BUFFER_LENGTH + chunk->offset;
+    }
+}
+
+static void chunk_release(Uring* ring, UringConnection* connection, uint16_t id) {
+    switch (id) {
+        case NO_BUFFER:
+            buffer_free(connection->replay);
+            connection->replay = NULL;
+            break;
+        case SPARE_CLIENT:
+        case SPARE_SERVER: {
+            UringSide* side = id == SPARE_CLIENT ? &connection->client : &connection->server;
+            buffer_free(side->spare);
+            side->spare = NULL;
+            ring->waiting_kick = 1;
+            break;
+        }
+        case STATUS_REPLY:
+            connection->reply = NULL;
+            break;
+        default:
+            buffer_recycle(ring, id);
+    }
+}
+
+static void arm_accept(Uring* ring) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        printf("io_uring submission queue full\n");
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->server_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    ring->accepting = 1;
+}
+
+// Once the listeners belong to another process, connections already accepted are still served
+static void cancel_accept(Uring* ring) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT;
+    sqe->user_data = OP_CANCEL_ACCEPT;
+    ring->accepting = 0;
+}
+
+// Watches the worker's resolver queue, the completion fires whenever lookups come back
+static void arm_resolve(Uring* ring) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        printf("io_uring submission queue full\n");
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->resolved->event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = OP_RESOLVE;
+}
+
+static void arm_recv(Uring* ring, UringConnection* connection, UringSide* side) {
+    if (connection->closing || side->receiving || side->parked || side->waiting) {
+        return;
+    }
+
+    struct io_uring_sqe* sqe = connection_sqe(ring, connection, side == &connection->client ? OP_RECV_CLIENT : OP_RECV_SERVER);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = side->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    side->receiving = 1;
+}
+
+// Receives into a buffer owned by the side. Every connection can then make progress even when
+// other connections hold all the provided buffers, which would otherwise deadlock peers that
+// only read after their own writes complete
+static ssize_t arm_recv_spare(Uring* ring, UringConnection* connection, UringSide* side) {
+    // Over the memory budget the side waits for the provided buffers like it would without spares
+    if (buffers_under_pressure()) {
+        buffers_throttled();
+        return -1;
+    }
+
+    side->spare = buffer_alloc(BUFFER_LENGTH);
+    if (side->spare == NULL) {
+        return -1;
+    }
+
+    struct io_uring_sqe* sqe = connection_sqe(ring, connection, side == &connection->client ? OP_RECV_CLIENT : OP_RECV_SERVER);
+    if (sqe == NULL) {
+        buffer_free(side->spare);
+        side->spare = NULL;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = side->fd;
+    sqe->addr = (uint64_t)(uintptr_t)side->spare;
+    sqe->len = BUFFER_LENGTH;
+    side->receiving = 1;
+    side->spare_receiving = 1;
+    return 0;
+}
+
+// Stops a multishot recv, the final completion reports -ECANCELED
+static void cancel_recv(Uring* ring, UringConnection* connection, UringSide* side) {
+    struct io_uring_sqe* sqe = connection_sqe(ring, connection, OP_CANCEL);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)connection | (side == &connection->client ? OP_RECV_CLIENT : OP_RECV_SERVER);
+}
+
+static void cancel_fd(Uring* ring, UringConnection* connection, int fd) {
+    struct io_uring_sqe* sqe = connection_sqe(ring, connection, OP_CANCEL);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+// Writes out the queued chunks of a side as one linked chain, so they hit the socket in order
+static void submit_sends(Uring* ring, UringConnection* connection, UringSide* side) {
+    if (connection->closing || side->sending > 0 || side->count == 0) {
+        return;
+    }
+    if (connection->session.state != SESSION_PIPE && !(connection->session.state == SESSION_STATUS && side == &connection->client)) {
+        return;
+    }
+
+    side->cursor = side->head;
+    uint16_t id = side->head;
+    for (uint16_t i = 0; i < side->count; ++i) {
+        Chunk* chunk = chunk_get(ring, connection, id);
+        struct io_uring_sqe* sqe = connection_sqe(ring, connection, side == &connection->client ? OP_SEND_CLIENT : OP_SEND_SERVER);
+        if (sqe == NULL) {
+            break;
+        }
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = side->fd;
+        sqe->addr = (uint64_t)(uintptr_t)chunk_data(ring, connection, id);
+        sqe->len = chunk->length - chunk->offset;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (i + 1 < side->count) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        ++side->sending;
+        id = chunk->next;
+    }
+}
+
+static void enqueue(Uring* ring, UringConnection* connection, UringSide* side, uint16_t id, uint32_t offset, uint32_t length) {
+    Chunk* chunk = chunk_get(ring, connection, id);
+    chunk->offset = offset;
+    chunk->length = length;
+    chunk->next = NO_CHUNK;
+    chunk->done = 0;
+
+    if (side->count == 0) {
+        side->head = id;
+    } else {
+        chunk_get(ring, connection, side->tail)->next = id;
+    }
+    side->tail = id;
+    ++side->count;
+}
+
+static void connection_close(Uring* ring, UringConnection* connection) {
+    if (connection->closing) {
+        return;
+    }
+    connection->closing = 1;
+
+    // Log the disconnection if the player was connected to the server
+    if (connection->session.state == SESSION_PIPE) {
+        session_log(&connection->session, connection->client.fd, LOG_DISCONNECTED);
+    }
+    connection->session.state = SESSION_CLOSED;
+    registry_remove(ring->sessions, connection->listed);
+    connection->listed = NULL;
+    timer_cancel(ring->timers, &connection->timer);
+
+    // Fail everything still queued on the sockets, the connection is freed after the last completion
+    shutdown(connection->client.fd, SHUT_RDWR);
+    cancel_fd(ring, connection, connection->client.fd);
+    if (connection->server.fd != -1) {
+        shutdown(connection->server.fd, SHUT_RDWR);
+        cancel_fd(ring, connection, connection->server.fd);
+    }
+}
+
+static void connection_free(Uring* ring, UringConnection* connection) {
+    UringSide* sides[2] = { &connection->client, &connection->server };
+    for (size_t i = 0; i < 2; ++i) {
+        uint16_t id = sides[i]->head;
+        for (uint16_t j = 0; j < sides[i]->count; ++j) {
+            uint16_t next = chunk_get(ring, connection, id)->next;
+            chunk_release(ring, connection, id);
+            id = next;
+        }
+        buffer_free(sides[i]->spare);
+        if (sides[i]->fd != -1) {
+            close(sides[i]->fd);
+        }
+    }
+
+    buffer_free(connection->replay);
+    session_destroy(&connection->session);
+    free(connection);
+}
+
+// Arms the connection's timer for the phase it is in, a timeout of 0 leaves it unarmed
+static void connection_deadline(Uring* ring, UringConnection* connection, enum TimerKind kind, uint64_t timeout_ms) {
+    connection->timer.kind = kind;
+    if (timeout_ms == 0) {
+        timer_cancel(ring->timers, &connection->timer);
+    } else {
+        timer_arm(ring->timers, &connection->timer, ring->now_ms + timeout_ms);
+    }
+}
+
+static void accept_connection(Uring* ring, int client_socket) {
+    // Multishot accepts don't report the peer, and floods are turned away before they cost any memory
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    if (getpeername(client_socket, (struct sockaddr*)&address, &address_length) == -1) {
+        close(client_socket);
+        return;
+    }
+    enum Admission admission = limiter_admit((struct sockaddr*)&address, address_length);
+    if (admission != ADMIT) {
+        limiter_reject(client_socket, admission);
+        return;
+    }
+
+    UringConnection* connection = calloc(1, sizeof(UringConnection));
+    if (connection == NULL || session_init(&connection->session) < 0) {
+        perror("Error allocating connection");
+        limiter_handshake_done();
+        free(connection);
+        close(client_socket);
+        return;
+    }
+
+    connection->client.fd = client_socket;
+    connection->server.fd = -1;
+    connection_deadline(ring, connection, TIMER_HANDSHAKE, config.handshake_timeout_ms);
+    arm_recv(ring, connection, &connection->client);
+}
+
+// Stops a connect in flight, it completes with -ECANCELED and the route's next backend is tried
+static void cancel_connect(Uring* ring, UringConnection* connection) {
+    struct io_uring_sqe* sqe = connection_sqe(ring, connection, OP_CANCEL);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)connection | OP_CONNECT;
+}
+
+// Closes the connections whose client is still handshaking or pinging past their deadline and the
+// idle sessions, cancels connects that took too long, then makes sure the loop wakes up for the next one
+static void expire_timers(Uring* ring) {
+    Timer* timer;
+
+    while ((timer = timer_expired(ring->timers, ring->now_ms)) != NULL) {
+        UringConnection* connection = (UringConnection*)((char*)timer - offsetof(UringConnection, timer));
+        Session* session = &connection->session;
+
+        if (timer->kind == TIMER_HANDSHAKE && (session->state == SESSION_HANDSHAKE || session->state == SESSION_STATUS)) {
+            metrics_add(GLOBAL_HANDSHAKE_TIMEOUTS, 1);
+            connection_close(ring, connection);
+        } else if (timer->kind == TIMER_CONNECT && session->state == SESSION_CONNECT) {
+            printf("Connecting to the backend timed out\n");
+            metrics_add(GLOBAL_CONNECT_TIMEOUTS, 1);
+            metrics_route_add(session->metrics, ROUTE_TIMEOUT_CONNECT, 1);
+            cancel_connect(ring, connection);
+        } else if (timer->kind == TIMER_IDLE && session->state == SESSION_PIPE) {
+            // Activity doesn't move the timer, it is only looked at once the timer fires
+            uint64_t idle_until = connection->active_ms + connection->idle_timeout_s * 1000ULL;
+            if (idle_until > ring->now_ms) {
+                timer_arm(ring->timers, timer, idle_until);
+                continue;
+            }
+            metrics_add(GLOBAL_IDLE_TIMEOUTS, 1);
+            metrics_route_add(session->metrics, ROUTE_TIMEOUT_IDLE, 1);
+            connection_close(ring, connection);
+        }
+    }
+
+    // A timeout already in flight for later still fires, it just wakes the loop for nothing
+    int wait = timer_wait_ms(ring->timers, ring->now_ms);
+    if (wait < 0 || (ring->timeout_at != 0 && ring->timeout_at <= ring->now_ms + wait)) {
+        return;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return;
+    }
+    ring->timeout.tv_sec = wait / 1000;
+    ring->timeout.tv_nsec = (long long)(wait % 1000) * 1000000;
+    ring->timeout_at = ring->now_ms + wait;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&ring->timeout;
+    sqe->len = 1;
+    sqe->user_data = ring->timeout_at << 4 | OP_TIMEOUT;
+}
+
+static void on_connect(Uring* ring, UringConnection* connection, int result);
+static void connect_backend(Uring* ring, UringConnection* connection);
+
+// Carries on with the backend the session picked: connects to it, or waits for the resolver
+static void connect_or_resolve(Uring* ring, UringConnection* connection, ssize_t picked) {
+    if (picked < 0) {
+        connection_close(ring, connection);
+    } else if (picked == 1) {
+        // The pending lookup keeps the connection allocated like any other operation. The resolver
+        // has its own timeouts
+        timer_cancel(ring->timers, &connection->timer);
+        ++connection->inflight;
+        connection->session.state = SESSION_RESOLVE;
+    } else {
+        connect_backend(ring, connection);
+    }
+}
+
+static void connect_backend(Uring* ring, UringConnection* connection) {
+    trace_mark(&connection->session.trace, TRACE_CONNECTING);
+
+    // A pooled socket is already connected. It is non-blocking for the pool's epoll, io_uring would
+    // then fail operations with EAGAIN instead of waiting for the socket
+    int pooled = pool_take((struct sockaddr*)&connection->session.backend, connection->session.backend_length);
+    if (pooled != -1) {
+        int flags = fcntl(pooled, F_GETFL, 0);
+        if (flags != -1 && fcntl(pooled, F_SETFL, flags & ~O_NONBLOCK) != -1) {
+            socket_profile_backend(pooled, connection->session.entry->profile, 1);
+            connection->server.fd = pooled;
+            connection->session.state = SESSION_CONNECT;
+            on_connect(ring, connection, 0);
+            return;
+        }
+        close(pooled);
+    }
+
+    connection->server.fd = socket(connection->session.backend.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection->server.fd == -1) {
+        perror("Error creating to socket");
+        connection_close(ring, connection);
+        return;
+    }
+
+    // Everything but fastopen, the send of the handshake would fail with EINPROGRESS until the
+    // backend answered the SYN, and io_uring doesn't retry it
+    socket_profile_client(connection->server.fd, connection->session.entry->profile);
+
+    struct io_uring_sqe* sqe = connection_sqe(ring, connection, OP_CONNECT);
+    if (sqe == NULL) {
+        connection_close(ring, connection);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = connection->server.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&connection->session.backend;
+    sqe->off = connection->session.backend_length;
+    connection->session.state = SESSION_CONNECT;
+    connection_deadline(ring, connection, TIMER_CONNECT, connection->session.entry->connect_timeout_ms);
+}
+
+// Answers a server list ping from the status cache, the next reply goes out once the last one is sent
+static void answer_status(Uring* ring, UringConnection* connection) {
+    if (connection->closing || connection->client.count > 0) {
+        return;
+    }
+
+    if (connection->reply_last) {
+        connection_close(ring, connection);
+        return;
+    }
+
+    uint32_t length;
+    ssize_t advanced = session_status_advance(&connection->session, &connection->reply, &length);
+    if (advanced < 0) {
+        printf("Malformed packet received\n");
+        connection_close(ring, connection);
+        return;
+    }
+    if (connection->reply == NULL) {
+        return;
+    }
+
+    connection->reply_last = advanced == 1;
+    enqueue(ring, connection, &connection->client, STATUS_REPLY, 0, length);
+    submit_sends(ring, connection, &connection->client);
+}
+
+static void route_backend(Uring* ring, UringConnection* connection) {
+    ssize_t routed = session_route(&connection->session, ring->resolved);
+    if (routed < 0) {
+        connection_close(ring, connection);
+    } else if (routed == 2) {
+        answer_status(ring, connection);
+    } else {
+        socket_profile_client(connection->client.fd, connection->session.entry->profile);
+        connection->idle_timeout_s = connection->session.entry->idle_timeout_s;
+        connect_or_resolve(ring, connection, routed);
+    }
+}
+
+static void finish_resolve(Uring* ring) {
+    ResolveRequest* request = resolve_queue_take(ring->resolved);
+
+    while (request != NULL) {
+        ResolveRequest* next = request->next;
+        UringConnection* connection = (UringConnection*)((char*)request - offsetof(UringConnection, session.resolve));
+        --connection->inflight;
+
+        if (!connection->closing) {
+            connect_or_resolve(ring, connection, session_resolved(&connection->session, ring->resolved));
+        }
+
+        if (connection->closing && connection->inflight == 0) {
+            connection_free(ring, connection);
+        }
+        request = next;
+    }
+}
+
+// Closes the sessions the admin socket asked for, it wakes the worker through the resolver queue
+static void finish_kills(Uring* ring) {
+    UringConnection* connection;
+    while ((connection = registry_next_kill(ring->sessions)) != NULL) {
+        printf("Closing the session of %s on request\n", connection->session.username);
+        connection_close(ring, connection);
+    }
+}
+
+static void on_connect(Uring* ring, UringConnection* connection, int result) {
+    if (result < 0) {
+        errno = -result;
+        perror("Error connecting to socket");
+        printf("Connection refused\n");
+
+        // The client doesn't notice, its bytes are still buffered for the route's next backend
+        close(connection->server.fd);
+        connection->server.fd = -1;
+        connect_or_resolve(ring, connection, session_backend_failed(&connection->session, ring->resolved));
+        return;
+    }
+
+    // Forward the buffered packets to the server before anything queued while connecting
+    uint32_t length;
+    connection->replay = session_take_handshake(&connection->session, &length);
+    connection->replay_chunk.offset = 0;
+    connection->replay_chunk.length = length;
+    connection->replay_chunk.done = 0;
+    connection->replay_chunk.next = connection->server.count > 0 ? connection->server.head : NO_CHUNK;
+    if (connection->server.count == 0) {
+        connection->server.tail = NO_BUFFER;
+    }
+    connection->server.head = NO_BUFFER;
+    ++connection->server.count;
+
+    connection->session.state = SESSION_PIPE;
+    connection->listed = registry_add(ring->sessions, connection, connection->client.fd, &connection->session);
+    registry_count(connection->listed, 1, length);
+    session_connected(&connection->session, connection->server.fd);
+    connection->active_ms = ring->now_ms;
+    connection_deadline(ring, connection, TIMER_IDLE, connection->idle_timeout_s * 1000ULL);
+
+    // Log the connection if the player is trying to join the server
+    session_log(&connection->session, connection->client.fd, LOG_CONNECTED);
+
+    submit_sends(ring, connection, &connection->server);
+    arm_recv(ring, connection, &connection->server);
+}
+
+// Bytes received with the handshake are kept with it and replayed once the backend is connected.
+// Returns how many bytes were taken, the rest belongs after the handshake
+static uint32_t on_handshake_data(Uring* ring, UringConnection* connection, const char* data, uint32_t length) {
+    Session* session = &connection->session;
+
+    uint32_t taken = HANDSHAKE_BUFFER_SIZE - session->handshake_length;
+    if (taken > length) {
+        taken = length;
+    }
+
+    memcpy(session->handshake + session->handshake_length, data, taken);
+    session->handshake_length += taken;
+
+    // Pings answered from the cache only ever send a few bytes more
+    if (session->state == SESSION_STATUS) {
+        if (taken < length) {
+            printf("Malformed packet received\n");
+            connection_close(ring, connection);
+        } else {
+            answer_status(ring, connection);
+        }
+        return length;
+    }
+
+    ssize_t ready = session_handshake_ready(session);
+    if (ready < 0) {
+        printf("Malformed packet received\n");
+        connection_close(ring, connection);
+    } else if (ready == 1) {
+        route_backend(ring, connection);
+    }
+    return taken;
+}
+
+static void on_recv(Uring* ring, UringConnection* connection, UringSide* side, struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        side->receiving = 0;
+    }
+
+    uint8_t spare = side->spare_receiving;
+    side->spare_receiving = 0;
+    if (spare && cqe->res <= 0) {
+        buffer_free(side->spare);
+        side->spare = NULL;
+    }
+
+    if (cqe->res > 0) {
+        connection->active_ms = ring->now_ms;
+        uint16_t id = spare ? (side == &connection->client ? SPARE_CLIENT : SPARE_SERVER) : cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        chunk_get(ring, connection, id)->offset = 0;
+
+        uint32_t offset = 0;
+        if (!connection->closing && (connection->session.state == SESSION_HANDSHAKE || connection->session.state == SESSION_STATUS)) {
+            offset = on_handshake_data(ring, connection, chunk_data(ring, connection, id), cqe->res);
+        }
+
+        if (connection->closing || offset == (uint32_t)cqe->res) {
+            chunk_release(ring, connection, id);
+        } else {
+            // Bytes past the handshake are queued and go out after it once the backend is connected
+            UringSide* peer = peer_of(connection, side);
+            enqueue(ring, connection, peer, id, offset, cqe->res);
+            if (side == &connection->server) {
+                trace_mark(&connection->session.trace, TRACE_FIRST_BYTE);
+            }
+            registry_count(connection->listed, side == &connection->client, cqe->res - offset);
+            metrics_route_add(connection->session.metrics, side == &connection->client ? ROUTE_BYTES_FROM_CLIENT : ROUTE_BYTES_TO_CLIENT,
+                              cqe->res - offset);
+
+            // The peer can't keep up, stop pulling from this side until it drains
+            if (peer->count >= QUEUE_PARK && !side->parked) {
+                side->parked = 1;
+                if (side->receiving) {
+                    cancel_recv(ring, connection, side);
+                }
+            }
+            submit_sends(ring, connection, peer);
+        }
+    } else if (cqe->res == 0) {
+        // Connection closed by the peer, what it sent last (a kick message, a Pong) still goes out first
+        UringSide* peer = peer_of(connection, side);
+        if (connection->session.state == SESSION_PIPE && (peer->count > 0 || peer->sending > 0)) {
+            connection->draining = 1;
+        } else {
+            connection_close(ring, connection);
+        }
+        return;
+    } else if (cqe->res == -ENOBUFS) {
+        // Out of provided buffers, fall back to the spare buffer or try again once some are recycled
+        if (side->spare == NULL && !side->parked && !connection->closing && arm_recv_spare(ring, connection, side) == 0) {
+            return;
+        }
+
+        ring->waiting_tail = ring->buffer_tail;
+        if (!side->waiting && ring->waiting_count < RING_ENTRIES) {
+            side->waiting = 1;
+            ++connection->inflight;
+            ring->waiting[ring->waiting_count] = connection;
+            ring->waiting_server[ring->waiting_count] = side == &connection->server;
+            ++ring->waiting_count;
+        }
+        return;
+    } else if (cqe->res != -ECANCELED) {
+        connection_close(ring, connection);
+        return;
+    }
+
+    arm_recv(ring, connection, side);
+}
+
+static void on_send(Uring* ring, UringConnection* connection, UringSide* side, int result) {
+    Chunk* chunk = chunk_get(ring, connection, side->cursor);
+    side->cursor = chunk->next;
+    --side->sending;
+
+    if (result > 0) {
+        chunk->offset += result;
+        chunk->done = chunk->offset == chunk->length;
+    } else if (result != -ECANCELED && !connection->closing) {
+        connection_close(ring, connection);
+    }
+
+    if (side->sending > 0) {
+        return;
+    }
+
+    // The chain is finished, release what went out and resend whatever a short send left behind
+    while (side->count > 0 && chunk_get(ring, connection, side->head)->done) {
+        uint16_t next = chunk_get(ring, connection, side->head)->next;
+        chunk_release(ring, connection, side->head);
+        side->head = next;
+        --side->count;
+    }
+
+    submit_sends(ring, connection, side);
+
+    if (connection->session.state == SESSION_STATUS && side->count == 0) {
+        answer_status(ring, connection);
+    }
+
+    if (connection->draining && side->count == 0) {
+        connection_close(ring, connection);
+        return;
+    }
+
+    UringSide* peer = peer_of(connection, side);
+    if (side->count == 0 && peer->parked) {
+        peer->parked = 0;
+        arm_recv(ring, connection, peer);
+    }
+}
+
+static void handle_completion(Uring* ring, struct io_uring_cqe* cqe) {
+    enum Operation operation = cqe->user_data & OP_MASK;
+
+    if (operation == OP_ACCEPT) {
+        if (cqe->res >= 0) {
+            accept_connection(ring, cqe->res);
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("Error accepting connection");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring->accepting = 0;
+            if (engine_accepting()) {
+                arm_accept(ring);
+            }
+        }
+        return;
+    }
+
+    if (operation == OP_TIMEOUT) {
+        if (cqe->user_data >> 4 == ring->timeout_at) {
+            ring->timeout_at = 0;
+        }
+        return;
+    }
+
+    if (operation == OP_CANCEL_ACCEPT) {
+        return;
+    }
+
+    if (operation == OP_RESOLVE) {
+        finish_resolve(ring);
+        finish_kills(ring);
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            arm_resolve(ring);
+        }
+        return;
+    }
+
+    UringConnection* connection = (UringConnection*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+    // Multishot recvs keep their connection referenced until the final completion
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        --connection->inflight;
+    }
+
+    switch (operation) {
+        case OP_RECV_CLIENT:
+            on_recv(ring, connection, &connection->client, cqe);
+            break;
+        case OP_RECV_SERVER:
+            on_recv(ring, connection, &connection->server, cqe);
+            break;
+        case OP_SEND_CLIENT:
+            on_send(ring, connection, &connection->client, cqe->res);
+            break;
+        case OP_SEND_SERVER:
+            on_send(ring, connection, &connection->server, cqe->res);
+            break;
+        case OP_CONNECT:
+            if (!connection->closing) {
+                on_connect(ring, connection, cqe->res);
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (connection->closing && connection->inflight == 0) {
+        connection_free(ring, connection);
+    }
+}
+
+static void rearm_waiting(Uring* ring) {
+    size_t count = ring->waiting_count;
+    ring->waiting_count = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        UringConnection* connection = ring->waiting[i];
+        UringSide* side = ring->waiting_server[i] ? &connection->server : &connection->client;
+
+        side->waiting = 0;
+        --connection->inflight;
+        arm_recv(ring, connection, side);
+
+        if (connection->closing && connection->inflight == 0) {
+            connection_free(ring, connection);
+        }
+    }
+}
+
+// Checks that the kernel has every opcode and feature the backend relies on
+ssize_t uring_supported() {
+    Uring ring;
+    if (uring_init(&ring, 8) < 0) {
+        uring_destroy(&ring);
+        return 0;
+    }
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_size);
+    ssize_t supported = probe != NULL && io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    // IORING_OP_SEND_ZC shipped in the same release as multishot recv, there is no separate flag for it
+    const int required[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_CONNECT, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD, IORING_OP_SEND_ZC };
+    for (size_t i = 0; supported && i < sizeof(required) / sizeof(required[0]); ++i) {
+        supported = required[i] <= probe->last_op && (probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    if (supported) {
+        supported = uring_init_buffers(&ring) == 0;
+    }
+
+    uring_destroy(&ring);
+    return supported;
+}
+
+void* uring_worker_run(void* arg) {
+    Worker* worker = arg;
+    Uring ring;
+
+    if (uring_init(&ring, RING_ENTRIES) < 0 || uring_init_buffers(&ring) < 0) {
+        perror("Error setting up io_uring");
+        uring_destroy(&ring);
+        return engine_fallback_run(worker);
+    }
+    ring.server_socket = worker->server_socket;
+    ring.resolved = &worker->resolved;
+    ring.timers = &worker->timers;
+    ring.sessions = worker->sessions;
+    ring.now_ms = limiter_now_ms();
+
+    arm_accept(&ring);
+    arm_resolve(&ring);
+
+    while (1) {
+        if (uring_submit(&ring, 1) < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        ring.now_ms = limiter_now_ms();
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_completion(&ring, &ring.cqes[head & ring.cq_mask]);
+            ++head;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        expire_timers(&ring);
+
+        if (ring.accepting && !engine_accepting()) {
+            cancel_accept(&ring);
+        }
+
+        // Recycled buffers are published by the next submit, so receives that ran dry can go again
+        if (ring.waiting_count > 0 && (ring.buffer_tail != ring.waiting_tail || ring.waiting_kick)) {
+            ring.waiting_kick = 0;
+            rearm_waiting(&ring);
+        }
+    }
+
+    uring_destroy(&ring);
+    return NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef URING_H
+#define URING_H
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include "engine.h"
+
+ssize_t uring_supported();
+void* uring_worker_run(void* arg);
+
+#endif // URING_H